@@ -1579,6 +1579,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.prompt_cache_ro = true;
         }
     ).set_examples({LLAMA_EXAMPLE_MAIN}));
+    add_opt(common_arg(
+        {"--cpu-profile"}, "FNAME",
+        "profile the ops computed by the CPU backend, print a summary per op at exit and save a Chrome trace of the last 16 graphs to FNAME (default: none)",
+        [](common_params & params, const std::string & value) {
+            params.path_cpu_profile = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN}));
     add_opt(common_arg(
         {"-r", "--reverse-prompt"}, "PROMPT",
         "halt generation at PROMPT, return control in interactive mode\n",
@@ -2174,9 +2181,66 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--defrag-cells"}, "N",
+        string_format("max number of KV cells moved per decode by the defragmentation, spreading it over several decodes (default: %d, 0 = all at once)", params.defrag_n_cells),
+        [](common_params & params, int value) {
+            params.defrag_n_cells = value;
+        }
+    ).set_env("LLAMA_ARG_DEFRAG_CELLS"));
+    add_opt(common_arg(
+        {"--kv-block-size"}, "N",
+        string_format("allocate the KV cache in blocks of N cells with per-sequence block tables (default: %d, 0 = disabled)", params.kv_block_size),
+        [](common_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--kv-recent"}, "N",
+        string_format("with a quantized K cache, also keep the K of the N most recent cells in F16 for their attention scores\n"
+                      "(more precise, but uses more memory and bandwidth; not compatible with --flash-attn; default: %d, 0 = disabled)", params.kv_recent),
+        [](common_params & params, int value) {
+            params.kv_recent = value;
+        }
+    ).set_env("LLAMA_ARG_KV_RECENT"));
+    add_opt(common_arg(
+        {"--kv-sink"}, "N",
+        string_format("number of first KV cells of a sequence that are never evicted with --kv-window (default: %d)", params.kv_sink),
+        [](common_params & params, int value) {
+            params.kv_sink = value;
+        }
+    ).set_env("LLAMA_ARG_KV_SINK"));
+    add_opt(common_arg(
+        {"--kv-window"}, "N",
+        string_format("when a sequence holds more than N KV cells after a batch, evict the oldest half of its cells after the --kv-sink first ones and move the kept cells down - the context needs room for N + the batch size cells per sequence (default: %d, 0 = disabled)", params.kv_window),
+        [](common_params & params, int value) {
+            params.kv_window = value;
+        }
+    ).set_env("LLAMA_ARG_KV_WINDOW"));
+    add_opt(common_arg(
+        {"--kv-h2o"},
+        "with --kv-window, evict the KV cells that received the least attention instead of the oldest ones, not compatible with --flash-attn",
+        [](common_params & params) {
+            params.kv_h2o = true;
+        }
+    ).set_env("LLAMA_ARG_KV_H2O"));
+    add_opt(common_arg(
+        {"--kv-checkpoint"}, "N",
+        string_format("recurrent models: checkpoint the state of a sequence every N tokens, so that the end of the sequence can be removed (e.g. for prompt caching) (default: %d, 0 = disabled)", params.kv_checkpoint),
+        [](common_params & params, int value) {
+            params.kv_checkpoint = value;
+        }
+    ).set_env("LLAMA_ARG_KV_CHECKPOINT"));
+    add_opt(common_arg(
+        {"--sparse-ffn-thold"}, "N",
+        string_format("skip the FFN up projection of the neurons whose gate activation magnitude is <= N, exact at 0 for ReLU models (default: %.1f, < 0 - disabled)", (double)params.sparse_ffn_thold),
+        [](common_params & params, const std::string & value) {
+            params.sparse_ffn_thold = std::stof(value);
+        }
+    ).set_env("LLAMA_ARG_SPARSE_FFN_THOLD"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
-        string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
+        string_format("number of parallel sequences to decode, at most 64 (default: %d)", params.n_parallel),
         [](common_params & params, int value) {
             params.n_parallel = value;
         }
@@ -2427,6 +2491,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.check_tensors = true;
         }
     ));
+    add_opt(common_arg(
+        {"--fuse-weights"},
+        string_format("pack the Q/K/V and the gate/up weights to compute them with one matmul, the packed weights are copied from the file, with mmap they are resident twice (default: %s)", params.fuse_weights ? "true" : "false"),
+        [](common_params & params) {
+            params.fuse_weights = true;
+        }
+    ).set_env("LLAMA_ARG_FUSE_WEIGHTS"));
     add_opt(common_arg(
         {"--override-kv"}, "KEY=TYPE:VALUE",
         "advanced option to override model metadata by key. may be specified multiple times.\n"
@@ -2799,6 +2870,34 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--kv-share-prefix"},
+        string_format("share the KV cache of the longest common prompt prefix between slots (default: %s)", params.kv_share_prefix ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.kv_share_prefix = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SHARE_PREFIX"));
+    add_opt(common_arg(
+        {"--cache-ram"}, "N",
+        string_format("host memory in MiB used to retain the KV cache of prompts evicted from the slots (default: %d, 0 = disabled)", params.cache_ram),
+        [](common_params & params, int value) {
+            params.cache_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_RAM"));
+    add_opt(common_arg(
+        {"--cache-disk"}, "N",
+        string_format("disk space in MiB used to spill the retained prompts that do not fit in --cache-ram (default: %d, 0 = disabled)", params.cache_disk),
+        [](common_params & params, int value) {
+            params.cache_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_DISK"));
+    add_opt(common_arg(
+        {"--cache-dir"}, "PATH",
+        "directory of the prompts spilled to disk (default: prompt-cache in the llama.cpp cache directory)",
+        [](common_params & params, const std::string & value) {
+            params.cache_dir = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_DIR"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
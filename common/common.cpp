@@ -1087,6 +1087,7 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.fuse_weights    = params.fuse_weights;
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1127,6 +1128,14 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_n_cells    = params.defrag_n_cells;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.kv_recent         = params.kv_recent;
+    cparams.kv_sink           = params.kv_sink;
+    cparams.kv_window         = params.kv_window;
+    cparams.kv_checkpoint     = params.kv_checkpoint;
+    cparams.sparse_ffn_thold  = params.sparse_ffn_thold;
+    cparams.kv_h2o            = params.kv_h2o;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -238,6 +238,14 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t defrag_n_cells        =     0; // max number of KV cells moved per decode by the defragmentation (0 = all at once)
+    int32_t kv_block_size         =     0; // KV cache block size for paged allocation (0 = disabled)
+    int32_t kv_recent             =     0; // number of recent cells whose K is also kept in F16 with a quantized K cache (0 = disabled)
+    int32_t kv_sink               =     4; // number of first KV cells of a sequence kept by the streaming eviction
+    int32_t kv_window             =     0; // max number of KV cells per sequence before the streaming eviction (0 = disabled)
+    int32_t kv_checkpoint         =     0; // checkpoint the recurrent state of a sequence every N tokens (0 = disabled)
+    bool    kv_h2o                = false; // evict the KV cells with the least accumulated attention instead of the oldest ones
+    float   sparse_ffn_thold      = -1.0f; // skip the FFN neurons with a gate activation magnitude <= thold (< 0 = disabled)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -277,6 +285,7 @@ struct common_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
+    std::string path_cpu_profile     = ""; // file for saving the Chrome trace of the CPU backend ops        // NOLINT
 
     std::vector<std::string> in_files;   // all input files
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
@@ -333,6 +342,7 @@ struct common_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool fuse_weights      = false; // pack the Q/K/V and the gate/up weights
     bool no_op_offload     = false; // globally disable offload host tensor operations to device
 
     bool single_turn       = false; // single turn chat conversation
@@ -361,9 +371,13 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    bool    kv_share_prefix = false;       // share the KV cache of common prompt prefixes between slots
+    int32_t cache_ram      = 0;            // host memory (MiB) to retain the KV cache of evicted prompts, 0 = disabled
+    int32_t cache_disk     = 0;            // disk space (MiB) to spill the retained prompts to, 0 = disabled
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
+    std::string cache_dir     = "";                                                                         // NOLINT
     std::string chat_template = "";                                                                         // NOLINT
     bool use_jinja = false;                                                                                 // NOLINT
     bool enable_chat_template = true;
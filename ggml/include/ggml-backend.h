@@ -341,6 +341,11 @@ extern "C" {
     // Compare the output of two backends
     GGML_API bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data);
 
+    // Compare a single node: backend1 computes the whole graph at once (e.g. to test the fusion of its nodes) and test_node is compared
+    // with ref_node as computed by backend2, or with test_node if ref_node is NULL (e.g. the dense result of an op that backends may compute partially)
+    // if test_node is NULL, this is the same as ggml_backend_compare_graph_backend
+    GGML_API bool ggml_backend_compare_graph_backend_node(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data, struct ggml_tensor * test_node, struct ggml_tensor * ref_node);
+
     // Tensor initialization
     GGML_API enum ggml_status ggml_backend_tensor_alloc(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, void * addr);
     GGML_API enum ggml_status ggml_backend_view_init(struct ggml_tensor * tensor);
@@ -58,6 +58,20 @@ extern "C" {
     GGML_BACKEND_API void                          ggml_threadpool_pause         (struct ggml_threadpool * threadpool);
     GGML_BACKEND_API void                          ggml_threadpool_resume        (struct ggml_threadpool * threadpool);
 
+    // per-op profiling of the graphs computed with a threadpool
+    //   records the time of each node on each thread, the waits at the barriers between the nodes, and the estimated
+    //   bytes read and written and FLOPs of the nodes
+    //   the summary covers all the profiled graphs, the trace only the last 16
+    //   a profiler can be shared by several threadpools, but not by graphs that are computed at the same time
+    typedef struct ggml_cpu_profiler * ggml_cpu_profiler_t;
+
+    GGML_BACKEND_API ggml_cpu_profiler_t ggml_cpu_profiler_new          (void);
+    GGML_BACKEND_API void                ggml_cpu_profiler_free         (ggml_cpu_profiler_t profiler);
+    GGML_BACKEND_API void                ggml_cpu_profiler_reset        (ggml_cpu_profiler_t profiler);
+    GGML_BACKEND_API bool                ggml_cpu_profiler_write_trace  (ggml_cpu_profiler_t profiler, const char * fname); // Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+    GGML_BACKEND_API void                ggml_cpu_profiler_print_summary(ggml_cpu_profiler_t profiler, FILE * stream);      // table of the time per op
+    GGML_BACKEND_API void                ggml_threadpool_set_profiler   (struct ggml_threadpool * threadpool, ggml_cpu_profiler_t profiler); // NULL to stop profiling
+
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
     GGML_BACKEND_API struct ggml_cplan ggml_graph_plan(
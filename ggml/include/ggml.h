@@ -1134,6 +1134,17 @@ extern "C" {
             struct ggml_tensor * a,
             enum ggml_prec       prec);
 
+    // ggml_mul_mat with a sparsity hint: the elements of the result where |c| <= thold are not needed
+    // (e.g. the FFN neurons zeroed by the activation), backends may skip them and write 0 instead
+    // c: same shape as the result, F32
+    // a negative thold disables the hint
+    GGML_API struct ggml_tensor * ggml_mul_mat_sparse(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c,
+            float                 thold);
+
     // indirect matrix multiplication
     GGML_API struct ggml_tensor * ggml_mul_mat_id(
             struct ggml_context * ctx,
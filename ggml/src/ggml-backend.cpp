@@ -1819,6 +1819,10 @@ void ggml_backend_graph_copy_free(struct ggml_backend_graph_copy copy) {
 }
 
 bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data) {
+    return ggml_backend_compare_graph_backend_node(backend1, backend2, graph, callback, user_data, NULL, NULL);
+}
+
+bool ggml_backend_compare_graph_backend_node(ggml_backend_t backend1, ggml_backend_t backend2, struct ggml_cgraph * graph, ggml_backend_eval_callback callback, void * user_data, struct ggml_tensor * test_node, struct ggml_tensor * ref_node) {
     struct ggml_backend_graph_copy copy = ggml_backend_graph_copy(backend2, graph);
     if (copy.buffer == NULL) {
         return false;
@@ -1829,6 +1833,37 @@ bool ggml_backend_compare_graph_backend(ggml_backend_t backend1, ggml_backend_t
 
     assert(g1->n_nodes == g2->n_nodes);
 
+    if (test_node != NULL) {
+        // backend1 computes the whole graph, so that it can fuse nodes, while backend2 computes one node at a time
+        ggml_backend_graph_compute(backend1, g1);
+
+        int i_test = -1;
+        int i_ref  = -1;
+
+        for (int i = 0; i < g2->n_nodes; i++) {
+            struct ggml_cgraph g2v = ggml_graph_view(g2, i, i + 1);
+
+            ggml_backend_graph_compute(backend2, &g2v);
+
+            if (g1->nodes[i] == test_node) {
+                i_test = i;
+            }
+            if (g1->nodes[i] == (ref_node ? ref_node : test_node)) {
+                i_ref = i;
+            }
+        }
+
+        GGML_ASSERT(i_test >= 0 && "test_node is not in the graph");
+        GGML_ASSERT(i_ref  >= 0 && "ref_node is not in the graph");
+        GGML_ASSERT(ggml_are_same_shape(g1->nodes[i_test], g2->nodes[i_ref]));
+
+        callback(i_test, g1->nodes[i_test], g2->nodes[i_ref], user_data);
+
+        ggml_backend_graph_copy_free(copy);
+
+        return true;
+    }
+
     for (int i = 0; i < g1->n_nodes; i++) {
         struct ggml_tensor * t1 = g1->nodes[i];
         struct ggml_tensor * t2 = g2->nodes[i];
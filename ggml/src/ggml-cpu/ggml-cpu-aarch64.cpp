@@ -1561,6 +1561,98 @@ static void ggml_gemv_q4_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, c
 }
 
 
+static void ggml_gemv_q8_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    // The horizontal sums of the two accumulators are in the order B0 B1 B4 B5 B2 B3 B6 B7
+    const __m256i finalpermutemask = _mm256_set_epi32(7, 6, 3, 2, 5, 4, 1, 0);
+
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+
+    // Take group of eight block_q8_0x8 structures at each pass of the loop and perform dot product operation
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+        // Master FP accumulator
+        __m256 acc_row = _mm256_setzero_ps();
+
+        for (int l = 0; l < nb; l++) {
+            __m256i iacc_0123 = _mm256_setzero_si256();
+            __m256i iacc_4567 = _mm256_setzero_si256();
+
+            for (int k = 0; k < qk / blocklen; k++) {
+                // Load 8 blocks of Q8_0 interleaved as 8 bytes: B0(k) B1(k) B2(k) B3(k) and B4(k) B5(k) B6(k) B7(k)
+                const __m256i rhs_vec_0123 = _mm256_loadu_si256((const __m256i *)(b_ptr[l].qs + k * ncols_interleaved * blocklen));
+                const __m256i rhs_vec_4567 = _mm256_loadu_si256((const __m256i *)(b_ptr[l].qs + k * ncols_interleaved * blocklen) + 1);
+
+                // Replicate the 8 bytes A0(k) of block_q8_0 across the 256 bit vector
+                int64_t lhs;
+                memcpy(&lhs, a_ptr[l].qs + k * blocklen, sizeof(int64_t));
+                const __m256i lhs_vec = _mm256_set1_epi64x(lhs);
+
+                // Dot products of 4 bytes, two 32 bit lanes per block
+                iacc_0123 = mul_sum_i8_pairs_acc_int32x8(iacc_0123, rhs_vec_0123, lhs_vec);
+                iacc_4567 = mul_sum_i8_pairs_acc_int32x8(iacc_4567, rhs_vec_4567, lhs_vec);
+            }
+
+            const __m256i iacc = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(iacc_0123, iacc_4567), finalpermutemask);
+
+            // Load the scale values for the 8 blocks interleaved in block_q8_0x8 and the scale of block_q8_0
+            const __m256 col_scale_f32 = GGML_F32Cx8_LOAD(b_ptr[l].d);
+            const __m256 row_scale_f32 = _mm256_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d));
+
+            // Accumulated values multipled with appropriate scales
+            acc_row = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc), _mm256_mul_ps(col_scale_f32, row_scale_f32), acc_row);
+        }
+
+        _mm256_storeu_ps(s + x * ncols_interleaved, acc_row);
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[8];
+        int sumi[8];
+
+        const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                for (int j = 0; j < ncols_interleaved; j++) sumi[j] = 0;
+                for (int k = 0; k < (qk / blocklen); k++) {
+                    for (int j = 0; j < ncols_interleaved; j++) {
+                        for (int i = 0; i < blocklen; ++i) {
+                            sumi[j] += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] * a_ptr[l].qs[k * blocklen + i];
+                        }
+                    }
+                }
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumf[j] += sumi[j] * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * GGML_FP16_TO_FP32(a_ptr[l].d);
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
 static void ggml_gemv_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -5534,6 +5626,126 @@ static void ggml_gemm_q4_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, c
 #endif
 }
 
+static void ggml_gemm_q8_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    // The horizontal sums of the two accumulators are in the order B0 B1 B4 B5 B2 B3 B6 B7
+    const __m256i finalpermutemask = _mm256_set_epi32(7, 6, 3, 2, 5, 4, 1, 0);
+
+    // Take a block_q8_0x4 structures at each pass of the loop and perform dot product operation
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+
+        // Take group of eight block_q8_0x8 structures at each pass of the loop and perform dot product operation
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+            // Master FP accumulators
+            __m256 acc_rows[4];
+            for (int m = 0; m < 4; m++) {
+                acc_rows[m] = _mm256_setzero_ps();
+            }
+
+            for (int l = 0; l < nb; l++) {
+                __m256i iacc_0123[4];
+                __m256i iacc_4567[4];
+                for (int m = 0; m < 4; m++) {
+                    iacc_0123[m] = _mm256_setzero_si256();
+                    iacc_4567[m] = _mm256_setzero_si256();
+                }
+
+                for (int k = 0; k < qk / blocklen; k++) {
+                    // Load 8 blocks of Q8_0 interleaved as 8 bytes: B0(k) B1(k) B2(k) B3(k) and B4(k) B5(k) B6(k) B7(k)
+                    const __m256i rhs_vec_0123 = _mm256_loadu_si256((const __m256i *)(b_ptr[l].qs + k * ncols_interleaved * blocklen));
+                    const __m256i rhs_vec_4567 = _mm256_loadu_si256((const __m256i *)(b_ptr[l].qs + k * ncols_interleaved * blocklen) + 1);
+
+                    for (int m = 0; m < 4; m++) {
+                        // Replicate the 8 bytes Am(k) of block_q8_0x4 across the 256 bit vector
+                        int64_t lhs;
+                        memcpy(&lhs, a_ptr[l].qs + k * 4 * blocklen + m * blocklen, sizeof(int64_t));
+                        const __m256i lhs_vec = _mm256_set1_epi64x(lhs);
+
+                        iacc_0123[m] = mul_sum_i8_pairs_acc_int32x8(iacc_0123[m], rhs_vec_0123, lhs_vec);
+                        iacc_4567[m] = mul_sum_i8_pairs_acc_int32x8(iacc_4567[m], rhs_vec_4567, lhs_vec);
+                    }
+                }
+
+                // Load the scale values for the 8 blocks interleaved in block_q8_0x8
+                const __m256 col_scale_f32 = GGML_F32Cx8_LOAD(b_ptr[l].d);
+
+                for (int m = 0; m < 4; m++) {
+                    const __m256i iacc = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(iacc_0123[m], iacc_4567[m]), finalpermutemask);
+                    const __m256 row_scale_f32 = _mm256_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d[m]));
+
+                    // Accumulated values multipled with appropriate scales
+                    acc_rows[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(iacc), _mm256_mul_ps(col_scale_f32, row_scale_f32), acc_rows[m]);
+                }
+            }
+
+            // Store the accumulated values
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * ncols_interleaved, acc_rows[m]);
+            }
+        }
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    float sumf[4][8];
+    int sumi[4][8];
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+            }
+            for (int l = 0; l < nb; l++) {
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumi[m][j] = 0;
+                }
+                for (int k = 0; k < (qk / blocklen); k++) {
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            for (int i = 0; i < blocklen; ++i) {
+                                sumi[m][j] += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] *
+                                              a_ptr[l].qs[k * 4 * blocklen + m * blocklen + i];
+                            }
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) {
+                        sumf[m][j] += sumi[m][j] * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * GGML_FP16_TO_FP32(a_ptr[l].d[m]);
+                    }
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                for (int j = 0; j < ncols_interleaved; j++)
+                    s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+            }
+        }
+    }
+}
+
 static void ggml_gemm_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -5882,6 +6094,61 @@ static int repack_q4_0_to_q4_0_8_bl(struct ggml_tensor * t, int interleave_block
     GGML_UNUSED(data_size);
 }
 
+// interleave 8 block_q8_0s in blocks of blck_size_interleave
+// returns an interleaved block_q8_0x8
+// in the interleaved block_q8_0x8, place deltas for 8 block_q8_0 blocks
+// first, then interleave quants from 8 block_q8_0s in blocks of blck_size_interleave
+static block_q8_0x8 make_block_q8_0x8(block_q8_0 * in, unsigned int blck_size_interleave) {
+    block_q8_0x8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    const int end = QK8_0 * 8 / blck_size_interleave;
+
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 8;
+        int src_offset = (i / 8) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qs[dst_offset], &in[src_id].qs[src_offset], blck_size_interleave);
+    }
+
+    return out;
+}
+
+static int repack_q8_0_to_q8_0_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q8_0);
+    GGML_ASSERT(interleave_block == 8);
+    constexpr int nrows_interleaved = 8;
+
+    block_q8_0x8 * dst = (block_q8_0x8 *)t->data;
+    const block_q8_0 * src = (const block_q8_0 *) data;
+    block_q8_0 dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK8_0;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q8_0));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q8_0x8(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
 static block_iq4_nlx4 make_block_iq4_nlx4(block_iq4_nl * in, unsigned int blck_size_interleave) {
     block_iq4_nlx4 out;
 
@@ -5971,6 +6238,10 @@ template <> int repack<block_q4_K, 8, 8>(struct ggml_tensor * t, const void * da
     return repack_q4_K_to_q4_K_8_bl(t, 8, data, data_size);
 }
 
+template <> int repack<block_q8_0, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q8_0_to_q8_0_8_bl(t, 8, data, data_size);
+}
+
 template <> int repack<block_iq4_nl, 4, 4>(struct ggml_tensor * t, const void * data, size_t data_size) {
     return repack_iq4_nl_to_iq4_nl_4_bl(t, 4, data, data_size);
 }
@@ -6000,6 +6271,10 @@ template <> void gemv<block_q4_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemv_q4_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q8_0, 8, 8, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q8_0_8x8_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemv<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -6024,6 +6299,10 @@ template <> void gemm<block_q4_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemm_q4_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q8_0, 8, 8, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q8_0_8x8_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemm<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -6111,7 +6390,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
             from_float((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), ne10);
         }
 
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
 
         const void * src1_wdata      = params->wdata;
         const size_t src1_col_stride = ggml_row_size(PARAM_TYPE, ne10);
@@ -6219,7 +6498,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PAR
             }
         }
 
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
 
         // compute each matrix multiplication in sequence
         for (int cur_a = 0; cur_a < n_as; ++cur_a) {
@@ -6279,6 +6558,9 @@ static const tensor_traits<block_q4_0, 8, 4, GGML_TYPE_Q8_0> q4_0_4x8_q8_0;
 static const tensor_traits<block_q4_0, 8, 8, GGML_TYPE_Q8_0> q4_0_8x8_q8_0;
 static const tensor_traits<block_q4_K, 8, 8, GGML_TYPE_Q8_K> q4_K_8x8_q8_K;
 
+// instance for Q8
+static const tensor_traits<block_q8_0, 8, 8, GGML_TYPE_Q8_0> q8_0_8x8_q8_0;
+
 // instance for IQ4
 static const tensor_traits<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0> iq4_nl_4x4_q8_0;
 
@@ -6307,6 +6589,15 @@ static const ggml::cpu::tensor_traits * ggml_aarch64_get_optimal_repack_type(con
                 return &ggml::cpu::aarch64::q4_K_8x8_q8_K;
             }
         }
+#ifdef GGML_USE_CPU_AARCH64_Q8_0
+    // opt-in: the speed of the Q8_0 8x8 kernels against tinyBLAS, which takes these weights otherwise, has not been measured
+    } else if (cur->type == GGML_TYPE_Q8_0) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q8_0_8x8_q8_0;
+            }
+        }
+#endif
     } else if (cur->type == GGML_TYPE_IQ4_NL) {
         if (ggml_cpu_has_neon() && ggml_cpu_has_dotprod()) {
             if (cur->ne[1] % 4 == 0) {
@@ -24,6 +24,16 @@ struct ggml_compute_params {
     void * wdata;
 
     struct ggml_threadpool * threadpool;
+
+    // the node is run by the threads [ith0, ith0 + nth) of the threadpool, ith is relative to ith0
+    //   group is the barrier of these threads, NULL if they are all the threads of the threadpool
+    int ith0;
+    struct ggml_compute_group * group;
+
+    // mul_mat: the buffer of src1 converted to vec_dot_type when it is shared with other mul_mats, NULL otherwise
+    //   wdata_src1_ready is set if it has already been converted
+    void * wdata_src1;
+    bool   wdata_src1_ready;
 };
 
 
@@ -505,7 +515,15 @@ static __m256 __lasx_xvreplfr2vr_s(const float val) {
 #endif
 
 // TODO: move to ggml-threading
-void ggml_barrier(struct ggml_threadpool * tp);
+// synchronize the threads that run the node
+void ggml_barrier(const struct ggml_compute_params * params);
+
+// work-stealing scheduler for the chunks [0, n_chunks) of an op
+//   before a barrier, either every thread calls ggml_chunk_sched_init() or a single thread calls ggml_chunk_sched_init_all()
+//   after the barrier, the threads call ggml_chunk_sched_next() until it returns -1
+void    ggml_chunk_sched_init    (const struct ggml_compute_params * params, int64_t n_chunks);
+void    ggml_chunk_sched_init_all(const struct ggml_compute_params * params, int64_t n_chunks);
+int64_t ggml_chunk_sched_next    (const struct ggml_compute_params * params);
 
 #ifdef __cplusplus
 }
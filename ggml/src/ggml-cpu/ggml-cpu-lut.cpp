@@ -0,0 +1,455 @@
+#define GGML_COMMON_DECL_CPP
+#include "ggml-common.h"
+#include "ggml-backend-impl.h"
+
+#include "ggml-impl.h"
+#include "ggml-cpu.h"
+#include "ggml-cpu-impl.h"
+#include "ggml-cpu-traits.h"
+
+#include <cassert>
+#include <cstring>
+
+#include "ggml-cpu-lut.h"
+
+// Lookup-table (T-MAC style) mul_mat for the ternary types TQ1_0 and TQ2_0.
+//
+// Instead of unpacking the weights and multiplying, the activations are turned into tables: for
+// every group of 4 consecutive activations the 16 possible partial sums are computed once per src1
+// column. The weights are repacked into the two bit-planes of q = w + 1 (q in {0, 1, 2}), so that
+// 4 weights of one bit-plane form a 4-bit index into the table of their group:
+//
+//   sum_i (q_i - 1)*a_i = lut[idx_0] + 2*lut[idx_1] - sum_i a_i
+//
+// The int16 table entries are stored as a table of low bytes and a table of high bytes, which lets
+// AVX2 look up 32 of them at a time with pshufb and recombine them exactly.
+//
+// TQ2_0 weights are only repacked with GGML_USE_CPU_LUT_TQ2_0: the vec_dot of TQ2_0 already reads
+// 2-bit weights and is as fast as the lookups, while TQ1_0 has to unpack its base-3 digits first.
+
+#define QK_LUT_G    4   // activations per lookup group
+#define QK_LUT_ROWS 32  // rows interleaved in a repacked block
+
+// QK_K columns of 32 rows. For the groups 2*v and 2*v + 1, byte qs[64*v + 2*r + p] holds the
+// bit-plane p indices of row r: group 2*v in the low nibble and group 2*v + 1 in the high nibble.
+struct block_tq2_0x32 {
+    ggml_half d[QK_LUT_ROWS];          // deltas of the 32 rows
+    uint8_t   qs[QK_K*QK_LUT_ROWS/4];  // bit-plane indices
+};
+
+static_assert(sizeof(block_tq2_0x32) == QK_LUT_ROWS * sizeof(block_tq2_0), "wrong tq2_0x32 block size/padding");
+
+// lookup tables for QK_K activations quantized to Q8_K
+struct block_lut_q8_K {
+    float   d;                      // delta
+    int32_t sum;                    // sum of quants
+    int8_t  tbl[QK_K/QK_LUT_G][32]; // partial sums of each group: low bytes in [0, 16), high bytes in [16, 32)
+};
+
+static void ggml_lut_from_float(const float * GGML_RESTRICT x, block_lut_q8_K * GGML_RESTRICT y, int64_t k, ggml_from_float_t quantize_q8_K) {
+    assert(k % QK_K == 0);
+    const int64_t nb = k / QK_K;
+
+    block_q8_K q8;
+
+    for (int64_t ib = 0; ib < nb; ++ib) {
+        quantize_q8_K(x + ib*QK_K, &q8, QK_K);
+
+        int32_t sum = 0;
+        for (int j = 0; j < QK_K/16; ++j) {
+            sum += q8.bsums[j];
+        }
+        y[ib].d   = q8.d;
+        y[ib].sum = sum;
+
+        for (int g = 0; g < QK_K/QK_LUT_G; ++g) {
+            const int8_t * a = q8.qs + g*QK_LUT_G;
+
+            int16_t t[16];
+            t[0] = 0;
+            for (int i = 0; i < QK_LUT_G; ++i) {
+                for (int m = 0; m < (1 << i); ++m) {
+                    t[(1 << i) + m] = t[m] + a[i];
+                }
+            }
+            for (int m = 0; m < 16; ++m) {
+                y[ib].tbl[g][m]      = (int8_t) (t[m] & 0xFF);
+                y[ib].tbl[g][16 + m] = (int8_t) (t[m] >> 8);
+            }
+        }
+    }
+}
+
+// s[0..32) = dot products of the 32 rows of vx with the column of vy
+static void ggml_gemv_tq2_0x32_lut(int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy) {
+    const int nb = n / QK_K;
+
+    assert(n % QK_K == 0);
+
+    const block_tq2_0x32 * GGML_RESTRICT x = (const block_tq2_0x32 *) vx;
+    const block_lut_q8_K * GGML_RESTRICT y = (const block_lut_q8_K *) vy;
+
+#if defined(__AVX2__)
+    const __m256i m4  = _mm256_set1_epi8(0x0F);
+    const __m256i k12 = _mm256_set1_epi16(0x0201); // weights of the two bit-planes
+
+    __m256 acc[4];
+    for (int i = 0; i < 4; ++i) {
+        acc[i] = _mm256_setzero_ps();
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i isum[4];
+        for (int i = 0; i < 4; ++i) {
+            isum[i] = _mm256_set1_epi32(-y[ib].sum);
+        }
+
+        // half a block at a time, so that the int16 sums of the low bytes cannot overflow
+        for (int h = 0; h < 2; ++h) {
+            __m256i sum_lo[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+            __m256i sum_hi[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+            for (int v = 16*h; v < 16*(h + 1); ++v) {
+                const int8_t * t_0 = y[ib].tbl[2*v + 0];
+                const int8_t * t_1 = y[ib].tbl[2*v + 1];
+
+                const __m256i lo_0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (t_0 +  0)));
+                const __m256i hi_0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (t_0 + 16)));
+                const __m256i lo_1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (t_1 +  0)));
+                const __m256i hi_1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (t_1 + 16)));
+
+                // the tables are shared by rows 0..15 (k = 0) and 16..31 (k = 1)
+                for (int k = 0; k < 2; ++k) {
+                    const __m256i q     = _mm256_loadu_si256((const __m256i *) (x[ib].qs + 64*v + 32*k));
+                    const __m256i idx_0 = _mm256_and_si256(q, m4);
+                    const __m256i idx_1 = _mm256_and_si256(_mm256_srli_epi16(q, 4), m4);
+
+                    // adjacent bytes are the two bit-planes of the same row
+                    sum_lo[k] = _mm256_add_epi16(sum_lo[k], _mm256_maddubs_epi16(_mm256_shuffle_epi8(lo_0, idx_0), k12));
+                    sum_hi[k] = _mm256_add_epi16(sum_hi[k], _mm256_maddubs_epi16(k12, _mm256_shuffle_epi8(hi_0, idx_0)));
+                    sum_lo[k] = _mm256_add_epi16(sum_lo[k], _mm256_maddubs_epi16(_mm256_shuffle_epi8(lo_1, idx_1), k12));
+                    sum_hi[k] = _mm256_add_epi16(sum_hi[k], _mm256_maddubs_epi16(k12, _mm256_shuffle_epi8(hi_1, idx_1)));
+                }
+            }
+
+            // rows 16*k + 0..7 are in the low lane, rows 16*k + 8..15 in the high lane
+            for (int k = 0; k < 2; ++k) {
+                const __m256i lo_l = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(sum_lo[k]));
+                const __m256i lo_h = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(sum_lo[k], 1));
+                const __m256i hi_l = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(sum_hi[k]));
+                const __m256i hi_h = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(sum_hi[k], 1));
+
+                isum[2*k + 0] = _mm256_add_epi32(isum[2*k + 0], _mm256_add_epi32(lo_l, _mm256_slli_epi32(hi_l, 8)));
+                isum[2*k + 1] = _mm256_add_epi32(isum[2*k + 1], _mm256_add_epi32(lo_h, _mm256_slli_epi32(hi_h, 8)));
+            }
+        }
+
+        float d[QK_LUT_ROWS];
+        for (int r = 0; r < QK_LUT_ROWS; ++r) {
+            d[r] = GGML_FP16_TO_FP32(x[ib].d[r]) * y[ib].d;
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            acc[i] = _mm256_add_ps(acc[i], _mm256_mul_ps(_mm256_cvtepi32_ps(isum[i]), _mm256_loadu_ps(d + 8*i)));
+        }
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        _mm256_storeu_ps(s + 8*i, acc[i]);
+    }
+#else
+    float sumf[QK_LUT_ROWS] = { 0.0f };
+
+    for (int ib = 0; ib < nb; ++ib) {
+        for (int r = 0; r < QK_LUT_ROWS; ++r) {
+            int32_t isum = -y[ib].sum;
+            for (int g = 0; g < QK_K/QK_LUT_G; ++g) {
+                for (int p = 0; p < 2; ++p) {
+                    const int idx = (x[ib].qs[64*(g/2) + 2*r + p] >> (4*(g%2))) & 0x0F;
+                    const int32_t t = (uint8_t) y[ib].tbl[g][idx] + 256*y[ib].tbl[g][16 + idx];
+                    isum += t * (1 + p);
+                }
+            }
+            sumf[r] += GGML_FP16_TO_FP32(x[ib].d[r]) * y[ib].d * isum;
+        }
+    }
+
+    memcpy(s, sumf, sizeof(sumf));
+#endif
+}
+
+static int repack_tq_to_tq2_0x32(struct ggml_tensor * t, const void * GGML_RESTRICT data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_TQ1_0 || t->type == GGML_TYPE_TQ2_0);
+
+    const int64_t nrow     = ggml_nrows(t);
+    const int64_t nblocks  = t->ne[0] / QK_K;
+    const size_t  row_size = ggml_row_size(t->type, t->ne[0]);
+    const size_t  blk_size = ggml_type_size(t->type);
+
+    GGML_ASSERT(data_size == nrow * row_size);
+
+    if (t->ne[1] % QK_LUT_ROWS != 0) {
+        return -1;
+    }
+
+    const ggml_to_float_t to_float = ggml_get_type_traits(t->type)->to_float;
+
+    block_tq2_0x32 * dst = (block_tq2_0x32 *) t->data;
+
+    float   f[QK_K];
+    uint8_t q[QK_LUT_ROWS][QK_K];
+
+    for (int64_t r0 = 0; r0 < nrow; r0 += QK_LUT_ROWS) {
+        for (int64_t ib = 0; ib < nblocks; ++ib) {
+            for (int r = 0; r < QK_LUT_ROWS; ++r) {
+                const char * src = (const char *) data + (r0 + r)*row_size + ib*blk_size;
+
+                const ggml_half d = t->type == GGML_TYPE_TQ1_0 ? ((const block_tq1_0 *) src)->d : ((const block_tq2_0 *) src)->d;
+                const float    df = GGML_FP16_TO_FP32(d);
+
+                // recover q from the sign of the dequantized weight, which works for every layout
+                to_float(src, f, QK_K);
+                for (int j = 0; j < QK_K; ++j) {
+                    q[r][j] = f[j] == 0.0f ? 1 : ((f[j] > 0.0f) == (df > 0.0f) ? 2 : 0);
+                }
+                dst->d[r] = d;
+            }
+
+            for (int v = 0; v < QK_K/(2*QK_LUT_G); ++v) {
+                for (int r = 0; r < QK_LUT_ROWS; ++r) {
+                    for (int p = 0; p < 2; ++p) {
+                        uint8_t b = 0;
+                        for (int h = 0; h < 2; ++h) {
+                            for (int i = 0; i < QK_LUT_G; ++i) {
+                                b |= ((q[r][QK_LUT_G*(2*v + h) + i] >> p) & 1) << (4*h + i);
+                            }
+                        }
+                        dst->qs[64*v + 2*r + p] = b;
+                    }
+                }
+            }
+            dst++;
+        }
+    }
+
+    return 0;
+}
+
+namespace ggml::cpu::lut {
+
+static size_t lut_row_size(int64_t ne) {
+    return (ne / QK_K) * sizeof(block_lut_q8_K);
+}
+
+class tensor_traits : public ggml::cpu::tensor_traits {
+    bool work_size(int /* n_threads */, const struct ggml_tensor * op, size_t & size) override {
+        if (op->op == GGML_OP_MUL_MAT) {
+            size = ggml_nrows(op->src[1]) * lut_row_size(op->src[1]->ne[0]);
+            return true;
+        }
+        return false;
+    }
+
+    bool compute_forward(struct ggml_compute_params * params, struct ggml_tensor * op) override {
+        if (op->op == GGML_OP_MUL_MAT) {
+            forward_mul_mat(params, op);
+            return true;
+        }
+        return false;
+    }
+
+    void forward_mul_mat(ggml_compute_params * params, ggml_tensor * op) {
+        const ggml_tensor * src0 = op->src[0];
+        const ggml_tensor * src1 = op->src[1];
+        ggml_tensor *       dst  = op;
+
+        GGML_TENSOR_BINARY_OP_LOCALS
+
+        const int ith = params->ith;
+        const int nth = params->nth;
+
+        GGML_ASSERT(ne0 == ne01);
+        GGML_ASSERT(ne1 == ne11);
+        GGML_ASSERT(ne2 == ne12);
+        GGML_ASSERT(ne3 == ne13);
+
+        // dst cannot be transposed or permuted
+        GGML_ASSERT(nb0 == sizeof(float));
+        GGML_ASSERT(nb0 <= nb1);
+        GGML_ASSERT(nb1 <= nb2);
+        GGML_ASSERT(nb2 <= nb3);
+
+        GGML_ASSERT(src1->type == GGML_TYPE_F32);
+        GGML_ASSERT(nb10 == sizeof(float));
+
+        const int64_t nr1  = ne11*ne12*ne13;
+        const size_t  nbw1 = lut_row_size(ne10);
+
+        GGML_ASSERT(params->wsize >= nbw1*nr1);
+
+        char * wdata = static_cast<char *>(params->wdata);
+
+        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_K)->from_float;
+
+        // build the tables of all src1 columns once, they are shared by all the rows of src0
+        for (int64_t ir1 = ith; ir1 < nr1; ir1 += nth) {
+            const int64_t i13 = ir1/(ne12*ne11);
+            const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+            const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+            ggml_lut_from_float((const float *) ((const char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13),
+                                (block_lut_q8_K *) (wdata + ir1*nbw1), ne10, from_float);
+        }
+
+        ggml_barrier(params);
+
+        const int64_t ntiles    = ne01 / QK_LUT_ROWS;
+        const int64_t tile0     = (ith*ntiles)/nth;
+        const int64_t tile1     = ((ith + 1)*ntiles)/nth;
+        const size_t  tile_size = (ne00/QK_K)*sizeof(block_tq2_0x32);
+
+        for (int64_t it = tile0; it < tile1; ++it) {
+            const char * x = (const char *) src0->data + it*tile_size;
+
+            for (int64_t ir1 = 0; ir1 < nr1; ++ir1) {
+                const int64_t i13 = ir1/(ne12*ne11);
+                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+                float * s = (float *) ((char *) dst->data + i11*nb1 + i12*nb2 + i13*nb3) + it*QK_LUT_ROWS;
+
+                ggml_gemv_tq2_0x32_lut(ne00, s, x, wdata + ir1*nbw1);
+            }
+        }
+    }
+
+  public:
+    int repack(struct ggml_tensor * t, const void * data, size_t data_size) {
+        GGML_LOG_DEBUG("%s: repack tensor %s with %s_%dx%d_lut\n", __func__, t->name, ggml_type_name(t->type),
+                       (int) QK_LUT_ROWS, (int) QK_LUT_G);
+        return repack_tq_to_tq2_0x32(t, data, data_size);
+    }
+};
+
+static const tensor_traits tq2_0x32_lut;
+
+}  // namespace ggml::cpu::lut
+
+static const ggml::cpu::tensor_traits * ggml_lut_get_optimal_repack_type(const struct ggml_tensor * cur) {
+#ifdef GGML_USE_CPU_LUT_TQ2_0
+    if (cur->type == GGML_TYPE_TQ1_0 || cur->type == GGML_TYPE_TQ2_0) {
+#else
+    if (cur->type == GGML_TYPE_TQ1_0) {
+#endif
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % QK_LUT_ROWS == 0) {
+                return &ggml::cpu::lut::tq2_0x32_lut;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+static enum ggml_status ggml_backend_cpu_lut_buffer_init_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
+    tensor->extra = (void *) const_cast<ggml::cpu::tensor_traits *>(ggml_lut_get_optimal_repack_type(tensor));
+
+    GGML_UNUSED(buffer);
+    return GGML_STATUS_SUCCESS;
+}
+
+static void ggml_backend_cpu_lut_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor,
+                                                   const void * data, size_t offset, size_t size) {
+    GGML_ASSERT(offset == 0);
+    GGML_ASSERT(size == ggml_nbytes(tensor));
+
+    auto tensor_traits = (ggml::cpu::lut::tensor_traits *) tensor->extra;
+    auto OK            = tensor_traits->repack(tensor, data, size);
+
+    GGML_ASSERT(OK == 0);
+    GGML_UNUSED(buffer);
+}
+
+static const char * ggml_backend_cpu_lut_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "CPU_LUT";
+
+    GGML_UNUSED(buft);
+}
+
+static ggml_backend_buffer_t ggml_backend_cpu_lut_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size);
+
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+
+    buffer->buft              = buft;
+    buffer->iface.init_tensor = ggml_backend_cpu_lut_buffer_init_tensor;
+    buffer->iface.set_tensor  = ggml_backend_cpu_lut_buffer_set_tensor;
+    buffer->iface.get_tensor  = nullptr;
+    buffer->iface.cpy_tensor  = nullptr;
+    return buffer;
+}
+
+static size_t ggml_backend_cpu_lut_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return TENSOR_ALIGNMENT;
+
+    GGML_UNUSED(buft);
+}
+
+static size_t ggml_backend_cpu_lut_buffer_type_get_alloc_size(ggml_backend_buffer_type_t buft, const struct ggml_tensor * tensor) {
+    // TQ1_0 is expanded to the 2 bits per weight of the repacked layout
+    if (tensor->type == GGML_TYPE_TQ1_0) {
+        return ggml_nrows(tensor) * ggml_row_size(GGML_TYPE_TQ2_0, tensor->ne[0]);
+    }
+    return ggml_nbytes(tensor);
+
+    GGML_UNUSED(buft);
+}
+
+namespace ggml::cpu::lut {
+class extra_buffer_type : ggml::cpu::extra_buffer_type {
+    bool supports_op(ggml_backend_dev_t, const struct ggml_tensor * op) override {
+        if (    op->op == GGML_OP_MUL_MAT &&
+                op->src[0]->buffer &&
+                (ggml_n_dims(op->src[0]) == 2) &&
+                op->src[0]->buffer->buft == ggml_backend_cpu_lut_buffer_type() &&
+                ggml_lut_get_optimal_repack_type(op->src[0])
+                ) {
+            if (op->src[1]->buffer && !ggml_backend_buft_is_host(op->src[1]->buffer->buft)) {
+                return false;
+            }
+            if (op->src[1]->type == GGML_TYPE_F32 && op->src[1]->nb[0] == sizeof(float)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ggml::cpu::tensor_traits * get_tensor_traits(const struct ggml_tensor * op) override {
+        if (op->op == GGML_OP_MUL_MAT) {
+            if (op->src[0]->buffer && op->src[0]->buffer->buft == ggml_backend_cpu_lut_buffer_type()) {
+                return (ggml::cpu::tensor_traits *) op->src[0]->extra;
+            }
+        }
+        return nullptr;
+    }
+};
+}  // namespace ggml::cpu::lut
+
+ggml_backend_buffer_type_t ggml_backend_cpu_lut_buffer_type(void) {
+    static struct ggml_backend_buffer_type ggml_backend_cpu_buffer_type_lut = {
+        /* .iface    = */ {
+                           /* .get_name         = */ ggml_backend_cpu_lut_buffer_type_get_name,
+                           /* .alloc_buffer     = */ ggml_backend_cpu_lut_buffer_type_alloc_buffer,
+                           /* .get_alignment    = */ ggml_backend_cpu_lut_buffer_type_get_alignment,
+                           /* .get_max_size     = */ nullptr,  // defaults to SIZE_MAX
+                           /* .get_alloc_size   = */ ggml_backend_cpu_lut_buffer_type_get_alloc_size,
+                           /* .is_host          = */ nullptr,
+                           },
+        /* .device  = */ ggml_backend_reg_dev_get(ggml_backend_cpu_reg(), 0),
+        /* .context = */ new ggml::cpu::lut::extra_buffer_type(),
+    };
+
+    return &ggml_backend_cpu_buffer_type_lut;
+}
@@ -0,0 +1,432 @@
+#include "ggml-impl.h"
+#include "ggml-cpu.h"
+
+#include "ggml-cpu-profile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// Per-op profiler of the CPU backend.
+//
+// Each thread appends the events it runs to its own list, so recording needs no synchronization. The lists are
+// reserved for the most events a thread can record in the graph before the threads start, so the recording never
+// reallocates. The nodes of the computed graphs are copied when the graph starts (the graph may be gone by the time
+// the profile is written), and the events refer to them by their index in the graph.
+//
+// The summary is aggregated when each graph ends, and only the nodes and the events of the last
+// GGML_CPU_PROFILE_TRACE_GRAPHS graphs are kept for the trace, so the memory of the profiler does not grow with the
+// number of computed graphs.
+
+struct ggml_cpu_profile_node {
+    char         name[GGML_MAX_NAME];
+    const char * op;   // ggml_op_desc()
+    const char * type; // the type of src0 for the mul_mats, of the node otherwise
+    int64_t      ne[GGML_MAX_DIMS];
+    int64_t      flops;
+    int64_t      bytes_read;
+    int64_t      bytes_written;
+};
+
+struct ggml_cpu_profile_event {
+    int64_t t0;
+    int64_t t1;
+    int32_t type;
+    int32_t n_nodes;
+    int32_t nodes[GGML_CPU_PROFILE_NODES_MAX]; // indices in the graph
+};
+
+struct alignas(64) ggml_cpu_profile_thread {
+    std::vector<ggml_cpu_profile_event> events;
+};
+
+struct ggml_cpu_profile_graph {
+    int64_t id; // the number of graphs computed before this one
+    int64_t t0;
+    int64_t t1;
+
+    std::vector<ggml_cpu_profile_node>   nodes;
+    std::vector<ggml_cpu_profile_thread> threads;
+};
+
+// a row of the summary
+struct ggml_cpu_profile_row {
+    bool    node      = false;
+    int64_t count     = 0;
+    int64_t t_wall    = 0; // from the first thread starting the node to the last one finishing it
+    int64_t t_threads = 0; // the sum over the threads
+    int64_t flops     = 0;
+    int64_t bytes     = 0;
+};
+
+struct ggml_cpu_profiler {
+    int64_t t_origin;
+
+    int64_t n_graphs; // since the creation or the last reset of the profiler
+    int64_t n_nodes;
+    int64_t t_graphs;
+
+    std::map<std::string, ggml_cpu_profile_row> rows;
+
+    // the last GGML_CPU_PROFILE_TRACE_GRAPHS graphs, graph id is in graphs[id % GGML_CPU_PROFILE_TRACE_GRAPHS]
+    std::vector<ggml_cpu_profile_graph> graphs;
+
+    ggml_cpu_profile_graph * cur; // the graph being computed
+
+    // the row and the span over the threads of each computed node of the current graph, by its first node
+    std::vector<ggml_cpu_profile_row *> node_row;
+    std::vector<int64_t>                node_t0;
+    std::vector<int64_t>                node_t1;
+};
+
+int64_t ggml_cpu_profiler_time_ns(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the nodes that only change the view of their source
+static bool ggml_cpu_profile_is_view(const struct ggml_tensor * t) {
+    switch (t->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_VIEW:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int64_t ggml_cpu_profile_flops(const struct ggml_tensor * t) {
+    switch (t->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return 2*t->src[0]->ne[0]*ggml_nelements(t);
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                const struct ggml_tensor * q = t->src[0];
+                const struct ggml_tensor * k = t->src[1];
+                const struct ggml_tensor * v = t->src[2];
+
+                return 2*q->ne[1]*q->ne[2]*q->ne[3]*k->ne[1]*(q->ne[0] + v->ne[0]);
+            }
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+        case GGML_OP_GET_ROWS:
+            return 0;
+        default:
+            // roughly one operation per element for the other ops
+            return ggml_cpu_profile_is_view(t) ? 0 : ggml_nelements(t);
+    }
+}
+
+static int64_t ggml_cpu_profile_bytes_read(const struct ggml_tensor * t) {
+    if (ggml_cpu_profile_is_view(t)) {
+        return 0;
+    }
+
+    int64_t bytes = 0;
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        const struct ggml_tensor * src = t->src[i];
+        if (src == nullptr) {
+            continue;
+        }
+
+        if (t->op == GGML_OP_MUL_MAT_ID && i == 0) {
+            // only the used experts are read
+            const struct ggml_tensor * ids = t->src[2];
+            const int64_t n_as = src->ne[2];
+            bytes += ggml_nbytes(src)/n_as*std::min(n_as, ids->ne[0]*ids->ne[1]);
+        } else if (t->op == GGML_OP_GET_ROWS && i == 0) {
+            bytes += ggml_row_size(src->type, src->ne[0])*ggml_nrows(t);
+        } else {
+            bytes += ggml_nbytes(src);
+        }
+    }
+
+    return bytes;
+}
+
+ggml_cpu_profiler_t ggml_cpu_profiler_new(void) {
+    ggml_cpu_profiler * profiler = new ggml_cpu_profiler;
+
+    profiler->graphs.resize(GGML_CPU_PROFILE_TRACE_GRAPHS);
+    ggml_cpu_profiler_reset(profiler);
+
+    return profiler;
+}
+
+void ggml_cpu_profiler_free(ggml_cpu_profiler_t profiler) {
+    delete profiler;
+}
+
+void ggml_cpu_profiler_reset(ggml_cpu_profiler_t profiler) {
+    profiler->t_origin = ggml_cpu_profiler_time_ns();
+
+    profiler->n_graphs = 0;
+    profiler->n_nodes  = 0;
+    profiler->t_graphs = 0;
+
+    profiler->rows.clear();
+
+    for (auto & graph : profiler->graphs) {
+        graph.nodes.clear();
+        graph.threads.clear();
+    }
+
+    profiler->cur = nullptr;
+}
+
+void ggml_cpu_profiler_graph_begin(ggml_cpu_profiler_t profiler, const struct ggml_cgraph * cgraph, int n_threads) {
+    ggml_cpu_profile_graph & graph = profiler->graphs[profiler->n_graphs % GGML_CPU_PROFILE_TRACE_GRAPHS];
+    graph.id = profiler->n_graphs++;
+
+    graph.nodes.clear();
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * t = cgraph->nodes[i];
+
+        ggml_cpu_profile_node node;
+        strncpy(node.name, t->name, sizeof(node.name));
+        node.name[sizeof(node.name) - 1] = '\0';
+        node.op   = ggml_op_desc(t);
+        node.type = ggml_type_name((t->op == GGML_OP_MUL_MAT || t->op == GGML_OP_MUL_MAT_ID) ? t->src[0]->type : t->type);
+        for (int d = 0; d < GGML_MAX_DIMS; d++) {
+            node.ne[d] = t->ne[d];
+        }
+        node.flops         = ggml_cpu_profile_flops(t);
+        node.bytes_read    = ggml_cpu_profile_bytes_read(t);
+        node.bytes_written = ggml_cpu_profile_is_view(t) ? 0 : ggml_nbytes(t);
+
+        graph.nodes.push_back(node);
+    }
+
+    // per wave of nodes, a thread records at most a src1 conversion, a node and a barrier, and there is a last barrier
+    const size_t n_events_max = 3*(size_t) cgraph->n_nodes + 1;
+
+    graph.threads.resize(n_threads);
+    for (auto & thread : graph.threads) {
+        thread.events.clear();
+        thread.events.reserve(n_events_max);
+    }
+
+    profiler->cur = &graph;
+
+    graph.t0 = ggml_cpu_profiler_time_ns();
+    graph.t1 = graph.t0;
+}
+
+// the name of the ops of an event, with the fused ops
+static std::string ggml_cpu_profile_event_op(const ggml_cpu_profile_graph & graph, const ggml_cpu_profile_event & event) {
+    switch (event.type) {
+        case GGML_CPU_PROFILE_EVENT_BARRIER: return "barrier";
+        case GGML_CPU_PROFILE_EVENT_SRC1:    return "src1 conversion";
+        default: break;
+    }
+
+    std::string op;
+    for (int i = 0; i < event.n_nodes; i++) {
+        op += (i > 0 ? "+" : "") + std::string(graph.nodes[event.nodes[i]].op);
+    }
+
+    return op;
+}
+
+// add the events of the graph to the summary
+static void ggml_cpu_profile_aggregate(ggml_cpu_profiler * profiler, const ggml_cpu_profile_graph & graph) {
+    const size_t n_nodes = graph.nodes.size();
+
+    profiler->node_row.assign(n_nodes, nullptr);
+    profiler->node_t0.assign(n_nodes, INT64_MAX);
+    profiler->node_t1.assign(n_nodes, INT64_MIN);
+
+    for (const auto & thread : graph.threads) {
+        for (const auto & event : thread.events) {
+            if (event.type != GGML_CPU_PROFILE_EVENT_NODE) {
+                ggml_cpu_profile_row & r = profiler->rows[ggml_cpu_profile_event_op(graph, event)];
+                r.count++;
+                r.t_threads += event.t1 - event.t0;
+                continue;
+            }
+
+            const int32_t i = event.nodes[0];
+
+            if (profiler->node_row[i] == nullptr) {
+                std::string op = ggml_cpu_profile_event_op(graph, event);
+                if (strncmp(graph.nodes[i].op, "MUL_MAT", 7) == 0) {
+                    op += std::string(" ") + graph.nodes[i].type;
+                }
+
+                ggml_cpu_profile_row & r = profiler->rows[op];
+                r.node = true;
+                r.count++;
+                for (int k = 0; k < event.n_nodes; k++) {
+                    const ggml_cpu_profile_node & node = graph.nodes[event.nodes[k]];
+                    r.flops += node.flops;
+                    r.bytes += node.bytes_read + node.bytes_written;
+                }
+
+                profiler->node_row[i] = &r;
+            }
+
+            profiler->node_row[i]->t_threads += event.t1 - event.t0;
+
+            profiler->node_t0[i] = std::min(profiler->node_t0[i], event.t0);
+            profiler->node_t1[i] = std::max(profiler->node_t1[i], event.t1);
+        }
+    }
+
+    for (size_t i = 0; i < n_nodes; i++) {
+        if (profiler->node_row[i] != nullptr) {
+            profiler->node_row[i]->t_wall += profiler->node_t1[i] - profiler->node_t0[i];
+        }
+    }
+
+    profiler->n_nodes  += n_nodes;
+    profiler->t_graphs += graph.t1 - graph.t0;
+}
+
+void ggml_cpu_profiler_graph_end(ggml_cpu_profiler_t profiler) {
+    ggml_cpu_profile_graph & graph = *profiler->cur;
+
+    graph.t1 = ggml_cpu_profiler_time_ns();
+
+    ggml_cpu_profile_aggregate(profiler, graph);
+}
+
+void ggml_cpu_profiler_record(ggml_cpu_profiler_t profiler, int ith, enum ggml_cpu_profile_event_type type,
+        const int * nodes, int n_nodes, int64_t t0, int64_t t1) {
+    GGML_ASSERT(n_nodes <= GGML_CPU_PROFILE_NODES_MAX);
+
+    auto & events = profiler->cur->threads[ith].events;
+
+    // reserved in ggml_cpu_profiler_graph_begin
+    GGML_ASSERT(events.size() < events.capacity());
+
+    ggml_cpu_profile_event event;
+    event.t0      = t0;
+    event.t1      = t1;
+    event.type    = type;
+    event.n_nodes = n_nodes;
+    for (int i = 0; i < n_nodes; i++) {
+        event.nodes[i] = nodes[i];
+    }
+
+    events.push_back(event);
+}
+
+static void ggml_cpu_profile_write_json_string(FILE * f, const char * s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool ggml_cpu_profiler_write_trace(ggml_cpu_profiler_t profiler, const char * fname) {
+    FILE * f = ggml_fopen(fname, "w");
+    if (!f) {
+        GGML_LOG_ERROR("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    // the timestamps are in us, relative to the creation or the last reset of the profiler
+    const auto ts = [&](int64_t t) { return (t - profiler->t_origin)/1000.0; };
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"ggml-cpu\"}}");
+
+    const int64_t id0 = std::max<int64_t>(0, profiler->n_graphs - GGML_CPU_PROFILE_TRACE_GRAPHS);
+
+    size_t n_threads = 0;
+    for (int64_t id = id0; id < profiler->n_graphs; id++) {
+        n_threads = std::max(n_threads, profiler->graphs[id % GGML_CPU_PROFILE_TRACE_GRAPHS].threads.size());
+    }
+
+    for (size_t ith = 0; ith < n_threads; ith++) {
+        fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %zu, \"args\": {\"name\": \"thread %zu\"}}", ith, ith);
+    }
+
+    for (int64_t id = id0; id < profiler->n_graphs; id++) {
+        const ggml_cpu_profile_graph & graph = profiler->graphs[id % GGML_CPU_PROFILE_TRACE_GRAPHS];
+
+        for (size_t ith = 0; ith < graph.threads.size(); ith++) {
+            for (const auto & event : graph.threads[ith].events) {
+                fprintf(f, ",\n{\"name\": ");
+                if (event.type == GGML_CPU_PROFILE_EVENT_NODE) {
+                    ggml_cpu_profile_write_json_string(f, graph.nodes[event.nodes[event.n_nodes - 1]].name);
+                } else {
+                    ggml_cpu_profile_write_json_string(f, ggml_cpu_profile_event_op(graph, event).c_str());
+                }
+                fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"graph\": %" PRId64,
+                        event.type == GGML_CPU_PROFILE_EVENT_NODE ? "node" : event.type == GGML_CPU_PROFILE_EVENT_BARRIER ? "barrier" : "src1",
+                        ith, ts(event.t0), (event.t1 - event.t0)/1000.0, graph.id);
+
+                if (event.type == GGML_CPU_PROFILE_EVENT_NODE) {
+                    const ggml_cpu_profile_node & node = graph.nodes[event.nodes[0]];
+
+                    int64_t flops = 0, bytes_read = 0, bytes_written = 0;
+                    for (int i = 0; i < event.n_nodes; i++) {
+                        flops         += graph.nodes[event.nodes[i]].flops;
+                        bytes_read    += graph.nodes[event.nodes[i]].bytes_read;
+                        bytes_written += graph.nodes[event.nodes[i]].bytes_written;
+                    }
+
+                    fprintf(f, ", \"node\": %d, \"op\": ", event.nodes[0]);
+                    ggml_cpu_profile_write_json_string(f, ggml_cpu_profile_event_op(graph, event).c_str());
+                    fprintf(f, ", \"type\": \"%s\", \"ne\": [%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 "]"
+                               ", \"flops\": %" PRId64 ", \"bytes_read\": %" PRId64 ", \"bytes_written\": %" PRId64,
+                            node.type, node.ne[0], node.ne[1], node.ne[2], node.ne[3], flops, bytes_read, bytes_written);
+                }
+
+                fprintf(f, "}}");
+            }
+        }
+
+        fprintf(f, ",\n{\"name\": \"graph\", \"cat\": \"graph\", \"ph\": \"X\", \"pid\": 0, \"tid\": -1, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"graph\": %" PRId64 ", \"n_nodes\": %zu}}",
+                ts(graph.t0), (graph.t1 - graph.t0)/1000.0, graph.id, graph.nodes.size());
+    }
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+
+    return true;
+}
+
+void ggml_cpu_profiler_print_summary(ggml_cpu_profiler_t profiler, FILE * stream) {
+    std::vector<std::pair<std::string, ggml_cpu_profile_row>> sorted(profiler->rows.begin(), profiler->rows.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto & a, const auto & b) {
+        return a.second.t_wall != b.second.t_wall ? a.second.t_wall > b.second.t_wall : a.second.t_threads > b.second.t_threads;
+    });
+
+    const int64_t t_graphs = profiler->t_graphs;
+
+    fprintf(stream, "\nggml_cpu_profiler: %" PRId64 " graphs, %" PRId64 " nodes, %.3f ms\n", profiler->n_graphs, profiler->n_nodes, t_graphs/1e6);
+    fprintf(stream, "%-32s %8s %11s %6s %11s %10s %9s %10s %9s\n",
+            "op", "count", "wall ms", "wall %", "thread ms", "GFLOP", "GFLOP/s", "GB", "GB/s");
+
+    for (const auto & it : sorted) {
+        const ggml_cpu_profile_row & r = it.second;
+        if (r.node) {
+            fprintf(stream, "%-32s %8" PRId64 " %11.3f %6.2f %11.3f %10.3f %9.2f %10.3f %9.2f\n",
+                    it.first.c_str(), r.count, r.t_wall/1e6, t_graphs > 0 ? 100.0*r.t_wall/t_graphs : 0.0, r.t_threads/1e6,
+                    r.flops/1e9, r.t_wall > 0 ? r.flops/(double) r.t_wall : 0.0, r.bytes/1e9, r.t_wall > 0 ? r.bytes/(double) r.t_wall : 0.0);
+        } else {
+            // the barrier waits overlap with the nodes of the other threads, only their total is meaningful
+            fprintf(stream, "%-32s %8" PRId64 " %11s %6s %11.3f\n", it.first.c_str(), r.count, "-", "-", r.t_threads/1e6);
+        }
+    }
+}
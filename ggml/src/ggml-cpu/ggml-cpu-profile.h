@@ -0,0 +1,37 @@
+#pragma once
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+// GGML internal header
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the max number of nodes of an event, the node computed by a kernel and the nodes fused into it
+#define GGML_CPU_PROFILE_NODES_MAX 4
+
+// the number of graphs kept for the trace, the last ones computed
+#define GGML_CPU_PROFILE_TRACE_GRAPHS 16
+
+enum ggml_cpu_profile_event_type {
+    GGML_CPU_PROFILE_EVENT_NODE,    // the computation of a node
+    GGML_CPU_PROFILE_EVENT_BARRIER, // the wait at the barrier after a wave of nodes
+    GGML_CPU_PROFILE_EVENT_SRC1,    // the conversion of the src1 shared by the mul_mats of a wave
+};
+
+int64_t ggml_cpu_profiler_time_ns(void);
+
+// called by the main thread before the threads start computing the graph and after they are done
+// n_threads is the max number of threads that compute the graph
+void ggml_cpu_profiler_graph_begin(ggml_cpu_profiler_t profiler, const struct ggml_cgraph * cgraph, int n_threads);
+void ggml_cpu_profiler_graph_end  (ggml_cpu_profiler_t profiler);
+
+// called by the thread ith, nodes are indices in the graph
+void ggml_cpu_profiler_record(ggml_cpu_profiler_t profiler, int ith, enum ggml_cpu_profile_event_type type,
+        const int * nodes, int n_nodes, int64_t t0, int64_t t1);
+
+#ifdef __cplusplus
+}
+#endif
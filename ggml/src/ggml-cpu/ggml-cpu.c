@@ -8,6 +8,7 @@
 #include "ggml-cpu.h"
 #include "ggml-impl.h"
 #include "ggml-cpu-quants.h"
+#include "ggml-cpu-profile.h"
 #include "ggml-threading.h"
 #include "unary-ops.h"
 #include "binary-ops.h"
@@ -36,6 +37,8 @@
 #include <signal.h>
 #if defined(__gnu_linux__)
 #include <syscall.h>
+#include <unistd.h>
+#include <linux/futex.h>
 #endif
 
 #ifdef GGML_USE_OPENMP
@@ -140,6 +143,23 @@ static void atomic_flag_clear(atomic_flag * ptr) {
 static void atomic_thread_fence(memory_order mo) {
     MemoryBarrier();
 }
+
+typedef volatile LONG64 atomic_int64;
+
+static int64_t atomic_load_int64(atomic_int64 * ptr) {
+    return InterlockedCompareExchange64(ptr, 0, 0);
+}
+static void atomic_store_int64(atomic_int64 * ptr, int64_t val) {
+    InterlockedExchange64(ptr, val);
+}
+static bool atomic_compare_exchange_int64(atomic_int64 * ptr, int64_t * expected, int64_t desired) {
+    const int64_t prev = InterlockedCompareExchange64(ptr, desired, *expected);
+    if (prev == *expected) {
+        return true;
+    }
+    *expected = prev;
+    return false;
+}
 #else // clang
 #include <stdatomic.h>
 #endif
@@ -189,6 +209,20 @@ typedef void * thread_ret_t;
 
 typedef pthread_t ggml_thread_t;
 
+#if !defined(_MSC_VER) || defined(__clang__)
+typedef _Atomic int64_t atomic_int64;
+
+static inline int64_t atomic_load_int64(atomic_int64 * ptr) {
+    return atomic_load_explicit(ptr, memory_order_relaxed);
+}
+static inline void atomic_store_int64(atomic_int64 * ptr, int64_t val) {
+    atomic_store_explicit(ptr, val, memory_order_relaxed);
+}
+static inline bool atomic_compare_exchange_int64(atomic_int64 * ptr, int64_t * expected, int64_t desired) {
+    return atomic_compare_exchange_weak_explicit(ptr, expected, desired, memory_order_relaxed, memory_order_relaxed);
+}
+#endif
+
 #if defined(__APPLE__)
 #include <unistd.h>
 #include <mach/mach.h>
@@ -429,6 +463,16 @@ typedef pthread_mutex_t    ggml_mutex_t;
 #endif
 
 // Threadpool def
+// the maximum number of nodes of a graph wave that are run concurrently by separate groups of threads
+#define GGML_GRAPH_WAVE_MAX 8
+
+// the root of the barrier of a group of threads
+struct ggml_compute_group {
+    atomic_int GGML_CACHE_ALIGN n_barrier;
+    atomic_int GGML_CACHE_ALIGN n_barrier_passed;
+    atomic_int n_barrier_sleeping; // the threads waiting on a futex for n_barrier_passed to change
+};
+
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
     ggml_cond_t  cond;        // cond.var for waiting for new work
@@ -438,9 +482,9 @@ struct ggml_threadpool {
 
     // synchronization primitives
     atomic_int n_graph;       // incremented when there is work to be done (i.e each graph)
-    atomic_int GGML_CACHE_ALIGN n_barrier;
-    atomic_int GGML_CACHE_ALIGN n_barrier_passed;
-    atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
+
+    struct ggml_compute_group barrier;                    // all the threads
+    struct ggml_compute_group groups[GGML_GRAPH_WAVE_MAX]; // the groups of the graph waves
 
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
@@ -454,9 +498,23 @@ struct ggml_threadpool {
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
 
+    ggml_cpu_profiler_t profiler; // NULL if the graphs are not profiled
+
+    // the waves of the current graph, built once per graph before the threads run it (see ggml_graph_waves_build())
+    struct ggml_graph_wave * waves;
+    int    n_waves;
+    int    n_waves_alloc;
+    size_t waves_wsize; // the part of the work buffer used by the nodes, the src1 cache is after it
+
     enum ggml_status ec;
 };
 
+// the counters of the hierarchical barrier, used if the thread is the first of its cluster or of its NUMA node
+struct ggml_barrier_counters {
+    atomic_int GGML_CACHE_ALIGN n_cluster;
+    atomic_int GGML_CACHE_ALIGN n_node;
+};
+
 // Per-thread state
 struct ggml_compute_state {
 #ifndef GGML_USE_OPENMP
@@ -467,6 +525,13 @@ struct ggml_compute_state {
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
+    int numa_node; // -1 if unknown
+
+    // the remaining chunks of this thread in the chunk scheduler, packed as (end << 32) | begin
+    atomic_int64 GGML_CACHE_ALIGN chunks;
+
+    struct ggml_barrier_counters barrier;       // barrier of all the threads
+    struct ggml_barrier_counters barrier_group; // barrier of the group of the thread in a graph wave
 };
 
 // Helpers for polling loops
@@ -517,44 +582,209 @@ struct ggml_state {
 
 static struct ggml_state g_state = {0};
 
-void ggml_barrier(struct ggml_threadpool * tp) {
-    int n_threads = atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed);
-    if (n_threads == 1) {
-        return;
+// hierarchical barrier
+//   the threads are split in clusters of up to GGML_BARRIER_CLUSTER consecutive threads of the same NUMA node, which
+//   usually share a core complex when the threads are pinned to consecutive cores. a thread arrives at the counter of
+//   its cluster, the last thread of a cluster arrives at the counter of its NUMA node and the last thread of a node
+//   arrives at the root, so a counter is never shared by more than a few threads
+//   the last thread to arrive at the root releases all the threads. the threads that wait longer than the polling
+//   level of the threadpool allows sleep on a futex (Linux only)
+
+#define GGML_BARRIER_CLUSTER 8
+
+// the number of NUMA nodes that the threads are distributed over, the thread ith runs on the node ith % n
+static int ggml_barrier_n_numa(int n_threads) {
+    if (g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_DISTRIBUTE && g_state.numa.n_nodes > 1) {
+        return MIN(n_threads, (int) g_state.numa.n_nodes);
     }
 
-#ifdef GGML_USE_OPENMP
-    #pragma omp barrier
-#else
-    int n_passed = atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed);
+    return 1;
+}
+
+// returns true for the last of the n threads to arrive
+static bool ggml_barrier_arrive(atomic_int * n_arrived, int n) {
+    if (n == 1) {
+        return true;
+    }
+
+    // full seq-cst fence
+    if (atomic_fetch_add_explicit(n_arrived, 1, memory_order_seq_cst) == n - 1) {
+        atomic_store_explicit(n_arrived, 0, memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+
+static void ggml_barrier_tree(struct ggml_compute_state * workers, bool group, struct ggml_compute_group * root, int ith, int nth, int n_numa, uint32_t poll) {
+    const int n_passed = atomic_load_explicit(&root->n_barrier_passed, memory_order_relaxed);
+
+    // the NUMA node of the thread, the index of the thread in the node and the number of threads of the node
+    const int node   = ith % n_numa;
+    const int i_node = ith / n_numa;
+    const int n_node = (nth - node + n_numa - 1)/n_numa;
 
-    // enter barrier (full seq-cst fence)
-    int n_barrier = atomic_fetch_add_explicit(&tp->n_barrier, 1, memory_order_seq_cst);
+    const int cluster    = i_node/GGML_BARRIER_CLUSTER;
+    const int n_cluster  = MIN(GGML_BARRIER_CLUSTER, n_node - cluster*GGML_BARRIER_CLUSTER);
+    const int n_clusters = (n_node + GGML_BARRIER_CLUSTER - 1)/GGML_BARRIER_CLUSTER;
 
-    if (n_barrier == (n_threads - 1)) {
+    // the threads that finish early in a group arrive at the barrier of all the threads while the others still use
+    // the barrier of the group, so the two need separate counters
+    struct ggml_compute_state * w_cluster = &workers[node + n_numa*cluster*GGML_BARRIER_CLUSTER];
+    struct ggml_compute_state * w_node    = &workers[node];
+
+    struct ggml_barrier_counters * c_cluster = group ? &w_cluster->barrier_group : &w_cluster->barrier;
+    struct ggml_barrier_counters * c_node    = group ? &w_node->barrier_group    : &w_node->barrier;
+
+    // enter barrier
+    if (ggml_barrier_arrive(&c_cluster->n_cluster, n_cluster) &&
+        ggml_barrier_arrive(&c_node->n_node, n_clusters) &&
+        ggml_barrier_arrive(&root->n_barrier, n_numa)) {
         // last thread
-        atomic_store_explicit(&tp->n_barrier, 0, memory_order_relaxed);
 
-        // exit barrier (fill seq-cst fence)
-        atomic_fetch_add_explicit(&tp->n_barrier_passed, 1, memory_order_seq_cst);
+        // exit barrier (full seq-cst fence)
+        atomic_fetch_add_explicit(&root->n_barrier_passed, 1, memory_order_seq_cst);
+
+#if defined(__gnu_linux__)
+        if (atomic_load_explicit(&root->n_barrier_sleeping, memory_order_seq_cst) > 0) {
+            syscall(SYS_futex, &root->n_barrier_passed, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+        }
+#endif
         return;
     }
 
     // wait for other threads
-    while (atomic_load_explicit(&tp->n_barrier_passed, memory_order_relaxed) == n_passed) {
+    //   the waits at a barrier are usually much shorter than the waits for a new graph, so the polling is shorter than
+    //   in ggml_graph_compute_poll_for_work(), with at least some polling for polling level 0
+    const uint64_t n_rounds = 1024UL * MAX(poll, 1);
+
+    for (uint64_t i = 0; atomic_load_explicit(&root->n_barrier_passed, memory_order_relaxed) == n_passed; i++) {
+#if defined(__gnu_linux__)
+        if (i >= n_rounds) {
+            atomic_fetch_add_explicit(&root->n_barrier_sleeping, 1, memory_order_seq_cst);
+            if (atomic_load_explicit(&root->n_barrier_passed, memory_order_seq_cst) == n_passed) {
+                syscall(SYS_futex, &root->n_barrier_passed, FUTEX_WAIT_PRIVATE, n_passed, NULL, NULL, 0);
+            }
+            atomic_fetch_sub_explicit(&root->n_barrier_sleeping, 1, memory_order_seq_cst);
+            continue;
+        }
+#else
+        UNUSED(n_rounds);
+#endif
         ggml_thread_cpu_relax();
     }
 
     // exit barrier (full seq-cst fence)
     // TSAN doesn't support standalone fence yet, we use a dummy read-modify-write instead
     #ifdef GGML_TSAN_ENABLED
-    atomic_fetch_add_explicit(&tp->n_barrier_passed, 0, memory_order_seq_cst);
+    atomic_fetch_add_explicit(&root->n_barrier_passed, 0, memory_order_seq_cst);
     #else
     atomic_thread_fence(memory_order_seq_cst);
     #endif
+}
+
+void ggml_barrier(const struct ggml_compute_params * params) {
+    if (params->nth == 1) {
+        return;
+    }
+
+    struct ggml_threadpool * tp = params->threadpool;
+
+    if (params->group) {
+        // a group of threads always uses its own barrier, even with OpenMP
+        ggml_barrier_tree(tp->workers + params->ith0, true, params->group, params->ith, params->nth, 1, tp->poll);
+        return;
+    }
+
+#ifdef GGML_USE_OPENMP
+    #pragma omp barrier
+#else
+    ggml_barrier_tree(tp->workers, false, &tp->barrier, params->ith, params->nth, ggml_barrier_n_numa(params->nth), tp->poll);
 #endif
 }
 
+// work-stealing chunk scheduler
+//   the chunks [0, n_chunks) are split in contiguous ranges, one per thread. each thread takes the chunks of its own
+//   range from the front and, once it is empty, steals chunks from the back of the ranges of the other threads, from
+//   the threads on the same NUMA node first
+
+static void ggml_chunk_sched_init_thread(const struct ggml_compute_params * params, int ith, int64_t n_chunks) {
+    const int nth = params->nth;
+
+    const int64_t c0 = n_chunks*ith/nth;
+    const int64_t c1 = n_chunks*(ith + 1)/nth;
+
+    atomic_store_int64(&params->threadpool->workers[params->ith0 + ith].chunks, (c1 << 32) | c0);
+}
+
+void ggml_chunk_sched_init(const struct ggml_compute_params * params, int64_t n_chunks) {
+    GGML_ASSERT(n_chunks >= 0 && n_chunks <= INT32_MAX);
+
+    ggml_chunk_sched_init_thread(params, params->ith, n_chunks);
+}
+
+void ggml_chunk_sched_init_all(const struct ggml_compute_params * params, int64_t n_chunks) {
+    GGML_ASSERT(n_chunks >= 0 && n_chunks <= INT32_MAX);
+
+    for (int j = 0; j < params->nth; ++j) {
+        ggml_chunk_sched_init_thread(params, j, n_chunks);
+    }
+}
+
+// take a chunk from the front (owner) or from the back (thief) of a range
+static bool ggml_chunk_sched_pop(atomic_int64 * chunks, bool front, int64_t * chunk) {
+    int64_t cur = atomic_load_int64(chunks);
+
+    while (true) {
+        const int64_t c0 = cur & 0xFFFFFFFF;
+        const int64_t c1 = cur >> 32;
+
+        if (c0 >= c1) {
+            return false;
+        }
+
+        const int64_t next = front ? (c1 << 32) | (c0 + 1) : ((c1 - 1) << 32) | c0;
+
+        if (atomic_compare_exchange_int64(chunks, &cur, next)) {
+            *chunk = front ? c0 : c1 - 1;
+            return true;
+        }
+    }
+}
+
+int64_t ggml_chunk_sched_next(const struct ggml_compute_params * params) {
+    // the workers of the threads that run the node
+    struct ggml_compute_state * workers = params->threadpool->workers + params->ith0;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    int64_t chunk;
+
+    if (ggml_chunk_sched_pop(&workers[ith].chunks, true, &chunk)) {
+        return chunk;
+    }
+
+    const int node = workers[ith].numa_node;
+
+    // steal from the threads on the same NUMA node first, then from the others
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 1; i < nth; ++i) {
+            const int j = (ith + i) % nth;
+
+            if ((workers[j].numa_node == node) != (pass == 0)) {
+                continue;
+            }
+
+            if (ggml_chunk_sched_pop(&workers[j].chunks, false, &chunk)) {
+                return chunk;
+            }
+        }
+    }
+
+    return -1;
+}
+
 #if defined(__gnu_linux__)
 static cpu_set_t ggml_get_numa_affinity(void) {
     cpu_set_t cpuset;
@@ -1164,6 +1394,68 @@ void ggml_set_f32_nd(const struct ggml_tensor * tensor, int i0, int i1, int i2,
 
 // ggml_compute_forward_mul_mat
 
+// the buffer with src1 converted to vec_dot_type
+static inline void * ggml_mul_mat_wdata_src1(const struct ggml_compute_params * params) {
+    return params->wdata_src1 ? params->wdata_src1 : params->wdata;
+}
+
+// convert src1 to vec_dot_type, each thread converts a part of every row
+static void ggml_compute_forward_mul_mat_src1(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src1,
+        enum ggml_type vec_dot_type,
+        char * wdata) {
+
+    GGML_TENSOR_LOCALS(int64_t, ne1, src1, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb1, src1, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    ggml_from_float_t const from_float = type_traits_cpu[vec_dot_type].from_float;
+
+    const size_t nbw0 = ggml_type_size(vec_dot_type);
+    const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
+    const size_t nbw2 = nbw1*ne11;
+    const size_t nbw3 = nbw2*ne12;
+
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+
+#if 0
+    for (int64_t i13 = 0; i13 < ne13; ++i13) {
+        for (int64_t i12 = 0; i12 < ne12; ++i12) {
+            for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
+                from_float((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11),
+                           (void *)               (wdata + i13*nbw3 + i12*nbw2 + i11*nbw1),
+                            ne10);
+            }
+        }
+    }
+#else
+    for (int64_t i13 = 0; i13 < ne13; ++i13) {
+        for (int64_t i12 = 0; i12 < ne12; ++i12) {
+            for (int64_t i11 = 0; i11 < ne11; ++i11) {
+                size_t bs = ggml_blck_size(vec_dot_type);
+                int64_t ne10_block_start = (ith * ne10/bs) / nth;
+                int64_t ne10_block_end   = ((ith + 1) * ne10/bs) / nth;
+                from_float((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + ne10_block_start*bs*nb10),
+                           (void *)               (wdata + i13*nbw3 + i12*nbw2 + i11*nbw1 + ne10_block_start*nbw0),
+                           (ne10_block_end - ne10_block_start) * bs);
+            }
+        }
+    }
+#endif
+}
+
+// the sparsity hint of ggml_mul_mat_sparse is used for a few src1 columns, where skipping rows of src0 saves memory
+// bandwidth; for larger batches the dense kernels are faster
+#define GGML_MUL_MAT_SPARSE_MAX_COLS 4
+
+// a negative threshold disables the hint
+static bool ggml_mul_mat_use_sparse(const struct ggml_tensor * dst) {
+    return dst->src[2] != NULL && ggml_get_op_params_f32(dst, 1) >= 0.0f && ggml_nrows(dst) <= GGML_MUL_MAT_SPARSE_MAX_COLS;
+}
+
 static void ggml_compute_forward_mul_mat_one_chunk(
     const struct ggml_compute_params * params,
     struct ggml_tensor * dst,
@@ -1176,11 +1468,15 @@ static void ggml_compute_forward_mul_mat_one_chunk(
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = ggml_mul_mat_use_sparse(dst) ? dst->src[2] : NULL;
 
     GGML_TENSOR_BINARY_OP_LOCALS
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
+    // the rows where |src2| <= thold are skipped
+    const float thold = src2 ? ggml_get_op_params_f32(dst, 1) : 0.0f;
+
     ggml_vec_dot_t const vec_dot      = type_traits_cpu[type].vec_dot;
     enum ggml_type const vec_dot_type = type_traits_cpu[type].vec_dot_type;
 
@@ -1195,7 +1491,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
         return;
     }
 
-    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : ggml_mul_mat_wdata_src1(params);
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
     assert(ne12 % ne02 == 0);
@@ -1242,8 +1538,20 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
                 //}
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir0_end; ir0 += num_rows_per_vec_dot) {
-                    vec_dot(ne00, &tmp[ir0 - iir0], (num_rows_per_vec_dot > 1 ? 16 : 0), src0_row + ir0 * nb01, (num_rows_per_vec_dot > 1 ? nb01 : 0), src1_col, (num_rows_per_vec_dot > 1 ? src1_col_stride : 0), num_rows_per_vec_dot);
+                if (src2) {
+                    const float * src2_col = (const float *) ((const char *) src2->data + (i1*src2->nb[1] + i2*src2->nb[2] + i3*src2->nb[3]));
+
+                    for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir0_end; ++ir0) {
+                        if (fabsf(src2_col[ir0]) > thold) {
+                            vec_dot(ne00, &tmp[ir0 - iir0], 0, src0_row + ir0 * nb01, 0, src1_col, 0, 1);
+                        } else {
+                            tmp[ir0 - iir0] = 0.0f;
+                        }
+                    }
+                } else {
+                    for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir0_end; ir0 += num_rows_per_vec_dot) {
+                        vec_dot(ne00, &tmp[ir0 - iir0], (num_rows_per_vec_dot > 1 ? 16 : 0), src0_row + ir0 * nb01, (num_rows_per_vec_dot > 1 ? nb01 : 0), src1_col, (num_rows_per_vec_dot > 1 ? src1_col_stride : 0), num_rows_per_vec_dot);
+                    }
                 }
 
                 for (int cn = 0; cn < num_rows_per_vec_dot; ++cn) {
@@ -1263,13 +1571,14 @@ static void ggml_compute_forward_mul_mat(
 
     GGML_TENSOR_BINARY_OP_LOCALS
 
-    const int ith = params->ith;
     const int nth = params->nth;
 
     enum ggml_type           const vec_dot_type         = type_traits_cpu[src0->type].vec_dot_type;
-    ggml_from_float_t        const from_float           = type_traits_cpu[vec_dot_type].from_float;
     int64_t                  const vec_dot_num_rows     = type_traits_cpu[src0->type].nrows;
 
+    // sgemm computes all the rows
+    const bool sparse = ggml_mul_mat_use_sparse(dst);
+
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
     GGML_ASSERT(ne2 == ne12);
@@ -1296,7 +1605,7 @@ static void ggml_compute_forward_mul_mat(
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    if (src1_cont) {
+    if (src1_cont && !sparse) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
                 if (!llamafile_sgemm(params,
@@ -1316,53 +1625,49 @@ static void ggml_compute_forward_mul_mat(
 UseGgmlGemm1:;
 #endif
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    // the shared src1 may have been converted by a previous node
+    if (src1->type != vec_dot_type && !params->wdata_src1_ready) {
+        assert(params->wdata_src1 || params->wsize >= ggml_row_size(vec_dot_type, ggml_nelements(src1)));
 
-        const size_t nbw0 = ggml_type_size(vec_dot_type);
-        const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
-        const size_t nbw2 = nbw1*ne11;
-        const size_t nbw3 = nbw2*ne12;
+        ggml_compute_forward_mul_mat_src1(params, src1, vec_dot_type, ggml_mul_mat_wdata_src1(params));
+    }
 
-        assert(params->wsize >= ne13*nbw3);
-        GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
+    const int64_t nr0 = ne0;
 
-    #if 0
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
-                    from_float((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11),
-                               (void *)               (wdata + i13*nbw3 + i12*nbw2 + i11*nbw1),
-                                ne10);
-                }
-            }
-        }
-    #else
-        for (int64_t i13 = 0; i13 < ne13; ++i13) {
-            for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                    size_t bs = ggml_blck_size(vec_dot_type);
-                    int64_t ne10_block_start = (ith * ne10/bs) / nth;
-                    int64_t ne10_block_end   = ((ith + 1) * ne10/bs) / nth;
-                    from_float((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11 + ne10_block_start*bs*nb10),
-                               (void *)               (wdata + i13*nbw3 + i12*nbw2 + i11*nbw1 + ne10_block_start*nbw0),
-                               (ne10_block_end - ne10_block_start) * bs);
-                }
-            }
-        }
-    #endif
+    // This is the size of the rest of the dimensions of the result
+    const int64_t nr1 = ne1 * ne2 * ne3;
+
+    // Now select a reasonable chunk size.
+    int chunk_size = 16;
+
+    // We need to step up the size if it's small
+    if (nr0 == 1 || nr1 == 1) {
+        chunk_size = 64;
     }
 
-    if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
+    // distribute the work across the inner or outer loop based on which one is larger
+    // The number of chunks in the 0/1 dim.
+    // CEIL(nr0/chunk_size)
+    int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
+    int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+
+    // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
+    //   On NUMA systems, each thread first processes its own contiguous range of chunks and steals from the threads of
+    //   the same node first, which keeps the locality of the static split that was used before (see https://github.com/ggml-org/llama.cpp/pull/6915)
+    if (nchunk0 * nchunk1 < nth * 4) {
+        // distribute the thread work across the inner or outer loop based on which one is larger
+        nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
     }
 
-    ggml_barrier(params->threadpool);
+    ggml_chunk_sched_init(params, nchunk0 * nchunk1);
+
+    ggml_barrier(params);
 
 #if GGML_USE_LLAMAFILE
-    if (src1->type != vec_dot_type) {
-        const void* wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    if (src1->type != vec_dot_type && !sparse) {
+        const void* wdata = (src1->type == vec_dot_type) ? src1->data : ggml_mul_mat_wdata_src1(params);
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
         for (int64_t i13 = 0; i13 < ne13; i13++)
@@ -1384,43 +1689,11 @@ UseGgmlGemm1:;
 UseGgmlGemm2:;
 #endif
 
-    // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
-    const int64_t nr0 = ne0;
-
-    // This is the size of the rest of the dimensions of the result
-    const int64_t nr1 = ne1 * ne2 * ne3;
-
-    // Now select a reasonable chunk size.
-    int chunk_size = 16;
-
-    // We need to step up the size if it's small
-    if (nr0 == 1 || nr1 == 1) {
-        chunk_size = 64;
-    }
-
-    // distribute the work across the inner or outer loop based on which one is larger
-    // The number of chunks in the 0/1 dim.
-    // CEIL(nr0/chunk_size)
-    int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
-    int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
-
-    // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
-    //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
-    //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
-        // distribute the thread work across the inner or outer loop based on which one is larger
-        nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-        nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
-    }
-
     // The number of elements in each chunk
     const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-    // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
-
-    while (current_chunk < nchunk0 * nchunk1) {
+    for (int64_t current_chunk = ggml_chunk_sched_next(params); current_chunk >= 0; current_chunk = ggml_chunk_sched_next(params)) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1435,16 +1708,10 @@ UseGgmlGemm2:;
 
         // these checks are needed to avoid crossing dim1 boundaries
         // can be optimized, but the logic would become more complicated, so keeping it like this for simplicity
-        if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
+        if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0) || sparse) {
             num_rows_per_vec_dot = 1;
         }
         ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
-
-        if (nth >= nchunk0 * nchunk1) {
-            break;
-        }
-
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
     }
 }
 
@@ -1457,6 +1724,35 @@ struct mmid_row_mapping {
     int32_t i2;
 };
 
+// the chunks of a src0 matrix with nr1 rows of src1, 0 chunks if there are no rows
+static void ggml_mul_mat_id_chunks(int64_t nr0, int64_t nr1, int nth, int64_t * nchunk0, int64_t * nchunk1) {
+    if (nr1 == 0) {
+        *nchunk0 = 0;
+        *nchunk1 = 0;
+        return;
+    }
+
+    int chunk_size = 16;
+    if (nr0 == 1 || nr1 == 1) {
+        chunk_size = 64;
+    }
+
+#if defined(__aarch64__)
+    // disable for ARM
+    const bool disable_chunking = true;
+#else
+    const bool disable_chunking = false;
+#endif // defined(__aarch64__)
+
+    *nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
+    *nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+
+    if (*nchunk0 * *nchunk1 < nth * 4 || disable_chunking) {
+        *nchunk0 = nr0 > nr1 ? nth : 1;
+        *nchunk1 = nr0 > nr1 ? 1 : nth;
+    }
+}
+
 static void ggml_compute_forward_mul_mat_id_one_chunk(
     struct ggml_tensor * dst,
     const struct ggml_tensor * src0,
@@ -1574,8 +1870,8 @@ static void ggml_compute_forward_mul_mat_id(
     struct mmid_row_mapping * matrix_rows = // [n_as][ids->ne[0]*ids->ne[1]]
         incr_ptr_aligned(&wdata_cur, n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping), sizeof(int64_t));
 
-    char (*atomic_current_chunk)[CACHE_LINE_SIZE] = // [n_as]
-        incr_ptr_aligned(&wdata_cur, CACHE_LINE_SIZE * n_as, CACHE_LINE_SIZE);
+    int64_t * matrix_chunk_offs = // [n_as + 1]
+        incr_ptr_aligned(&wdata_cur, (n_as + 1)*sizeof(int64_t), sizeof(int64_t));
 
     GGML_ASSERT(params->wsize >= (size_t)((char *) wdata_cur - (char *) params->wdata));
 
@@ -1631,80 +1927,70 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
-    }
-
-    // reset current_chunk
-    for (int cur_a = ith; cur_a < n_as; cur_a += nth) {
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-        *current_chunk_ctr = nth;
-    }
 
-    ggml_barrier(params->threadpool);
+        // the chunks of all the src0 matrices are scheduled together, matrix_chunk_offs[cur_a] is the first chunk of cur_a
+        matrix_chunk_offs[0] = 0;
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            int64_t nchunk0;
+            int64_t nchunk1;
 
-    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
-        const int64_t cne1 = matrix_row_counts[cur_a];
+            ggml_mul_mat_id_chunks(ne01, matrix_row_counts[cur_a], nth, &nchunk0, &nchunk1);
 
-        if (cne1 == 0) {
-            continue;
+            matrix_chunk_offs[cur_a + 1] = matrix_chunk_offs[cur_a] + nchunk0*nchunk1;
         }
 
-        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
-        const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+        ggml_chunk_sched_init_all(params, matrix_chunk_offs[n_as]);
+    }
 
-        const int64_t nr0 = ne01;
-        const int64_t nr1 = cne1;
+    ggml_barrier(params);
+
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
-        int chunk_size = 16;
-        if (nr0 == 1 || nr1 == 1) {
-            chunk_size = 64;
+    for (int64_t current_chunk = ggml_chunk_sched_next(params); current_chunk >= 0; current_chunk = ggml_chunk_sched_next(params)) {
+        // find the src0 matrix of the chunk
+        int cur_a = 0;
+        {
+            int hi = n_as;
+            while (hi - cur_a > 1) {
+                const int mid = (cur_a + hi)/2;
+                if (matrix_chunk_offs[mid] <= current_chunk) {
+                    cur_a = mid;
+                } else {
+                    hi = mid;
+                }
+            }
         }
 
-#if defined(__aarch64__)
-        // disable for ARM
-        const bool disable_chunking = true;
-#else
-        // disable for NUMA
-        const bool disable_chunking = ggml_is_numa();
-#endif // defined(__aarch64__)
+        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
 
-        int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
-        int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+        const int64_t nr0 = ne01;
+        const int64_t nr1 = matrix_row_counts[cur_a];
 
-        if (nchunk0 * nchunk1 < nth * 4 || disable_chunking) {
-            nchunk0 = nr0 > nr1 ? nth : 1;
-            nchunk1 = nr0 > nr1 ? 1 : nth;
-        }
+        int64_t nchunk0;
+        int64_t nchunk1;
+
+        ggml_mul_mat_id_chunks(nr0, nr1, nth, &nchunk0, &nchunk1);
 
         const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
         const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-        int current_chunk = ith;
-
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-
-        while (current_chunk < nchunk0 * nchunk1) {
-            const int64_t ith0 = current_chunk % nchunk0;
-            const int64_t ith1 = current_chunk / nchunk0;
-
-            const int64_t ir0_start = dr0 * ith0;
-            const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
+        const int64_t chunk = current_chunk - matrix_chunk_offs[cur_a];
 
-            const int64_t ir1_start = dr1 * ith1;
-            const int64_t ir1_end = MIN(ir1_start + dr1, nr1);
+        const int64_t ith0 = chunk % nchunk0;
+        const int64_t ith1 = chunk / nchunk0;
 
-            ggml_compute_forward_mul_mat_id_one_chunk(
-                dst, src0, src1, ids, cur_a,
-                ir0_start, ir0_end, ir1_start, ir1_end,
-                src0_cur, matrix_rows, row_size, src1_cont, wdata
-            );
+        const int64_t ir0_start = dr0 * ith0;
+        const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
 
-            if (nth >= nchunk0 * nchunk1) {
-                break;
-            }
+        const int64_t ir1_start = dr1 * ith1;
+        const int64_t ir1_end = MIN(ir1_start + dr1, nr1);
 
-            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, 1, memory_order_relaxed);
-        }
+        ggml_compute_forward_mul_mat_id_one_chunk(
+            dst, src0, src1, ids, cur_a,
+            ir0_start, ir0_end, ir1_start, ir1_end,
+            src0_cur, matrix_rows, row_size, src1_cont, wdata
+        );
     }
 }
 
@@ -2070,6 +2356,22 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__gnu_linux__)
+// the NUMA node that set_numa_thread_affinity() places the thread on, -1 if unknown
+static int ggml_numa_thread_node(int thread_n) {
+    if (!ggml_is_numa()) {
+        return -1;
+    }
+
+    switch(g_state.numa.numa_strategy) {
+        case GGML_NUMA_STRATEGY_DISTRIBUTE:
+            return thread_n % g_state.numa.n_nodes;
+        case GGML_NUMA_STRATEGY_ISOLATE:
+            return g_state.numa.current_node;
+        default:
+            return -1;
+    }
+}
+
 static void set_numa_thread_affinity(int thread_n) {
     if (!ggml_is_numa()) {
         return;
@@ -2138,7 +2440,8 @@ static void clear_numa_thread_affinity(void) {
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
-static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
+static int  ggml_numa_thread_node(int thread_n) { UNUSED(thread_n); return -1; }
+static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n); }
 static void clear_numa_thread_affinity(void) {}
 #endif
 
@@ -2591,6 +2894,8 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     ggml_cond_destroy(&threadpool->cond);
 #endif // GGML_USE_OPENMP
 
+    free(threadpool->waves);
+
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
@@ -2635,6 +2940,765 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
+void ggml_threadpool_set_profiler(struct ggml_threadpool * threadpool, ggml_cpu_profiler_t profiler) {
+    threadpool->profiler = profiler;
+}
+
+// the size of the work buffer used by the node when it is run by n_threads threads
+static size_t ggml_graph_node_work_size(struct ggml_tensor * node, int n_threads) {
+    const int n_tasks = ggml_get_n_tasks(node, n_threads);
+
+    size_t cur = 0;
+
+    if (!ggml_cpu_extra_work_size(n_threads, node, &cur)) {
+        switch (node->op) {
+            case GGML_OP_CPY:
+            case GGML_OP_DUP:
+                {
+                    if (ggml_is_quantized(node->type) ||
+                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_ADD:
+            case GGML_OP_ADD1:
+                {
+                    if (ggml_is_quantized(node->src[0]->type)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_ACC:
+                {
+                    if (ggml_is_quantized(node->src[0]->type)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_COUNT_EQUAL:
+                {
+                    cur = ggml_type_size(node->type)*n_tasks;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+
+                    if (node->src[1]->type != vec_dot_type) {
+                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                    }
+                } break;
+            case GGML_OP_MUL_MAT_ID:
+                {
+                    cur = 0;
+                    const struct ggml_tensor * src0 = node->src[0];
+                    const struct ggml_tensor * src1 = node->src[1];
+                    const struct ggml_tensor * ids = node->src[2];
+                    const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
+                    const int n_as = src0->ne[2];
+                    // src1
+                    if (src1->type != vec_dot_type) {
+                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src1)) + sizeof(int64_t);
+                    }
+                    // matrix_row_counts
+                    cur += n_as * sizeof(int64_t) + sizeof(int64_t);
+                    // matrix_rows
+                    cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
+                    // matrix_chunk_offs
+                    cur += (n_as + 1)*sizeof(int64_t) + sizeof(int64_t);
+                } break;
+            case GGML_OP_OUT_PROD:
+                {
+                    if (ggml_is_quantized(node->src[0]->type)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_SOFT_MAX:
+            case GGML_OP_ROPE:
+            case GGML_OP_ROPE_BACK:
+                {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                } break;
+            case GGML_OP_CONV_TRANSPOSE_1D:
+                {
+                    GGML_ASSERT(node->src[0]->ne[3] == 1);
+                    GGML_ASSERT(node->src[1]->ne[2] == 1);
+                    GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                    const int64_t ne00 = node->src[0]->ne[0];  // K
+                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
+                    const int64_t ne10 = node->src[1]->ne[0];  // L
+                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                    if ((node->src[0]->type == GGML_TYPE_F16 ||
+                         node->src[0]->type == GGML_TYPE_BF16) &&
+                        node->src[1]->type == GGML_TYPE_F32) {
+                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                               node->src[1]->type == GGML_TYPE_F32) {
+                        cur += sizeof(float)*ne00*ne01*ne02;
+                        cur += sizeof(float)*ne10*ne11;
+                    } else {
+                        GGML_ABORT("fatal error");
+                    }
+                } break;
+            case GGML_OP_CONV_TRANSPOSE_2D:
+                {
+                    const int64_t ne00 = node->src[0]->ne[0]; // W
+                    const int64_t ne01 = node->src[0]->ne[1]; // H
+                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                    const int64_t ne10 = node->src[1]->ne[0]; // W
+                    const int64_t ne11 = node->src[1]->ne[1]; // H
+                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+                } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    const int64_t ne10 = node->src[1]->ne[0]; // DK
+                    const int64_t ne20 = node->src[2]->ne[0]; // DV
+
+                    cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                    cur = MAX(cur, sizeof(float)*(GGML_FA_TILE_WSIZE(ne10, ne20)*n_tasks + GGML_FA_TILE_WSIZE_PART(ne20, n_tasks))); // query-tiled kernel
+                } break;
+            case GGML_OP_FLASH_ATTN_BACK:
+                {
+                    const int64_t    D = node->src[0]->ne[0];
+                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                    if (node->src[1]->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    } else if (node->src[1]->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    }
+                } break;
+
+            case GGML_OP_CROSS_ENTROPY_LOSS:
+                {
+                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ABORT("fatal error");
+                }
+            default:
+                break;
+        }
+    }
+
+    return cur;
+}
+
+// dataflow execution of the graph
+//   instead of a barrier after every node, the graph is run in waves: a wave is a sequence of consecutive nodes that
+//   do not depend on each other, the threads are split in groups that run the nodes of the wave concurrently, each
+//   group with its own barrier and its own part of the work buffer, and there is a single barrier at the end of the wave
+//   the nodes that do nothing (views, reshapes, ...) never end a wave
+//   the waves are built by a single thread before the others start running the graph, and shared by all of them
+
+// the cost of a barrier, in the units of ggml_graph_node_cost()
+#define GGML_GRAPH_BARRIER_COST 8192
+
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// the ops that can access memory other than their node and its sources cannot run concurrently with other nodes
+static bool ggml_graph_node_can_group(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+        case GGML_OP_CUSTOM:
+        case GGML_OP_OPT_STEP_ADAMW:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// a rough estimate of the work of the node
+static int64_t ggml_graph_node_cost(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return ggml_nelements(node)*node->src[0]->ne[0];
+        case GGML_OP_FLASH_ATTN_EXT:
+            return ggml_nelements(node)*node->src[1]->ne[1]*2;
+        default:
+            return ggml_nelements(node);
+    }
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a->data == NULL || b->data == NULL) {
+        // not allocated yet, assume the worst
+        return true;
+    }
+
+    const uintptr_t a0 = (uintptr_t) a->data;
+    const uintptr_t b0 = (uintptr_t) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// check if the node reads or writes the memory written by the other node, or writes the memory read by it
+static bool ggml_graph_nodes_conflict(const struct ggml_tensor * node, const struct ggml_tensor * other) {
+    if (ggml_tensors_overlap(node, other)) {
+        return true;
+    }
+
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        if (node->src[j] && ggml_tensors_overlap(node->src[j], other)) {
+            return true;
+        }
+        if (other->src[j] && ggml_tensors_overlap(other->src[j], node)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// operator fusion
+//   short chains of row ops are computed as a single node, with one pass over the rows and without the barriers
+//   between the ops: rms_norm -> mul, add -> rms_norm [-> mul] and silu -> mul
+//   in the FFN the up matmul is between the silu and its mul, so the silu is deferred to the mul when the nodes in
+//   between do not touch its memory
+//   the intermediate results are still written, the results are the same as without the fusion
+
+#define GGML_GRAPH_FUSE_MAX    3
+#define GGML_GRAPH_FUSE_WINDOW 4 // how far after a silu its mul is looked for
+
+struct ggml_graph_fusion {
+    int n;                         // the number of fused nodes
+    int node[GGML_GRAPH_FUSE_MAX]; // the index in the graph of the fused nodes, in graph order
+};
+
+// the fused kernels work on F32 rows
+static bool ggml_graph_fuse_rows(const struct ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32 && t->nb[0] == sizeof(float);
+}
+
+static bool ggml_graph_can_fuse_rms_norm_mul(const struct ggml_tensor * norm, const struct ggml_tensor * mul) {
+    if (norm->op != GGML_OP_RMS_NORM || mul->op != GGML_OP_MUL || mul->src[0] != norm) {
+        return false;
+    }
+
+    const struct ggml_tensor * w = mul->src[1];
+
+    return ggml_graph_fuse_rows(norm) && ggml_graph_fuse_rows(norm->src[0]) &&
+           ggml_graph_fuse_rows(mul)  && ggml_graph_fuse_rows(w) &&
+           ggml_are_same_shape(norm, norm->src[0]) && ggml_are_same_shape(norm, mul) &&
+           w->ne[0] == norm->ne[0] && ggml_can_repeat(w, mul);
+}
+
+static bool ggml_graph_can_fuse_add_rms_norm(const struct ggml_tensor * add, const struct ggml_tensor * norm) {
+    if (add->op != GGML_OP_ADD || norm->op != GGML_OP_RMS_NORM || norm->src[0] != add) {
+        return false;
+    }
+
+    return ggml_graph_fuse_rows(add) && ggml_graph_fuse_rows(add->src[0]) && ggml_graph_fuse_rows(add->src[1]) &&
+           ggml_graph_fuse_rows(norm) &&
+           ggml_are_same_shape(add, add->src[0]) && ggml_are_same_shape(add, add->src[1]) && ggml_are_same_shape(add, norm);
+}
+
+// the index of the mul that the silu at node i is deferred to, or -1
+static int ggml_graph_fuse_silu(const struct ggml_cgraph * cgraph, int i) {
+    const struct ggml_tensor * silu = cgraph->nodes[i];
+
+    if (silu->op != GGML_OP_UNARY || ggml_get_unary_op(silu) != GGML_UNARY_OP_SILU ||
+        !ggml_graph_fuse_rows(silu) || !ggml_graph_fuse_rows(silu->src[0]) || !ggml_are_same_shape(silu, silu->src[0])) {
+        return -1;
+    }
+
+    for (int j = i + 1; j < MIN(cgraph->n_nodes, i + 1 + GGML_GRAPH_FUSE_WINDOW); j++) {
+        const struct ggml_tensor * node = cgraph->nodes[j];
+
+        if (node->op == GGML_OP_MUL && (node->src[0] == silu || node->src[1] == silu)) {
+            const struct ggml_tensor * u = node->src[0] == silu ? node->src[1] : node->src[0];
+
+            // the mul can be fused with its rms_norm instead
+            if (ggml_graph_can_fuse_rms_norm_mul(cgraph->nodes[j - 1], node)) {
+                return -1;
+            }
+
+            if (ggml_graph_fuse_rows(node) && ggml_graph_fuse_rows(u) && ggml_are_same_shape(silu, u) && ggml_are_same_shape(silu, node)) {
+                return j;
+            }
+
+            return -1;
+        }
+
+        if (ggml_graph_nodes_conflict(node, silu)) {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+// find the nodes that are computed together with the node i
+//   returns false if the node is computed later, with the node it is fused into
+static bool ggml_graph_fusion_at(const struct ggml_cgraph * cgraph, int i, struct ggml_graph_fusion * fusion) {
+    struct ggml_tensor * node = cgraph->nodes[i];
+
+    fusion->n       = 1;
+    fusion->node[0] = i;
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+            {
+                if (i + 1 < cgraph->n_nodes && ggml_graph_can_fuse_add_rms_norm(node, cgraph->nodes[i + 1])) {
+                    fusion->node[fusion->n++] = i + 1;
+
+                    if (i + 2 < cgraph->n_nodes && ggml_graph_can_fuse_rms_norm_mul(cgraph->nodes[i + 1], cgraph->nodes[i + 2])) {
+                        fusion->node[fusion->n++] = i + 2;
+                    }
+                }
+            } break;
+        case GGML_OP_RMS_NORM:
+            {
+                if (i + 1 < cgraph->n_nodes && ggml_graph_can_fuse_rms_norm_mul(node, cgraph->nodes[i + 1])) {
+                    fusion->node[fusion->n++] = i + 1;
+                }
+            } break;
+        case GGML_OP_UNARY:
+            {
+                if (ggml_graph_fuse_silu(cgraph, i) >= 0) {
+                    return false;
+                }
+            } break;
+        case GGML_OP_MUL:
+            {
+                for (int k = MAX(0, i - GGML_GRAPH_FUSE_WINDOW); k < i; k++) {
+                    if ((cgraph->nodes[k] == node->src[0] || cgraph->nodes[k] == node->src[1]) && ggml_graph_fuse_silu(cgraph, k) == i) {
+                        fusion->n       = 2;
+                        fusion->node[0] = k;
+                        fusion->node[1] = i;
+                        break;
+                    }
+                }
+            } break;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+static void ggml_compute_forward_fusion(struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, const struct ggml_graph_fusion * fusion) {
+    struct ggml_tensor * node = cgraph->nodes[fusion->node[0]];
+
+    if (fusion->n == 1) {
+        ggml_compute_forward(params, node);
+        return;
+    }
+
+    struct ggml_tensor * next = cgraph->nodes[fusion->node[1]];
+
+    switch (node->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_mul(params, node, next);
+            } break;
+        case GGML_OP_ADD:
+            {
+                ggml_compute_forward_add_rms_norm(params, node, next, fusion->n > 2 ? cgraph->nodes[fusion->node[2]] : NULL);
+            } break;
+        case GGML_OP_UNARY:
+            {
+                ggml_compute_forward_silu_mul(params, node, next);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+static bool ggml_graph_fusions_conflict(const struct ggml_cgraph * cgraph, const struct ggml_graph_fusion * a, const struct ggml_graph_fusion * b) {
+    for (int ia = 0; ia < a->n; ia++) {
+        for (int ib = 0; ib < b->n; ib++) {
+            if (ggml_graph_nodes_conflict(cgraph->nodes[a->node[ia]], cgraph->nodes[b->node[ib]])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// how a node of the wave uses the cache of the src1 conversions (see ggml_graph_src1_cache_find())
+struct ggml_graph_src1_use {
+    char * wdata;   // the entry, NULL if the node does not use the cache
+    bool   ready;   // src1 is converted before the node
+    bool   convert; // src1 is converted by all the threads before the wave
+};
+
+struct ggml_graph_wave {
+    int i1; // the wave is the nodes [i0, i1) of the graph
+    int n;  // the number of nodes of the wave that are computed
+
+    struct ggml_graph_fusion node[GGML_GRAPH_WAVE_MAX]; // the computed nodes, with the nodes fused into them
+
+    int    ith0 [GGML_GRAPH_WAVE_MAX]; // the first thread of the group of the node
+    int    nth  [GGML_GRAPH_WAVE_MAX]; // the number of threads of the group of the node
+    size_t woffs[GGML_GRAPH_WAVE_MAX]; // the part of the work buffer of the group of the node
+    size_t wsize[GGML_GRAPH_WAVE_MAX];
+
+    struct ggml_graph_src1_use use[GGML_GRAPH_WAVE_MAX];
+    bool   convert; // some src1 are converted by all the threads before the wave
+};
+
+// split the threads between the first n nodes of the wave, in proportion to their cost
+//   returns false if running the nodes concurrently is not expected to be faster than running them one after the other,
+//   or if they do not fit in the work buffer
+static bool ggml_graph_wave_assign(const struct ggml_cgraph * cgraph, struct ggml_graph_wave * wave, int n, int n_threads, size_t work_size) {
+    int64_t cost   [GGML_GRAPH_WAVE_MAX];
+    int     n_tasks[GGML_GRAPH_WAVE_MAX];
+
+    int64_t cost_sum = 0;
+    int64_t cost_seq = 0; // the cost of running the nodes one after the other
+
+    for (int k = 0; k < n; k++) {
+        cost[k]    = 0;
+        n_tasks[k] = 1;
+
+        for (int j = 0; j < wave->node[k].n; j++) {
+            struct ggml_tensor * node = cgraph->nodes[wave->node[k].node[j]];
+
+            cost[k]   += ggml_graph_node_cost(node);
+            n_tasks[k] = MAX(n_tasks[k], MIN(ggml_get_n_tasks(node, n_threads), n_threads));
+        }
+
+        cost[k] = MAX(cost[k], 1);
+
+        cost_sum += cost[k];
+        cost_seq += cost[k]/n_tasks[k] + GGML_GRAPH_BARRIER_COST;
+    }
+
+    int n_left = n_threads;
+
+    for (int k = 0; k < n; k++) {
+        wave->nth[k] = MIN(n_tasks[k], MAX(1, (int) ((double) n_threads*cost[k]/cost_sum)));
+        n_left -= wave->nth[k];
+    }
+
+    // the rounding up of the small nodes can take too many threads, take them back from the largest groups
+    while (n_left < 0) {
+        int kmax = 0;
+        for (int k = 1; k < n; k++) {
+            if (wave->nth[k] > wave->nth[kmax]) {
+                kmax = k;
+            }
+        }
+        wave->nth[kmax]--;
+        n_left++;
+    }
+
+    // give the remaining threads to the nodes with the most work per thread
+    while (n_left > 0) {
+        int kmax = -1;
+        for (int k = 0; k < n; k++) {
+            if (wave->nth[k] < n_tasks[k] && (kmax < 0 || cost[k]/wave->nth[k] > cost[kmax]/wave->nth[kmax])) {
+                kmax = k;
+            }
+        }
+        if (kmax < 0) {
+            break;
+        }
+        wave->nth[kmax]++;
+        n_left--;
+    }
+
+    int64_t cost_par = 0; // the cost of running the nodes concurrently
+
+    size_t woffs = 0;
+
+    for (int k = 0; k < n; k++) {
+        cost_par = MAX(cost_par, cost[k]/wave->nth[k]);
+
+        wave->ith0[k] = k == 0 ? 0 : wave->ith0[k - 1] + wave->nth[k - 1];
+
+        size_t wsize = 0;
+        for (int j = 0; j < wave->node[k].n; j++) {
+            wsize = MAX(wsize, ggml_graph_node_work_size(cgraph->nodes[wave->node[k].node[j]], wave->nth[k]));
+        }
+        if (wsize > 0) {
+            wsize += CACHE_LINE_SIZE*wave->nth[k];
+        }
+
+        wave->woffs[k] = woffs;
+        wave->wsize[k] = wsize;
+
+        woffs = GGML_PAD(woffs + wsize, CACHE_LINE_SIZE);
+    }
+
+    return n == 1 || (cost_par + GGML_GRAPH_BARRIER_COST <= cost_seq && woffs <= work_size);
+}
+
+// find the wave that starts at the node i0
+static void ggml_graph_wave_next(const struct ggml_cgraph * cgraph, int i0, int n_threads, size_t work_size, struct ggml_graph_wave * wave) {
+    const int n_max = MIN(n_threads, GGML_GRAPH_WAVE_MAX);
+
+    wave->n = 0;
+
+    int i = i0;
+
+    while (i < cgraph->n_nodes) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        struct ggml_graph_fusion fusion;
+
+        if (ggml_graph_node_is_noop(node) || !ggml_graph_fusion_at(cgraph, i, &fusion)) {
+            i++;
+            continue;
+        }
+
+        if (wave->n > 0) {
+            if (wave->n == n_max || !ggml_graph_node_can_group(node) || !ggml_graph_node_can_group(cgraph->nodes[wave->node[0].node[0]])) {
+                break;
+            }
+
+            bool conflict = false;
+            for (int k = 0; k < wave->n && !conflict; k++) {
+                conflict = ggml_graph_fusions_conflict(cgraph, &fusion, &wave->node[k]);
+            }
+            if (conflict) {
+                break;
+            }
+
+            wave->node[wave->n] = fusion;
+            if (!ggml_graph_wave_assign(cgraph, wave, wave->n + 1, n_threads, work_size)) {
+                break;
+            }
+        }
+
+        wave->node[wave->n++] = fusion;
+
+        i = fusion.node[fusion.n - 1] + 1;
+    }
+
+    wave->i1 = i;
+
+    if (wave->n == 1) {
+        // a single node is run by all the threads
+        wave->ith0[0]  = 0;
+        wave->nth[0]   = n_threads;
+        wave->woffs[0] = 0;
+        wave->wsize[0] = work_size;
+    } else if (wave->n > 1) {
+        ggml_graph_wave_assign(cgraph, wave, wave->n, n_threads, work_size);
+    }
+}
+
+// cache of the conversions of src1 of mul_mat
+//   the mul_mats that share their src1 (Q, K and V, gate and up) convert it to vec_dot_type once per graph, in one of
+//   the entries of the cache at the end of the work buffer. the entries are kept until a node writes the memory of src1
+//   when several nodes of a wave share a src1 that is not in the cache, all the threads convert it before the wave
+//   the use of the cache by the nodes is decided when the waves are built
+
+#define GGML_GRAPH_SRC1_CACHE_MAX 2  // the number of entries of the cache
+#define GGML_GRAPH_SRC1_WINDOW    16 // how far apart in the graph the mul_mats that share their src1 can be
+
+struct ggml_graph_src1_cache {
+    char * wdata; // the entries, NULL if the graph does not use the cache
+    size_t size;  // the size of an entry
+
+    const struct ggml_tensor * src1[GGML_GRAPH_SRC1_CACHE_MAX];
+    enum ggml_type             type[GGML_GRAPH_SRC1_CACHE_MAX];
+    int                        used[GGML_GRAPH_SRC1_CACHE_MAX]; // the last wave that used the entry
+};
+
+// the mul_mats that convert src1 with the generic code
+static bool ggml_graph_node_src1_cacheable(const struct ggml_tensor * node) {
+    if (node->op != GGML_OP_MUL_MAT || node->src[1]->type != GGML_TYPE_F32) {
+        return false;
+    }
+
+    size_t size = 0;
+
+    return ggml_is_quantized(type_traits_cpu[node->src[0]->type].vec_dot_type) && !ggml_cpu_extra_work_size(1, node, &size);
+}
+
+// check if the src1 of the mul_mat at node i is shared with a mul_mat close to it
+static bool ggml_graph_node_src1_shared(const struct ggml_cgraph * cgraph, int i) {
+    const struct ggml_tensor * node = cgraph->nodes[i];
+
+    if (!ggml_graph_node_src1_cacheable(node)) {
+        return false;
+    }
+
+    const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+
+    for (int j = MAX(0, i - GGML_GRAPH_SRC1_WINDOW); j < MIN(cgraph->n_nodes, i + GGML_GRAPH_SRC1_WINDOW + 1); j++) {
+        const struct ggml_tensor * other = cgraph->nodes[j];
+
+        if (j != i && other->op == GGML_OP_MUL_MAT && other->src[1] == node->src[1] &&
+            type_traits_cpu[other->src[0]->type].vec_dot_type == vec_dot_type && ggml_graph_node_src1_cacheable(other)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the size of an entry of the cache, 0 if the graph has no shared src1
+static size_t ggml_graph_src1_cache_size(const struct ggml_cgraph * cgraph) {
+    size_t size = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (ggml_graph_node_src1_shared(cgraph, i)) {
+            size = MAX(size, ggml_row_size(type_traits_cpu[node->src[0]->type].vec_dot_type, ggml_nelements(node->src[1])));
+        }
+    }
+
+    return GGML_PAD(size, CACHE_LINE_SIZE);
+}
+
+// find the entries used by the nodes of the wave
+//   returns true if some of them are converted before the wave
+static bool ggml_graph_src1_cache_find(
+        struct ggml_graph_src1_cache * cache,
+        const struct ggml_cgraph     * cgraph,
+        const struct ggml_graph_wave * wave,
+        int                            iwave,
+        struct ggml_graph_src1_use   * use) {
+    bool convert = false;
+
+    int first[GGML_GRAPH_SRC1_CACHE_MAX]; // the node of the wave that added the entry, if it was added by this wave
+
+    for (int e = 0; e < GGML_GRAPH_SRC1_CACHE_MAX; e++) {
+        first[e] = -1;
+    }
+
+    for (int k = 0; k < wave->n; k++) {
+        use[k].wdata   = NULL;
+        use[k].ready   = false;
+        use[k].convert = false;
+
+        if (cache->wdata == NULL || wave->node[k].n > 1 || !ggml_graph_node_src1_shared(cgraph, wave->node[k].node[0])) {
+            continue;
+        }
+
+        const struct ggml_tensor * node = cgraph->nodes[wave->node[k].node[0]];
+        const enum ggml_type       type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+
+        int e = 0;
+        while (e < GGML_GRAPH_SRC1_CACHE_MAX && !(cache->src1[e] == node->src[1] && cache->type[e] == type)) {
+            e++;
+        }
+
+        if (e < GGML_GRAPH_SRC1_CACHE_MAX) {
+            if (first[e] >= 0) {
+                // another node of the wave needs it, convert it before the wave
+                use[first[e]].ready   = true;
+                use[first[e]].convert = true;
+                convert = true;
+            }
+            use[k].ready = true;
+        } else {
+            // replace the least recently used entry that is not used by this wave
+            e = -1;
+            for (int j = 0; j < GGML_GRAPH_SRC1_CACHE_MAX; j++) {
+                if (cache->used[j] != iwave && (e < 0 || cache->src1[j] == NULL || (cache->src1[e] != NULL && cache->used[j] < cache->used[e]))) {
+                    e = j;
+                }
+            }
+            if (e < 0) {
+                continue;
+            }
+
+            cache->src1[e] = node->src[1];
+            cache->type[e] = type;
+            first[e] = k;
+        }
+
+        cache->used[e] = iwave;
+        use[k].wdata   = cache->wdata + e*cache->size;
+    }
+
+    return convert;
+}
+
+// remove the entries with a src1 that is written by the wave
+static void ggml_graph_src1_cache_update(struct ggml_graph_src1_cache * cache, const struct ggml_cgraph * cgraph, const struct ggml_graph_wave * wave) {
+    for (int e = 0; e < GGML_GRAPH_SRC1_CACHE_MAX; e++) {
+        for (int k = 0; k < wave->n && cache->src1[e]; k++) {
+            for (int j = 0; j < wave->node[k].n; j++) {
+                if (ggml_tensors_overlap(cgraph->nodes[wave->node[k].node[j]], cache->src1[e])) {
+                    cache->src1[e] = NULL;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// build the waves of the graph for n_threads threads, and decide how their nodes use the src1 cache
+//   called by a single thread before the threads start running the graph
+static void ggml_graph_waves_build(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan, int n_threads) {
+    // a wave has at least one node, except possibly the last one
+    if (tp->n_waves_alloc < cgraph->n_nodes) {
+        free(tp->waves);
+        tp->n_waves_alloc = cgraph->n_nodes;
+        tp->waves = malloc(sizeof(struct ggml_graph_wave)*tp->n_waves_alloc);
+        GGML_ASSERT(tp->waves != NULL);
+    }
+
+    struct ggml_graph_src1_cache cache;
+    memset(&cache, 0, sizeof(cache));
+
+    tp->waves_wsize = cplan->work_size;
+
+    cache.size = ggml_graph_src1_cache_size(cgraph);
+
+    if (cache.size > 0 && cplan->work_size >= GGML_GRAPH_SRC1_CACHE_MAX*cache.size) {
+        tp->waves_wsize -= GGML_GRAPH_SRC1_CACHE_MAX*cache.size;
+        cache.wdata      = (char *) cplan->work_data + tp->waves_wsize;
+    }
+
+    for (int e = 0; e < GGML_GRAPH_SRC1_CACHE_MAX; e++) {
+        cache.used[e] = -1;
+    }
+
+    tp->n_waves = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; ) {
+        struct ggml_graph_wave * wave = &tp->waves[tp->n_waves];
+
+        ggml_graph_wave_next(cgraph, i, n_threads, tp->waves_wsize, wave);
+
+        wave->convert = ggml_graph_src1_cache_find(&cache, cgraph, wave, tp->n_waves, wave->use);
+
+        ggml_graph_src1_cache_update(&cache, cgraph, wave);
+
+        i = wave->i1;
+        tp->n_waves++;
+    }
+}
+
 struct ggml_cplan ggml_graph_plan(
           const struct ggml_cgraph * cgraph,
                                int   n_threads,
@@ -2662,167 +3726,56 @@ struct ggml_cplan ggml_graph_plan(
 
         max_tasks = MAX(max_tasks, n_tasks);
 
-        size_t cur = 0;
-
-        if (!ggml_cpu_extra_work_size(n_threads, node, &cur)) {
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        if (ggml_is_quantized(node->type) ||
-                            // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                            (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                            (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_ADD:
-                case GGML_OP_ADD1:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_ACC:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_COUNT_EQUAL:
-                    {
-                        cur = ggml_type_size(node->type)*n_tasks;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+        work_size = MAX(work_size, ggml_graph_node_work_size(node, n_threads));
+    }
 
-                        if (node->src[1]->type != vec_dot_type) {
-                            cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                        }
-                    } break;
-                case GGML_OP_MUL_MAT_ID:
-                    {
-                        cur = 0;
-                        const struct ggml_tensor * src0 = node->src[0];
-                        const struct ggml_tensor * src1 = node->src[1];
-                        const struct ggml_tensor * ids = node->src[2];
-                        const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
-                        const int n_as = src0->ne[2];
-                        // src1
-                        if (src1->type != vec_dot_type) {
-                            cur += ggml_row_size(vec_dot_type, ggml_nelements(src1)) + sizeof(int64_t);
-                        }
-                        // matrix_row_counts
-                        cur += n_as * sizeof(int64_t) + sizeof(int64_t);
-                        // matrix_rows
-                        cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
-                        // atomic_current_chunk
-                        cur += CACHE_LINE_SIZE*n_as + CACHE_LINE_SIZE;
-                    } break;
-                case GGML_OP_OUT_PROD:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                case GGML_OP_ROPE:
-                case GGML_OP_ROPE_BACK:
-                    {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    } break;
-                case GGML_OP_CONV_TRANSPOSE_1D:
-                    {
-                        GGML_ASSERT(node->src[0]->ne[3] == 1);
-                        GGML_ASSERT(node->src[1]->ne[2] == 1);
-                        GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                        const int64_t ne00 = node->src[0]->ne[0];  // K
-                        const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                        const int64_t ne02 = node->src[0]->ne[2];  // Cin
-                        const int64_t ne10 = node->src[1]->ne[0];  // L
-                        const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                        if ((node->src[0]->type == GGML_TYPE_F16 ||
-                             node->src[0]->type == GGML_TYPE_BF16) &&
-                            node->src[1]->type == GGML_TYPE_F32) {
-                            cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                            cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                        } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                                   node->src[1]->type == GGML_TYPE_F32) {
-                            cur += sizeof(float)*ne00*ne01*ne02;
-                            cur += sizeof(float)*ne10*ne11;
-                        } else {
-                            GGML_ABORT("fatal error");
-                        }
-                    } break;
-                case GGML_OP_CONV_TRANSPOSE_2D:
-                    {
-                        const int64_t ne00 = node->src[0]->ne[0]; // W
-                        const int64_t ne01 = node->src[0]->ne[1]; // H
-                        const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                        const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+    if (work_size > 0) {
+        work_size += CACHE_LINE_SIZE*(n_threads);
+    }
 
-                        const int64_t ne10 = node->src[1]->ne[0]; // W
-                        const int64_t ne11 = node->src[1]->ne[1]; // H
-                        const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+    cplan.n_threads  = MIN(max_tasks, n_threads);
 
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                    } break;
-                case GGML_OP_FLASH_ATTN_EXT:
-                    {
-                        const int64_t ne10 = node->src[1]->ne[0]; // DK
-                        const int64_t ne20 = node->src[2]->ne[0]; // DV
+    // the concurrent nodes of a wave use separate parts of the work buffer
+    for (int i = 0; i < cgraph->n_nodes; ) {
+        struct ggml_graph_wave wave;
 
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
-                    } break;
-                case GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        const int64_t    D = node->src[0]->ne[0];
-                        const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                        if (node->src[1]->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        } else if (node->src[1]->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        }
-                    } break;
+        ggml_graph_wave_next(cgraph, i, cplan.n_threads, SIZE_MAX, &wave);
 
-                case GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ABORT("fatal error");
-                    }
-                default:
-                    break;
-            }
+        if (wave.n > 1) {
+            work_size = MAX(work_size, wave.woffs[wave.n - 1] + wave.wsize[wave.n - 1]);
         }
 
-        work_size = MAX(work_size, cur);
+        i = wave.i1;
     }
 
-    if (work_size > 0) {
-        work_size += CACHE_LINE_SIZE*(n_threads);
+    // the cache of the shared src1 of mul_mat is after the rest
+    const size_t src1_cache_size = ggml_graph_src1_cache_size(cgraph);
+    if (src1_cache_size > 0) {
+        work_size = GGML_PAD(work_size, CACHE_LINE_SIZE) + GGML_GRAPH_SRC1_CACHE_MAX*src1_cache_size;
     }
 
     cplan.threadpool = threadpool;
-    cplan.n_threads  = MIN(max_tasks, n_threads);
     cplan.work_size  = work_size;
     cplan.work_data  = NULL;
 
     return cplan;
 }
 
+// the time of a profiler event, 0 if the graph is not profiled
+static inline int64_t ggml_graph_profile_time(ggml_cpu_profiler_t profiler) {
+    return profiler ? ggml_cpu_profiler_time_ns() : 0;
+}
+
+static void ggml_graph_profile_barrier(ggml_cpu_profiler_t profiler, const struct ggml_compute_params * params, int ith) {
+    const int64_t t0 = ggml_graph_profile_time(profiler);
+
+    ggml_barrier(params);
+
+    if (profiler && params->nth > 1) {
+        ggml_cpu_profiler_record(profiler, ith, GGML_CPU_PROFILE_EVENT_BARRIER, NULL, 0, t0, ggml_cpu_profiler_time_ns());
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2830,33 +3783,95 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const struct ggml_cgraph * cgraph = tp->cgraph;
     const struct ggml_cplan  * cplan  = tp->cplan;
 
+    ggml_cpu_profiler_t profiler = tp->profiler;
+
     set_numa_thread_affinity(state->ith);
 
     struct ggml_compute_params params = {
         /*.ith       =*/ state->ith,
         /*.nth       =*/ atomic_load_explicit(&tp->n_threads_cur, memory_order_relaxed),
-        /*.wsize     =*/ cplan->work_size,
+        /*.wsize     =*/ tp->waves_wsize,
         /*.wdata     =*/ cplan->work_data,
         /*.threadpool=*/ tp,
+        /*.ith0      =*/ 0,
+        /*.group     =*/ NULL,
+        /*.wdata_src1=*/ NULL,
+        /*.wdata_src1_ready=*/ false,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
-        struct ggml_tensor * node = cgraph->nodes[node_n];
+    for (int node_n = 0, iwave = 0; iwave < tp->n_waves && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n = tp->waves[iwave].i1, iwave++) {
+        const struct ggml_graph_wave * wave = &tp->waves[iwave];
+        const struct ggml_graph_src1_use * use = wave->use;
+
+        if (wave->convert) {
+            const int64_t t0 = ggml_graph_profile_time(profiler);
 
-        ggml_compute_forward(&params, node);
+            for (int k = 0; k < wave->n; k++) {
+                if (use[k].convert) {
+                    const struct ggml_tensor * node = cgraph->nodes[wave->node[k].node[0]];
+
+                    ggml_compute_forward_mul_mat_src1(&params, node->src[1], type_traits_cpu[node->src[0]->type].vec_dot_type, use[k].wdata);
+                }
+            }
+
+            ggml_barrier(&params);
+
+            if (profiler) {
+                ggml_cpu_profiler_record(profiler, state->ith, GGML_CPU_PROFILE_EVENT_SRC1, NULL, 0, t0, ggml_cpu_profiler_time_ns());
+            }
+        }
+
+        if (wave->n == 1) {
+            params.wdata_src1       = use[0].wdata;
+            params.wdata_src1_ready = use[0].ready;
+
+            const int64_t t0 = ggml_graph_profile_time(profiler);
+
+            ggml_compute_forward_fusion(&params, cgraph, &wave->node[0]);
+
+            if (profiler) {
+                ggml_cpu_profiler_record(profiler, state->ith, GGML_CPU_PROFILE_EVENT_NODE, wave->node[0].node, wave->node[0].n, t0, ggml_cpu_profiler_time_ns());
+            }
+        } else {
+            for (int k = 0; k < wave->n; k++) {
+                if (params.ith < wave->ith0[k] || params.ith >= wave->ith0[k] + wave->nth[k]) {
+                    continue;
+                }
+
+                struct ggml_compute_params params_group = {
+                    /*.ith       =*/ params.ith - wave->ith0[k],
+                    /*.nth       =*/ wave->nth[k],
+                    /*.wsize     =*/ wave->wsize[k],
+                    /*.wdata     =*/ (char *) params.wdata + wave->woffs[k],
+                    /*.threadpool=*/ tp,
+                    /*.ith0      =*/ wave->ith0[k],
+                    /*.group     =*/ &tp->groups[k],
+                    /*.wdata_src1=*/ use[k].wdata,
+                    /*.wdata_src1_ready=*/ use[k].ready,
+                };
+
+                const int64_t t0 = ggml_graph_profile_time(profiler);
+
+                ggml_compute_forward_fusion(&params_group, cgraph, &wave->node[k]);
+
+                if (profiler) {
+                    ggml_cpu_profiler_record(profiler, state->ith, GGML_CPU_PROFILE_EVENT_NODE, wave->node[k].node, wave->node[k].n, t0, ggml_cpu_profiler_time_ns());
+                }
+            }
+        }
 
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
-            atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
+            atomic_store_explicit(&tp->abort, wave->i1, memory_order_relaxed);
             tp->ec    = GGML_STATUS_ABORTED;
         }
 
-        if (node_n + 1 < cgraph->n_nodes) {
-            ggml_barrier(state->threadpool);
+        if (wave->n > 0 && wave->i1 < cgraph->n_nodes) {
+            ggml_graph_profile_barrier(profiler, &params, state->ith);
         }
     }
 
-    ggml_barrier(state->threadpool);
+    ggml_graph_profile_barrier(profiler, &params, state->ith);
 
     return 0;
 }
@@ -3019,9 +4034,8 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
         threadpool->n_graph          = 0;
-        threadpool->n_barrier        = 0;
-        threadpool->n_barrier_passed = 0;
-        threadpool->current_chunk    = 0;
+        memset(&threadpool->barrier, 0, sizeof(threadpool->barrier));
+        memset(threadpool->groups,   0, sizeof(threadpool->groups));
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
@@ -3030,6 +4044,11 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
+        threadpool->profiler         = NULL;
+        threadpool->waves            = NULL;
+        threadpool->n_waves          = 0;
+        threadpool->n_waves_alloc    = 0;
+        threadpool->waves_wsize      = 0;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
@@ -3041,6 +4060,7 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     for (int j = 0; j < tpp->n_threads; j++) {
         workers[j].threadpool = threadpool;
         workers[j].ith        = j;
+        workers[j].numa_node  = ggml_numa_thread_node(j); // set before the threads start, read by the chunk stealing
     }
 
     threadpool->workers = workers;
@@ -3102,11 +4122,14 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         // No worker threads should be accessing the parameters below at this stage
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
-        threadpool->current_chunk    = 0;
         threadpool->abort            = -1;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    if (threadpool->profiler) {
+        ggml_cpu_profiler_graph_begin(threadpool->profiler, cgraph, n_threads);
+    }
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3116,12 +4139,15 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 // update the number of threads from the actual number of threads that we got from OpenMP
                 n_threads = omp_get_num_threads();
                 atomic_store_explicit(&threadpool->n_threads_cur, n_threads, memory_order_relaxed);
+
+                ggml_graph_waves_build(threadpool, cgraph, cplan, n_threads);
             }
 
             ggml_graph_compute_thread(&threadpool->workers[omp_get_thread_num()]);
         }
     } else {
         atomic_store_explicit(&threadpool->n_threads_cur, 1, memory_order_relaxed);
+        ggml_graph_waves_build(threadpool, cgraph, cplan, 1);
         ggml_graph_compute_thread(&threadpool->workers[0]);
     }
 #else
@@ -3130,6 +4156,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         n_threads = threadpool->n_threads_max;
     }
 
+    ggml_graph_waves_build(threadpool, cgraph, cplan, n_threads);
+
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
@@ -3140,6 +4168,10 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
+    if (threadpool->profiler) {
+        ggml_cpu_profiler_graph_end(threadpool->profiler);
+    }
+
     enum ggml_status ret = threadpool->ec;
 
     if (disposable_threadpool) {
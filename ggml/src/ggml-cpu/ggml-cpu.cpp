@@ -2,6 +2,7 @@
 #include "ggml-backend-impl.h"
 #include "ggml-cpu.h"
 #include "ggml-cpu-aarch64.h"
+#include "ggml-cpu-lut.h"
 #include "ggml-cpu-traits.h"
 #include "ggml-impl.h"
 #include "amx/amx.h"
@@ -57,6 +58,12 @@ std::vector<ggml_backend_buffer_type_t>& ggml_backend_cpu_get_extra_buffers_type
         }
 #endif
 
+#ifdef GGML_USE_CPU_LUT
+        if (ggml_backend_cpu_lut_buffer_type()) {
+            bufts.push_back(ggml_backend_cpu_lut_buffer_type());
+        }
+#endif
+
         bufts.push_back(NULL);
 
         return bufts;
@@ -599,6 +606,9 @@ static ggml_backend_feature * ggml_backend_cpu_get_features(ggml_backend_reg_t r
     #ifdef GGML_USE_CPU_AARCH64
         features.push_back({ "AARCH64_REPACK", "1" });
     #endif
+    #ifdef GGML_USE_CPU_LUT
+        features.push_back({ "LUT", "1" });
+    #endif
 
         features.push_back({ nullptr, nullptr });
 
@@ -642,6 +652,26 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_set_threadpool") == 0) {
         return (void *)ggml_backend_cpu_set_threadpool;
     }
+    if (strcmp(name, "ggml_threadpool_set_profiler") == 0) {
+        return (void *)ggml_threadpool_set_profiler;
+    }
+
+    // profiler
+    if (strcmp(name, "ggml_cpu_profiler_new") == 0) {
+        return (void *)ggml_cpu_profiler_new;
+    }
+    if (strcmp(name, "ggml_cpu_profiler_free") == 0) {
+        return (void *)ggml_cpu_profiler_free;
+    }
+    if (strcmp(name, "ggml_cpu_profiler_reset") == 0) {
+        return (void *)ggml_cpu_profiler_reset;
+    }
+    if (strcmp(name, "ggml_cpu_profiler_write_trace") == 0) {
+        return (void *)ggml_cpu_profiler_write_trace;
+    }
+    if (strcmp(name, "ggml_cpu_profiler_print_summary") == 0) {
+        return (void *)ggml_cpu_profiler_print_summary;
+    }
 
     return NULL;
 
@@ -3,7 +3,6 @@
 //
 #include <arm_neon.h>
 #include <assert.h>
-#include <atomic>
 #include <cfloat>
 #include <stdexcept>
 #include <stdint.h>
@@ -140,8 +139,6 @@ class tensor_traits : public ggml::cpu::tensor_traits {
     }
 
     bool compute_forward_kv_cache(ggml_compute_params * params, struct ggml_tensor * dst) {
-        static std::atomic_flag first_to_arrive = ATOMIC_FLAG_INIT;
-
         const ggml_tensor * src0 = dst->src[0];
         const ggml_tensor * src1 = dst->src[1];
 
@@ -216,8 +213,8 @@ class tensor_traits : public ggml::cpu::tensor_traits {
             }
 
             // RHS packing
-            if (first_to_arrive.test_and_set(std::memory_order_acquire) == false) {
-                // First thread to reach this point handles RHS packing
+            if (ith == 0) {
+                // the first thread handles RHS packing
                 memset(bias, 0, n * sizeof(float));
                 transpose_f32kxn_f16nxk(n, k, reinterpret_cast<float *>(rhs_kxn),
                                         reinterpret_cast<const uint16_t *>(rhs_batch), rhs_stride);
@@ -226,9 +223,7 @@ class tensor_traits : public ggml::cpu::tensor_traits {
                              rhs_kxn, bias, nullptr, rhs_packed, 0, nullptr);
             }
 
-            ggml_barrier(params->threadpool);
-
-            first_to_arrive.clear(std::memory_order_release);
+            ggml_barrier(params);
 
             // Perform the matmul
             {
@@ -262,7 +257,7 @@ class tensor_traits : public ggml::cpu::tensor_traits {
                 // the work data buffer (params->wdata) is used as temporary storage which means that only
                 // a single batch can be processed at any given time. No barrier is needed for the last
                 // batch since GGML inserts a barrier between the execution of every operator.
-                ggml_barrier(params->threadpool);
+                ggml_barrier(params);
             }
         }
 
@@ -325,7 +320,7 @@ class tensor_traits : public ggml::cpu::tensor_traits {
             variant_call<void>(lhs_info->pack_func, m_to_process, k, QK4_0, mr, kr, sr, 0, src_ptr, src_stride, lhs_packed_ptr);
         }
 
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
 
         // Perform the operation
         const size_t dst_stride        = dst->nb[1];
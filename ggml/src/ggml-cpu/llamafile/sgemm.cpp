@@ -53,7 +53,6 @@
 #include "ggml-cpu-impl.h"
 #include "ggml-quants.h"
 
-#include <atomic>
 #include <array>
 #include <type_traits>
 
@@ -394,8 +393,6 @@ class tinyBLAS {
 
     template <int RM, int RN, int BM>
     NOINLINE void gemm(int64_t m, int64_t n, int64_t BN) {
-        static std::atomic<int64_t> current_chunk;
-
         GGML_ASSERT(m % (RM * BM) == 0);
         const int64_t ytiles = m / (RM * BM);
         const int64_t xtiles = (n + RN -1) / RN;
@@ -409,14 +406,13 @@ class tinyBLAS {
 
         if (params->ith == 0) {
             GGML_ASSERT( jj_BN * SIZE_BN + (NB_BN - jj_BN) * (SIZE_BN - 1) == xtiles);
-            // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-            std::atomic_store_explicit(&current_chunk, (int64_t)params->nth, std::memory_order_relaxed);
         }
 
-        ggml_barrier(params->threadpool);
+        ggml_chunk_sched_init(params, nb_job);
+
+        ggml_barrier(params);
 
-        int64_t job = params->ith;
-        while (job < nb_job) {
+        for (int64_t job = ggml_chunk_sched_next(params); job >= 0; job = ggml_chunk_sched_next(params)) {
             const int64_t ii = (job % ytiles) * RM * BM;
             const int64_t jb =  job / ytiles;
             const int64_t jr0 = BLOC_POS(jb  , jj_BN, SIZE_BN);
@@ -438,12 +434,9 @@ class tinyBLAS {
                 }
                 GGML_ASSERT(jj == jj2);
             }
-
-            // next step.
-            job = std::atomic_fetch_add_explicit(&current_chunk, (int64_t)1, std::memory_order_relaxed);
         }
 
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
         return;
     }
 
@@ -1043,6 +1036,400 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+#if defined(__AVX2__)
+template <typename TA>
+class tinyBLAS_QK_AVX {
+  public:
+    tinyBLAS_QK_AVX(const ggml_compute_params * params, int64_t k,
+                    const TA *A, int64_t lda,
+                    const block_q8_K *B, int64_t ldb,
+                    float *C, int64_t ldc)
+        : params(params), A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(params->ith), nth(params->nth) {
+    }
+
+    bool matmul(int64_t m, int64_t n) {
+        if (n < min_cols)
+            return false;
+        if (n <= max_cols) {
+            mpack(0, m, n);
+        } else {
+            mnpack(0, m, 0, n);
+        }
+        return true;
+    }
+
+  private:
+    // below this many columns of B, unpacking the super-blocks costs more than the vec_dot of some of the types
+    //   measured at K = M = 4096 on 1 thread: at 3 columns the tiles are still slower than vec_dot for Q2_K, Q3_K and Q4_K,
+    //   from 4 columns they are at least on par for all the types
+    static constexpr int64_t min_cols = 4;
+
+    // up to this many columns of B (e.g. the sequences of a batched decode), a tile spans all of them
+    static constexpr int64_t max_cols = 16;
+
+    // a super-block of A, unpacked once per tile and multiplied with all the columns of the tile
+    struct alignas(32) unpacked {
+        uint8_t q[QK_K];      // unsigned quants
+        int16_t sc[QK_K/2];   // scale of each pair of quants, for _mm256_madd_epi16
+        int16_t mn[QK_K/16];  // min of each group of 16 quants, for the bsums of block_q8_K
+        float   d;
+        float   dmin;
+    };
+
+    // Q3_K and Q6_K are offset by 4 and 32 with the same scales, which is subtracted before converting to float
+    static constexpr bool has_dmin = !std::is_same<TA, block_q3_K>::value && !std::is_same<TA, block_q6_K>::value;
+
+    void mpack(int64_t m0, int64_t m, int64_t n) {
+        int64_t mc;
+        switch (MIN(m - m0, 4)) {
+        case 4:
+            mc = 4;
+            gemm_cols<4>(m0, m, n);
+            break;
+        case 3:
+            mc = 3;
+            gemm_cols<3>(m0, m, n);
+            break;
+        case 2:
+            mc = 2;
+            gemm_cols<2>(m0, m, n);
+            break;
+        case 1:
+            mc = 1;
+            gemm_cols<1>(m0, m, n);
+            break;
+        default:
+            return;
+        }
+        mpack(m0 + (m - m0) / mc * mc, m, n);
+    }
+
+    void mnpack(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t mc, nc, mp, np;
+        switch ((MIN(m - m0, 4) << 4) | MIN(n - n0, 4)) {
+#if VECTOR_REGISTERS == 32
+        case 0x44:
+            mc = 4;
+            nc = 4;
+            gemm<4, 4>(m0, m, n0, n);
+            break;
+        case 0x43:
+            mc = 4;
+            nc = 3;
+            gemm<4, 3>(m0, m, n0, n);
+            break;
+        case 0x34:
+            mc = 3;
+            nc = 4;
+            gemm<3, 4>(m0, m, n0, n);
+            break;
+        case 0x33:
+            mc = 3;
+            nc = 3;
+            gemm<3, 3>(m0, m, n0, n);
+            break;
+        case 0x42:
+            mc = 4;
+            nc = 2;
+            gemm<4, 2>(m0, m, n0, n);
+            break;
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+#else
+        case 0x44:
+        case 0x43:
+        case 0x42:
+            mc = 4;
+            nc = 2;
+            gemm<4, 2>(m0, m, n0, n);
+            break;
+        case 0x34:
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+        case 0x33:
+#endif
+        case 0x32:
+            mc = 3;
+            nc = 2;
+            gemm<3, 2>(m0, m, n0, n);
+            break;
+        case 0x23:
+            mc = 2;
+            nc = 3;
+            gemm<2, 3>(m0, m, n0, n);
+            break;
+        case 0x41:
+            mc = 4;
+            nc = 1;
+            gemm<4, 1>(m0, m, n0, n);
+            break;
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x14:
+            mc = 1;
+            nc = 4;
+            gemm<1, 4>(m0, m, n0, n);
+            break;
+        case 0x31:
+            mc = 3;
+            nc = 1;
+            gemm<3, 1>(m0, m, n0, n);
+            break;
+        case 0x13:
+            mc = 1;
+            nc = 3;
+            gemm<1, 3>(m0, m, n0, n);
+            break;
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+        mp = m0 + (m - m0) / mc * mc;
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    template <int RM, int RN>
+    NOINLINE void gemm(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t ytiles = (m - m0) / RM;
+        int64_t xtiles = (n - n0) / RN;
+        int64_t tiles = xtiles * ytiles;
+        int64_t duty = (tiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > tiles)
+            end = tiles;
+        for (int64_t job = start; job < end; ++job) {
+            int64_t ii = m0 + job / xtiles * RM;
+            int64_t jj = n0 + job % xtiles * RN;
+            __m256 Cv[RN][RM] = {};
+            unpacked Au[RM];
+            for (int64_t l = 0; l < k; ++l) {
+                for (int64_t i = 0; i < RM; ++i)
+                    unpack(A + lda * (ii + i) + l, Au[i]);
+                for (int64_t j = 0; j < RN; ++j)
+                    dot<RM>(Au, B + ldb * (jj + j) + l, Cv[j]);
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i)
+                    C[ldc * (jj + j) + (ii + i)] = hsum(Cv[j][i]);
+        }
+    }
+
+    // tiles of RM rows and all the n <= max_cols columns, so that the super-blocks of A are unpacked once
+    //   the tiles are distributed by the chunk scheduler of the op
+    template <int RM>
+    NOINLINE void gemm_cols(int64_t m0, int64_t m, int64_t n) {
+        const int64_t tiles = (m - m0) / RM;
+
+        ggml_chunk_sched_init(params, tiles);
+
+        ggml_barrier(params);
+
+        for (int64_t job = ggml_chunk_sched_next(params); job >= 0; job = ggml_chunk_sched_next(params)) {
+            int64_t ii = m0 + job * RM;
+            __m256 Cv[max_cols][RM] = {};
+            unpacked Au[RM];
+            for (int64_t l = 0; l < k; ++l) {
+                for (int64_t i = 0; i < RM; ++i)
+                    unpack(A + lda * (ii + i) + l, Au[i]);
+                for (int64_t j = 0; j < n; ++j)
+                    dot<RM>(Au, B + ldb * j + l, Cv[j]);
+            }
+            for (int64_t j = 0; j < n; ++j)
+                for (int64_t i = 0; i < RM; ++i)
+                    C[ldc * j + (ii + i)] = hsum(Cv[j][i]);
+        }
+
+        ggml_barrier(params);
+    }
+
+    // accumulates the products of RM unpacked super-blocks of A with the super-block b of a column
+    template <int RM>
+    static inline void dot(const unpacked * Au, const block_q8_K * b, __m256 * Cv) {
+        __m256i sumi[RM] = {};
+        for (int64_t c = 0; c < QK_K/32; ++c) {
+            const __m256i bv = _mm256_loadu_si256((const __m256i *)(b->qs + 32*c));
+            for (int64_t i = 0; i < RM; ++i) {
+                // the quants of A are unsigned, at most 63, so the pairs of products do not saturate
+                const __m256i p = _mm256_maddubs_epi16(_mm256_load_si256((const __m256i *)(Au[i].q + 32*c)), bv);
+                sumi[i] = _mm256_add_epi32(sumi[i], _mm256_madd_epi16(p, _mm256_load_si256((const __m256i *)(Au[i].sc + 16*c))));
+            }
+        }
+        const __m256i bsums = _mm256_loadu_si256((const __m256i *)b->bsums);
+        for (int64_t i = 0; i < RM; ++i) {
+            const __m256i summ = _mm256_madd_epi16(_mm256_load_si256((const __m256i *)Au[i].mn), bsums);
+            if constexpr (has_dmin) {
+                Cv[i] = madd(_mm256_set1_ps(Au[i].d * b->d), _mm256_cvtepi32_ps(sumi[i]), Cv[i]);
+                Cv[i] = madd(_mm256_set1_ps(-Au[i].dmin * b->d), _mm256_cvtepi32_ps(summ), Cv[i]);
+            } else {
+                Cv[i] = madd(_mm256_set1_ps(Au[i].d * b->d), _mm256_cvtepi32_ps(_mm256_sub_epi32(sumi[i], summ)), Cv[i]);
+            }
+        }
+    }
+
+    // the scales of the 16 groups of 16 quants of Q2_K, Q3_K and Q6_K
+    static inline void unpack_scales_16(const int8_t * scales, unpacked & a) {
+        for (int j = 0; j < QK_K/32; ++j) {
+            _mm256_store_si256((__m256i *)(a.sc + 16*j), MM256_SET_M128I(_mm_set1_epi16(scales[2*j + 1]), _mm_set1_epi16(scales[2*j + 0])));
+        }
+    }
+
+    // the 6-bit scales and mins of the 8 sub-blocks of 32 quants of Q4_K and Q5_K
+    static inline void unpack_scales_k4(const uint8_t * scales, unpacked & a) {
+        for (int j = 0; j < QK_K/32; ++j) {
+            uint8_t sc, mn;
+            if (j < 4) {
+                sc = scales[j] & 63;
+                mn = scales[j + 4] & 63;
+            } else {
+                sc = (scales[j + 4] & 0xF) | ((scales[j - 4] >> 6) << 4);
+                mn = (scales[j + 4] >>  4) | ((scales[j - 0] >> 6) << 4);
+            }
+            _mm256_store_si256((__m256i *)(a.sc + 16*j), _mm256_set1_epi16(sc));
+            a.mn[2*j + 0] = mn;
+            a.mn[2*j + 1] = mn;
+        }
+    }
+
+    static inline void unpack(const block_q2_K * x, unpacked & a) {
+        const __m256i m3 = _mm256_set1_epi8(3);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q = _mm256_loadu_si256((const __m256i *)(x->qs + 32*j));
+            for (int s = 0; s < 4; ++s) {
+                _mm256_store_si256((__m256i *)(a.q + 128*j + 32*s), _mm256_and_si256(_mm256_srli_epi16(q, 2*s), m3));
+            }
+        }
+        int8_t sc[QK_K/16];
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j]   = x->scales[j] & 0xF;
+            a.mn[j] = x->scales[j] >> 4;
+        }
+        unpack_scales_16(sc, a);
+        a.d    = unhalf(x->d);
+        a.dmin = unhalf(x->dmin);
+    }
+
+    static inline void unpack(const block_q3_K * x, unpacked & a) {
+        const __m256i m3 = _mm256_set1_epi8(3);
+        const __m256i m1 = _mm256_set1_epi8(1);
+        const __m256i hm = _mm256_loadu_si256((const __m256i *)x->hmask);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i q = _mm256_loadu_si256((const __m256i *)(x->qs + 32*j));
+            for (int s = 0; s < 4; ++s) {
+                // the high bit is set for the non-negative quants, the offset of 4 is a min of 4*scale
+                const __m256i h = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hm, 4*j + s), m1), 2);
+                _mm256_store_si256((__m256i *)(a.q + 128*j + 32*s), _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q, 2*s), m3), h));
+            }
+        }
+        uint32_t aux[4];
+        memcpy(aux, x->scales, 12);
+        const uint32_t tmp = aux[2];
+        aux[2] = ((aux[0] >> 4) & 0x0f0f0f0f) | (((tmp >> 4) & 0x03030303) << 4);
+        aux[3] = ((aux[1] >> 4) & 0x0f0f0f0f) | (((tmp >> 6) & 0x03030303) << 4);
+        aux[0] = ( aux[0]       & 0x0f0f0f0f) | (((tmp >> 0) & 0x03030303) << 4);
+        aux[1] = ( aux[1]       & 0x0f0f0f0f) | (((tmp >> 2) & 0x03030303) << 4);
+        int8_t sc[QK_K/16];
+        for (int j = 0; j < QK_K/16; ++j) {
+            sc[j]   = (int8_t)(((const uint8_t *)aux)[j]) - 32;
+            a.mn[j] = 4*sc[j];
+        }
+        unpack_scales_16(sc, a);
+        a.d    = unhalf(x->d);
+        a.dmin = a.d;
+    }
+
+    static inline void unpack(const block_q4_K * x, unpacked & a) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q = _mm256_loadu_si256((const __m256i *)(x->qs + 32*j));
+            _mm256_store_si256((__m256i *)(a.q + 64*j +  0), _mm256_and_si256(q, m4));
+            _mm256_store_si256((__m256i *)(a.q + 64*j + 32), _mm256_and_si256(_mm256_srli_epi16(q, 4), m4));
+        }
+        unpack_scales_k4(x->scales, a);
+        a.d    = unhalf(x->d);
+        a.dmin = unhalf(x->dmin);
+    }
+
+    static inline void unpack(const block_q5_K * x, unpacked & a) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i m1 = _mm256_set1_epi8(1);
+        __m256i qh = _mm256_loadu_si256((const __m256i *)x->qh);
+        for (int j = 0; j < QK_K/64; ++j) {
+            const __m256i q = _mm256_loadu_si256((const __m256i *)(x->qs + 32*j));
+            const __m256i h0 = _mm256_slli_epi16(_mm256_and_si256(qh, m1), 4);
+            const __m256i h1 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qh, 1), m1), 4);
+            _mm256_store_si256((__m256i *)(a.q + 64*j +  0), _mm256_or_si256(_mm256_and_si256(q, m4), h0));
+            _mm256_store_si256((__m256i *)(a.q + 64*j + 32), _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q, 4), m4), h1));
+            qh = _mm256_srli_epi16(qh, 2);
+        }
+        unpack_scales_k4(x->scales, a);
+        a.d    = unhalf(x->d);
+        a.dmin = unhalf(x->dmin);
+    }
+
+    static inline void unpack(const block_q6_K * x, unpacked & a) {
+        const __m256i m4 = _mm256_set1_epi8(15);
+        const __m256i m2 = _mm256_set1_epi8(3);
+        for (int j = 0; j < QK_K/128; ++j) {
+            const __m256i ql0 = _mm256_loadu_si256((const __m256i *)(x->ql + 64*j +  0));
+            const __m256i ql1 = _mm256_loadu_si256((const __m256i *)(x->ql + 64*j + 32));
+            const __m256i qh  = _mm256_loadu_si256((const __m256i *)(x->qh + 32*j));
+            _mm256_store_si256((__m256i *)(a.q + 128*j +  0), _mm256_or_si256(_mm256_and_si256(ql0, m4),
+                        _mm256_slli_epi16(_mm256_and_si256(qh, m2), 4)));
+            _mm256_store_si256((__m256i *)(a.q + 128*j + 32), _mm256_or_si256(_mm256_and_si256(ql1, m4),
+                        _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qh, 2), m2), 4)));
+            _mm256_store_si256((__m256i *)(a.q + 128*j + 64), _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql0, 4), m4),
+                        _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qh, 4), m2), 4)));
+            _mm256_store_si256((__m256i *)(a.q + 128*j + 96), _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql1, 4), m4),
+                        _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(qh, 6), m2), 4)));
+        }
+        // the scales are per group of 16 quants, the offset of 32 is a min of 32*scale
+        unpack_scales_16(x->scales, a);
+        for (int j = 0; j < QK_K/16; ++j) {
+            a.mn[j] = 32*x->scales[j];
+        }
+        a.d    = unhalf(x->d);
+        a.dmin = a.d;
+    }
+
+    const ggml_compute_params * params;
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AVX2__
+
 //PPC Implementation
 #if defined(__MMA__)
 
@@ -3524,6 +3911,76 @@ bool llamafile_sgemm(const struct ggml_compute_params * params, int64_t m, int64
 #endif
     }
 
+    case GGML_TYPE_Q2_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_QK_AVX<block_q2_K> tb{ params,
+            k, (const block_q2_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc};
+        return tb.matmul(m, n);
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q3_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_QK_AVX<block_q3_K> tb{ params,
+            k, (const block_q3_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc};
+        return tb.matmul(m, n);
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q4_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_QK_AVX<block_q4_K> tb{ params,
+            k, (const block_q4_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc};
+        return tb.matmul(m, n);
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q5_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_QK_AVX<block_q5_K> tb{ params,
+            k, (const block_q5_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc};
+        return tb.matmul(m, n);
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q6_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_QK_AVX<block_q6_K> tb{ params,
+            k, (const block_q6_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc};
+        return tb.matmul(m, n);
+#else
+        return false;
+#endif
+    }
+
     default:
         return false;
     }
@@ -1730,7 +1730,7 @@ static void ggml_compute_forward_acc_f32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
     }
 
     const int ith = params->ith;
@@ -2159,7 +2159,7 @@ static void ggml_compute_forward_count_equal_i32(
     if (ith != 0) {
         sums[ith] = sum_thread;
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     if (ith != 0) {
         return;
@@ -2896,6 +2896,44 @@ static void ggml_compute_forward_silu(
             }
     }
 }
+
+// silu -> mul, the fused kernel of the chains found by ggml_graph_fusion_at()
+
+void ggml_compute_forward_silu_mul(
+        const ggml_compute_params * params,
+        ggml_tensor * silu,
+        ggml_tensor * mul) {
+
+    const ggml_tensor * src0 = silu->src[0];
+    const ggml_tensor * u    = mul->src[0] == silu ? mul->src[1] : mul->src[0];
+
+    const int64_t ne0 = silu->ne[0];
+    const int64_t ne1 = silu->ne[1];
+    const int64_t ne2 = silu->ne[2];
+
+    const auto row = [](const ggml_tensor * t, int64_t i1, int64_t i2, int64_t i3) {
+        return (float *) ((char *) t->data + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3]);
+    };
+
+    const auto [ir0, ir1] = get_thread_range(params, silu);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+              float * s  = row(silu, i1, i2, i3);
+        const float * ur = row(u,    i1, i2, i3);
+              float * y  = row(mul,  i1, i2, i3);
+
+        ggml_vec_silu_f32(ne0, s, row(src0, i1, i2, i3));
+
+        for (int64_t i0 = 0; i0 < ne0; i0++) {
+            y[i0] = s[i0]*ur[i0];
+        }
+    }
+}
+
 // ggml_compute_forward_leaky_relu
 
 static void ggml_compute_forward_leaky_relu_f32(
@@ -3230,6 +3268,97 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// fused kernels for chains of rows ops
+//   the chains are found by ggml_graph_fusion_at() and run with a single pass over the rows, without the barriers
+//   between the nodes. the intermediate results are still written, they can be used by other nodes, and the results
+//   are the same as with the separate nodes
+
+// [add ->] rms_norm [-> mul]
+static void ggml_compute_forward_add_rms_norm_mul_f32(
+        const ggml_compute_params * params,
+        ggml_tensor * add,
+        ggml_tensor * norm,
+        ggml_tensor * mul) {
+
+    const ggml_tensor * src0 = add ? add->src[0] : norm->src[0];
+    const ggml_tensor * src1 = add ? add->src[1] : nullptr;
+    const ggml_tensor * w    = mul ? mul->src[1] : nullptr;
+
+    const int64_t ne0 = norm->ne[0];
+    const int64_t ne1 = norm->ne[1];
+    const int64_t ne2 = norm->ne[2];
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    const auto row = [](const ggml_tensor * t, int64_t i1, int64_t i2, int64_t i3) {
+        return (float *) ((char *) t->data + i1*t->nb[1] + i2*t->nb[2] + i3*t->nb[3]);
+    };
+
+    const auto [ir0, ir1] = get_thread_range(params, norm);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+        const float * x = row(src0, i1, i2, i3);
+
+        if (add) {
+            const float * b = row(src1, i1, i2, i3);
+                  float * s = row(add,  i1, i2, i3);
+
+            for (int64_t i0 = 0; i0 < ne0; i0++) {
+                s[i0] = x[i0] + b[i0];
+            }
+
+            x = s;
+        }
+
+        ggml_float sum = 0.0;
+        for (int64_t i0 = 0; i0 < ne0; i0++) {
+            sum += (ggml_float)(x[i0] * x[i0]);
+        }
+
+        const float mean = sum/ne0;
+
+        const float scale = 1.0f/sqrtf(mean + eps);
+
+        float * n = row(norm, i1, i2, i3);
+
+        if (mul) {
+            const float * wr = row(w, i1 % w->ne[1], i2 % w->ne[2], i3 % w->ne[3]);
+                  float * y  = row(mul, i1, i2, i3);
+
+            for (int64_t i0 = 0; i0 < ne0; i0++) {
+                n[i0] = x[i0]*scale;
+                y[i0] = n[i0]*wr[i0];
+            }
+        } else {
+            for (int64_t i0 = 0; i0 < ne0; i0++) {
+                n[i0] = x[i0]*scale;
+            }
+        }
+    }
+}
+
+void ggml_compute_forward_rms_norm_mul(
+        const ggml_compute_params * params,
+        ggml_tensor * norm,
+        ggml_tensor * mul) {
+    ggml_compute_forward_add_rms_norm_mul_f32(params, nullptr, norm, mul);
+}
+
+void ggml_compute_forward_add_rms_norm(
+        const ggml_compute_params * params,
+        ggml_tensor * add,
+        ggml_tensor * norm,
+        ggml_tensor * mul) {
+    ggml_compute_forward_add_rms_norm_mul_f32(params, add, norm, mul);
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -3604,7 +3733,7 @@ static void ggml_compute_forward_out_prod_f32(
     if (ith == 0) {
         ggml_vec_set_f32(ne0*ne1*ne2*ne3, (float *)dst->data, 0);
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     // dst[:,:,:,:] = 0
     // for i2,i3:
@@ -3726,7 +3855,7 @@ static void ggml_compute_forward_out_prod_q_f32(
     if (ith == 0) {
         ggml_vec_set_f32(ne0*ne1*ne2*ne3, (float *)dst->data, 0);
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     // parallelize by last three dimensions
 
@@ -3911,7 +4040,7 @@ static void ggml_compute_forward_set_f32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
     }
 
     const int ith = params->ith;
@@ -3982,7 +4111,7 @@ static void ggml_compute_forward_set_i32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
     }
 
     const int ith = params->ith;
@@ -4563,7 +4692,7 @@ static void ggml_compute_forward_diag_mask_f32(
                 ((char *) src0->data),
                 ggml_nbytes(dst));
         }
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
     }
 
     // TODO: handle transposed/permuted matrices
@@ -5545,7 +5674,7 @@ static void ggml_compute_forward_conv_transpose_1d_f16_f32(
         // need to zero dst since we are accumulating into it
         memset(dst->data, 0, ggml_nbytes(dst));
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     const int32_t s0 = ((const int32_t*)(dst->op_params))[0];
 
@@ -5633,7 +5762,7 @@ static void ggml_compute_forward_conv_transpose_1d_f32(
         // need to zero dst since we are accumulating into it
         memset(dst->data, 0, ggml_nbytes(dst));
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     const int32_t s0 = ((const int32_t*)(dst->op_params))[0];
 
@@ -6014,7 +6143,7 @@ void ggml_compute_forward_conv_transpose_2d(
 
         memset(dst->data, 0, ggml_nbytes(dst));
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     const int32_t stride = ggml_get_op_params_i32(dst, 0);
 
@@ -7061,6 +7190,362 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+// query-tiled variant: each thread processes tiles of GGML_FA_TILE_Q query rows against tiles of GGML_FA_TILE_KV
+// rows of K and V, so that the K and V rows are loaded (and converted to F32) once per tile of queries instead of
+// once per query
+// with GQA, the query heads that share a K/V head are processed together: the rows of a tile are the (query, head)
+// pairs of a group, so that the K/V cache is read once per group instead of once per head
+// when there are fewer tiles than threads (e.g. for single-token decoding), the K/V rows are also split in chunks
+// processed by different threads, and the partial results are merged after a barrier
+static void ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const ggml_compute_params * params,
+        const ggml_tensor * q,
+        const ggml_tensor * k,
+        const ggml_tensor * v,
+        const ggml_tensor * mask,
+        ggml_tensor * dst) {
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(neq0 == DK);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    // number of query heads per group sharing the same K/V head
+    const int64_t G = rk2 == rv2 ? rk2 : 1;
+
+    // rows of a group: the (query, head) pairs
+    const int64_t nr_group = N*G;
+
+    // parallelize by tiles of rows of the groups
+
+    // total tiles
+    const int64_t n_tiles = (nr_group + GGML_FA_TILE_Q - 1)/GGML_FA_TILE_Q;
+    const int64_t n_units = n_tiles*(neq2/G)*neq3;
+
+    // number of chunks of K/V rows per tile
+    const int64_t n_chunks = n_units < nth ? MAX(1, MIN((nth + n_units - 1)/n_units, nek1/GGML_FA_CHUNK_KV_MIN)) : 1;
+
+    const int64_t chunk_size = GGML_PAD((nek1 + n_chunks - 1)/n_chunks, GGML_FA_TILE_KV);
+
+    const int64_t nr = n_units*n_chunks;
+
+    // work items per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // work item range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    ggml_to_float_t const k_to_float = ggml_get_type_traits(k->type)->to_float;
+    ggml_to_float_t const v_to_float = ggml_get_type_traits(v->type)->to_float;
+
+    GGML_ASSERT((k->type == GGML_TYPE_F32 || k_to_float) && "fattn: unsupported K-type");
+    GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float) && "fattn: unsupported V-type");
+
+    float * Q32 = (float *) params->wdata + ith*(GGML_FA_TILE_WSIZE(DK, DV) + CACHE_LINE_SIZE_F32); // FP32 Q tile
+    float * K32 = Q32 + GGML_FA_TILE_Q*DK;       // FP32 K tile
+    float * V32 = K32 + GGML_FA_TILE_KV*DK;      // FP32 V tile
+    float * KQ  = V32 + GGML_FA_TILE_KV*DV;      // KQ values of the tile, with the mask applied
+    float * VKQ = KQ  + GGML_FA_TILE_Q*GGML_FA_TILE_KV; // FP32 VKQ accumulators
+    float * M   = VKQ + GGML_FA_TILE_Q*DV;       // maximum KQ value of each row
+    float * S   = M   + GGML_FA_TILE_Q;          // sum of each row
+
+    // partial results of the chunks (VKQ, M, S), shared by all threads
+    float * part = (float *) params->wdata + nth*(GGML_FA_TILE_WSIZE(DK, DV) + CACHE_LINE_SIZE_F32);
+
+    const int64_t part_size = GGML_FA_TILE_Q*(DV + 2);
+
+    int64_t iq1s[GGML_FA_TILE_Q]; // query index of each row of the tile
+    int64_t iq2s[GGML_FA_TILE_Q]; // head index of each row of the tile
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t iu = ir/n_chunks;
+        const int64_t ch = ir - iu*n_chunks;
+
+        // unit indices
+        const int64_t iq3 = iu/((neq2/G)*n_tiles);
+        const int64_t ig  = (iu - iq3*(neq2/G)*n_tiles)/n_tiles;  // group index
+        const int64_t it  =  iu - iq3*(neq2/G)*n_tiles - ig*n_tiles; // tile index
+
+        const int64_t r0 = it*GGML_FA_TILE_Q; // first row of the tile
+        const int64_t nq = MIN(GGML_FA_TILE_Q, nr_group - r0);
+
+        // k indices
+        const int64_t ik3 = iq3 / rk3;
+        const int64_t ik2 = (ig*G) / rk2;
+
+        // v indices
+        const int64_t iv3 = iq3 / rv3;
+        const int64_t iv2 = (ig*G) / rv2;
+
+        // K/V rows of the chunk
+        const int64_t ic_start = ch*chunk_size;
+        const int64_t ic_end   = MIN(ic_start + chunk_size, nek1);
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            iq1s[iq] = (r0 + iq)/G;
+            iq2s[iq] = ig*G + (r0 + iq)%G;
+
+            const float * pq = (const float *) ((char *) q->data + (iq1s[iq]*nbq1 + iq2s[iq]*nbq2 + iq3*nbq3));
+            memcpy(Q32 + iq*DK, pq, DK*sizeof(float));
+
+            M[iq] = -INFINITY;
+            S[iq] = 0.0f;
+        }
+
+        memset(VKQ, 0, nq*DV*sizeof(float));
+
+        // online softmax / attention, one tile of K and V rows at a time
+        // ref: https://arxiv.org/pdf/2112.05682.pdf
+        for (int64_t ic0 = ic_start; ic0 < ic_end; ic0 += GGML_FA_TILE_KV) {
+            const int64_t nk = MIN(GGML_FA_TILE_KV, ic_end - ic0);
+
+            // apply the mask first, to skip the tiles that are fully masked (e.g. above the diagonal of a causal mask)
+            bool masked = true;
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                const uint32_t h = iq2s[iq]; // head index
+                const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+                const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1s[iq]*mask->nb[1]) + ic0 : NULL;
+
+                for (int64_t ic = 0; ic < nk; ++ic) {
+                    const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+
+                    KQ[iq*GGML_FA_TILE_KV + ic] = mv;
+
+                    masked = masked && mv == -INFINITY;
+                }
+            }
+
+            if (masked) {
+                continue;
+            }
+
+            for (int64_t ic = 0; ic < nk; ++ic) {
+                const char * k_data = (const char *) k->data + ((ic0 + ic)*nbk1 + ik2*nbk2 + ik3*nbk3);
+                const char * v_data = (const char *) v->data + ((ic0 + ic)*nbv1 + iv2*nbv2 + iv3*nbv3);
+
+                if (k->type == GGML_TYPE_F16) {
+                    ggml_cpu_fp16_to_fp32((const ggml_fp16_t *) k_data, K32 + ic*DK, DK);
+                } else if (k_to_float) {
+                    k_to_float(k_data, K32 + ic*DK, DK);
+                } else {
+                    memcpy(K32 + ic*DK, k_data, DK*sizeof(float));
+                }
+
+                if (v->type == GGML_TYPE_F16) {
+                    ggml_cpu_fp16_to_fp32((const ggml_fp16_t *) v_data, V32 + ic*DV, DV);
+                } else if (v_to_float) {
+                    v_to_float(v_data, V32 + ic*DV, DV);
+                } else {
+                    memcpy(V32 + ic*DV, v_data, DV*sizeof(float));
+                }
+            }
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * kq = KQ + iq*GGML_FA_TILE_KV;
+
+                // KQ = Q*K^T for the tile
+                float Mnew = M[iq];
+
+                for (int64_t ic = 0; ic < nk; ++ic) {
+                    if (kq[ic] == -INFINITY) {
+                        continue;
+                    }
+
+                    float s; // KQ value
+
+                    ggml_vec_dot_f32(DK, &s, 0, K32 + ic*DK, 0, Q32 + iq*DK, 0, 1);
+
+                    s = s*scale; // scale KQ value
+
+                    if (logit_softcap != 0.0f) {
+                        s = logit_softcap*tanhf(s);
+                    }
+
+                    kq[ic] += s; // apply mask
+
+                    Mnew = MAX(Mnew, kq[ic]);
+                }
+
+                if (Mnew == -INFINITY) {
+                    // all the rows of the tile are masked for this query
+                    continue;
+                }
+
+                float * vkq = VKQ + iq*DV;
+
+                // upon new higher max val, scale VKQ and KQ sum with expf(Mold - M)
+                const float ms = expf(M[iq] - Mnew);
+                if (ms != 1.0f) {
+                    ggml_vec_scale_f32(DV, vkq, ms);
+                }
+
+                // V += v*expf(s - M)
+                float sum = 0.0f;
+
+                for (int64_t ic = 0; ic < nk; ++ic) {
+                    if (kq[ic] == -INFINITY) {
+                        continue;
+                    }
+
+                    const float vs = expf(kq[ic] - Mnew);
+
+                    ggml_vec_mad_f32(DV, vkq, V32 + ic*DV, vs);
+
+                    sum += vs;
+                }
+
+                S[iq] = S[iq]*ms + sum;
+                M[iq] = Mnew;
+            }
+        }
+
+        if (n_chunks > 1) {
+            // keep the partial result, merged below
+            float * p = part + ir*part_size;
+
+            memcpy(p,                          VKQ, nq*DV*sizeof(float));
+            memcpy(p + GGML_FA_TILE_Q*DV,      M,   nq*sizeof(float));
+            memcpy(p + GGML_FA_TILE_Q*(DV + 1), S,  nq*sizeof(float));
+
+            continue;
+        }
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float * vkq = VKQ + iq*DV;
+
+            // V /= S
+            const float S_inv = 1.0f/S[iq];
+            ggml_vec_scale_f32(DV, vkq, S_inv);
+
+            // dst indices
+            const int64_t i1 = iq1s[iq];
+            const int64_t i2 = iq2s[iq];
+            const int64_t i3 = iq3;
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, vkq, nb1);
+        }
+    }
+
+    if (n_chunks == 1) {
+        return;
+    }
+
+    ggml_barrier(params);
+
+    // merge the partial results of the chunks of each unit
+    const int64_t du  = (n_units + nth - 1)/nth;
+    const int64_t iu0 = du*ith;
+    const int64_t iu1 = MIN(iu0 + du, n_units);
+
+    for (int64_t iu = iu0; iu < iu1; ++iu) {
+        const int64_t iq3 = iu/((neq2/G)*n_tiles);
+        const int64_t ig  = (iu - iq3*(neq2/G)*n_tiles)/n_tiles;
+        const int64_t it  =  iu - iq3*(neq2/G)*n_tiles - ig*n_tiles;
+
+        const int64_t r0 = it*GGML_FA_TILE_Q;
+        const int64_t nq = MIN(GGML_FA_TILE_Q, nr_group - r0);
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float Mmax = -INFINITY;
+            for (int64_t ch = 0; ch < n_chunks; ++ch) {
+                const float * p = part + (iu*n_chunks + ch)*part_size;
+                Mmax = MAX(Mmax, p[GGML_FA_TILE_Q*DV + iq]);
+            }
+
+            float * vkq = VKQ;
+            memset(vkq, 0, DV*sizeof(float));
+
+            float Ssum = 0.0f;
+
+            for (int64_t ch = 0; ch < n_chunks; ++ch) {
+                const float * p = part + (iu*n_chunks + ch)*part_size;
+
+                const float Mc = p[GGML_FA_TILE_Q*DV       + iq];
+                const float Sc = p[GGML_FA_TILE_Q*(DV + 1) + iq];
+
+                if (Mc == -INFINITY) {
+                    continue;
+                }
+
+                const float ms = expf(Mc - Mmax);
+
+                ggml_vec_mad_f32(DV, vkq, p + iq*DV, ms);
+
+                Ssum += Sc*ms;
+            }
+
+            // V /= S
+            const float S_inv = 1.0f/Ssum;
+            ggml_vec_scale_f32(DV, vkq, S_inv);
+
+            // dst indices
+            const int64_t i1 = (r0 + iq)/G;
+            const int64_t i2 = ig*G + (r0 + iq)%G;
+            const int64_t i3 = iq3;
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, vkq, nb1);
+        }
+    }
+}
+
 void ggml_compute_forward_flash_attn_ext(
         const ggml_compute_params * params,
         const ggml_tensor * q,
@@ -7073,7 +7558,17 @@ void ggml_compute_forward_flash_attn_ext(
         case GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                // batches of queries and groups of GQA heads use the query-tiled kernel, which reads the K and V rows
+                // once per tile of rows
+                const int64_t n_group = k->ne[2] == v->ne[2] ? q->ne[2]/k->ne[2] : 1;
+
+                if (q->ne[1]*n_group >= GGML_FA_TILE_Q/8 &&
+                    (k->type == GGML_TYPE_F32 || ggml_get_type_traits(k->type)->to_float) &&
+                    (v->type == GGML_TYPE_F32 || ggml_get_type_traits(v->type)->to_float)) {
+                    ggml_compute_forward_flash_attn_ext_f16_tiled(params, q, k, v, mask, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                }
             } break;
         default:
             {
@@ -7143,7 +7638,7 @@ static void ggml_compute_forward_flash_attn_back_f32(
     if (ith == 0) {
         memset(dst->data, 0, nb0*ne0*ne1*ne2*ne3);
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     const int64_t elem_q = ggml_nelements(q);
     const int64_t elem_k = ggml_nelements(k);
@@ -7838,7 +8333,7 @@ static void ggml_compute_forward_add_rel_pos_f32(
         if (params->ith == 0) {
             memcpy((char *) dst->data, (char *) src0->data, ggml_nbytes(dst));
         }
-        ggml_barrier(params->threadpool);
+        ggml_barrier(params);
     }
     // ref: https://github.com/facebookresearch/segment-anything/blob/main/segment_anything/modeling/image_encoder.py#L357-L359
 
@@ -7944,7 +8439,7 @@ static void ggml_compute_forward_rwkv_wkv6_f32(
     if (ith == 0) {
         memset(dst_data, 0, T * C * sizeof(float));
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
 
     #if defined(__AVX__) && !defined(__AVX512F__)
@@ -8146,7 +8641,7 @@ static void ggml_compute_forward_gla_f32(
     if (ith == 0) {
         memset(dst_data, 0, T * C * sizeof(float));
     }
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
 
     #if defined(__AVX__) && !defined(__AVX512F__)
@@ -8601,7 +9096,7 @@ static void ggml_compute_forward_cross_entropy_loss_f32(
 #endif
     }
     sums[ith] = sum_thread;
-    ggml_barrier(params->threadpool);
+    ggml_barrier(params);
 
     if (ith == 0) {
         float * dp = (float *) dst->data;
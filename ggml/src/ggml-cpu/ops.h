@@ -20,6 +20,23 @@
 
 static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 
+//
+// flash attention
+//
+
+// the number of query rows and of KV rows per tile of the query-tiled kernel
+#define GGML_FA_TILE_Q  32
+#define GGML_FA_TILE_KV 16
+
+// the minimum number of KV rows per chunk when the KV rows of a tile are split across threads
+#define GGML_FA_CHUNK_KV_MIN 256
+
+// per thread work buffer of the query-tiled kernel, in floats
+#define GGML_FA_TILE_WSIZE(DK, DV) (GGML_FA_TILE_Q*(DK) + GGML_FA_TILE_KV*((DK) + (DV)) + GGML_FA_TILE_Q*(GGML_FA_TILE_KV + (DV) + 2))
+
+// shared buffer for the partial results of the KV chunks, in floats (there are less than 2*nth chunks)
+#define GGML_FA_TILE_WSIZE_PART(DV, nth) (2*(nth)*GGML_FA_TILE_Q*((DV) + 2))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,6 +57,9 @@ void ggml_compute_forward_silu_back(const struct ggml_compute_params * params, s
 void ggml_compute_forward_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_rms_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_rms_norm_back(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+void ggml_compute_forward_rms_norm_mul(const struct ggml_compute_params * params, struct ggml_tensor * norm, struct ggml_tensor * mul);
+void ggml_compute_forward_add_rms_norm(const struct ggml_compute_params * params, struct ggml_tensor * add, struct ggml_tensor * norm, struct ggml_tensor * mul);
+void ggml_compute_forward_silu_mul(const struct ggml_compute_params * params, struct ggml_tensor * silu, struct ggml_tensor * mul);
 void ggml_compute_forward_group_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_l2_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_out_prod(const struct ggml_compute_params * params, struct ggml_tensor * dst);
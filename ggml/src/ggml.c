@@ -2726,6 +2726,25 @@ void ggml_mul_mat_set_prec(
     ggml_set_op_params_i32(a, 0, prec_i32);
 }
 
+struct ggml_tensor * ggml_mul_mat_sparse(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        float                 thold) {
+    GGML_ASSERT(c->type == GGML_TYPE_F32);
+
+    struct ggml_tensor * result = ggml_mul_mat(ctx, a, b);
+
+    GGML_ASSERT(ggml_are_same_shape(result, c));
+
+    ggml_set_op_params_f32(result, 1, thold);
+
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_mul_mat_id
 
 /*
@@ -321,6 +321,8 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool fuse_weights;  // pack the Q/K/V and the gate/up weights in single tensors, to compute them with one matmul
+                            // the packed weights are copies, with mmap they are resident twice (the copy and the page cache)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -329,7 +331,7 @@ extern "C" {
         uint32_t n_ctx;             // text context, 0 = from model
         uint32_t n_batch;           // logical maximum batch size that can be submitted to llama_decode
         uint32_t n_ubatch;          // physical maximum batch size
-        uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
+        uint32_t n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models), at most 64
         int32_t  n_threads;         // number of threads to use for generation
         int32_t  n_threads_batch;   // number of threads to use for batch processing
 
@@ -346,6 +348,15 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, <= 0 disabled (default)
+        uint32_t defrag_n_cells;   // max number of KV cells moved per decode by the defragmentation, 0 = all at once (default)
+        uint32_t kv_block_size;    // allocate the KV cache in blocks of this many cells, 0 = disabled (default) [EXPERIMENTAL]
+        uint32_t kv_recent;        // with a quantized K cache, also keep the K of the most recent cells in F16 and compute
+                                   // their scores from it - adds memory and reads, 0 = disabled (default) [EXPERIMENTAL]
+        uint32_t kv_sink;          // number of first cells of a sequence that are never evicted when kv_window is set
+        uint32_t kv_window;        // evict the oldest cells of a sequence beyond this many cells and move the kept cells down
+                                   // after the sinks - the next position is llama_kv_self_seq_pos_max + 1, 0 = disabled (default) [EXPERIMENTAL]
+        uint32_t kv_checkpoint;    // recurrent models: checkpoint the state of a sequence every this many tokens, 0 = disabled (default) [EXPERIMENTAL]
+        float    sparse_ffn_thold; // skip the FFN up rows of neurons whose gate activation magnitude is <= thold, < 0 = disabled (default) [EXPERIMENTAL]
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -365,6 +376,7 @@ extern "C" {
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
         bool op_offload;  // whether to offload host tensor operations to device
+        bool kv_h2o;      // with kv_window, evict the cells with the least accumulated attention instead of the oldest [EXPERIMENTAL]
     };
 
     // model quantization parameters
@@ -679,6 +691,8 @@ extern "C" {
 
     // Removes all tokens that belong to the specified sequence and have positions in [p0, p1)
     // Returns false if a partial sequence cannot be removed. Removing a whole sequence never fails
+    // Recurrent models can only remove the end of a sequence, by rolling back to a state checkpoint (see kv_checkpoint)
+    //   the sequence can then end before p0 - use llama_kv_self_seq_pos_max() to find where to continue from
     // seq_id < 0 : match any sequence
     // p0 < 0     : [0,  p1]
     // p1 < 0     : [p0, inf)
@@ -708,6 +722,8 @@ extern "C" {
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_self_update()
+    // Cells shared with other sequences are copied first - if there are not enough free cells for the copies,
+    // the KV cache is not modified (see llama_kv_self_seq_try_add)
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
     LLAMA_API void llama_kv_self_seq_add(
@@ -717,10 +733,21 @@ extern "C" {
                        llama_pos   p1,
                        llama_pos   delta);
 
+    // Same as llama_kv_self_seq_add, but returns false if the KV cache has not been modified
+    // because there are not enough free cells to copy the shared cells
+    LLAMA_API bool llama_kv_self_seq_try_add(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                       llama_pos   delta);
+
     // Integer division of the positions by factor of `d > 1`
     // If the KV cache is RoPEd, the KV data is updated accordingly:
     //   - lazily on next llama_decode()
     //   - explicitly with llama_kv_self_update()
+    // Cells shared with other sequences are copied first - if there are not enough free cells for the copies,
+    // the KV cache is not modified (see llama_kv_self_seq_try_div)
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
     LLAMA_API void llama_kv_self_seq_div(
@@ -730,11 +757,33 @@ extern "C" {
                        llama_pos   p1,
                              int   d);
 
+    // Same as llama_kv_self_seq_div, but returns false if the KV cache has not been modified
+    // because there are not enough free cells to copy the shared cells
+    LLAMA_API bool llama_kv_self_seq_try_div(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                             int   d);
+
+    // Returns the smallest position present in the KV cache for the specified sequence
+    // Returns -1 if the sequence is empty
+    LLAMA_API llama_pos llama_kv_self_seq_pos_min(
+            struct llama_context * ctx,
+                     llama_seq_id   seq_id);
+
     // Returns the largest position present in the KV cache for the specified sequence
+    // Returns 0 if the sequence is empty
     LLAMA_API llama_pos llama_kv_self_seq_pos_max(
             struct llama_context * ctx,
                      llama_seq_id   seq_id);
 
+    // Returns true if some positions between the smallest and the largest position of the sequence are not in the KV cache
+    // This happens when cells are evicted without moving the others, e.g. with kv_h2o
+    LLAMA_API bool llama_kv_self_seq_has_holes(
+            struct llama_context * ctx,
+                     llama_seq_id   seq_id);
+
     // Defragment the KV cache
     // This will be applied:
     //   - lazily on next llama_decode()
@@ -1421,6 +1470,10 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+
+        double  t_defrag_ms;    // time spent defragmenting the KV cache
+        int32_t n_defrag;       // number of KV cache defragmentation steps
+        int32_t n_defrag_cells; // number of KV cells moved by the defragmentation
     };
 
     struct llama_perf_sampler_data {
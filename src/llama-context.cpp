@@ -33,6 +33,14 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_n_cells   = params.defrag_n_cells;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.kv_recent        = params.kv_recent;
+    cparams.kv_sink          = params.kv_sink;
+    cparams.kv_window        = params.kv_window;
+    cparams.kv_checkpoint    = params.kv_checkpoint;
+    cparams.sparse_ffn_thold = params.sparse_ffn_thold;
+    cparams.kv_h2o           = params.kv_h2o;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -117,6 +125,12 @@ llama_context::llama_context(
                 __func__, n_ctx_per_seq, hparams.n_ctx_train);
     }
 
+    // the window is enforced after each batch, so a sequence temporarily holds the window and the new tokens
+    if (cparams.kv_window > 0 && cparams.kv_window + cparams.n_batch > n_ctx_per_seq) {
+        LLAMA_LOG_WARN("%s: kv_window (%u) + n_batch (%u) > n_ctx_per_seq (%u) -- a full sequence might not have room for a batch\n",
+                __func__, cparams.kv_window, cparams.n_batch, n_ctx_per_seq);
+    }
+
     if (!hparams.vocab_only) {
         // GPU backends
         for (auto * dev : model.devices) {
@@ -884,6 +898,15 @@ int llama_context::decode(llama_batch & inp_batch) {
         }
     }
 
+    for (int64_t i = 0; i < n_tokens_all; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id[%" PRId64 "][%d] = %d >= %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_SEQ);
+                throw std::runtime_error("invalid seq_id");
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -923,6 +946,12 @@ int llama_context::decode(llama_batch & inp_batch) {
     // handle any pending defrags/shifts
     kv_self_update();
 
+    // drop the attention scores of a previous batch that failed
+    if (!kv_score.empty()) {
+        ggml_backend_sched_synchronize(sched.get());
+        kv_score.clear();
+    }
+
     int64_t n_outputs_prev = 0;
 
     while (sbatch.n_tokens > 0) {
@@ -982,6 +1011,16 @@ int llama_context::decode(llama_batch & inp_batch) {
         //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
         //}
 
+        // copy the attention received by the KV cells for the heavy-hitter eviction - applied after the last ubatch
+        if (auto * t_kv_score = res->get_kv_score()) {
+            ggml_backend_t backend_score = ggml_backend_sched_get_tensor_backend(sched.get(), t_kv_score);
+            GGML_ASSERT(backend_score != nullptr);
+
+            // note: moving the vectors does not move their data, so the pending copies stay valid
+            kv_score.emplace_back(ggml_nelements(t_kv_score));
+            ggml_backend_tensor_get_async(backend_score, t_kv_score, kv_score.back().data(), 0, ggml_nbytes(t_kv_score));
+        }
+
         auto * t_logits = cparams.embeddings ? nullptr         : res->get_logits();
         auto * t_embd   = cparams.embeddings ? res->get_embd() : nullptr;
 
@@ -1065,6 +1104,21 @@ int llama_context::decode(llama_batch & inp_batch) {
     // finalize the batch processing
     kv_guard.commit();
 
+    if (!kv_score.empty()) {
+        ggml_backend_sched_synchronize(sched.get());
+
+        if (auto * kv = dynamic_cast<llama_kv_cache_unified *>(kv_self)) {
+            for (const auto & score : kv_score) {
+                kv->score_add(score);
+            }
+        }
+
+        kv_score.clear();
+    }
+
+    // the batch is stored - evict the cells according to the eviction policy of the cache
+    kv_self->evict();
+
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     n_outputs = n_outputs_all;
 
@@ -1841,6 +1895,14 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
 
+    if (const auto * kv = dynamic_cast<const llama_kv_cache_unified *>(memory.get())) {
+        const auto & defrag = kv->get_defrag_perf();
+
+        data.t_defrag_ms    = 1e-3 * defrag.t_us;
+        data.n_defrag       = defrag.n_steps;
+        data.n_defrag_cells = defrag.n_cells;
+    }
+
     return data;
 }
 
@@ -1848,6 +1910,10 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+
+    if (auto * kv = dynamic_cast<llama_kv_cache_unified *>(memory.get())) {
+        kv->reset_defrag_perf();
+    }
 }
 
 //
@@ -2082,6 +2148,13 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_n_cells              =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_recent                   =*/ 0,
+        /*.kv_sink                     =*/ 4,
+        /*.kv_window                   =*/ 0,
+        /*.kv_checkpoint               =*/ 0,
+        /*.sparse_ffn_thold            =*/ -1.0f,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -2093,6 +2166,7 @@ llama_context_params llama_context_default_params() {
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
         /*.op_offload                  =*/ true,
+        /*.kv_h2o                      =*/ false,
     };
 
     return result;
@@ -2116,6 +2190,11 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_SEQ);
+        return nullptr;
+    }
+
     if (params.flash_attn && model->arch == LLM_ARCH_GROK) {
         LLAMA_LOG_WARN("%s: flash_attn is not compatible with Grok - forcing off\n", __func__);
         params.flash_attn = false;
@@ -2126,6 +2205,21 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    if (params.kv_recent > 0 && (params.flash_attn || !ggml_is_quantized(params.type_k))) {
+        LLAMA_LOG_WARN("%s: kv_recent requires a quantized K cache and is not compatible with flash_attn - forcing off\n", __func__);
+        params.kv_recent = 0;
+    }
+
+    if (params.kv_window > 0 && params.kv_window <= params.kv_sink) {
+        LLAMA_LOG_WARN("%s: kv_window must be larger than kv_sink - disabling the streaming eviction\n", __func__);
+        params.kv_window = 0;
+    }
+
+    if (params.kv_h2o && (params.kv_window == 0 || params.flash_attn)) {
+        LLAMA_LOG_WARN("%s: kv_h2o requires kv_window and is not compatible with flash_attn - forcing off\n", __func__);
+        params.kv_h2o = false;
+    }
+
     try {
         auto * ctx = new llama_context(*model, params);
         return ctx;
@@ -2376,6 +2470,12 @@ bool llama_kv_self_seq_rm(
         return true;
     }
 
+    // the recurrent cache can restore a state checkpoint - wait for the pending computations that use the state
+    const auto * kvr = dynamic_cast<const llama_kv_cache_recurrent *>(kv);
+    if (kvr && kvr->get_has_ckpt()) {
+        ctx->synchronize();
+    }
+
     return kv->seq_rm(seq_id, p0, p1);
 }
 
@@ -2443,6 +2543,20 @@ void llama_kv_self_seq_add(
     kv->seq_add(seq_id, p0, p1, delta);
 }
 
+bool llama_kv_self_seq_try_add(
+        llama_context * ctx,
+         llama_seq_id   seq_id,
+            llama_pos   p0,
+            llama_pos   p1,
+            llama_pos   delta) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return true;
+    }
+
+    return kv->seq_add(seq_id, p0, p1, delta);
+}
+
 // deprecated
 void llama_kv_cache_seq_div(
         llama_context * ctx,
@@ -2467,11 +2581,34 @@ void llama_kv_self_seq_div(
     kv->seq_div(seq_id, p0, p1, d);
 }
 
+bool llama_kv_self_seq_try_div(
+        llama_context * ctx,
+         llama_seq_id   seq_id,
+            llama_pos   p0,
+            llama_pos   p1,
+                  int   d) {
+    auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return true;
+    }
+
+    return kv->seq_div(seq_id, p0, p1, d);
+}
+
 // deprecated
 llama_pos llama_kv_cache_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     return llama_kv_self_seq_pos_max(ctx, seq_id);
 }
 
+llama_pos llama_kv_self_seq_pos_min(llama_context * ctx, llama_seq_id seq_id) {
+    const auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return -1;
+    }
+
+    return kv->seq_pos_min(seq_id);
+}
+
 llama_pos llama_kv_self_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     const auto * kv = ctx->get_kv_self();
     if (!kv) {
@@ -2481,6 +2618,15 @@ llama_pos llama_kv_self_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     return kv->seq_pos_max(seq_id);
 }
 
+bool llama_kv_self_seq_has_holes(llama_context * ctx, llama_seq_id seq_id) {
+    const auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return false;
+    }
+
+    return kv->seq_has_holes(seq_id);
+}
+
 // deprecated
 void llama_kv_cache_defrag(llama_context * ctx) {
     llama_kv_self_defrag(ctx);
@@ -2671,6 +2817,10 @@ void llama_perf_context_print(const llama_context * ctx) {
             __func__, data.t_p_eval_ms, data.n_p_eval, data.t_p_eval_ms / data.n_p_eval, 1e3 / data.t_p_eval_ms * data.n_p_eval);
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
+    if (data.n_defrag > 0) {
+        LLAMA_LOG_INFO("%s:      defrag time = %10.2f ms / %5d steps  (%8.2f ms per step, %5d cells moved)\n",
+                __func__, data.t_defrag_ms, data.n_defrag, data.t_defrag_ms / data.n_defrag, data.n_defrag_cells);
+    }
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
 }
 
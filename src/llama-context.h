@@ -227,6 +227,9 @@ private:
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
     std::map<llama_seq_id, std::vector<float>> embd_seq;
 
+    // the attention received by the KV cells in each ubatch of the current batch (see llama_kv_cache_unified::score_add)
+    std::vector<std::vector<float>> kv_score;
+
     int32_t n_outputs     = 0; // number of actually-used outputs in the current ubatch or last logical batch
     int32_t n_outputs_max = 0; // capacity (of tokens positions) for the output buffers
 
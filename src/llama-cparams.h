@@ -4,6 +4,9 @@
 
 #include <cstdint>
 
+// the maximum number of sequences of a context - llama_context_params.n_seq_max and the seq_id of a batch must be below it
+#define LLAMA_MAX_SEQ 64
+
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
     uint32_t n_batch;
@@ -24,6 +27,14 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t defrag_n_cells; // 0 - defragment the whole cache at once
+    uint32_t kv_block_size;  // 0 - paged KV cache allocation disabled
+    uint32_t kv_recent;      // 0 - F16 recent-K window disabled
+    uint32_t kv_sink;
+    uint32_t kv_window;      // 0 - streaming eviction disabled
+    uint32_t kv_checkpoint;  // 0 - recurrent state checkpoints disabled
+    float    sparse_ffn_thold; // < 0 - sparse FFN disabled
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
@@ -31,6 +42,7 @@ struct llama_cparams {
     bool no_perf;
     bool warmup;
     bool op_offload;
+    bool kv_h2o;
 
     enum llama_pooling_type pooling_type;
 
@@ -122,7 +122,7 @@ void llm_graph_input_pos_bucket_kv::set_input(const llama_ubatch * ubatch) {
         for (int h = 0; h < 1; ++h) {
             for (int j = 0; j < n_tokens; ++j) {
                 for (int i = 0; i < n_kv; ++i) {
-                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(kv_self->cells[i].pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(kv_self->cells.pos_get(i), ubatch->pos[j], hparams.n_rel_attn_bkts, false);
                 }
             }
         }
@@ -443,13 +443,13 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                     for (int i = 0; i < n_kv; ++i) {
                         float f;
                         // mask the token if:
-                        if (!kv_self->cells[i].has_seq_id(seq_id) // not the correct sequence
-                            || (cparams.causal_attn && kv_self->cells[i].pos > pos) // for causal, mask future tokens
+                        if (!kv_self->cells.seq_has(i, seq_id) // not the correct sequence
+                            || (cparams.causal_attn && kv_self->cells.pos_get(i) > pos) // for causal, mask future tokens
                         ) {
                             f = -INFINITY;
                         } else {
                             if (hparams.use_alibi) {
-                                f = -std::abs(kv_self->cells[i].pos - pos);
+                                f = -std::abs(kv_self->cells.pos_get(i) - pos);
                             } else {
                                 f = 0.0f;
                             }
@@ -464,11 +464,11 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                         if (data_swa) {
                             if (hparams.n_attn_chunk) {
                                 llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (kv_self->cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
+                                if (kv_self->cells.pos_get(i) < pos_chunk_start || pos < pos_chunk_start) {
                                     f = -INFINITY;
                                 }
                             } else {
-                                if (pos - kv_self->cells[i].pos >= (int32_t)hparams.n_swa) {
+                                if (pos - kv_self->cells.pos_get(i) >= (int32_t)hparams.n_swa) {
                                     f = -INFINITY;
                                 }
                             }
@@ -698,8 +698,33 @@ ggml_tensor * llm_graph_context::build_ffn(
      llm_ffn_op_type   type_op,
    llm_ffn_gate_type   type_gate,
                  int   il) const {
-    ggml_tensor * tmp = up ? build_lora_mm(up, cur) : cur;
-    cb(tmp, "ffn_up", il);
+    // with a parallel gate, the up projection can be deferred until after the activation and only the rows
+    // of the neurons with a non-negligible activation need to be computed
+    const bool sparse = cparams.sparse_ffn_thold >= 0.0f && up && !up_b && !up_s &&
+        gate && type_gate == LLM_FFN_PAR && loras->empty() &&
+        (type_op == LLM_FFN_SILU || type_op == LLM_FFN_GELU || type_op == LLM_FFN_RELU);
+
+    ggml_tensor * inp = cur;
+
+    // the gate and up weights packed in a single tensor, see llama_model_params::fuse_weights
+    //   a single matmul computes both projections, the gate and the up results are views of its rows
+    ggml_tensor * gate_up = nullptr;
+    if (!sparse && up && gate && type_gate == LLM_FFN_PAR && loras->empty() && ggml_is_matrix(cur) &&
+        gate->view_src && gate->view_src == up->view_src &&
+        gate->view_offs == 0 && up->view_offs == ggml_nbytes(gate) && gate->view_src->ne[1] == gate->ne[1] + up->ne[1]) {
+        gate_up = build_lora_mm(gate->view_src, cur);
+        cb(gate_up, "ffn_gate_up", il);
+    }
+
+    ggml_tensor * tmp = nullptr;
+    if (gate_up) {
+        tmp = ggml_view_2d(ctx0, gate_up, up->ne[1], gate_up->ne[1], gate_up->nb[1], gate->ne[1]*ggml_element_size(gate_up));
+    } else if (!sparse) {
+        tmp = up ? build_lora_mm(up, cur) : cur;
+    }
+    if (tmp) {
+        cb(tmp, "ffn_up", il);
+    }
 
     if (up_b) {
         tmp = ggml_add(ctx0, tmp, up_b);
@@ -720,7 +745,11 @@ ggml_tensor * llm_graph_context::build_ffn(
                 } break;
             case LLM_FFN_PAR:
                 {
-                    cur = build_lora_mm(gate, cur);
+                    if (gate_up) {
+                        cur = ggml_view_2d(ctx0, gate_up, gate->ne[1], gate_up->ne[1], gate_up->nb[1], 0);
+                    } else {
+                        cur = build_lora_mm(gate, cur);
+                    }
                     cb(cur, "ffn_gate", il);
                 } break;
         }
@@ -782,6 +811,11 @@ ggml_tensor * llm_graph_context::build_ffn(
             } break;
     }
 
+    if (sparse) {
+        tmp = ggml_mul_mat_sparse(ctx0, up, inp, cur, cparams.sparse_ffn_thold);
+        cb(tmp, "ffn_up", il);
+    }
+
     if (gate && type_gate == LLM_FFN_PAR) {
         cur = ggml_mul(ctx0, cur, tmp);
         cb(cur, "ffn_gate_par", il);
@@ -1185,11 +1219,13 @@ ggml_tensor * llm_graph_context::build_attn_mha(
          ggml_tensor * q,
          ggml_tensor * k,
          ggml_tensor * v,
+         const std::vector<std::pair<int64_t, ggml_tensor *>> & k_hot,
          ggml_tensor * kq_b,
          ggml_tensor * kq_mask,
          ggml_tensor * v_mla,
              bool      v_trans,
-             float     kq_scale) const {
+             float     kq_scale,
+             bool      kv_score) const {
   //const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
   //const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -1208,6 +1244,7 @@ ggml_tensor * llm_graph_context::build_attn_mha(
     // TODO: replace hardcoded padding with ggml-provided padding
     if (cparams.flash_attn && (n_kv % 256 == 0) && kq_b == nullptr) {
         GGML_ASSERT(kq_b == nullptr && "Flash attention does not support KQ bias yet");
+        GGML_ASSERT(k_hot.empty() && "Flash attention does not support the hot cache");
 
         if (v_trans) {
             v = ggml_transpose(ctx0, v);
@@ -1251,6 +1288,15 @@ ggml_tensor * llm_graph_context::build_attn_mha(
         //       while for some models F16 is enough, for others it is not, so we default to F32 here
         ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
 
+        // the scores of the cells that have an F16 copy in the hot cache are computed again from the copy
+        // and written over the scores computed from the quantized cache
+        for (const auto & run : k_hot) {
+            ggml_tensor * kq_hot = ggml_mul_mat(ctx0, run.second, q);
+            ggml_mul_mat_set_prec(kq_hot, GGML_PREC_F32);
+
+            kq = ggml_set_inplace(ctx0, kq, kq_hot, kq->nb[1], kq->nb[2], kq->nb[3], run.first*kq->nb[0]);
+        }
+
         if (arch == LLM_ARCH_GROK) {
             // need to do the following:
             // multiply by attn_output_multiplyer of 0.08838834764831845
@@ -1274,6 +1320,16 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
         kq = ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
 
+        if (kv_score) {
+            // sum the attention weights of each KV cell over the tokens and the heads
+            //   the rows of kq are accumulated in place, without a transposed copy of kq
+            ggml_tensor * score = ggml_repeat_back(ctx0, kq, ggml_view_1d(ctx0, kq, kq->ne[0], 0));
+
+            res->t_kv_score = res->t_kv_score ? ggml_add(ctx0, res->t_kv_score, score) : score;
+
+            ggml_build_forward_expand(gf, res->t_kv_score);
+        }
+
         if (!v_trans) {
             // note: avoid this branch
             v = ggml_cont(ctx0, ggml_transpose(ctx0, v));
@@ -1345,7 +1401,7 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * v = ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
     //cb(k, "v", il);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale);
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, {}, kq_b, kq_mask, v_mla, false, kq_scale);
 
     cb(cur, "kqv_out", il);
 
@@ -1418,8 +1474,48 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const bool v_trans = !cparams.flash_attn;
 
+    // store the K of the most recent tokens to the hot cache
+    for (const auto & run : kv_self->get_hot_runs()) {
+        ggml_tensor * k_run = ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], run.n, k_cur->nb[1], k_cur->nb[2], run.i0*k_cur->nb[2]);
+
+        ggml_tensor * k_hot_view = ggml_view_1d(ctx0, kv_self->k_hot_l[il], run.n*n_embd_k_gqa, ggml_row_size(kv_self->k_hot_l[il]->type, n_embd_k_gqa)*run.c0);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_run, k_hot_view));
+    }
+
     // store to KV cache
-    {
+    const auto & store_runs = kv_self->get_store_runs();
+
+    if (store_runs.size() > 1) {
+        // paged KV cache - the tokens of the ubatch are scattered in several runs of cells
+        GGML_ASSERT(kv_self->size == n_ctx);
+        GGML_ASSERT(k_cur->ne[2] == n_tokens);
+
+        v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
+
+        for (const auto & run : store_runs) {
+            ggml_tensor * k_run = ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], run.n, k_cur->nb[1], k_cur->nb[2], run.i0*k_cur->nb[2]);
+            ggml_tensor * v_run = ggml_view_2d(ctx0, v_cur, n_embd_v_gqa, run.n, v_cur->nb[1], run.i0*v_cur->nb[1]);
+
+            ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], run.n*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*run.c0);
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_run, k_cache_view));
+
+            ggml_tensor * v_cache_view = nullptr;
+
+            if (!v_trans) {
+                v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], run.n*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*run.c0);
+            } else {
+                v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], run.n, n_embd_v_gqa,
+                        (   n_ctx)*ggml_element_size(kv_self->v_l[il]),
+                        (run.c0)*ggml_element_size(kv_self->v_l[il]));
+
+                v_run = ggml_transpose(ctx0, v_run);
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_run, v_cache_view));
+        }
+    } else {
         const auto kv_head = kv_self->head;
 
         GGML_ASSERT(kv_self->size == n_ctx);
@@ -1483,7 +1579,18 @@ ggml_tensor * llm_graph_context::build_attn(
                 ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
                 0);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, v_trans, kq_scale);
+    // the F16 copies of the cells [i0, i0 + n) in the hot slots [c0, c0 + n)
+    std::vector<std::pair<int64_t, ggml_tensor *>> k_hot;
+
+    for (const auto & run : kv_self->get_hot_attn_runs()) {
+        k_hot.emplace_back(run.i0, ggml_view_3d(ctx0, kv_self->k_hot_l[il],
+                n_embd_head_k, run.n, n_head_kv,
+                ggml_row_size(kv_self->k_hot_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv_self->k_hot_l[il]->type, n_embd_head_k),
+                ggml_row_size(kv_self->k_hot_l[il]->type, n_embd_k_gqa)*run.c0));
+    }
+
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, k_hot, kq_b, kq_mask, v_mla, v_trans, kq_scale, kv_self->get_h2o());
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1543,7 +1650,7 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * v = ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
     //cb(k, "v", il);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale);
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, {}, kq_b, kq_mask, v_mla, false, kq_scale);
 
     cb(cur, "kqv_out", il);
 
@@ -302,6 +302,7 @@ public:
     virtual ggml_tensor * get_logits()      = 0;
     virtual ggml_tensor * get_embd()        = 0;
     virtual ggml_tensor * get_embd_pooled() = 0;
+    virtual ggml_tensor * get_kv_score()    = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
 };
@@ -317,6 +318,7 @@ public:
     ggml_tensor * get_logits()      override { return t_logits; }
     ggml_tensor * get_embd()        override { return t_embd; }
     ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
+    ggml_tensor * get_kv_score()    override { return t_kv_score; }
 
     void set_inputs(const llama_ubatch * ubatch) override {
         for (auto & input : inputs) {
@@ -334,6 +336,7 @@ public:
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
+    ggml_tensor * t_kv_score    = nullptr; // the attention received by each KV cell, summed over the layers
 
     std::vector<llm_graph_input_ptr> inputs;
 };
@@ -510,11 +513,13 @@ struct llm_graph_context {
              ggml_tensor * q,     // [n_embd_head_q, n_tokens, n_head_q]
              ggml_tensor * k,     // [n_embd_head_k, n_tokens, n_head_k]
              ggml_tensor * v,     // [n_embd_head_v, n_tokens, n_head_v] (v_trans == false)
+             const std::vector<std::pair<int64_t, ggml_tensor *>> & k_hot, // (i, [n_embd_head_k, n, n_head_k]) F16 copies of the cells [i, i + n)
              ggml_tensor * kq_b,
              ggml_tensor * kq_mask,
              ggml_tensor * v_mla, // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
                     bool   v_trans,
-                   float   kq_scale) const;
+                   float   kq_scale,
+                    bool   kv_score = false) const; // accumulate the attention of each KV cell in res->t_kv_score
 
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
@@ -29,26 +29,48 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                      bool   v_trans,
                      bool   offload,
                  uint32_t   kv_size,
-                 uint32_t   padding) : model(model), hparams(model.hparams), v_trans(v_trans), padding(padding) {
+                 uint32_t   padding,
+                 uint32_t   block_size,
+                 uint32_t   n_hot,
+                 uint32_t   n_sink,
+                 uint32_t   n_window,
+                     bool   h2o) : model(model), hparams(model.hparams), v_trans(v_trans), padding(padding), block_size(block_size), n_hot(std::min(n_hot, kv_size)),
+                                   n_sink(n_sink), n_window(std::min(n_window, kv_size)), h2o(h2o && n_window > 0) {
     const int32_t n_layer = hparams.n_layer;
 
-    has_shift = false;
     can_shift = true;
 
-    LLAMA_LOG_INFO("%s: kv_size = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d, padding = %d\n",
-            __func__, kv_size, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift, padding);
+    LLAMA_LOG_INFO("%s: kv_size = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d, padding = %d, block_size = %d, n_hot = %d\n",
+            __func__, kv_size, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift, padding, block_size, this->n_hot);
+
+    if (this->n_window > 0) {
+        GGML_ASSERT(this->n_window > n_sink && "the window must be larger than the number of sink cells");
+
+        LLAMA_LOG_INFO("%s: streaming eviction: n_sink = %d, n_window = %d, h2o = %d\n", __func__, n_sink, this->n_window, this->h2o);
+    }
 
     GGML_ASSERT(kv_size % padding == 0 && "kv_size must be a multiple of padding");
 
+    if (block_size > 0) {
+        GGML_ASSERT(kv_size % block_size == 0 && "kv_size must be a multiple of block_size");
+
+        block_owner.resize(kv_size/block_size, -1);
+        block_prev .resize(kv_size/block_size, -1);
+        block_next .resize(kv_size/block_size, -1);
+    }
+
+    if (this->n_hot > 0) {
+        hot_cells.resize(this->n_hot, -1);
+    }
+
     head = 0;
     size = kv_size;
-    used = 0;
 
     this->type_k = type_k;
     this->type_v = type_v;
 
-    cells.clear();
     cells.resize(kv_size);
+    cells.set_block_size(block_size);
 
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
@@ -56,7 +78,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         auto it = ctx_map.find(buft);
         if (it == ctx_map.end()) {
             ggml_init_params params = {
-                /*.mem_size   =*/ size_t(2u*n_layer*ggml_tensor_overhead()),
+                /*.mem_size   =*/ size_t(4u*n_layer*ggml_tensor_overhead()),
                 /*.mem_buffer =*/ NULL,
                 /*.no_alloc   =*/ true,
             };
@@ -106,6 +128,12 @@ llama_kv_cache_unified::llama_kv_cache_unified(
         ggml_format_name(v, "cache_v_l%d", i);
         k_l.push_back(k);
         v_l.push_back(v);
+
+        if (this->n_hot > 0) {
+            ggml_tensor * k_hot = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_embd_k_gqa*this->n_hot);
+            ggml_format_name(k_hot, "cache_k_hot_l%d", i);
+            k_hot_l.push_back(k_hot);
+        }
     }
 
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
@@ -134,12 +162,15 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 }
 
 void llama_kv_cache_unified::clear() {
-    for (int32_t i = 0; i < (int32_t) size; ++i) {
-        cells[i].pos = -1;
-        cells[i].seq_id.clear();
-    }
+    cells.reset();
+
     head = 0;
-    used = 0;
+
+    block_tables_clear();
+
+    cow_info.ids.clear();
+
+    hot_clear();
 
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
@@ -147,6 +178,8 @@ void llama_kv_cache_unified::clear() {
 }
 
 bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    GGML_ASSERT(seq_id < LLAMA_MAX_SEQ);
+
     uint32_t new_head = size;
 
     if (p0 < 0) {
@@ -157,25 +190,26 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         p1 = std::numeric_limits<llama_pos>::max();
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].pos >= p0 && cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cells[i].seq_id.clear();
-            } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
-            } else {
+    if (seq_id < 0) {
+        for (uint32_t i = cells.next_used(0); i < size; i = cells.next_used(i + 1)) {
+            if (!cells.pos_in(i, p0, p1)) {
                 continue;
             }
-            if (cells[i].is_empty()) {
-                // keep count of the number of used cells
-                if (cells[i].pos >= 0) {
-                    used--;
-                }
 
-                cells[i].pos = -1;
+            cells.rm(i);
 
-                if (new_head == size) {
-                    new_head = i;
+            new_head = std::min(new_head, i);
+        }
+    } else {
+        block_table & table = block_tables[seq_id];
+
+        for (uint32_t i : cells.seq_cells(seq_id, p0, p1)) {
+            if (cells.seq_rm(i, seq_id)) {
+                new_head = std::min(new_head, i);
+
+                // the cells freed in the last block of the sequence are reused, e.g. after rejected draft tokens
+                if (block_size > 0 && (int32_t) (i/block_size) == table.last) {
+                    table.tail = std::min(table.tail, i);
                 }
             }
         }
@@ -186,10 +220,18 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         head = new_head;
     }
 
+    // the whole sequence has been removed - release its blocks
+    if (block_size > 0 && p0 == 0 && p1 == std::numeric_limits<llama_pos>::max()) {
+        block_tables_rm(seq_id);
+    }
+
     return true;
 }
 
 void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    GGML_ASSERT(seq_id_src >= 0 && seq_id_src < LLAMA_MAX_SEQ);
+    GGML_ASSERT(seq_id_dst >= 0 && seq_id_dst < LLAMA_MAX_SEQ);
+
     if (seq_id_src == seq_id_dst) {
         return;
     }
@@ -205,31 +247,21 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     // otherwise, this is the KV of a Transformer-like model
     head = 0;
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id_src) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            cells[i].seq_id.insert(seq_id_dst);
+    for (uint32_t i : cells.seq_cells(seq_id_src, p0, p1)) {
+        if (!cells.seq_has(i, seq_id_dst)) {
+            cells.seq_add(i, seq_id_dst);
         }
     }
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
-    uint32_t new_head = size;
-
-    for (uint32_t i = 0; i < size; ++i) {
-        if (!cells[i].has_seq_id(seq_id)) {
-            if (cells[i].pos >= 0) {
-                used--;
-            }
+    GGML_ASSERT(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
 
-            cells[i].pos = -1;
-            cells[i].seq_id.clear();
+    uint32_t new_head = size;
 
-            if (new_head == size){
-                new_head = i;
-            }
-        } else {
-            cells[i].seq_id.clear();
-            cells[i].seq_id.insert(seq_id);
+    for (uint32_t i = cells.next_used(0); i < size; i = cells.next_used(i + 1)) {
+        if (cells.seq_keep(i, seq_id)) {
+            new_head = std::min(new_head, i);
         }
     }
 
@@ -237,11 +269,21 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != size && new_head < head) {
         head = new_head;
     }
+
+    if (block_size > 0) {
+        for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (s != seq_id) {
+                block_tables_rm(s);
+            }
+        }
+    }
 }
 
-void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+bool llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    GGML_ASSERT(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
     if (delta == 0) {
-        return;
+        return true;
     }
 
     uint32_t new_head = size;
@@ -256,36 +298,55 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the
     if (p0 == p1) {
-        return;
+        return true;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
-            cells[i].pos   += delta;
-            cells[i].delta += delta;
+    // collect the cells first - copying a shared cell adds a new cell of the sequence in the range
+    const std::vector<uint32_t> ids = cells.seq_cells(seq_id, p0, p1);
 
-            if (cells[i].pos < 0) {
-                if (!cells[i].is_empty()) {
-                    used--;
-                }
-                cells[i].pos = -1;
-                cells[i].seq_id.clear();
-                if (new_head == size) {
-                    new_head = i;
-                }
+    // the shared cells are copied before they are shifted - make sure there is room for all of them
+    uint32_t n_cow = 0;
+    for (uint32_t i : ids) {
+        if (cells.seq_count(i) > 1 && cells.pos_get(i) + delta >= 0) {
+            n_cow++;
+        }
+    }
+
+    if (n_cow > cell_cow_n_free(seq_id)) {
+        LLAMA_LOG_ERROR("%s: seq %d: not enough free cells to copy %u shared cells - the cache is not modified\n", __func__, seq_id, n_cow);
+        return false;
+    }
+
+    for (uint32_t i : ids) {
+        if (cells.seq_count(i) > 1) {
+            if (cells.pos_get(i) + delta < 0) {
+                // the cell is removed from this sequence - nothing to copy
+                cells.seq_rm(i, seq_id);
+                continue;
             }
+
+            const int32_t j = cell_cow(i, seq_id);
+            GGML_ASSERT(j >= 0);
+            i = j;
+        }
+
+        if (cells.pos_add(i, delta)) {
+            new_head = std::min(new_head, i);
         }
     }
 
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != size ? new_head : 0;
+
+    return true;
 }
 
-void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+bool llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    GGML_ASSERT(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
     if (d == 1) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -298,32 +359,52 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the cache.
     if (p0 == p1) {
-        return;
+        return true;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            has_shift = true;
+    const std::vector<uint32_t> ids = cells.seq_cells(seq_id, p0, p1);
 
-            {
-                llama_pos p_old = cells[i].pos;
-                cells[i].pos   /= d;
-                cells[i].delta += cells[i].pos - p_old;
-            }
+    uint32_t n_cow = 0;
+    for (uint32_t i : ids) {
+        if (cells.seq_count(i) > 1) {
+            n_cow++;
         }
     }
-}
 
-llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
-    llama_pos result = 0;
+    if (n_cow > cell_cow_n_free(seq_id)) {
+        LLAMA_LOG_ERROR("%s: seq %d: not enough free cells to copy %u shared cells - the cache is not modified\n", __func__, seq_id, n_cow);
+        return false;
+    }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cells[i].pos);
+    for (uint32_t i : ids) {
+        if (cells.seq_count(i) > 1) {
+            const int32_t j = cell_cow(i, seq_id);
+            GGML_ASSERT(j >= 0);
+            i = j;
         }
+
+        cells.pos_div(i, d);
     }
 
-    return result;
+    return true;
+}
+
+llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+    return cells.seq_pos_min(seq_id);
+}
+
+llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+    return std::max(0, cells.seq_pos_max(seq_id));
+}
+
+bool llama_kv_cache_unified::seq_has_holes(llama_seq_id seq_id) const {
+    GGML_ASSERT(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+    return cells.seq_has_holes(seq_id);
 }
 
 void llama_kv_cache_unified::restore() {
@@ -335,14 +416,9 @@ void llama_kv_cache_unified::restore() {
 
     for (auto & range : pending.ranges) {
         for (uint32_t i = range.c0; i < range.c1; ++i) {
-            cells[i].seq_id.clear();
-
-            // keep count of the number of used cells
-            if (cells[i].pos >= 0) {
-                used--;
+            if (!cells.is_empty(i)) {
+                cells.rm(i);
             }
-
-            cells[i].pos = -1;
         }
 
         new_head = std::min(new_head, range.c0);
@@ -368,43 +444,95 @@ bool llama_kv_cache_unified::update(llama_context & lctx) {
 
     auto * sched = lctx.get_sched();
 
-    if (has_shift) {
+    // the copies must be done before the K-shift, which updates the copied cells
+    if (!cow_info.ids.empty()) {
+        LLAMA_LOG_DEBUG("%s: copying %zu shared KV cells\n", __func__, cow_info.ids.size());
+
+        // each copy requires 6*n_layer nodes (see build_graph_cow)
+        const uint32_t n_layer   = hparams.n_layer;
+        const uint32_t max_moves = std::max(1u, (lctx.graph_max_nodes() - 2*n_layer)/(6*n_layer));
+
+        for (uint32_t i0 = 0; i0 < cow_info.ids.size(); i0 += max_moves) {
+            const uint32_t i1 = std::min<uint32_t>(cow_info.ids.size(), i0 + max_moves);
+
+            ggml_backend_sched_reset(sched);
+
+            auto * gf = lctx.graph_init();
+
+            auto res = build_graph_cow(lctx.get_cparams(), lctx.get_ctx_compute(), gf, i0, i1);
+
+            ggml_backend_sched_alloc_graph(sched, gf);
+
+            res->set_inputs(nullptr);
+
+            lctx.graph_compute(gf, false);
+        }
+
+        cow_info.ids.clear();
+
+        need_reserve = true;
+    }
+
+    if (cells.get_has_shift()) {
         if (!get_can_shift()) {
             GGML_ABORT("The current KV cache / model configuration does not support K-shift");
         }
 
         LLAMA_LOG_DEBUG("%s: applying K-shift\n", __func__);
 
+        // only rotate the range of cells that have been shifted
+        uint32_t c0 = size;
+        uint32_t c1 = 0;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            if (cells.get_shift(i) != 0) {
+                c0 = std::min(c0, i);
+                c1 = i + 1;
+            }
+        }
+
         // apply K-shift if needed
-        if (hparams.rope_type != LLAMA_ROPE_TYPE_NONE) {
+        // note: the K-shift graph is much smaller than the worst-case graph, so there is no need to reserve again
+        //       the allocator never shrinks the reserved compute buffers, and the next graph is planned within them
+        //       with a streaming eviction window the kept cells are shifted regularly, and a reserve here would rebuild
+        //       the worst-case graph every time
+        if (hparams.rope_type != LLAMA_ROPE_TYPE_NONE && c0 < c1) {
             ggml_backend_sched_reset(sched);
 
             auto * gf = lctx.graph_init();
 
-            auto res = build_graph_shift(lctx.get_cparams(), lctx.get_ctx_compute(), gf);
+            auto res = build_graph_shift(lctx.get_cparams(), lctx.get_ctx_compute(), gf, c0, c1);
 
             ggml_backend_sched_alloc_graph(sched, gf);
 
             res->set_inputs(nullptr);
 
             lctx.graph_compute(gf, false);
-
-            need_reserve = true;
         }
 
-        {
-            has_shift = false;
-
-            for (uint32_t i = 0; i < size; ++i) {
-                cells[i].delta = 0;
+        // the copies in the hot cache of the shifted cells have not been shifted
+        for (uint32_t s = 0; s < n_hot; ++s) {
+            if (hot_cells[s] >= 0 && cells.get_shift(hot_cells[s]) != 0) {
+                hot_cells[s] = -1;
             }
         }
+
+        cells.reset_shift();
     }
 
     if (do_defrag) {
         LLAMA_LOG_DEBUG("%s: defragmenting KV cache\n", __func__);
 
-        if (defrag_prepare(lctx.graph_max_nodes())) {
+        const int64_t t_start_us = ggml_time_us();
+
+        const uint32_t n_max_cells = lctx.get_cparams().defrag_n_cells;
+
+        const bool moved = n_max_cells > 0 ?
+            defrag_prepare_step(lctx.graph_max_nodes(), n_max_cells) :
+            defrag_prepare     (lctx.graph_max_nodes());
+
+        // note: the defrag graph is much smaller than the worst-case graph, so there is no need to reserve again
+        if (moved) {
             ggml_backend_sched_reset(sched);
 
             auto * gf = lctx.graph_init();
@@ -417,19 +545,46 @@ bool llama_kv_cache_unified::update(llama_context & lctx) {
 
             lctx.graph_compute(gf, false);
 
-            need_reserve = true;
+            const auto & ids = defrag_info.ids;
+
+            for (uint32_t i = 0; i < ids.size(); ++i) {
+                if (ids[i] == i || ids[i] == ids.size()) {
+                    continue;
+                }
+
+                // the ring copies of both the source and the destination cell are stale
+                if (n_hot > 0) {
+                    if (hot_cells[i % n_hot] == (int32_t) i) {
+                        hot_cells[i % n_hot] = -1;
+                    }
+                    if (hot_cells[ids[i] % n_hot] == (int32_t) ids[i]) {
+                        hot_cells[ids[i] % n_hot] = -1;
+                    }
+                }
+
+                defrag_perf.n_cells++;
+            }
+
+            defrag_perf.n_steps++;
+            defrag_perf.t_us += ggml_time_us() - t_start_us;
         }
 
-        do_defrag = false;
+        // the incremental defrag continues in the next updates, until there are no holes left
+        do_defrag = moved && n_max_cells > 0 && cells.used_max_p1() > cells.get_used();
     }
 
     return need_reserve;
 }
 
 void llama_kv_cache_unified::defrag_sched(float thold) {
+    // in paged mode the holes are reused one block at a time, so there is nothing to gain from compacting the cache
+    if (block_size > 0) {
+        return;
+    }
+
     // - do not defrag small contexts (i.e. < 2048 tokens)
     // - count the padding towards the number of used tokens
-    const float fragmentation = n >= 2048 ? std::max(0.0f, 1.0f - (float(used + padding)/n)) : 0.0f;
+    const float fragmentation = n >= 2048 ? std::max(0.0f, 1.0f - (float(cells.get_used() + padding)/n)) : 0.0f;
 
     // queue defragmentation for next llama_kv_cache_update
     if (fragmentation > thold) {
@@ -448,6 +603,107 @@ void llama_kv_cache_unified::set_full() {
     //   setting it to 0 is the simplest way to achieve that
     // ref: https://github.com/ggml-org/llama.cpp/issues/13359
     head = 0;
+
+    store_runs.clear();
+    hot_runs.clear();
+    hot_attn_runs.clear();
+}
+
+void llama_kv_cache_unified::evict() {
+    if (n_window == 0) {
+        return;
+    }
+
+    std::vector<std::pair<llama_pos, uint32_t>> seq_cells; // (pos, cell)
+
+    for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+        const uint32_t n_cur = cells.seq_n_cells(seq_id);
+
+        if (n_cur <= n_window) {
+            continue;
+        }
+
+        seq_cells.clear();
+        for (uint32_t i = cells.next_used(0); i < size; i = cells.next_used(i + 1)) {
+            if (cells.seq_has(i, seq_id)) {
+                seq_cells.emplace_back(cells.pos_get(i), i);
+            }
+        }
+
+        GGML_ASSERT(seq_cells.size() == n_cur);
+
+        if (h2o) {
+            // n_window > n_sink, so at least one cell after the sinks is kept
+            const uint32_t n_evict = n_cur - n_window;
+
+            // the candidates are the cells between the sinks and the most recent cells
+            const uint32_t n_recent = std::min(n_window/2, n_cur - n_sink - n_evict);
+
+            // move the sinks to the front and the most recent cells to the back
+            std::nth_element(seq_cells.begin(), seq_cells.begin() + n_sink, seq_cells.end());
+            std::nth_element(seq_cells.begin() + n_sink, seq_cells.end() - n_recent, seq_cells.end());
+
+            std::nth_element(seq_cells.begin() + n_sink, seq_cells.begin() + n_sink + n_evict, seq_cells.end() - n_recent,
+                    [&](const std::pair<llama_pos, uint32_t> & a, const std::pair<llama_pos, uint32_t> & b) {
+                        return cells.score_get(a.second) < cells.score_get(b.second);
+                    });
+
+            for (uint32_t k = n_sink; k < n_sink + n_evict; ++k) {
+                const uint32_t i = seq_cells[k].second;
+
+                if (cells.seq_rm(i, seq_id)) {
+                    head = std::min(head, i);
+                }
+            }
+
+            LLAMA_LOG_DEBUG("%s: seq %d: evicted %u cells with the lowest attention\n", __func__, seq_id, n_evict);
+
+            continue;
+        }
+
+        // like the context shift of the examples, half of the cells after the sinks are discarded at once, so that the kept
+        // cells are moved only once every (n_window - n_sink)/2 tokens - at least one cell after the sinks is kept
+        const uint32_t n_evict = n_cur - n_window + (n_window - n_sink)/2;
+
+        // the cells ordered by position, up to the first one that is kept after the evicted ones
+        std::partial_sort(seq_cells.begin(), seq_cells.begin() + n_sink + n_evict + 1, seq_cells.end());
+
+        for (uint32_t k = n_sink; k < n_sink + n_evict; ++k) {
+            const uint32_t i = seq_cells[k].second;
+
+            if (cells.seq_rm(i, seq_id)) {
+                head = std::min(head, i);
+            }
+        }
+
+        if (n_sink == 0 || !get_can_shift()) {
+            continue;
+        }
+
+        // move the kept cells down, right after the sinks - the sinks keep their positions and are never rotated
+        const llama_pos p0    = seq_cells[n_sink + n_evict].first;
+        const llama_pos delta = p0 - 1 - seq_cells[n_sink - 1].first;
+
+        if (delta <= 0) {
+            continue;
+        }
+
+        // the shared cells are copied first - either all of the kept cells are moved or none of them
+        uint32_t n_cow = 0;
+        for (uint32_t k = n_sink + n_evict; k < n_cur; ++k) {
+            n_cow += cells.seq_count(seq_cells[k].second) > 1;
+        }
+
+        if (n_cow > cell_cow_n_free(seq_id)) {
+            LLAMA_LOG_DEBUG("%s: seq %d: no free cells to copy the shared cells - the kept cells are not moved\n", __func__, seq_id);
+            continue;
+        }
+
+        const bool ok = seq_add(seq_id, p0, -1, -delta);
+        GGML_ASSERT(ok);
+
+        LLAMA_LOG_DEBUG("%s: seq %d: evicted %u cells, kept cells moved by %d\n", __func__, seq_id, n_evict, -delta);
+    }
 }
 
 llama_sbatch llama_kv_cache_unified::sbatch_init(
@@ -466,13 +722,136 @@ llama_ubatch llama_kv_cache_unified::ubatch_next(
 
 bool llama_kv_cache_unified::find_slot(
        const llama_ubatch & ubatch) {
+    bool res = false;
+
+    if (block_size > 0) {
+        res = find_slot_paged(ubatch);
+    }
+
+    // fallback to a contiguous slot if the ubatch is scattered over too many blocks
+    if (!res) {
+        res = find_slot_cont(ubatch);
+        if (res && block_size > 0) {
+            for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+                block_tables_add(ubatch.seq_id[s][0], head + s*ubatch.n_seq_tokens, head + (s + 1)*ubatch.n_seq_tokens);
+            }
+        }
+    }
+
+    if (!res) {
+        return false;
+    }
+
+    // a heuristic, to avoid attending the full cache if it is not yet utilized
+    // after enough generations, the benefit from this heuristic disappears
+    // if we start defragmenting the cache, the benefit from this will be more important
+    n = std::min(size, std::max(padding, GGML_PAD(cells.used_max_p1(), padding)));
+
+    //printf("n = %5d, used = %5d, head = %5d\n", n, cells.get_used(), head);
+
+    hot_update();
+
+    return true;
+}
+
+const std::vector<llama_kv_cache_unified::store_run> & llama_kv_cache_unified::get_store_runs() const {
+    return store_runs;
+}
+
+const std::vector<llama_kv_cache_unified::store_run> & llama_kv_cache_unified::get_hot_runs() const {
+    return hot_runs;
+}
+
+const std::vector<llama_kv_cache_unified::store_run> & llama_kv_cache_unified::get_hot_attn_runs() const {
+    return hot_attn_runs;
+}
+
+uint32_t llama_kv_cache_unified::get_n_hot() const {
+    return n_hot;
+}
+
+bool llama_kv_cache_unified::get_h2o() const {
+    return h2o;
+}
+
+void llama_kv_cache_unified::score_add(const std::vector<float> & score) {
+    GGML_ASSERT(score.size() <= size);
+
+    for (uint32_t i = 0; i < score.size(); ++i) {
+        if (!cells.is_empty(i)) {
+            cells.score_add(i, score[i]);
+        }
+    }
+}
+
+void llama_kv_cache_unified::hot_update() {
+    hot_runs.clear();
+    hot_attn_runs.clear();
+
+    if (n_hot == 0) {
+        return;
+    }
+
+    // when several tokens of the ubatch map to the same slot, only the last one is stored in it
+    std::vector<int32_t> slot_token(n_hot, -1);
+
+    for (const auto & run : store_runs) {
+        for (uint32_t k = 0; k < run.n; ++k) {
+            const uint32_t c = run.c0 + k;
+
+            slot_token[c % n_hot] = run.i0 + k;
+            hot_cells [c % n_hot] = c;
+        }
+    }
+
+    for (const auto & run : store_runs) {
+        for (uint32_t k = 0; k < run.n; ++k) {
+            const uint32_t i = run.i0 + k;
+            const uint32_t s = (run.c0 + k) % n_hot;
+
+            if (slot_token[s] != (int32_t) i) {
+                continue;
+            }
+
+            if (!hot_runs.empty() && hot_runs.back().i0 + hot_runs.back().n == i && hot_runs.back().c0 + hot_runs.back().n == s) {
+                hot_runs.back().n++;
+            } else {
+                hot_runs.push_back({ i, s, 1 });
+            }
+        }
+    }
+
+    // each run adds a few nodes per layer to the graph - the cells of the runs past the limit use the quantized cache
+    const uint32_t n_runs_max = std::max(1u, 512u/hparams.n_layer);
+
+    for (uint32_t s = 0; s < n_hot; ++s) {
+        const int32_t i = hot_cells[s];
+
+        if (i < 0 || (uint32_t) i >= n) {
+            continue;
+        }
+
+        if (!hot_attn_runs.empty() && hot_attn_runs.back().i0 + hot_attn_runs.back().n == (uint32_t) i && hot_attn_runs.back().c0 + hot_attn_runs.back().n == s) {
+            hot_attn_runs.back().n++;
+        } else if (hot_attn_runs.size() < n_runs_max) {
+            hot_attn_runs.push_back({ (uint32_t) i, s, 1 });
+        }
+    }
+}
+
+void llama_kv_cache_unified::hot_clear() {
+    std::fill(hot_cells.begin(), hot_cells.end(), -1);
+}
+
+bool llama_kv_cache_unified::find_slot_cont(
+       const llama_ubatch & ubatch) {
     const uint32_t n_tokens = ubatch.n_tokens;
     const uint32_t n_seqs   = ubatch.n_seqs;
     const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
 
     // if we have enough unused cells before the current head ->
     //   better to start searching from the beginning of the cache, hoping to fill it
-    if (head > used + 2*ubatch.n_tokens) {
+    if (head > cells.get_used() + 2*ubatch.n_tokens) {
         head = 0;
     }
 
@@ -492,20 +871,15 @@ bool llama_kv_cache_unified::find_slot(
             continue;
         }
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cells[head + i].pos >= 0) {
-                found = false;
-                head     += i + 1;
-                n_tested += i + 1;
-                break;
-            }
-        }
-
-        if (found) {
+        // the cells [head, next_used(head)) are free
+        const uint32_t i = cells.next_used(head) - head;
+        if (i >= n_tokens) {
             break;
         }
 
+        head     += i + 1;
+        n_tested += i + 1;
+
         if (n_tested >= size) {
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return false;
@@ -515,40 +889,278 @@ bool llama_kv_cache_unified::find_slot(
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
-            cells[head + k].pos = ubatch.pos[k];
+            cells.pos_set(head + k, ubatch.pos[k]);
 
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
-                cells[head + k].seq_id.insert(ubatch.seq_id[s][j]);
+                cells.seq_add(head + k, ubatch.seq_id[s][j]);
             }
         }
     }
 
-    used += n_tokens;
-
     pending.ranges.push_back({head, head + n_tokens});
 
-    // a heuristic, to avoid attending the full cache if it is not yet utilized
-    // after enough generations, the benefit from this heuristic disappears
-    // if we start defragmenting the cache, the benefit from this will be more important
-    n = std::min(size, std::max(padding, GGML_PAD(cell_max(), padding)));
+    store_runs.clear();
+    store_runs.push_back({0, head, n_tokens});
+
+    return true;
+}
+
+bool llama_kv_cache_unified::find_slot_paged(
+       const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    if (cells.get_used() + n_tokens > size) {
+        return false;
+    }
+
+    // each store run adds a few nodes per layer to the graph, so limit the number of runs
+    const uint32_t n_runs_max = std::max(1u, 2048u/hparams.n_layer);
+
+    store_runs.clear();
+
+    bool ok = true;
+
+    for (uint32_t s = 0; s < n_seqs && ok; s++) {
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            const int32_t c = block_find_cell(ubatch.seq_id[s][0]);
+            if (c < 0) {
+                ok = false;
+                break;
+            }
+
+            if (!store_runs.empty() && store_runs.back().c0 + store_runs.back().n == (uint32_t) c) {
+                store_runs.back().n++;
+            } else {
+                store_runs.push_back({k, (uint32_t) c, 1});
+            }
+
+            cells.pos_set(c, ubatch.pos[k]);
+
+            for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
+                cells.seq_add(c, ubatch.seq_id[s][j]);
+            }
+
+            if (store_runs.size() > n_runs_max) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    if (!ok) {
+        // undo the cells assigned so far
+        for (const auto & run : store_runs) {
+            for (uint32_t c = run.c0; c < run.c0 + run.n; ++c) {
+                cells.rm(c);
+            }
+        }
+
+        store_runs.clear();
+
+        return false;
+    }
+
+    for (const auto & run : store_runs) {
+        pending.ranges.push_back({run.c0, run.c0 + run.n});
+    }
 
-    //printf("n = %5d, used = %5d, head = %5d\n", n, used, head);
+    head = store_runs[0].c0;
 
     return true;
 }
 
-int32_t llama_kv_cache_unified::get_n_tokens() const {
-    int32_t result = 0;
+int32_t llama_kv_cache_unified::block_find_cell(llama_seq_id seq_id) {
+    block_table & table = block_tables[seq_id];
 
-    for (uint32_t i = 0; i < size; i++) {
-        result += cells[i].seq_id.size();
+    if (table.last >= 0) {
+        const uint32_t c1 = (table.last + 1)*block_size;
+
+        while (table.tail < c1) {
+            const uint32_t i = table.tail++;
+
+            if (cells.is_empty(i)) {
+                return i;
+            }
+        }
     }
 
-    return result;
+    // allocate an empty block
+    const int32_t ib = cells.block_pop_free();
+    if (ib < 0) {
+        return -1;
+    }
+
+    // the block may still be in the table of its previous owner
+    block_unlink(ib);
+    block_link(seq_id, ib);
+
+    table.tail = ib*block_size + 1;
+
+    return ib*block_size;
+}
+
+void llama_kv_cache_unified::block_link(llama_seq_id seq_id, uint32_t ib) {
+    block_table & table = block_tables[seq_id];
+
+    block_owner[ib] = seq_id;
+    block_prev [ib] = table.last;
+    block_next [ib] = -1;
+
+    if (table.last >= 0) {
+        block_next[table.last] = ib;
+    } else {
+        table.first = ib;
+    }
+
+    table.last = ib;
+    table.tail = ib*block_size;
+}
+
+void llama_kv_cache_unified::block_unlink(uint32_t ib) {
+    const llama_seq_id owner = block_owner[ib];
+    if (owner < 0) {
+        return;
+    }
+
+    block_table & table = block_tables[owner];
+
+    const int32_t prev = block_prev[ib];
+    const int32_t next = block_next[ib];
+
+    if (prev >= 0) {
+        block_next[prev] = next;
+    } else {
+        table.first = next;
+    }
+
+    if (next >= 0) {
+        block_prev[next] = prev;
+    } else {
+        // the cells before the cursor of the new last block are not reused
+        table.last = prev;
+        table.tail = (prev + 1)*block_size;
+    }
+
+    block_owner[ib] = -1;
+    block_prev [ib] = -1;
+    block_next [ib] = -1;
+}
+
+void llama_kv_cache_unified::block_tables_add(llama_seq_id seq_id, uint32_t c0, uint32_t c1) {
+    if (block_size == 0 || c0 >= c1) {
+        return;
+    }
+
+    for (uint32_t ib = c0/block_size; ib <= (c1 - 1)/block_size; ++ib) {
+        if (block_owner[ib] == seq_id) {
+            continue;
+        }
+
+        block_unlink(ib);
+        block_link(seq_id, ib);
+    }
+}
+
+void llama_kv_cache_unified::block_tables_rm(llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        block_tables_clear();
+        return;
+    }
+
+    block_table & table = block_tables[seq_id];
+
+    for (int32_t ib = table.first; ib >= 0; ) {
+        const int32_t next = block_next[ib];
+
+        block_owner[ib] = -1;
+        block_prev [ib] = -1;
+        block_next [ib] = -1;
+
+        ib = next;
+    }
+
+    table = {};
+}
+
+void llama_kv_cache_unified::block_tables_clear() {
+    for (auto & table : block_tables) {
+        table = {};
+    }
+
+    std::fill(block_owner.begin(), block_owner.end(), -1);
+    std::fill(block_prev .begin(), block_prev .end(), -1);
+    std::fill(block_next .begin(), block_next .end(), -1);
+}
+
+int32_t llama_kv_cache_unified::cell_cow(uint32_t i, llama_seq_id seq_id) {
+    int32_t j = -1;
+
+    if (block_size > 0) {
+        j = block_find_cell(seq_id);
+    } else {
+        for (uint32_t k = 0; k < size; ++k) {
+            const uint32_t c = (head + k) % size;
+            if (cells.is_empty(c)) {
+                j = c;
+                break;
+            }
+        }
+    }
+
+    if (j < 0) {
+        return -1;
+    }
+
+    cells.seq_mv(i, j, seq_id);
+
+    // the data of the cell is copied only in the main cache
+    if (n_hot > 0 && hot_cells[j % n_hot] == j) {
+        hot_cells[j % n_hot] = -1;
+    }
+
+    cow_info.ids.emplace_back(i, j);
+
+    return j;
+}
+
+uint32_t llama_kv_cache_unified::cell_cow_n_free(llama_seq_id seq_id) const {
+    if (block_size == 0) {
+        return size - cells.get_used();
+    }
+
+    // the empty blocks and the free cells after the cursor of the last block of the sequence
+    uint32_t n_free = cells.get_n_blocks_free()*block_size;
+
+    const block_table & table = block_tables[seq_id];
+
+    // an empty last block is already counted
+    if (table.last >= 0 && cells.get_block_used(table.last) > 0) {
+        for (uint32_t i = table.tail; i < (table.last + 1)*block_size; ++i) {
+            n_free += cells.is_empty(i);
+        }
+    }
+
+    return n_free;
+}
+
+const llama_kv_cache_unified::defrag_perf_data & llama_kv_cache_unified::get_defrag_perf() const {
+    return defrag_perf;
+}
+
+void llama_kv_cache_unified::reset_defrag_perf() {
+    defrag_perf = {};
+}
+
+int32_t llama_kv_cache_unified::get_n_tokens() const {
+    return cells.get_n_seq_cells();
 }
 
 int32_t llama_kv_cache_unified::get_used_cells() const {
-    return used;
+    return cells.get_used();
 }
 
 bool llama_kv_cache_unified::get_can_shift() const {
@@ -556,12 +1168,7 @@ bool llama_kv_cache_unified::get_can_shift() const {
 }
 
 llama_pos llama_kv_cache_unified::get_pos_max() const {
-    llama_pos pos_max = -1;
-    for (const auto & cell : cells) {
-        pos_max = std::max(pos_max, cell.pos);
-    }
-
-    return pos_max;
+    return cells.pos_max();
 }
 
 size_t llama_kv_cache_unified::total_size() const {
@@ -580,6 +1187,10 @@ size_t llama_kv_cache_unified::size_k_bytes() const {
         size_k_bytes += ggml_nbytes(k);
     }
 
+    for (const auto & k : k_hot_l) {
+        size_k_bytes += ggml_nbytes(k);
+    }
+
     return size_k_bytes;
 }
 
@@ -637,14 +1248,16 @@ ggml_tensor * llama_kv_cache_unified::build_rope_shift(
 
 class llm_graph_input_k_shift : public llm_graph_input_i {
 public:
-    llm_graph_input_k_shift(const llama_kv_cache_unified * kv_self) : kv_self(kv_self) {}
+    llm_graph_input_k_shift(const llama_kv_cache_unified * kv_self, uint32_t c0) : kv_self(kv_self), c0(c0) {}
     virtual ~llm_graph_input_k_shift() = default;
 
     void set_input(const llama_ubatch * ubatch) override;
 
-    ggml_tensor * k_shift; // I32 [kv_size]
+    ggml_tensor * k_shift; // I32 [c1 - c0]
 
     const llama_kv_cache_unified * kv_self;
+
+    const uint32_t c0;
 };
 
 void llm_graph_input_k_shift::set_input(const llama_ubatch * ubatch) {
@@ -655,8 +1268,8 @@ void llm_graph_input_k_shift::set_input(const llama_ubatch * ubatch) {
 
         int32_t * data = (int32_t *) k_shift->data;
 
-        for (uint32_t i = 0; i < kv_self->size; ++i) {
-            data[i] = kv_self->cells[i].delta;
+        for (int64_t i = 0; i < ggml_nelements(k_shift); ++i) {
+            data[i] = kv_self->cells.get_shift(c0 + i);
         }
     }
 }
@@ -664,7 +1277,9 @@ void llm_graph_input_k_shift::set_input(const llama_ubatch * ubatch) {
 llm_graph_result_ptr llama_kv_cache_unified::build_graph_shift(
         const llama_cparams & cparams,
                ggml_context * ctx,
-                ggml_cgraph * gf) const {
+                ggml_cgraph * gf,
+                   uint32_t   c0,
+                   uint32_t   c1) const {
     auto res = std::make_unique<llm_graph_result>();
 
     const auto & n_layer = hparams.n_layer;
@@ -676,9 +1291,9 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_shift(
 
     //GGML_ASSERT(kv_self->size == n_ctx);
 
-    auto inp = std::make_unique<llm_graph_input_k_shift>(this);
+    auto inp = std::make_unique<llm_graph_input_k_shift>(this, c0);
 
-    inp->k_shift = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, cparams.n_ctx);
+    inp->k_shift = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, c1 - c0);
     ggml_set_input(inp->k_shift);
 
     for (uint32_t il = 0; il < n_layer; ++il) {
@@ -696,10 +1311,10 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_shift(
 
         ggml_tensor * k =
             ggml_view_3d(ctx, k_l[il],
-                n_embd_head_k, n_head_kv, size,
+                n_embd_head_k, n_head_kv, c1 - c0,
                 ggml_row_size(k_l[il]->type, n_embd_head_k),
                 ggml_row_size(k_l[il]->type, n_embd_k_gqa),
-                0);
+                ggml_row_size(k_l[il]->type, n_embd_k_gqa)*c0);
 
         ggml_tensor * cur = build_rope_shift(cparams, ctx, k, inp->k_shift, rope_factors, freq_base_l, freq_scale_l);
 
@@ -856,11 +1471,83 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_defrag(
     return res;
 }
 
+llm_graph_result_ptr llama_kv_cache_unified::build_graph_cow(
+        const llama_cparams & cparams,
+               ggml_context * ctx,
+                ggml_cgraph * gf,
+                     uint32_t   i0,
+                     uint32_t   i1) const {
+    GGML_UNUSED(cparams);
+
+    auto res = std::make_unique<llm_graph_result>();
+
+    const auto & ids = cow_info.ids;
+
+    for (uint32_t i = i0; i < i1; ++i) {
+        const uint32_t src = ids[i].first;
+        const uint32_t dst = ids[i].second;
+
+        // copy runs of consecutive cells at once
+        uint32_t nm = 1;
+
+        while (i + nm < i1 && ids[i + nm].first == src + nm && ids[i + nm].second == dst + nm) {
+            nm++;
+        }
+
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) { // NOLINT
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * view_k_src = ggml_view_2d(ctx, k_l[il],
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(k_l[il]->type, n_embd_k_gqa*src));
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx, k_l[il],
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(k_l[il]->type, n_embd_k_gqa*dst));
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (!v_trans) {
+                view_v_src = ggml_view_2d(ctx, v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(v_l[il]->type, n_embd_v_gqa*src));
+
+                view_v_dst = ggml_view_2d(ctx, v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(v_l[il]->type, n_embd_v_gqa*dst));
+            } else {
+                view_v_src = ggml_view_2d(ctx, v_l[il],
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(v_l[il]->type, size),
+                        ggml_row_size(v_l[il]->type, src));
+
+                view_v_dst = ggml_view_2d(ctx, v_l[il],
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(v_l[il]->type, size),
+                        ggml_row_size(v_l[il]->type, dst));
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+        }
+
+        i += nm - 1;
+    }
+
+    return res;
+}
+
 bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     const uint32_t n_layer = hparams.n_layer;
 
-    const uint32_t n_kv   = cell_max();
-    const uint32_t n_used = used;
+    const uint32_t n_kv   = cells.used_max_p1();
+    const uint32_t n_used = cells.get_used();
 
     assert(n_used <= n_kv);
 
@@ -888,9 +1575,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     ids.resize(n_kv, n_kv);
 
     for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = cells[i0];
-
-        if (!cell0.is_empty()) {
+        if (!cells.is_empty(i0)) {
             ids[i0] = i0;
 
             continue;
@@ -901,7 +1586,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && cells.is_empty(i0 + nh)) {
             nh++;
         }
 
@@ -910,9 +1595,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = cells[is];
-
-            if (cell1.is_empty() || ids[is] != n_kv) {
+            if (cells.is_empty(is) || ids[is] != n_kv) {
                 continue;
             }
 
@@ -939,9 +1622,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
 
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = cells[i1];
-
-            if (cell1.is_empty() || ids[i1] != n_kv) {
+            if (cells.is_empty(i1) || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
                     stop = true;
                     break;
@@ -954,11 +1635,10 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
 
-            // move the cell meta data
-            cells[i0 + nf] = cell1;
+            // move the cell meta data and clear the old cell
+            cells.mv(i1, i0 + nf);
 
-            // clear the old cell and move the head there
-            cell1 = kv_cell();
+            // move the head there
             head = n_used;
 
             if (!cont) {
@@ -986,6 +1666,9 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         return false;
     }
 
+    // the cells have moved between blocks
+    block_tables_clear();
+
     LLAMA_LOG_DEBUG("%s: (tmp log) KV defrag cell moves: %u\n", __func__, n_moves);
 
     LLAMA_LOG_DEBUG("%s: expected gf nodes: %u\n", __func__, 6*n_moves*n_layer);
@@ -993,16 +1676,166 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     return true;
 }
 
-uint32_t llama_kv_cache_unified::cell_max() const {
-    for (uint32_t i = size; i > 0; --i) {
-        const kv_cell & cell = cells[i - 1];
+bool llama_kv_cache_unified::defrag_prepare_step(int32_t n_max_nodes, uint32_t n_max_cells) {
+    const uint32_t n_layer = hparams.n_layer;
 
-        if (cell.pos >= 0 && !cell.is_empty()) {
-            return i;
+    const uint32_t n_kv = cells.used_max_p1();
+
+    // each move requires 6*n_layer tensors (see defrag_prepare)
+    const uint32_t max_moves = (n_max_nodes - 2*n_layer)/(6*n_layer);
+
+    // the runs of used cells in [0, n_kv) and of free cells in [0, size)
+    struct run {
+        uint32_t i0;
+        uint32_t i1;
+    };
+
+    std::vector<run> used_runs;
+    std::vector<run> free_runs;
+
+    for (uint32_t i = 0; i < n_kv; ) {
+        const uint32_t i0 = i;
+
+        if (cells.is_empty(i)) {
+            i = cells.next_used(i);
+            free_runs.push_back({ i0, i });
+        } else {
+            while (i < n_kv && !cells.is_empty(i)) {
+                i++;
+            }
+            used_runs.push_back({ i0, i });
         }
     }
 
-    return 0;
+    if (free_runs.empty()) {
+        return false;
+    }
+
+    // the free run at the end of the cache is never a destination, but the last used run merges into it
+    free_runs.push_back({ n_kv, size });
+
+    // the free runs before and after each used run (-1 if none)
+    std::vector<int32_t> free_prev(used_runs.size(), -1);
+    std::vector<int32_t> free_next(used_runs.size(), -1);
+
+    for (uint32_t k = 0, f = 0; k < used_runs.size(); ++k) {
+        while (f < free_runs.size() && free_runs[f].i1 <= used_runs[k].i0) {
+            f++;
+        }
+        free_prev[k] = f > 0 && free_runs[f - 1].i1 == used_runs[k].i0 ? f - 1 : -1;
+        free_next[k] = f < free_runs.size() && free_runs[f].i0 == used_runs[k].i1 ? f : -1;
+    }
+
+    const auto run_len = [&](int32_t f) -> uint32_t {
+        return f < 0 ? 0 : free_runs[f].i1 - free_runs[f].i0;
+    };
+
+    // moving the cells of a used run out of the way merges the free runs around it into a single run
+    // prefer the used runs that create the largest free run per moved cell - the last run merges with the free cells
+    // at the end of the cache, which also reduces the number of cells that the attention has to visit
+    std::vector<uint32_t> order(used_runs.size());
+    std::vector<float>    score(used_runs.size());
+
+    for (uint32_t k = 0; k < used_runs.size(); ++k) {
+        const uint32_t len = used_runs[k].i1 - used_runs[k].i0;
+
+        order[k] = k;
+        score[k] = float(run_len(free_prev[k]) + len + run_len(free_next[k]))/len;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return score[a] > score[b] || (score[a] == score[b] && a > b);
+    });
+
+    // the destination free runs are filled from the start of the cache
+    std::vector<uint32_t> filled(free_runs.size(), 0);
+    std::vector<bool>     merged(free_runs.size(), false);
+
+    merged.back() = true;
+
+    auto & ids = defrag_info.ids;
+
+    ids.clear();
+    ids.resize(n_kv, n_kv);
+
+    uint32_t n_moves = 0;
+    uint32_t n_cells = 0;
+
+    // the first free run that is not full
+    uint32_t f_first = 0;
+
+    for (const uint32_t k : order) {
+        if (n_cells == n_max_cells || n_moves == max_moves) {
+            break;
+        }
+
+        // note: a used run is always followed by a free run, possibly the empty one at the end of the cache
+        const int32_t fp = free_prev[k];
+        const int32_t fn = free_next[k];
+
+        // move the cells on the side of the larger free run, which is then merged with the cells left free
+        const bool    right = fn == (int32_t) free_runs.size() - 1 || run_len(fn) >= run_len(fp);
+        const int32_t fm    = right ? fn : fp;
+
+        // the free run has already received cells
+        if (filled[fm] > 0) {
+            continue;
+        }
+
+        merged[fm] = true;
+
+        const uint32_t len = used_runs[k].i1 - used_runs[k].i0;
+        const uint32_t n   = std::min(len, n_max_cells - n_cells);
+        const uint32_t s0  = right ? used_runs[k].i1 - n : used_runs[k].i0;
+
+        // the cells only move to a lower index, so the steps always terminate
+        uint32_t m = 0;
+
+        while (f_first < free_runs.size() && filled[f_first] == run_len(f_first)) {
+            f_first++;
+        }
+
+        for (uint32_t f = f_first; f < free_runs.size() && m < n && n_moves < max_moves; ++f) {
+            if (merged[f] || filled[f] == run_len(f)) {
+                continue;
+            }
+
+            const uint32_t d0 = free_runs[f].i0 + filled[f];
+            if (d0 >= s0 + m) {
+                break;
+            }
+
+            const uint32_t nm = std::min(n - m, run_len(f) - filled[f]);
+
+            for (uint32_t j = 0; j < nm; ++j) {
+                ids[s0 + m + j] = d0 + j;
+            }
+
+            filled[f] += nm;
+            m         += nm;
+
+            n_moves++;
+        }
+
+        n_cells += m;
+    }
+
+    if (n_cells == 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_kv; ++i) {
+        if (ids[i] != n_kv) {
+            cells.mv(i, ids[i]);
+        }
+    }
+
+    // the cells have moved between blocks
+    block_tables_clear();
+
+    LLAMA_LOG_DEBUG("%s: moved %u cells in %u moves, %u holes left\n", __func__, n_cells, n_moves, cells.used_max_p1() - cells.get_used());
+
+    return true;
 }
 
 void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
@@ -1013,8 +1846,7 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
     // Find all the ranges of cells with this seq id (or all, when -1)
     uint32_t cell_range_begin = size;
     for (uint32_t i = 0; i < size; ++i) {
-        const auto & cell = cells[i];
-        if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+        if (seq_id == -1 ? !cells.is_empty(i) : cells.seq_has(i, seq_id)) {
             ++cell_count;
             if (cell_range_begin == size) {
                 cell_range_begin = i;
@@ -1047,6 +1879,9 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
+    // the restored cells are not copied to the hot cache
+    hot_clear();
+
     bool res = true;
     res = res && state_read_meta(io, cell_count, seq_id);
     res = res && state_read_data(io, cell_count);
@@ -1064,16 +1899,17 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id) const {
     for (const auto & range : cell_ranges) {
         for (uint32_t i = range.first; i < range.second; ++i) {
-            const auto & cell = cells[i];
-            const llama_pos pos      = cell.pos;
-            const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+            const llama_pos pos      = cells.pos_get(i);
+            const uint32_t  n_seq_id = seq_id == -1 ? cells.seq_count(i) : 0;
 
             io.write(&pos,      sizeof(pos));
             io.write(&n_seq_id, sizeof(n_seq_id));
 
             if (n_seq_id) {
-                for (auto seq_id : cell.seq_id) {
-                    io.write(&seq_id, sizeof(seq_id));
+                for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+                    if (cells.seq_has(i, s)) {
+                        io.write(&s, sizeof(s));
+                    }
                 }
             }
         }
@@ -1189,19 +2025,21 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         }
         batch.n_seq_id[0] = 1;
         batch.seq_id[0] = &dest_seq_id;
-        if (!find_slot(batch)) {
+        if (!find_slot_cont(batch)) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
         }
         commit();
 
+        block_tables_add(dest_seq_id, head, head + cell_count);
+
         // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
         // Assume that this is one contiguous block of cells
         GGML_ASSERT(head + cell_count <= size);
-        GGML_ASSERT(cells[head].pos == batch.pos[0]);
-        GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
-        GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        GGML_ASSERT(cells.pos_get(head) == batch.pos[0]);
+        GGML_ASSERT(cells.pos_get(head + cell_count - 1) == batch.pos[cell_count - 1]);
+        GGML_ASSERT(cells.seq_has(head, dest_seq_id));
+        GGML_ASSERT(cells.seq_has(head + cell_count - 1, dest_seq_id));
     } else {
         // whole KV cache restore
 
@@ -1213,34 +2051,35 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         clear();
 
         for (uint32_t i = 0; i < cell_count; ++i) {
-            kv_cell & cell = cells[i];
-
             llama_pos pos;
             uint32_t  n_seq_id;
 
             io.read_to(&pos,      sizeof(pos));
             io.read_to(&n_seq_id, sizeof(n_seq_id));
 
-            cell.pos = pos;
+            if (pos < 0 || n_seq_id == 0) {
+                LLAMA_LOG_ERROR("%s: invalid kv cell, pos = %d, n_seq_id = %u\n", __func__, pos, n_seq_id);
+                return false;
+            }
+
+            cells.pos_set(i, pos);
 
             for (uint32_t j = 0; j < n_seq_id; ++j) {
                 llama_seq_id seq_id;
                 io.read_to(&seq_id, sizeof(seq_id));
 
-                // TODO: llama_kv_cache_unified should have a notion of max sequences
-                //if (seq_id < 0 || (uint32_t) seq_id >= llama_n_seq_max(ctx)) {
-                if (seq_id < 0) {
-                    //LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %u)\n", __func__, seq_id, llama_n_seq_max(ctx));
-                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, inf)\n", __func__, seq_id);
+                if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id, %d is out of range [0, %d)\n", __func__, seq_id, LLAMA_MAX_SEQ);
                     return false;
                 }
 
-                cell.seq_id.insert(seq_id);
+                if (!cells.seq_has(i, seq_id)) {
+                    cells.seq_add(i, seq_id);
+                }
             }
         }
 
         head = 0;
-        used = cell_count;
     }
 
     return true;
@@ -1373,11 +2212,12 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
                 ggml_type   type_k,
                 ggml_type   type_v,
                      bool   offload,
-                 uint32_t   kv_size) : hparams(model.hparams) {
+                 uint32_t   kv_size,
+                 uint32_t   n_ckpt) : hparams(model.hparams), n_ckpt(n_ckpt) {
     const int32_t n_layer = hparams.n_layer;
 
-    LLAMA_LOG_INFO("%s: kv_size = %d, type_k = '%s', type_v = '%s', n_layer = %d\n",
-            __func__, kv_size, ggml_type_name(type_k), ggml_type_name(type_v), n_layer);
+    LLAMA_LOG_INFO("%s: kv_size = %d, type_k = '%s', type_v = '%s', n_layer = %d, n_ckpt = %u\n",
+            __func__, kv_size, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, n_ckpt);
 
     head = 0;
     size = kv_size;
@@ -1389,6 +2229,8 @@ llama_kv_cache_recurrent::llama_kv_cache_recurrent(
     cells.clear();
     cells.resize(kv_size);
 
+    ckpts.resize(kv_size);
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -1482,6 +2324,10 @@ void llama_kv_cache_recurrent::clear() {
     head = 0;
     used = 0;
 
+    for (auto & cs : ckpts) {
+        cs.clear();
+    }
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -1507,6 +2353,48 @@ bool llama_kv_cache_recurrent::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_p
         int32_t & tail_id = cells[seq_id].tail;
         if (tail_id >= 0) {
             const kv_cell & cell = cells[tail_id];
+            // removing the end of the sequence - roll back to the last checkpoint before p0
+            if (0 < p0 && p0 <= cell.pos && cell.pos < p1) {
+                auto & cs = ckpts[seq_id];
+
+                auto it = std::lower_bound(cs.begin(), cs.end(), p0,
+                        [](const kv_ckpt & c, llama_pos p) { return c.pos < p; });
+                if (it == cs.begin()) {
+                    return false;
+                }
+
+                const kv_ckpt ckpt = *(it - 1);
+
+                if (cell.seq_id.size() > 1) {
+                    // the cell is shared with other sequences - move the sequence to an empty cell
+                    uint32_t cell_id = size;
+                    for (uint32_t i = 0; i < size; ++i) {
+                        if (cells[i].is_empty()) {
+                            cell_id = i;
+                            break;
+                        }
+                    }
+                    if (cell_id == size) {
+                        return false;
+                    }
+
+                    cells[tail_id].seq_id.erase(seq_id);
+                    cells[cell_id].seq_id.insert(seq_id);
+                    tail_id = cell_id;
+                    used += 1;
+                }
+
+                kv_cell & cell_rb = cells[tail_id];
+
+                ckpt_load(tail_id, *ckpt.data);
+
+                cell_rb.pos = ckpt.pos;
+                cell_rb.src = tail_id;
+
+                cs.erase(it, cs.end());
+
+                return true;
+            }
             // partial intersection is invalid
             if ((0 < p0 && p0 <= cell.pos) || (0 < p1 && p1 <= cell.pos)) {
                 return false;
@@ -1516,11 +2404,21 @@ bool llama_kv_cache_recurrent::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_p
                 tail_id = -1;
             }
         }
+
+        auto & cs = ckpts[seq_id];
+        cs.erase(std::remove_if(cs.begin(), cs.end(),
+                    [&](const kv_ckpt & c) { return p0 <= c.pos && c.pos < p1; }), cs.end());
     } else {
         // seq_id is negative, then the range should include everything or nothing
         if (p0 != p1 && (p0 != 0 || p1 != std::numeric_limits<llama_pos>::max())) {
             return false;
         }
+
+        if (p0 != p1) {
+            for (auto & cs : ckpts) {
+                cs.clear();
+            }
+        }
     }
 
     for (uint32_t i = 0; i < size; ++i) {
@@ -1588,6 +2486,9 @@ void llama_kv_cache_recurrent::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_
             cell_src.seq_id.insert(seq_id_dst);
             tail_dst.tail = tail_src.tail;
         }
+
+        // the checkpoint data is shared
+        ckpts[seq_id_dst] = ckpts[seq_id_src];
     }
 }
 
@@ -1597,6 +2498,7 @@ void llama_kv_cache_recurrent::seq_keep(llama_seq_id seq_id) {
     for (uint32_t i = 0; i < size; ++i) {
         if ((llama_seq_id) i != seq_id) {
             cells[i].tail = -1;
+            ckpts[i].clear();
         }
 
         if (!cells[i].has_seq_id(seq_id)) {
@@ -1623,9 +2525,9 @@ void llama_kv_cache_recurrent::seq_keep(llama_seq_id seq_id) {
     }
 }
 
-void llama_kv_cache_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+bool llama_kv_cache_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
     if (delta == 0) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -1638,7 +2540,7 @@ void llama_kv_cache_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_
 
     // If there is no range then return early to avoid looping over the
     if (p0 == p1) {
-        return;
+        return true;
     }
 
     // for Mamba-like or RWKV models, only the pos needs to be shifted
@@ -1650,12 +2552,23 @@ void llama_kv_cache_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_
                 cell.pos += delta;
             }
         }
+
+        auto & cs = ckpts[seq_id];
+        for (auto & c : cs) {
+            if (p0 <= c.pos && c.pos < p1) {
+                c.pos += delta;
+            }
+        }
+        cs.erase(std::remove_if(cs.begin(), cs.end(), [](const kv_ckpt & c) { return c.pos < 0; }), cs.end());
+        std::stable_sort(cs.begin(), cs.end(), [](const kv_ckpt & a, const kv_ckpt & b) { return a.pos < b.pos; });
     }
+
+    return true;
 }
 
-void llama_kv_cache_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+bool llama_kv_cache_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
     if (d == 1) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -1668,7 +2581,7 @@ void llama_kv_cache_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_
 
     // If there is no range then return early to avoid looping over the cache.
     if (p0 == p1) {
-        return;
+        return true;
     }
 
     // for Mamba-like or RWKV models, only the pos needs to be changed
@@ -1680,7 +2593,29 @@ void llama_kv_cache_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_
                 cell.pos /= d;
             }
         }
+
+        auto & cs = ckpts[seq_id];
+        for (auto & c : cs) {
+            if (p0 <= c.pos && c.pos < p1) {
+                c.pos /= d;
+            }
+        }
+        std::stable_sort(cs.begin(), cs.end(), [](const kv_ckpt & a, const kv_ckpt & b) { return a.pos < b.pos; });
+    }
+
+    return true;
+}
+
+llama_pos llama_kv_cache_recurrent::seq_pos_min(llama_seq_id seq_id) const {
+    llama_pos result = -1;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (cells[i].has_seq_id(seq_id) && (result < 0 || cells[i].pos < result)) {
+            result = cells[i].pos;
+        }
     }
+
+    return result;
 }
 
 llama_pos llama_kv_cache_recurrent::seq_pos_max(llama_seq_id seq_id) const {
@@ -1695,6 +2630,11 @@ llama_pos llama_kv_cache_recurrent::seq_pos_max(llama_seq_id seq_id) const {
     return result;
 }
 
+bool llama_kv_cache_recurrent::seq_has_holes(llama_seq_id /*seq_id*/) const {
+    // the state of a sequence covers all of its positions
+    return false;
+}
+
 void llama_kv_cache_recurrent::restore() {
     if (pending.ranges.empty()) {
         return;
@@ -1708,15 +2648,98 @@ void llama_kv_cache_recurrent::commit() {
 }
 
 bool llama_kv_cache_recurrent::update(llama_context & lctx) {
-    GGML_UNUSED(lctx);
+    if (n_ckpt == 0) {
+        return false;
+    }
+
+    // the cells with a due checkpoint - only the states that were computed in place are up to date
+    std::vector<uint32_t> due;
+
+    for (uint32_t s = 0; s < size; ++s) {
+        const int32_t tail_id = cells[s].tail;
+        if (tail_id < 0 || cells[tail_id].src != tail_id) {
+            continue;
+        }
+
+        const llama_pos pos_last = ckpts[s].empty() ? -1 : ckpts[s].back().pos;
+
+        if (cells[tail_id].pos - pos_last >= (llama_pos) n_ckpt) {
+            due.push_back(s);
+        }
+    }
+
+    if (due.empty()) {
+        return false;
+    }
+
+    // the previous decode may still be writing the states
+    ggml_backend_sched_synchronize(lctx.get_sched());
+
+    // sequences sharing a cell share the checkpoint data
+    std::map<uint32_t, std::shared_ptr<const std::vector<uint8_t>>> saved;
+
+    for (const uint32_t s : due) {
+        const int32_t tail_id = cells[s].tail;
+
+        auto & data = saved[tail_id];
+        if (!data) {
+            auto tmp = std::make_shared<std::vector<uint8_t>>();
+            ckpt_save(tail_id, *tmp);
+            data = std::move(tmp);
+        }
+
+        auto & cs = ckpts[s];
+
+        cs.push_back({ cells[tail_id].pos, data });
+
+        if (cs.size() > n_ckpt_max) {
+            cs.erase(cs.begin());
+        }
+    }
+
     return false;
 }
 
+void llama_kv_cache_recurrent::ckpt_save(uint32_t cell_id, std::vector<uint8_t> & data) const {
+    data.clear();
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        const size_t k_size_row = ggml_row_size(k_l[il]->type, hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s());
+        const size_t v_size_row = ggml_row_size(v_l[il]->type, hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s());
+
+        const size_t offs = data.size();
+        data.resize(offs + k_size_row + v_size_row);
+
+        ggml_backend_tensor_get(k_l[il], data.data() + offs,              cell_id*k_size_row, k_size_row);
+        ggml_backend_tensor_get(v_l[il], data.data() + offs + k_size_row, cell_id*v_size_row, v_size_row);
+    }
+}
+
+void llama_kv_cache_recurrent::ckpt_load(uint32_t cell_id, const std::vector<uint8_t> & data) {
+    size_t offs = 0;
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        const size_t k_size_row = ggml_row_size(k_l[il]->type, hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s());
+        const size_t v_size_row = ggml_row_size(v_l[il]->type, hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s());
+
+        GGML_ASSERT(offs + k_size_row + v_size_row <= data.size());
+
+        ggml_backend_tensor_set(k_l[il], data.data() + offs,              cell_id*k_size_row, k_size_row);
+        ggml_backend_tensor_set(v_l[il], data.data() + offs + k_size_row, cell_id*v_size_row, v_size_row);
+
+        offs += k_size_row + v_size_row;
+    }
+}
+
 void llama_kv_cache_recurrent::defrag_sched(float thold) {
     GGML_UNUSED(thold);
     // noop
 }
 
+void llama_kv_cache_recurrent::evict() {
+    // noop
+}
+
 void llama_kv_cache_recurrent::set_full() {
     n = size;
     head = 0;
@@ -1939,6 +2962,10 @@ bool llama_kv_cache_recurrent::get_can_shift() const {
     return false;
 }
 
+bool llama_kv_cache_recurrent::get_has_ckpt() const {
+    return n_ckpt > 0;
+}
+
 int32_t llama_kv_cache_recurrent::s_copy(int i) const {
     const uint32_t cell_id = i + head;
 
@@ -2440,7 +3467,7 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
         view->cells_sequences = (llama_seq_id *)p;
     }
 
-    const std::vector<llama_kv_cache_unified::kv_cell> & kv_cells = kvu->cells;
+    const llama_kv_cells_unified & kv_cells = kvu->cells;
     llama_kv_cache_view_cell * c_curr = view->cells;
     llama_seq_id * cs_curr = view->cells_sequences;
     int32_t used_cells = 0;
@@ -2450,9 +3477,9 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(kvu->size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells.seq_count(i);
         token_count += curr_size;
-        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+        c_curr->pos = kv_cells.pos_get(i) + kv_cells.get_shift(i);
 
         if (curr_size > 0) {
             if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
@@ -2465,12 +3492,14 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
+        for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
             if (seq_idx >= view->n_seq_max) {
                 break;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
+            if (kv_cells.seq_has(i, s)) {
+                cs_curr[seq_idx] = s;
+                seq_idx++;
+            }
         }
         if (seq_idx != 0) {
             used_cells++;
@@ -2487,8 +3516,8 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
     view->max_contiguous_idx = max_contig_idx;
     view->token_count = token_count;
     view->used_cells = used_cells;
-    if (uint32_t(used_cells) != kvu->used) {
+    if (uint32_t(used_cells) != kv_cells.get_used()) {
         LLAMA_LOG_ERROR("%s: used cells mismatch. kv_cache says %d but we calculated %d\n",
-            __func__, kvu->used, used_cells);
+            __func__, kv_cells.get_used(), used_cells);
     }
 }
@@ -3,10 +3,12 @@
 #include "llama.h"
 #include "llama-io.h"
 #include "llama-graph.h"
+#include "llama-kv-cells.h"
 #include "llama-memory.h"
 
 #include "ggml-cpp.h"
 
+#include <memory>
 #include <set>
 #include <vector>
 
@@ -33,6 +35,10 @@ struct llama_kv_cache : public llama_memory_i {
     // schedule a defrag if the fragmentation threshold is exceeded. otherwise, do nothing
     virtual void defrag_sched(float thold) = 0;
 
+    // evict cells according to the eviction policy of the cache (if any)
+    // call once after a batch has been processed and committed - a failed batch does not evict anything
+    virtual void evict() = 0;
+
     // simulate full cache, used for allocating worst-case compute buffers
     virtual void set_full() = 0;
 
@@ -90,23 +96,11 @@ private:
 // TODO: add notion of max sequences
 class llama_kv_cache_unified : public llama_kv_cache {
 public:
-    struct kv_cell {
-        llama_pos pos   = -1;
-        llama_pos delta =  0;
-
-        std::set<llama_seq_id> seq_id;
-
-        bool has_seq_id(const llama_seq_id & id) const {
-            return seq_id.find(id) != seq_id.end();
-        }
-
-        bool is_empty() const {
-            return seq_id.empty();
-        }
-
-        bool is_same_seq(const kv_cell & other) const {
-            return seq_id == other.seq_id;
-        }
+    // a run of consecutive ubatch tokens that is stored in consecutive cells of the cache
+    struct store_run {
+        uint32_t i0 = 0; // index of the first token in the ubatch
+        uint32_t c0 = 0; // index of the first cell in the cache
+        uint32_t n  = 0; // number of tokens
     };
 
     static uint32_t get_padding(const llama_cparams & cparams);
@@ -118,7 +112,12 @@ public:
                          bool   v_trans,
                          bool   offload,
                      uint32_t   kv_size,
-                     uint32_t   padding);
+                     uint32_t   padding,
+                     uint32_t   block_size = 0,
+                     uint32_t   n_hot      = 0,
+                     uint32_t   n_sink     = 0,
+                     uint32_t   n_window   = 0,
+                         bool   h2o        = false);
 
     ~llama_kv_cache_unified() = default;
 
@@ -131,11 +130,14 @@ public:
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
     void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
     void seq_keep(llama_seq_id seq_id) override;
-    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
-    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+    bool seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
+    bool seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
 
+    llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
+    bool seq_has_holes(llama_seq_id seq_id) const override;
+
     //
     // llama_kv_cache
     //
@@ -147,6 +149,8 @@ public:
 
     void defrag_sched(float thold) override;
 
+    void evict() override;
+
     void set_full() override;
 
     llama_sbatch sbatch_init(const llama_batch & batch, bool logits_all) override;
@@ -156,12 +160,38 @@ public:
     // updates the cache head
     // Note: On success, it's important that cache.head points
     // to the first cell of the slot.
+    // In paged mode, the tokens of the ubatch may be scattered across several blocks - use get_store_runs()
     bool find_slot(const llama_ubatch & batch) override;
 
+    // the destination cells of the last ubatch passed to find_slot()
+    const std::vector<store_run> & get_store_runs() const;
+
+    // the tokens of the last ubatch that are also stored in the hot cache - c0 is the index of the first hot slot
+    const std::vector<store_run> & get_hot_runs() const;
+
+    // the cells [i0, i0 + n) of the current view that have a copy in the hot slots [c0, c0 + n)
+    const std::vector<store_run> & get_hot_attn_runs() const;
+
+    uint32_t get_n_hot() const;
+
+    bool get_h2o() const;
+
+    // accumulate the attention received by the cells [0, score.size()) in a ubatch
+    void score_add(const std::vector<float> & score);
+
+    // defrag progress, reported in the perf data of the context
+    struct defrag_perf_data {
+        int64_t t_us    = 0; // time spent in the defrag steps
+        int32_t n_steps = 0;
+        int32_t n_cells = 0; // number of moved cells
+    };
+
+    const defrag_perf_data & get_defrag_perf() const;
+    void                   reset_defrag_perf();
+
     int32_t get_n_tokens()   const override;
     int32_t get_used_cells() const override;
 
-    // TODO: better data structures to reduce the cost of this operation
     llama_pos get_pos_max() const override;
 
     bool get_can_shift() const override;
@@ -173,23 +203,26 @@ public:
 
     uint32_t head = 0; // the location where the batch will be placed in the cache (see find_slot())
     uint32_t size = 0; // total number of cells, shared across all sequences
-    uint32_t used = 0; // used cells (i.e. at least one seq_id)
 
     // computed before each graph build
     uint32_t n = 0;
 
-    std::vector<kv_cell> cells;
+    llama_kv_cells_unified cells;
 
     std::vector<ggml_tensor *> k_l; // per layer
     std::vector<ggml_tensor *> v_l;
 
+    // hot cache (see n_hot)
+    std::vector<ggml_tensor *> k_hot_l; // per layer
+
 private:
     const llama_model & model;
     const llama_hparams & hparams;
 
-    bool has_shift = false;
     bool do_defrag = false;
 
+    defrag_perf_data defrag_perf;
+
     bool v_trans   = true;  // the value tensor is transposed
     bool can_shift = false;
 
@@ -202,6 +235,100 @@ private:
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // paged allocation
+    //   the cells are grouped in fixed-size blocks and each sequence appends its tokens to the blocks in its block
+    //   table, so a ubatch does not need a contiguous run of free cells and the cache does not need defragmentation
+    //   a sequence fills the last block of its table from a cursor, and takes a new block from the free list of the
+    //   cells when it is full, so a cell is found in constant time. a block whose cells have all been freed goes back to
+    //   the free list, and is removed from the table of its owner when it is taken again
+    //   note: the block tables are only used for allocation - the attention uses the per-cell metadata
+    uint32_t block_size = 0; // 0 - paged allocation disabled
+
+    std::vector<llama_seq_id> block_owner; // per block, -1 if not in a block table
+
+    // the block tables are linked lists over the blocks, in allocation order
+    std::vector<int32_t> block_prev; // per block, -1 for the first block of a table
+    std::vector<int32_t> block_next; // per block, -1 for the last block of a table
+
+    struct block_table {
+        int32_t  first = -1;
+        int32_t  last  = -1;
+        uint32_t tail  =  0; // the next cell of the last block to try
+    };
+
+    block_table block_tables[LLAMA_MAX_SEQ];
+
+    std::vector<store_run> store_runs;
+
+    // F16 recent-K window
+    //   the K cache uses a quantized type and the K of the n_hot most recently stored cells is also kept in a small
+    //   F16 ring (slot = cell % n_hot). the KQ scores of these cells are computed from the ring and written over the
+    //   scores computed from the quantized cache, so the recent tokens keep their full K precision
+    //   this is a precision feature only: every cell is quantized when it is stored and is never requantized later,
+    //   V is not part of the window (the V cache cannot be quantized without flash attention, which does not support
+    //   the ring), and the ring is read in addition to the quantized K of its cells - the cache is not smaller and a
+    //   decode step reads more K data than without the window
+    uint32_t n_hot = 0; // 0 - disabled
+
+    std::vector<int32_t> hot_cells; // per hot slot, the cell it holds a copy of, -1 if none
+
+    std::vector<store_run> hot_runs;
+    std::vector<store_run> hot_attn_runs;
+
+    // compute the hot runs of the ubatch from the store runs and the hot attention runs of the view
+    void hot_update();
+
+    // the ring copies are not valid anymore, e.g. after the cells have been shifted or moved
+    void hot_clear();
+
+    // streaming eviction with attention sinks
+    //   when a sequence holds more than n_window cells after a batch, its oldest cells after the first n_sink ones are
+    //   evicted, down to half of the cells after the sinks. the cache needs room for n_window cells plus the tokens of
+    //   a batch per sequence
+    //   the sinks keep their positions and the kept cells are moved down right after them, so the next position of the
+    //   sequence is its pos_max + 1. the K-shift rotates the kept cells once per eviction, every (n_window - n_sink)/2
+    //   tokens, and never rotates the sinks
+    uint32_t n_sink   = 0;
+    uint32_t n_window = 0; // 0 - disabled
+
+    // heavy-hitter eviction (H2O)
+    //   instead of the oldest cells, evict the cells that received the least attention so far (see score_add()).
+    //   the sinks and the most recent n_window/2 cells of the sequence are always kept, and the positions of the kept
+    //   cells do not change
+    bool h2o = false;
+
+    bool find_slot_cont (const llama_ubatch & batch);
+    bool find_slot_paged(const llama_ubatch & batch);
+
+    // find a free cell in the last block of the sequence, or allocate a new block for it
+    int32_t block_find_cell(llama_seq_id seq_id);
+
+    // append the block to the table of the sequence / remove it from the table of its owner
+    void block_link  (llama_seq_id seq_id, uint32_t ib);
+    void block_unlink(uint32_t ib);
+
+    // add the blocks of the cells [c0, c1) to the block table of the sequence
+    void block_tables_add(llama_seq_id seq_id, uint32_t c0, uint32_t c1);
+
+    // release the blocks of the sequence, seq_id < 0 for all sequences
+    void block_tables_rm(llama_seq_id seq_id);
+
+    void block_tables_clear();
+
+    // copy-on-write
+    //   a cell can be shared by several sequences (see seq_cp()). before a sequence changes the position of a shared
+    //   cell, the sequence gets its own copy of the cell, so the positions seen by the other sequences do not change
+    struct {
+        std::vector<std::pair<uint32_t, uint32_t>> ids; // (src, dst) cells - the data is copied in update()
+    } cow_info;
+
+    // detach seq_id from the shared cell i
+    // returns the index of the new cell, or -1 if there are no free cells
+    int32_t cell_cow(uint32_t i, llama_seq_id seq_id);
+
+    // the number of cells that cell_cow() can still allocate for seq_id
+    uint32_t cell_cow_n_free(llama_seq_id seq_id) const;
+
     // defrag
     struct {
         std::vector<uint32_t> ids;
@@ -210,6 +337,10 @@ private:
     // return true if cells have been moved
     bool defrag_prepare(int32_t n_max_nodes);
 
+    // incremental defrag - move at most n_max_cells cells, preferring the moves that free the largest runs of cells
+    // return true if cells have been moved
+    bool defrag_prepare_step(int32_t n_max_nodes, uint32_t n_max_cells);
+
     // commit/restore cache
     struct slot_range {
         uint32_t c0 = 0; // note: these are cell indices, not sequence positions
@@ -221,9 +352,6 @@ private:
         std::vector<slot_range> ranges;
     } pending;
 
-    // find how many cells are currently in use
-    uint32_t cell_max() const;
-
     size_t total_size() const;
 
     size_t size_k_bytes() const;
@@ -238,16 +366,27 @@ private:
                           float   freq_base,
                           float   freq_scale) const;
 
+    // rotate the K of the cells [c0, c1) by their delta
     llm_graph_result_ptr build_graph_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
-                    ggml_cgraph * gf) const;
+                    ggml_cgraph * gf,
+                       uint32_t   c0,
+                       uint32_t   c1) const;
 
     llm_graph_result_ptr build_graph_defrag(
             const llama_cparams & cparams,
                    ggml_context * ctx,
                     ggml_cgraph * gf) const;
 
+    // copy the data of the cells cow_info.ids[i0, i1)
+    llm_graph_result_ptr build_graph_cow(
+            const llama_cparams & cparams,
+                   ggml_context * ctx,
+                    ggml_cgraph * gf,
+                         uint32_t   i0,
+                         uint32_t   i1) const;
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -286,7 +425,8 @@ public:
                     ggml_type   type_k,
                     ggml_type   type_v,
                          bool   offload,
-                     uint32_t   kv_size);
+                     uint32_t   kv_size,
+                     uint32_t   n_ckpt);
 
     ~llama_kv_cache_recurrent() = default;
 
@@ -296,14 +436,20 @@ public:
 
     void clear() override;
 
+    // note: the end of a sequence can be removed only if a checkpoint was taken before p0 (see n_ckpt)
+    //       the state is then rolled back to the last such checkpoint, so the sequence can end before p0
+    //       use seq_pos_max() to find the position from which the tokens have to be evaluated again
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
     void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
     void seq_keep(llama_seq_id seq_id) override;
-    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
-    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+    bool seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
+    bool seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
 
+    llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
+    bool seq_has_holes(llama_seq_id seq_id) const override;
+
     //
     // llama_kv_cache
     //
@@ -311,10 +457,13 @@ public:
     void restore() override;
     void commit()  override;
 
+    // takes the due state checkpoints
     bool update(llama_context & lctx) override;
 
     void defrag_sched(float thold) override;
 
+    void evict() override;
+
     void set_full() override;
 
     llama_sbatch sbatch_init(const llama_batch & batch, bool logits_all) override;
@@ -331,6 +480,9 @@ public:
 
     bool get_can_shift() const override;
 
+    // true if the state checkpoints are enabled, i.e. seq_rm() can read the state of the sequences
+    bool get_has_ckpt() const;
+
     // TODO: temporary methods - they are not really const as they do const_cast<>, fix this
     int32_t s_copy(int i) const;
     float   s_mask(int i) const;
@@ -374,6 +526,26 @@ private:
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    // state checkpoints
+    //   a copy of the state of a sequence is kept in host memory every n_ckpt tokens, so that the end of the
+    //   sequence can be removed by rolling back to the last checkpoint before it (e.g. for prompt caching)
+    //   the checkpoints are taken in update(), i.e. at the start of a decode, and are not saved in the session files
+    struct kv_ckpt {
+        llama_pos pos; // the position of the cell when the checkpoint was taken
+
+        // the K and V rows of the cell for all layers - shared by the sequences copied with seq_cp()
+        std::shared_ptr<const std::vector<uint8_t>> data;
+    };
+
+    static constexpr uint32_t n_ckpt_max = 8; // per sequence, the oldest checkpoints are dropped
+
+    uint32_t n_ckpt = 0; // 0 - checkpoints disabled
+
+    std::vector<std::vector<kv_ckpt>> ckpts; // per sequence, in increasing order of pos
+
+    void ckpt_save(uint32_t cell_id, std::vector<uint8_t> & data) const;
+    void ckpt_load(uint32_t cell_id, const std::vector<uint8_t> & data);
+
     // find how many cells are currently in use
     uint32_t cell_max() const;
 
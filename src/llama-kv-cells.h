@@ -0,0 +1,575 @@
+#pragma once
+
+#include "llama.h"
+#include "llama-cparams.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <map>
+#include <vector>
+
+// meta information about the KV cells of the unified cache
+//   the data is stored as a structure of arrays, so the scans over the cells only touch the data they need:
+//   - pos:   the position of each cell, -1 if the cell is empty
+//   - shift: the pending K-shift of each cell, applied and reset in llama_kv_cache_unified::update()
+//   - seq:   a bitmask of the sequences that each cell belongs to
+//   - score: the attention accumulated by each cell since it was stored, used by the heavy-hitter eviction
+//   in addition, the used cells are tracked in a bitset and the positions of each sequence are counted, so finding a
+//   free run of cells or the position range of a sequence does not require a full scan
+//   with a block size, the used cells of each block are counted and the blocks without used cells are kept in a free
+//   list (see llama_kv_cache_unified::block_size)
+class llama_kv_cells_unified {
+public:
+    using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
+
+    void reset() {
+        std::fill(pos.begin(),   pos.end(),   -1);
+        std::fill(shift.begin(), shift.end(),  0);
+        std::fill(seq.begin(),   seq.end(),   seq_set_t());
+        std::fill(score.begin(), score.end(), 0.0f);
+
+        has_shift = false;
+
+        std::fill(used.begin(), used.end(), 0);
+        n_used = 0;
+
+        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            seq_pos[s].clear();
+            seq_n[s] = 0;
+        }
+
+        n_seq_cells = 0;
+
+        pos_max_cur   = -1;
+        pos_max_dirty = false;
+
+        if (block_size > 0) {
+            const uint32_t n_blocks = pos.size()/block_size;
+
+            block_n_used.assign(n_blocks, 0);
+            block_in_free.assign(n_blocks, 1);
+
+            // the blocks are taken from the back of the list - start with the first one
+            block_free.resize(n_blocks);
+            for (uint32_t ib = 0; ib < n_blocks; ++ib) {
+                block_free[ib] = n_blocks - 1 - ib;
+            }
+
+            n_blocks_free = n_blocks;
+        }
+    }
+
+    // group the cells in blocks of n cells, 0 - no blocks
+    void set_block_size(uint32_t n) {
+        assert(n == 0 || pos.size() % n == 0);
+
+        block_size = n;
+
+        reset();
+    }
+
+    void resize(uint32_t n) {
+        pos.resize(n);
+        shift.resize(n);
+        seq.resize(n);
+        score.resize(n);
+
+        used.resize((n + 63)/64);
+
+        reset();
+    }
+
+    uint32_t size() const {
+        return pos.size();
+    }
+
+    // the number of used cells (i.e. that belong to at least one sequence)
+    uint32_t get_used() const {
+        return n_used;
+    }
+
+    // the number of (cell, sequence) pairs, i.e. a cell shared by N sequences is counted N times
+    uint32_t get_n_seq_cells() const {
+        return n_seq_cells;
+    }
+
+    // the index of the last used cell + 1, 0 if there are no used cells
+    uint32_t used_max_p1() const {
+        for (size_t w = used.size(); w-- > 0; ) {
+            if (used[w]) {
+                uint32_t b = 63;
+                while ((used[w] >> b & 1) == 0) {
+                    --b;
+                }
+
+                return 64*w + b + 1;
+            }
+        }
+
+        return 0;
+    }
+
+    // the index of the first used cell in [i, size()), size() if there is none
+    //   the cells [i, next_used(i)) are a run of free cells
+    uint32_t next_used(uint32_t i) const {
+        if (i >= size()) {
+            return size();
+        }
+
+        size_t w = i/64;
+
+        uint64_t bits = used[w] & (~0ULL << (i % 64));
+
+        while (bits == 0) {
+            if (++w == used.size()) {
+                return size();
+            }
+
+            bits = used[w];
+        }
+
+        // the number of trailing zeros
+        return 64*w + std::bitset<64>(bits ^ (bits - 1)).count() - 1;
+    }
+
+    // the number of blocks without used cells
+    uint32_t get_n_blocks_free() const {
+        return n_blocks_free;
+    }
+
+    // the number of used cells of the block ib
+    uint32_t get_block_used(uint32_t ib) const {
+        assert(ib < block_n_used.size());
+
+        return block_n_used[ib];
+    }
+
+    // take a block without used cells from the free list, -1 if there is none
+    //   the blocks that have been used since they were added to the list are skipped
+    int32_t block_pop_free() {
+        while (!block_free.empty()) {
+            const uint32_t ib = block_free.back();
+            block_free.pop_back();
+
+            block_in_free[ib] = 0;
+
+            if (block_n_used[ib] == 0) {
+                return ib;
+            }
+        }
+
+        return -1;
+    }
+
+    bool is_empty(uint32_t i) const {
+        assert(i < pos.size());
+        assert((pos[i] < 0 && seq[i].none()) || (pos[i] >= 0 && seq[i].any()));
+
+        return pos[i] == -1;
+    }
+
+    bool get_has_shift() const {
+        return has_shift;
+    }
+
+    void reset_shift() {
+        has_shift = false;
+
+        std::fill(shift.begin(), shift.end(), 0);
+    }
+
+    // move the meta data of the used cell isrc to the empty cell idst
+    void mv(uint32_t isrc, uint32_t idst) {
+        assert(!is_empty(isrc) && is_empty(idst));
+
+        // the position and the sequences do not change, so the position counts are not updated
+        pos  [idst] = pos  [isrc];
+        shift[idst] = shift[isrc];
+        seq  [idst] = seq  [isrc];
+        score[idst] = score[isrc];
+
+        pos  [isrc] = -1;
+        shift[isrc] =  0;
+        seq  [isrc].reset();
+        score[isrc] = 0.0f;
+
+        used_reset(isrc);
+        used_set  (idst);
+    }
+
+    // free the cell, removing it from all of its sequences
+    void rm(uint32_t i) {
+        assert(!is_empty(i));
+
+        seq_pos_rm(i);
+
+        pos[i] = -1;
+        seq[i].reset();
+
+        used_reset(i);
+    }
+
+    // returns true if the cell becomes empty
+    bool seq_rm(uint32_t i, llama_seq_id seq_id) {
+        assert(seq[i].test(seq_id));
+        assert(!is_empty(i));
+
+        seq[i].reset(seq_id);
+        seq_pos_dec(seq_id, i);
+
+        if (seq[i].none()) {
+            pos[i] = -1;
+
+            used_reset(i);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    // keep only seq_id in the cell - returns true if the cell becomes empty
+    bool seq_keep(uint32_t i, llama_seq_id seq_id) {
+        assert(i < pos.size());
+
+        if (seq[i].test(seq_id)) {
+            seq_pos_rm(i);
+            seq[i].reset();
+
+            seq[i].set(seq_id);
+            seq_pos_inc(seq_id, i);
+
+            return false;
+        }
+
+        if (seq[i].any()) {
+            rm(i);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    // the number of sequences of the cell
+    int seq_count(uint32_t i) const {
+        assert(i < pos.size());
+
+        return seq[i].count();
+    }
+
+    bool seq_has(uint32_t i, llama_seq_id seq_id) const {
+        assert(i < pos.size());
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+        return seq[i].test(seq_id);
+    }
+
+    const seq_set_t & seq_get(uint32_t i) const {
+        assert(i < pos.size());
+
+        return seq[i];
+    }
+
+    // note: call only after the position of the cell has been set with pos_set()
+    void seq_add(uint32_t i, llama_seq_id seq_id) {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+        assert(!seq[i].test(seq_id));
+
+        seq[i].set(seq_id);
+        seq_pos_inc(seq_id, i);
+    }
+
+    // move seq_id from the cell isrc to the empty cell idst, keeping the position and the pending shift
+    void seq_mv(uint32_t isrc, uint32_t idst, llama_seq_id seq_id) {
+        assert(seq[isrc].test(seq_id) && seq[isrc].count() > 1);
+        assert(is_empty(idst));
+
+        // the position does not change, so the position counts are not updated
+        pos  [idst] = pos  [isrc];
+        shift[idst] = shift[isrc];
+        seq  [idst].set(seq_id);
+        score[idst] = score[isrc];
+
+        seq[isrc].reset(seq_id);
+
+        used_set(idst);
+    }
+
+    // the number of cells of the sequence
+    uint32_t seq_n_cells(llama_seq_id seq_id) const {
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+        return seq_n[seq_id];
+    }
+
+    // the smallest position of the sequence, -1 if the sequence has no cells
+    llama_pos seq_pos_min(llama_seq_id seq_id) const {
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+        return seq_pos[seq_id].empty() ? -1 : seq_pos[seq_id].begin()->first;
+    }
+
+    // the largest position of the sequence, -1 if the sequence has no cells
+    llama_pos seq_pos_max(llama_seq_id seq_id) const {
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+        return seq_pos[seq_id].empty() ? -1 : seq_pos[seq_id].rbegin()->first;
+    }
+
+    // true if some positions between the smallest and the largest position of the sequence have no cell
+    bool seq_has_holes(llama_seq_id seq_id) const {
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+        const auto & m = seq_pos[seq_id];
+
+        return !m.empty() && (size_t) (m.rbegin()->first - m.begin()->first + 1) > m.size();
+    }
+
+    // the largest position over all sequences, -1 if there are no used cells
+    //   cached - recomputed only after the cell holding the largest position has been removed or moved
+    llama_pos pos_max() const {
+        if (pos_max_dirty) {
+            pos_max_cur   = -1;
+            pos_max_dirty = false;
+
+            for (const auto & s : seq_pos) {
+                if (!s.empty()) {
+                    pos_max_cur = std::max(pos_max_cur, s.rbegin()->first);
+                }
+            }
+        }
+
+        return pos_max_cur;
+    }
+
+    // the cells of the sequence with a position within [p0, p1), in increasing cell order
+    std::vector<uint32_t> seq_cells(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+        assert(seq_id >= 0 && seq_id < LLAMA_MAX_SEQ);
+
+        std::vector<uint32_t> res;
+
+        if (seq_n[seq_id] == 0) {
+            return res;
+        }
+
+        for (uint32_t i = next_used(0); i < size(); i = next_used(i + 1)) {
+            if (seq[i].test(seq_id) && pos[i] >= p0 && pos[i] < p1) {
+                res.push_back(i);
+            }
+        }
+
+        return res;
+    }
+
+    llama_pos pos_get(uint32_t i) const {
+        assert(i < pos.size());
+
+        return pos[i];
+    }
+
+    llama_pos get_shift(uint32_t i) const {
+        assert(i < pos.size());
+
+        return shift[i];
+    }
+
+    // check if a cell is not empty and its position is within [p0, p1)
+    bool pos_in(uint32_t i, llama_pos p0, llama_pos p1) const {
+        assert(i < pos.size());
+
+        return pos[i] >= p0 && pos[i] < p1;
+    }
+
+    // set the position of an empty cell
+    // does not modify "has_shift"
+    // note: call seq_add() afterwards
+    void pos_set(uint32_t i, llama_pos p) {
+        assert(i < pos.size());
+        assert(pos[i] == -1);
+        assert(seq[i].none());
+
+        pos  [i] = p;
+        score[i] = 0.0f;
+
+        used_set(i);
+    }
+
+    // pos[i] = pos[i] + d
+    // sets "has_shift" to true
+    // note: call only if the cell is not empty
+    // returns true if the cell becomes empty
+    bool pos_add(uint32_t i, llama_pos d) {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+
+        seq_pos_rm(i);
+
+        pos[i]   += d;
+        shift[i] += d;
+
+        has_shift = true;
+
+        if (pos[i] < 0) {
+            pos[i] = -1;
+            seq[i].reset();
+
+            used_reset(i);
+
+            return true;
+        }
+
+        seq_pos_add(i);
+
+        return false;
+    }
+
+    // pos[i] = pos[i] / d
+    // sets "has_shift" to true
+    // note: call only if the cell is not empty
+    void pos_div(uint32_t i, int d) {
+        assert(i < pos.size());
+        assert(pos[i] != -1);
+
+        const llama_pos p_old = pos[i];
+
+        seq_pos_rm(i);
+
+        pos[i]   /= d;
+        shift[i] += pos[i] - p_old;
+
+        seq_pos_add(i);
+
+        has_shift = true;
+    }
+
+    float score_get(uint32_t i) const {
+        assert(i < pos.size());
+
+        return score[i];
+    }
+
+    void score_add(uint32_t i, float s) {
+        assert(i < pos.size());
+
+        score[i] += s;
+    }
+
+private:
+    bool has_shift = false;
+
+    std::vector<llama_pos> pos;
+    std::vector<llama_pos> shift;
+    std::vector<seq_set_t> seq;
+    std::vector<float>     score;
+
+    // bit i is set if the cell i is used
+    std::vector<uint64_t> used;
+
+    // the number of set bits in used
+    uint32_t n_used = 0;
+
+    uint32_t block_size = 0;
+
+    std::vector<uint32_t> block_n_used;  // per block, the number of used cells
+    std::vector<uint8_t>  block_in_free; // per block, 1 if it is in block_free
+    std::vector<uint32_t> block_free;    // the blocks that had no used cells when they were added
+
+    // the number of blocks without used cells
+    uint32_t n_blocks_free = 0;
+
+    // for each sequence, the number of its cells at each position
+    //   the first and last entries are the min and max position of the sequence
+    std::map<llama_pos, int> seq_pos[LLAMA_MAX_SEQ];
+
+    // for each sequence, the number of its cells
+    uint32_t seq_n[LLAMA_MAX_SEQ] = {};
+
+    // the sum of seq_n
+    uint32_t n_seq_cells = 0;
+
+    mutable llama_pos pos_max_cur   = -1;
+    mutable bool      pos_max_dirty = false;
+
+    void used_set(uint32_t i) {
+        assert((used[i/64] & (1ULL << (i % 64))) == 0);
+
+        used[i/64] |= 1ULL << (i % 64);
+        n_used++;
+
+        if (block_size > 0 && block_n_used[i/block_size]++ == 0) {
+            n_blocks_free--;
+        }
+    }
+
+    void used_reset(uint32_t i) {
+        assert((used[i/64] & (1ULL << (i % 64))) != 0);
+
+        used[i/64] &= ~(1ULL << (i % 64));
+        n_used--;
+
+        if (block_size > 0 && --block_n_used[i/block_size] == 0) {
+            const uint32_t ib = i/block_size;
+
+            n_blocks_free++;
+
+            if (!block_in_free[ib]) {
+                block_in_free[ib] = 1;
+                block_free.push_back(ib);
+            }
+        }
+    }
+
+    void seq_pos_inc(llama_seq_id seq_id, uint32_t i) {
+        // the tokens of a batch are usually stored with increasing positions after the existing ones,
+        // so the hint makes the insertion constant time for the common case
+        auto & m = seq_pos[seq_id];
+
+        m.emplace_hint(m.end(), pos[i], 0)->second++;
+
+        seq_n[seq_id]++;
+        n_seq_cells++;
+
+        if (!pos_max_dirty) {
+            pos_max_cur = std::max(pos_max_cur, pos[i]);
+        }
+    }
+
+    void seq_pos_dec(llama_seq_id seq_id, uint32_t i) {
+        auto & m = seq_pos[seq_id];
+
+        auto it = m.find(pos[i]);
+        assert(it != m.end());
+
+        if (--it->second == 0) {
+            m.erase(it);
+        }
+
+        seq_n[seq_id]--;
+        n_seq_cells--;
+
+        if (pos[i] == pos_max_cur) {
+            pos_max_dirty = true;
+        }
+    }
+
+    // remove the cell from the index of all of its sequences
+    void seq_pos_rm(uint32_t i) {
+        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (seq[i].test(s)) {
+                seq_pos_dec(s, i);
+            }
+        }
+    }
+
+    // add the cell to the index of all of its sequences
+    void seq_pos_add(uint32_t i) {
+        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (seq[i].test(s)) {
+                seq_pos_inc(s, i);
+            }
+        }
+    }
+};
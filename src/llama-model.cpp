@@ -17,6 +17,7 @@
 #include <cmath>
 #include <functional>
 #include <map>
+#include <numeric>
 #include <regex>
 #include <sstream>
 #include <stdexcept>
@@ -1529,11 +1530,13 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     int max_n_tensors = ml.n_tensors;
     max_n_tensors += 1;         // duplicated output tensor
     max_n_tensors += n_layer*2; // duplicated rope freq tensors
+    max_n_tensors += n_layer*2; // packed weights
     const size_t ctx_size = ggml_tensor_overhead()*max_n_tensors;
 
-    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
-    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
-        auto it = ctx_map.find(buft);
+    // the packed weights are in separate contexts, their buffers cannot be mapped from the file
+    std::map<std::pair<ggml_backend_buffer_type_t, bool>, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft, bool packed = false) -> ggml_context * {
+        auto it = ctx_map.find({buft, packed});
         if (it == ctx_map.end()) {
             ggml_init_params params = {
                 /*.mem_size   =*/ ctx_size,
@@ -1546,7 +1549,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 throw std::runtime_error(format("failed to create ggml context"));
             }
 
-            ctx_map[buft] = ctx;
+            ctx_map[{buft, packed}] = ctx;
             pimpl->ctxs.emplace_back(ctx);
 
             return ctx;
@@ -1585,51 +1588,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         ggml_backend_buffer_type_t first_moved_from_buft = nullptr;
         ggml_backend_buffer_type_t first_moved_to_buft = nullptr;
 
-        auto create_tensor = [&](const LLM_TN_IMPL & tn, const std::initializer_list<int64_t> & ne, int flags) -> ggml_tensor * {
-            ggml_tensor * t_meta = ml.get_tensor_meta(tn.str().c_str());
-
-            if (!t_meta) {
-                if (flags & TENSOR_NOT_REQUIRED) {
-                    return nullptr;
-                }
-                throw std::runtime_error(format("missing tensor '%s'", tn.str().c_str()));
-            }
-
-            // some models use the token embedding tensor as the output, but since these are used in different layers and with different ops
-            // the tensor is duplicated
-            // to handle this, we check if the tensor is duplicated, and if so, we assume that it is being loaded as the output tensor
-            llm_tensor tn_tensor = tn.tensor;
-            if (tn.tensor == LLM_TENSOR_TOKEN_EMBD && flags & TENSOR_DUPLICATED) {
-                tn_tensor = LLM_TENSOR_OUTPUT;
-            }
-
-            llm_tensor_info info;
-            try {
-                info = llm_tensor_info_for(tn_tensor);
-            } catch (const std::out_of_range & e) {
-                throw std::runtime_error(format("missing tensor info mapping for %s", tn.str().c_str()));
-            }
-
-            // skip unused tensors
-            if (info.op == GGML_OP_NONE) {
-                const size_t nbytes = ggml_nbytes(t_meta);
-                LLAMA_LOG_WARN("model has unused tensor %s (size = %zu bytes) -- ignoring\n", tn.str().c_str(), nbytes);
-
-                ml.size_data -= nbytes;
-                ml.n_created++;
-
-                return nullptr;
-            }
-
-            // tensors with "bias" suffix are always used with GGML_OP_ADD
-            ggml_op op;
-            bool bias = tn.suffix != nullptr && strcmp(tn.suffix, "bias") == 0;
-            if (bias) {
-                op = GGML_OP_ADD;
-            } else {
-                op = info.op;
-            }
-
+        // the buffer types that can be used for a tensor, in order of preference
+        auto buft_list_for = [&](const LLM_TN_IMPL & tn, const llm_tensor_info & info) -> buft_list_t * {
             // sanity checks
             if (info.layer == LLM_TENSOR_LAYER_INPUT || info.layer == LLM_TENSOR_LAYER_OUTPUT) {
                 if (tn.bid != -1) {
@@ -1641,7 +1601,6 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 }
             }
 
-            // select the buffer type for this tensor
             buft_list_t * buft_list;
             switch (info.layer) {
                 case LLM_TENSOR_LAYER_INPUT:
@@ -1657,6 +1616,22 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                     GGML_ABORT("invalid layer %d for tensor %s", info.layer, tn.str().c_str());
             }
 
+            return buft_list;
+        };
+
+        // select the buffer type for a tensor
+        auto select_tensor_buft = [&](const LLM_TN_IMPL & tn, const llm_tensor_info & info, ggml_tensor * t_meta) -> ggml_backend_buffer_type_t {
+            // tensors with "bias" suffix are always used with GGML_OP_ADD
+            ggml_op op;
+            bool bias = tn.suffix != nullptr && strcmp(tn.suffix, "bias") == 0;
+            if (bias) {
+                op = GGML_OP_ADD;
+            } else {
+                op = info.op;
+            }
+
+            buft_list_t * buft_list = buft_list_for(tn, info);
+
             ggml_backend_buffer_type_t buft = nullptr;
 
             // check overrides
@@ -1692,6 +1667,49 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 buft = ggml_backend_dev_buffer_type(cpu_dev);
             }
 
+            return buft;
+        };
+
+        auto create_tensor = [&](const LLM_TN_IMPL & tn, const std::initializer_list<int64_t> & ne, int flags) -> ggml_tensor * {
+            ggml_tensor * t_meta = ml.get_tensor_meta(tn.str().c_str());
+
+            if (!t_meta) {
+                if (flags & TENSOR_NOT_REQUIRED) {
+                    return nullptr;
+                }
+                throw std::runtime_error(format("missing tensor '%s'", tn.str().c_str()));
+            }
+
+            // some models use the token embedding tensor as the output, but since these are used in different layers and with different ops
+            // the tensor is duplicated
+            // to handle this, we check if the tensor is duplicated, and if so, we assume that it is being loaded as the output tensor
+            llm_tensor tn_tensor = tn.tensor;
+            if (tn.tensor == LLM_TENSOR_TOKEN_EMBD && flags & TENSOR_DUPLICATED) {
+                tn_tensor = LLM_TENSOR_OUTPUT;
+            }
+
+            llm_tensor_info info;
+            try {
+                info = llm_tensor_info_for(tn_tensor);
+            } catch (const std::out_of_range & e) {
+                throw std::runtime_error(format("missing tensor info mapping for %s", tn.str().c_str()));
+            }
+
+            // skip unused tensors
+            if (info.op == GGML_OP_NONE) {
+                const size_t nbytes = ggml_nbytes(t_meta);
+                LLAMA_LOG_WARN("model has unused tensor %s (size = %zu bytes) -- ignoring\n", tn.str().c_str(), nbytes);
+
+                ml.size_data -= nbytes;
+                ml.n_created++;
+
+                return nullptr;
+            }
+
+            buft_list_t * buft_list = buft_list_for(tn, info);
+
+            ggml_backend_buffer_type_t buft = select_tensor_buft(tn, info, t_meta);
+
             if (buft != buft_list->front().second) {
                 n_moved_tensors++;
                 if (!first_moved_tensor) {
@@ -1713,10 +1731,88 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
             return ml.create_tensor(ctx, tn, ne, flags);
         };
 
+        // create the weights that are multiplied by the same input as views of a single packed tensor, so that the graph
+        // can compute them with a single matmul, see llama_model_params::fuse_weights
+        //   returns nullptr if the weights cannot be packed
+        auto create_tensor_packed = [&](const std::string & name, const std::vector<LLM_TN_IMPL> & tns, int64_t n_in, const std::vector<int64_t> & n_out, std::vector<ggml_tensor *> & out) -> ggml_tensor * {
+            if (!params.fuse_weights) {
+                return nullptr;
+            }
+
+            ggml_backend_buffer_type_t buft = nullptr;
+            ggml_type type = GGML_TYPE_COUNT;
+            int64_t n_rows = 0;
+
+            for (size_t k = 0; k < tns.size(); ++k) {
+                ggml_tensor * t_meta = ml.get_tensor_meta(tns[k].str().c_str());
+                if (!t_meta || ggml_n_dims(t_meta) != 2 || t_meta->ne[0] != n_in || t_meta->ne[1] != n_out[k]) {
+                    return nullptr;
+                }
+                if (type != GGML_TYPE_COUNT && t_meta->type != type) {
+                    return nullptr;
+                }
+
+                ggml_backend_buffer_type_t t_buft = select_tensor_buft(tns[k], llm_tensor_info_for(tns[k].tensor), t_meta);
+                if (buft && t_buft != buft) {
+                    return nullptr;
+                }
+
+                buft    = t_buft;
+                type    = t_meta->type;
+                n_rows += n_out[k];
+            }
+
+            // the extra buffer types repack the weights in their own layout, which is not a layout of rows
+            ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+            if (!dev) {
+                dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+            }
+            if (!dev || buft != ggml_backend_dev_buffer_type(dev)) {
+                return nullptr;
+            }
+
+            ggml_context * ctx = ctx_for_buft(buft, true);
+
+            ggml_tensor * packed = ggml_new_tensor_2d(ctx, type, n_in, n_rows);
+            ggml_set_name(packed, name.c_str());
+
+            out.clear();
+
+            size_t offs = 0;
+            for (size_t k = 0; k < tns.size(); ++k) {
+                out.push_back(ml.create_tensor_as_view(ctx, packed, tns[k], {n_in, n_out[k]}, offs, true));
+                offs += ggml_row_size(type, n_in)*n_out[k];
+            }
+
+            return packed;
+        };
+
         layers.resize(n_layer);
 
         // TODO: move to a separate function
         const auto tn = LLM_TN(arch);
+
+        // the ffn_gate and ffn_up weights of a layer, packed in ffn_gate_up if possible
+        //   build_ffn() computes the packed weights with a single matmul, see llama_model_params::fuse_weights
+        auto create_ffn_gate_up = [&](llama_layer & layer, int i, int64_t n_ff) {
+            std::vector<ggml_tensor *> packed;
+
+            if (!ml.get_tensor_meta(tn(LLM_TENSOR_FFN_GATE, "bias", i).str().c_str()) &&
+                !ml.get_tensor_meta(tn(LLM_TENSOR_FFN_UP,   "bias", i).str().c_str())) {
+                layer.ffn_gate_up = create_tensor_packed(format("blk.%d.ffn_gate_up.weight", i),
+                        { tn(LLM_TENSOR_FFN_GATE, "weight", i), tn(LLM_TENSOR_FFN_UP, "weight", i) },
+                        n_embd, { n_ff, n_ff }, packed);
+            }
+
+            if (layer.ffn_gate_up) {
+                layer.ffn_gate = packed[0];
+                layer.ffn_up   = packed[1];
+            } else {
+                layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd, n_ff}, 0);
+                layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd, n_ff}, 0);
+            }
+        };
+
         switch (arch) {
             case LLM_ARCH_LLAMA:
             case LLM_ARCH_REFACT:
@@ -1740,9 +1836,23 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
                         layer.attn_norm = create_tensor(tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd}, 0);
 
-                        layer.wq = create_tensor(tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head}, 0);
-                        layer.wk = create_tensor(tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa}, 0);
-                        layer.wv = create_tensor(tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa}, 0);
+                        std::vector<ggml_tensor *> packed;
+
+                        if (arch == LLM_ARCH_LLAMA && !ml.get_tensor_meta(tn(LLM_TENSOR_ATTN_Q, "bias", i).str().c_str())) {
+                            layer.wqkv = create_tensor_packed(format("blk.%d.attn_qkv.weight", i),
+                                    { tn(LLM_TENSOR_ATTN_Q, "weight", i), tn(LLM_TENSOR_ATTN_K, "weight", i), tn(LLM_TENSOR_ATTN_V, "weight", i) },
+                                    n_embd, { n_embd_head_k * n_head, n_embd_k_gqa, n_embd_v_gqa }, packed);
+                        }
+
+                        if (layer.wqkv) {
+                            layer.wq = packed[0];
+                            layer.wk = packed[1];
+                            layer.wv = packed[2];
+                        } else {
+                            layer.wq = create_tensor(tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head}, 0);
+                            layer.wk = create_tensor(tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa}, 0);
+                            layer.wv = create_tensor(tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa}, 0);
+                        }
                         layer.wo = create_tensor(tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd}, 0);
 
                         // optional bias tensors
@@ -1762,9 +1872,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         }
 
                         if (n_expert == 0) {
-                            layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 0);
+                            create_ffn_gate_up(layer, i, n_ff);
                             layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0);
-                            layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 0);
 
                             // optional MLP bias
                             layer.ffn_gate_b = create_tensor(tn(LLM_TENSOR_FFN_GATE, "bias", i), {n_ff}, TENSOR_NOT_REQUIRED);
@@ -2395,9 +2504,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
                         layer.ffn_norm = create_tensor(tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, 0);
 
-                        layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 0);
+                        create_ffn_gate_up(layer, i, n_ff);
                         layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0);
-                        layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 0);
                     }
                 } break;
             case LLM_ARCH_QWEN2MOE:
@@ -2476,9 +2584,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         layer.attn_q_norm = create_tensor(tn(LLM_TENSOR_ATTN_Q_NORM, "weight", i), {n_embd_head_k}, 0);
 
                         layer.ffn_norm = create_tensor(tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, 0);
-                        layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 0);
+                        create_ffn_gate_up(layer, i, n_ff);
                         layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0);
-                        layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 0);
                     }
                 } break;
             case LLM_ARCH_QWEN3MOE:
@@ -2801,8 +2908,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         layer.wo = create_tensor(tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd}, 0);
 
                         layer.ffn_norm = create_tensor(tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, 0);
-                        layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 0);
-                        layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 0);
+                        create_ffn_gate_up(layer, i, n_ff);
                         layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0);
                     }
                 } break;
@@ -2826,8 +2932,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                         layer.attn_post_norm = create_tensor(tn(LLM_TENSOR_ATTN_POST_NORM, "weight", i), {n_embd}, 0);
 
                         layer.ffn_norm = create_tensor(tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, 0);
-                        layer.ffn_gate = create_tensor(tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 0);
-                        layer.ffn_up   = create_tensor(tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 0);
+                        create_ffn_gate_up(layer, i, n_ff);
                         layer.ffn_down = create_tensor(tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0);
                         layer.ffn_post_norm = create_tensor(tn(LLM_TENSOR_FFN_POST_NORM, "weight", i), {n_embd}, 0);
                     }
@@ -4130,7 +4235,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     pimpl->bufs.reserve(n_max_backend_buffer);
 
     for (auto & it : ctx_map) {
-        ggml_backend_buffer_type_t buft = it.first;
+        ggml_backend_buffer_type_t buft = it.first.first;
+        const bool packed               = it.first.second;
         ggml_context * ctx              = it.second;
 
         // skip contexts without tensors
@@ -4155,7 +4261,7 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         bool buffer_from_host_ptr_supported = props.caps.buffer_from_host_ptr;
         bool is_default_buft = buft == ggml_backend_dev_buffer_type(dev);
 
-        if (ml.use_mmap && use_mmap_buffer && buffer_from_host_ptr_supported && is_default_buft) {
+        if (ml.use_mmap && use_mmap_buffer && buffer_from_host_ptr_supported && is_default_buft && !packed) {
             for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
                 // only the mmap region containing the tensors in the model is mapped to the backend buffer
                 // this is important for metal with apple silicon: if the entire model could be mapped to a metal buffer, then we could just use metal for all layers
@@ -4544,31 +4650,47 @@ struct llm_build_llama : public llm_graph_context {
                 // rope freq factors for llama3; may return nullptr for llama2 and other models
                 ggml_tensor * rope_factors = model.get_rope_factors(n_ctx_per_seq, il);
 
+                ggml_tensor * Qcur = nullptr;
+                ggml_tensor * Kcur = nullptr;
+                ggml_tensor * Vcur = nullptr;
+
                 // compute Q and K and RoPE them
-                ggml_tensor * Qcur = build_lora_mm(model.layers[il].wq, cur);
-                cb(Qcur, "Qcur", il);
-                if (model.layers[il].bq) {
-                    Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
+                if (model.layers[il].wqkv && loras->empty()) {
+                    // the packed weights, see llama_model_params::fuse_weights
+                    ggml_tensor * QKVcur = build_lora_mm(model.layers[il].wqkv, cur);
+                    cb(QKVcur, "wqkv", il);
+
+                    Qcur = ggml_view_3d(ctx0, QKVcur, n_embd_head, n_head,    n_tokens, n_embd_head*sizeof(float), QKVcur->nb[1], 0*sizeof(float)*(n_embd_head*n_head));
+                    Kcur = ggml_view_3d(ctx0, QKVcur, n_embd_head, n_head_kv, n_tokens, n_embd_head*sizeof(float), QKVcur->nb[1], 1*sizeof(float)*(n_embd_head*n_head));
+                    Vcur = ggml_cont(ctx0, ggml_view_2d(ctx0, QKVcur, n_embd_head*n_head_kv, n_tokens, QKVcur->nb[1], 1*sizeof(float)*(n_embd_head*(n_head + n_head_kv))));
+
+                    Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
+                } else {
+                    Qcur = build_lora_mm(model.layers[il].wq, cur);
                     cb(Qcur, "Qcur", il);
-                }
+                    if (model.layers[il].bq) {
+                        Qcur = ggml_add(ctx0, Qcur, model.layers[il].bq);
+                        cb(Qcur, "Qcur", il);
+                    }
 
-                ggml_tensor * Kcur = build_lora_mm(model.layers[il].wk, cur);
-                cb(Kcur, "Kcur", il);
-                if (model.layers[il].bk) {
-                    Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
+                    Kcur = build_lora_mm(model.layers[il].wk, cur);
                     cb(Kcur, "Kcur", il);
-                }
+                    if (model.layers[il].bk) {
+                        Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
+                        cb(Kcur, "Kcur", il);
+                    }
 
-                ggml_tensor * Vcur = build_lora_mm(model.layers[il].wv, cur);
-                cb(Vcur, "Vcur", il);
-                if (model.layers[il].bv) {
-                    Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
+                    Vcur = build_lora_mm(model.layers[il].wv, cur);
                     cb(Vcur, "Vcur", il);
-                }
+                    if (model.layers[il].bv) {
+                        Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
+                        cb(Vcur, "Vcur", il);
+                    }
 
-                Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
-                Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
-                Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
+                    Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
+                    Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
+                    Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
+                }
 
                 if (use_rope) {
                     Qcur = ggml_rope_ext(
@@ -13058,7 +13180,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         GGML_TYPE_F32,
                         GGML_TYPE_F32,
                         cparams.offload_kqv,
-                        std::max((uint32_t) 1, cparams.n_seq_max));
+                        std::max((uint32_t) 1, cparams.n_seq_max),
+                        cparams.kv_checkpoint);
             } break;
         default:
             {
@@ -13066,6 +13189,10 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
 
                 cparams.n_ctx = GGML_PAD(cparams.n_ctx, padding);
 
+                if (cparams.kv_block_size > 0) {
+                    cparams.n_ctx = GGML_PAD(cparams.n_ctx, std::lcm(padding, cparams.kv_block_size));
+                }
+
                 LLAMA_LOG_DEBUG("%s: n_ctx = %u (padded)\n", __func__, cparams.n_ctx);
 
                 res = new llama_kv_cache_unified(
@@ -13075,7 +13202,12 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         !cparams.flash_attn,
                         cparams.offload_kqv,
                         cparams.n_ctx,
-                        padding);
+                        padding,
+                        cparams.kv_block_size,
+                        cparams.kv_recent,
+                        cparams.kv_sink,
+                        cparams.kv_window,
+                        cparams.kv_h2o);
             }
     }
 
@@ -13372,6 +13504,7 @@ llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.fuse_weights                =*/ false,
     };
 
 #ifdef GGML_USE_METAL
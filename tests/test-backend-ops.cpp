@@ -100,7 +100,7 @@ static void init_tensor_uniform(ggml_tensor * tensor, float min = -1.0f, float m
             };
 
             const size_t min_blocks_per_thread = 1;
-            const size_t n_threads = std::min<size_t>(std::thread::hardware_concurrency()/2,
+            const size_t n_threads = std::min<size_t>(std::max<size_t>(1, std::thread::hardware_concurrency()/2),
                                                       std::max<size_t>(1, n_blocks / min_blocks_per_thread));
             std::vector<std::future<void>> tasks;
             tasks.reserve(n_threads);
@@ -338,6 +338,16 @@ struct test_case {
         return 1e-4;
     }
 
+    // if true, the backend computes the whole graph at once, so that it can fuse its nodes, and only the output is compared
+    virtual bool run_whole_graph() {
+        return false;
+    }
+
+    // if > 0, the number of threads of the tested backend for this case (e.g. to split the work of a small op)
+    virtual int n_threads() {
+        return 0;
+    }
+
     virtual float grad_eps() {
         return 1e-1f;
     }
@@ -385,6 +395,9 @@ struct test_case {
     ggml_cgraph * gf = nullptr;
     ggml_cgraph * gb = nullptr;
 
+    // with run_whole_graph(), the output is compared with this node as computed by the reference backend, if set by build_graph
+    ggml_tensor * out_ref = nullptr;
+
     static const int sentinel_size = 1024;
 
     test_mode mode;
@@ -448,6 +461,8 @@ struct test_case {
         // pre-graph sentinel
         add_sentinel(ctx);
 
+        out_ref = nullptr;
+
         ggml_tensor * out = build_graph(ctx);
 
         if (op_name != nullptr && op_desc(out) != op_name) {
@@ -489,6 +504,9 @@ struct test_case {
         }
 
         // build graph
+        if (out_ref) {
+            ggml_build_forward_expand(gf, out_ref);
+        }
         ggml_build_forward_expand(gf, out);
 
         // add sentinels as graph nodes so that they are checked in the callback
@@ -574,7 +592,23 @@ struct test_case {
             GGML_UNUSED(index);
         };
 
-        const bool cmp_ok = ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
+        ggml_backend_set_n_threads_t set_n_threads_fn = nullptr;
+        if (n_threads() > 0) {
+            ggml_backend_dev_t dev = ggml_backend_get_device(backend1);
+            ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+            if (reg) {
+                set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+            }
+            if (set_n_threads_fn) {
+                set_n_threads_fn(backend1, n_threads());
+            }
+        }
+
+        const bool cmp_ok = ggml_backend_compare_graph_backend_node(backend1, backend2, gf, callback, &ud, run_whole_graph() ? out : nullptr, out_ref);
+
+        if (set_n_threads_fn) {
+            set_n_threads_fn(backend1, std::thread::hardware_concurrency());
+        }
 
         if (!cmp_ok) {
             printf("compare failed ");
@@ -1791,6 +1825,149 @@ struct test_rms_norm : public test_case {
     }
 };
 
+// GGML_OP_ADD + GGML_OP_RMS_NORM + GGML_OP_MUL, computed as a single graph so that the backend can fuse them
+struct test_rms_norm_mul : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    const float eps;
+    const bool add;       // add -> rms_norm
+    const bool mul;       // rms_norm -> mul
+    const bool broadcast; // the weight of the mul is a single row
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return std::string(add ? "ADD_" : "") + "RMS_NORM" + (mul ? "_MUL" : "");
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR4(type, ne, eps, broadcast);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_rms_norm_mul(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {64, 5, 4, 3},
+            float eps = 1e-6f,
+            bool add = false,
+            bool mul = true,
+            bool broadcast = true)
+        : type(type), ne(ne), eps(eps), add(add), mul(mul), broadcast(broadcast) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        ggml_tensor * x = a;
+
+        if (add) {
+            ggml_tensor * b = ggml_new_tensor(ctx, type, 4, ne.data());
+            ggml_set_name(b, "b");
+
+            x = ggml_add(ctx, a, b);
+            ggml_set_name(x, "a + b");
+        }
+
+        ggml_tensor * out = ggml_rms_norm(ctx, x, eps);
+
+        if (mul) {
+            ggml_set_name(out, "rms_norm");
+
+            ggml_tensor * w = broadcast ? ggml_new_tensor_1d(ctx, type, ne[0]) : ggml_new_tensor(ctx, type, 4, ne.data());
+            ggml_set_name(w, "w");
+
+            out = ggml_mul(ctx, out, w);
+        }
+
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            init_tensor_uniform(t, -10.f, 10.f);
+        }
+    }
+
+    double max_nmse_err() override {
+        return 1e-6;
+    }
+};
+
+// GGML_UNARY_OP_SILU + GGML_OP_MUL, computed as a single graph so that the backend can fuse them
+struct test_silu_mul : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    const bool ffn; // the silu and the mul are separated by a mul_mat, like the gate and the up projections of a FFN
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "SILU_MUL";
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR3(type, ne, ffn);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_silu_mul(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {64, 5, 4, 3},
+            bool ffn = false)
+        : type(type), ne(ne), ffn(ffn) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * g;
+        ggml_tensor * u;
+
+        if (ffn) {
+            // ne[0] is the size of the hidden layer
+            const int64_t n_embd = 32;
+
+            ggml_tensor * x = ggml_new_tensor_4d(ctx, type, n_embd, ne[1], ne[2], ne[3]);
+            ggml_set_name(x, "x");
+
+            ggml_tensor * w_gate = ggml_new_tensor_2d(ctx, type, n_embd, ne[0]);
+            ggml_set_name(w_gate, "w_gate");
+
+            ggml_tensor * w_up = ggml_new_tensor_2d(ctx, type, n_embd, ne[0]);
+            ggml_set_name(w_up, "w_up");
+
+            g = ggml_mul_mat(ctx, w_gate, x);
+            ggml_set_name(g, "gate");
+
+            g = ggml_silu(ctx, g);
+            ggml_set_name(g, "silu");
+
+            // the up projection is computed between the silu and the mul
+            u = ggml_mul_mat(ctx, w_up, x);
+            ggml_set_name(u, "up");
+        } else {
+            ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+            ggml_set_name(a, "a");
+
+            u = ggml_new_tensor(ctx, type, 4, ne.data());
+            ggml_set_name(u, "b");
+
+            g = ggml_silu(ctx, a);
+            ggml_set_name(g, "silu");
+        }
+
+        ggml_tensor * out = ggml_mul(ctx, g, u);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    double max_nmse_err() override {
+        return 1e-6;
+    }
+};
+
 // GGML_OP_RMS_NORM_BACK
 struct test_rms_norm_back : public test_case {
     const ggml_type type;
@@ -2075,6 +2252,88 @@ struct test_mul_mat : public test_case {
     }
 };
 
+// GGML_OP_MUL_MAT with a sparsity hint, compared with the dense result
+//   the hint c is zero for the elements that may be skipped, so the result masked by c does not depend on them
+struct test_mul_mat_sparse : public test_case {
+    const ggml_type type_a;
+    const int64_t m;
+    const int64_t n;
+    const int64_t k;
+    const float thold;
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "MUL_MAT_SPARSE";
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR5(type_a, m, n, k, thold);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    test_mul_mat_sparse(ggml_type type_a = GGML_TYPE_F32,
+            int64_t m = 256, int64_t n = 1, int64_t k = 256,
+            float thold = 0.0f)
+        : type_a(type_a), m(m), n(n), k(k), thold(thold) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, type_a, k, m);
+        ggml_set_name(a, "a");
+
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n);
+        ggml_set_name(b, "b");
+
+        ggml_tensor * c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, m, n);
+        ggml_set_name(c, "c");
+
+        ggml_tensor * dense = ggml_mul_mat(ctx, a, b);
+        ggml_set_name(dense, "dense");
+
+        out_ref = ggml_mul(ctx, dense, c);
+        ggml_set_name(out_ref, "out_ref");
+
+        ggml_tensor * sparse = ggml_mul_mat_sparse(ctx, a, b, c, thold);
+        ggml_set_name(sparse, "sparse");
+
+        ggml_tensor * out = ggml_mul(ctx, sparse, c);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        std::default_random_engine rng(42);
+        std::uniform_real_distribution<float> ud(-1.0f, 1.0f);
+
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (strcmp(t->name, "c") != 0) {
+                init_tensor_uniform(t);
+                continue;
+            }
+
+            // zero the hint of the elements below the threshold and of a third of the rows
+            std::vector<float> data(ggml_nelements(t));
+            for (int64_t i1 = 0; i1 < t->ne[1]; i1++) {
+                for (int64_t i0 = 0; i0 < t->ne[0]; i0++) {
+                    float v = ud(rng);
+                    if (std::fabs(v) <= thold || i0 % 3 == 0) {
+                        v = 0.0f;
+                    }
+                    data[i1*t->ne[0] + i0] = v;
+                }
+            }
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    }
+};
+
 // GGML_OP_MUL_MAT_ID
 struct test_mul_mat_id : public test_case {
     const ggml_type type_a;
@@ -3362,6 +3621,139 @@ struct test_flash_attn_ext : public test_case {
     }
 };
 
+// GGML_OP_FLASH_ATTN_EXT
+// the kernel that processes the queries by tiles, compared with the kernel that processes one query row at a time: the
+// reference computes the queries in groups small enough for the per-row kernel, with one K/V head per query head
+struct test_flash_attn_ext_rows : public test_case {
+    const int64_t hsk; // K head size
+    const int64_t hsv; // V head size
+    const int64_t nh; // num K/V heads
+    const int64_t nr; // repeat in Q, tests for grouped-query attention
+    const int64_t kv; // kv size
+    const int64_t nb; // batch size
+
+    const bool mask; // causal mask, with some holes
+
+    const float max_bias; // ALiBi
+    const float logit_softcap; // Gemma 2
+
+    const ggml_type type_KV;
+
+    const int nth; // threads of the tested backend
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "FLASH_ATTN_EXT_ROWS";
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR11(hsk, hsv, nh, nr, kv, nb, mask, max_bias, logit_softcap, type_KV, nth);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    int n_threads() override {
+        return nth;
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    test_flash_attn_ext_rows(int64_t hsk = 128, int64_t hsv = 128, int64_t nh = 2, int64_t nr = 1, int64_t kv = 96, int64_t nb = 8,
+                             bool mask = true, float max_bias = 0.0f, float logit_softcap = 0.0f,
+                             ggml_type type_KV = GGML_TYPE_F16, int nth = 0)
+        : hsk(hsk), hsv(hsv), nh(nh), nr(nr), kv(kv), nb(nb), mask(mask), max_bias(max_bias), logit_softcap(logit_softcap), type_KV(type_KV), nth(nth) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        const float scale = 1.0f/sqrtf(hsk);
+
+        ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hsk, nb, nh*nr, 1);
+        ggml_set_name(q, "q");
+
+        ggml_tensor * k = ggml_new_tensor_4d(ctx, type_KV, hsk, kv, nh, 1);
+        ggml_set_name(k, "k");
+
+        ggml_tensor * v = ggml_new_tensor_4d(ctx, type_KV, hsv, kv, nh, 1);
+        ggml_set_name(v, "v");
+
+        // GGML_KQ_MASK_PAD more rows than needed, so that the reference can take a padded view at each query
+        ggml_tensor * m = nullptr;
+        if (mask) {
+            m = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kv, GGML_PAD(nb, GGML_KQ_MASK_PAD) + GGML_KQ_MASK_PAD, 1, 1);
+            ggml_set_name(m, "m");
+        }
+
+        // one K/V head per query head: head h uses the K/V head h/nr
+        // the per-row kernel has no F32 K, the tiled kernel converts the K rows to F32, which is exact from F16
+        // quantized K is dequantized through F32, since there is no direct conversion to F16
+        ggml_tensor * k_ref = k;
+        if (type_KV != GGML_TYPE_F16) {
+            k_ref = ggml_cpy(ctx, k, ggml_new_tensor_3d(ctx, GGML_TYPE_F32, hsk, kv, nh));
+            k_ref = ggml_cast(ctx, k_ref, GGML_TYPE_F16);
+        }
+        ggml_tensor * v_ref = ggml_cpy(ctx, v, ggml_new_tensor_3d(ctx, GGML_TYPE_F32, hsv, kv, nh));
+        if (nr > 1) {
+            k_ref = ggml_reshape_4d(ctx, k_ref, hsk, kv, 1, nh);
+            k_ref = ggml_repeat(ctx, k_ref, ggml_new_tensor_4d(ctx, GGML_TYPE_F16, hsk, kv, nr, nh));
+            k_ref = ggml_reshape_3d(ctx, k_ref, hsk, kv, nh*nr);
+
+            v_ref = ggml_reshape_4d(ctx, v_ref, hsv, kv, 1, nh);
+            v_ref = ggml_repeat(ctx, v_ref, ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hsv, kv, nr, nh));
+            v_ref = ggml_reshape_3d(ctx, v_ref, hsv, kv, nh*nr);
+        }
+
+        // the per-row kernel is used for fewer than 4 rows
+        const int64_t nb_ref = 3;
+
+        for (int64_t i = 0; i < nb; i += nb_ref) {
+            const int64_t n = std::min(nb_ref, nb - i);
+
+            ggml_tensor * q_i = ggml_view_4d(ctx, q, hsk, n, nh*nr, 1, q->nb[1], q->nb[2], q->nb[3], i*q->nb[1]);
+            ggml_tensor * m_i = m ? ggml_view_2d(ctx, m, kv, GGML_KQ_MASK_PAD, m->nb[1], i*m->nb[1]) : nullptr;
+
+            ggml_tensor * out_i = ggml_flash_attn_ext(ctx, q_i, k_ref, v_ref, m_i, scale, max_bias, logit_softcap);
+            ggml_flash_attn_ext_set_prec(out_i, GGML_PREC_F32);
+
+            out_ref = i == 0 ? out_i : ggml_concat(ctx, out_ref, out_i, 2);
+        }
+        ggml_set_name(out_ref, "out_ref");
+
+        ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, m, scale, max_bias, logit_softcap);
+        ggml_flash_attn_ext_set_prec(out, GGML_PREC_F32);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (strcmp(t->name, "m") != 0) {
+                init_tensor_uniform(t);
+                continue;
+            }
+
+            // the query i is at the position kv - nb + i: it does not see the later cells, nor one cell in 7 of the
+            // earlier ones - with ALiBi, the visible cells are biased by their distance
+            std::vector<ggml_fp16_t> data(ggml_nelements(t));
+            for (int64_t i = 0; i < t->ne[1]; i++) {
+                for (int64_t j = 0; j < t->ne[0]; j++) {
+                    const int64_t d = (kv - nb + i) - j;
+
+                    float f = max_bias > 0.0f ? -(float) std::abs(d) : 0.0f;
+                    if (d < 0 || (3*i + j) % 7 == 0) {
+                        f = -INFINITY;
+                    }
+                    data[i*t->ne[0] + j] = ggml_fp32_to_fp16(f);
+                }
+            }
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    }
+};
+
 // GGML_OP_CROSS_ENTROPY_LOSS
 struct test_cross_entropy_loss : public test_case {
     const ggml_type type;
@@ -4178,6 +4570,18 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
 
     test_cases.emplace_back(new test_l2_norm(GGML_TYPE_F32, {64, 5, 4, 3}, 1e-12f));
 
+    // fused chains
+    for (bool broadcast : {true, false}) {
+        test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {64, 5, 4, 3}, 1e-6f, false, true, broadcast));
+        test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {64, 5, 4, 3}, 1e-6f, true,  true, broadcast));
+    }
+    test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {64, 5, 4, 3}, 1e-6f, true, false));
+    test_cases.emplace_back(new test_rms_norm_mul(GGML_TYPE_F32, {4096, 7, 1, 1}, 1e-5f, true, true));
+    for (bool ffn : {false, true}) {
+        test_cases.emplace_back(new test_silu_mul(GGML_TYPE_F32, {64, 5, 4, 3}, ffn));
+        test_cases.emplace_back(new test_silu_mul(GGML_TYPE_F32, {1024, 7, 1, 1}, ffn));
+    }
+
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {4, 1536, 1, 1}, {4, 1536, 1, 1}));
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {8, 1536, 1, 1}, {4, 1536, 1, 1}));
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {4, 1536, 4, 1}, {4, 1536, 1, 1}));
@@ -4333,6 +4737,15 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    // the CPU backend skips the rows of the hint for up to 4 columns, more columns use the dense kernels
+    for (ggml_type type_a : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, GGML_TYPE_Q4_K}) {
+        for (int n : {1, 4, 9}) {
+            for (float thold : {0.0f, 0.25f, -1.0f}) {
+                test_cases.emplace_back(new test_mul_mat_sparse(type_a, 256, n, 256, thold));
+            }
+        }
+    }
+
     for (ggml_type type_a : base_types) {
         for (ggml_type type_b : {GGML_TYPE_F32, GGML_TYPE_F16}) {
             for (int n : {1, 16}) {
@@ -4531,6 +4944,26 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    // the query-tiled kernel against the per-row kernel
+    for (ggml_type type_KV : {GGML_TYPE_F16, GGML_TYPE_Q8_0}) {
+        for (int nr : { 1, 4 }) {
+            for (int nb : { 4, 32, 35, 64 }) {
+                if (nb < 4/nr) continue;
+                test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 2, nr, 128, nb, false, 0.0f,  0.0f, type_KV));
+                test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 2, nr, 128, nb, true,  0.0f,  0.0f, type_KV));
+                test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 2, nr, 128, nb, true,  8.0f,  0.0f, type_KV));
+                test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 2, nr, 128, nb, true,  0.0f, 10.0f, type_KV));
+                test_cases.emplace_back(new test_flash_attn_ext_rows( 64,  64, 2, nr, 128, nb, true,  0.0f,  0.0f, type_KV));
+            }
+        }
+        // decoding with the K/V rows split in chunks processed by different threads
+        for (int nb : { 1, 2 }) {
+            test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 1, 4, 1024, nb, true, 0.0f,  0.0f, type_KV, 4));
+            test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 1, 4, 1024, nb, true, 8.0f,  0.0f, type_KV, 4));
+            test_cases.emplace_back(new test_flash_attn_ext_rows(128, 128, 2, 8, 2048, nb, true, 0.0f, 10.0f, type_KV, 3));
+        }
+    }
+
     test_cases.emplace_back(new test_cross_entropy_loss     (GGML_TYPE_F32, {   10, 5, 4, 3}));
     test_cases.emplace_back(new test_cross_entropy_loss     (GGML_TYPE_F32, {30000, 1, 1, 1}));
     test_cases.emplace_back(new test_cross_entropy_loss_back(GGML_TYPE_F32, {   10, 5, 4, 3}));
@@ -0,0 +1,199 @@
+// check that the CPU backend computes random graphs with several threads exactly like with a single thread
+//   the independent nodes of a graph are run concurrently by groups of threads (the graph waves), so the graphs mix
+//   independent branches, mul_mats that share their src1, fusable chains and writes to views of a shared tensor
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static const int64_t K = 128; // the row size of the tensors
+static const int64_t N = 9;   // the number of rows of the tensors of the pool
+
+struct graph_result {
+    std::vector<float> out;
+    std::vector<float> kv;
+};
+
+// builds the random graph of the seed and computes it, with a disposable threadpool if tp is NULL
+static graph_result run(int seed, int n_threads, ggml_threadpool * tp) {
+    ggml_init_params ip = {
+        /* .mem_size   = */ 256*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(ip);
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> ud(-0.5f, 0.5f);
+
+    auto fill = [&](ggml_tensor * t) {
+        for (int64_t j = 0; j < ggml_nelements(t); ++j) {
+            ((float *) t->data)[j] = ud(rng);
+        }
+    };
+
+    std::vector<ggml_tensor *> pool;
+    for (int i = 0; i < 4; ++i) {
+        ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, K, N);
+        fill(t);
+        pool.push_back(t);
+    }
+
+    std::vector<ggml_tensor *> w;
+    for (ggml_type type : { GGML_TYPE_Q8_0, GGML_TYPE_Q4_0, GGML_TYPE_F16 }) {
+        std::vector<float> wf(K*K);
+        for (auto & x : wf) {
+            x = ud(rng);
+        }
+
+        ggml_tensor * t = ggml_new_tensor_2d(ctx, type, K, K);
+        ggml_quantize_chunk(type, wf.data(), t->data, 0, K, K, NULL);
+        w.push_back(t);
+    }
+
+    ggml_tensor * kv = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, K, 64);
+    fill(kv);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    for (int it = 0; it < 200; ++it) {
+        ggml_tensor * a = pool[rng() % pool.size()];
+        ggml_tensor * b = pool[rng() % pool.size()];
+
+        ggml_tensor * r = nullptr;
+
+        switch (rng() % 9) {
+            case 0:
+                r = ggml_mul_mat(ctx, w[rng() % w.size()], a);
+                break;
+            case 1:
+                {
+                    // mul_mats that share their src1, like Q, K and V
+                    ggml_tensor * q = ggml_mul_mat(ctx, w[0], a);
+                    ggml_tensor * k = ggml_mul_mat(ctx, w[1], a);
+                    ggml_build_forward_expand(gf, q);
+                    ggml_build_forward_expand(gf, k);
+                    r = ggml_add(ctx, q, k);
+                } break;
+            case 2:
+                r = ggml_add(ctx, a, b);
+                break;
+            case 3:
+                r = ggml_mul(ctx, ggml_rms_norm(ctx, a, 1e-5f), ggml_view_2d(ctx, b, K, 1, b->nb[1], 0));
+                break;
+            case 4:
+                r = ggml_soft_max(ctx, a);
+                break;
+            case 5:
+                r = ggml_mul(ctx, ggml_silu(ctx, ggml_scale(ctx, a, 0.5f)), b);
+                break;
+            case 6:
+                {
+                    // write into a view of a shared tensor, then read another view of it
+                    ggml_tensor * v = ggml_view_2d(ctx, kv, K, N, kv->nb[1], (rng() % 50)*kv->nb[1]);
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx, a, v));
+                    r = ggml_cont(ctx, ggml_view_2d(ctx, kv, K, N, kv->nb[1], (rng() % 50)*kv->nb[1]));
+                    ggml_build_forward_expand(gf, r);
+                    r = ggml_add(ctx, r, a);
+                } break;
+            case 7:
+                r = ggml_add_inplace(ctx, ggml_cont(ctx, a), b);
+                break;
+            default:
+                r = ggml_sum_rows(ctx, a);
+                break;
+        }
+
+        if (r->ne[0] == K && r->ne[1] == N) {
+            pool.push_back(r);
+        }
+
+        ggml_build_forward_expand(gf, r);
+    }
+
+    ggml_tensor * out = pool.back();
+    for (size_t i = pool.size() - 20; i < pool.size(); ++i) {
+        out = ggml_add(ctx, out, pool[i]);
+    }
+    ggml_build_forward_expand(gf, out);
+
+    ggml_cplan cplan = ggml_graph_plan(gf, n_threads, tp);
+
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+
+    if (ggml_graph_compute(gf, &cplan) != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "seed %d, n_threads %d: graph compute failed\n", seed, n_threads);
+        exit(1);
+    }
+
+    graph_result res;
+    res.out.assign((float *) out->data, (float *) out->data + ggml_nelements(out));
+    res.kv .assign((float *) kv->data,  (float *) kv->data  + ggml_nelements(kv));
+
+    ggml_free(ctx);
+
+    return res;
+}
+
+static double max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    double res = 0.0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        res = std::max(res, (double) std::fabs(a[i] - b[i]));
+    }
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    int n_seeds = 8;
+
+    if (argc > 1) {
+        n_seeds = std::atoi(argv[1]);
+    }
+
+    int n_fail = 0;
+
+    for (int n_threads : { 2, 3, 4, 8 }) {
+        // the same threadpool computes graphs of different sizes one after the other
+        ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+        ggml_threadpool * tp = ggml_threadpool_new(&tpp);
+        if (!tp) {
+            fprintf(stderr, "threadpool create failed : n_threads %d\n", n_threads);
+            return 1;
+        }
+
+        for (int seed = 1; seed <= n_seeds; ++seed) {
+            const graph_result ref = run(seed, 1, nullptr);
+
+            for (ggml_threadpool * pool : { (ggml_threadpool *) nullptr, tp }) {
+                const graph_result cur = run(seed, n_threads, pool);
+
+                const double d_out = max_diff(ref.out, cur.out);
+                const double d_kv  = max_diff(ref.kv,  cur.kv);
+
+                if (d_out > 1e-5 || d_kv > 1e-5) {
+                    fprintf(stderr, "seed %d, n_threads %d, %s threadpool: max diff out %g, kv %g\n",
+                            seed, n_threads, pool ? "persistent" : "disposable", d_out, d_kv);
+                    n_fail++;
+                }
+            }
+        }
+
+        ggml_threadpool_free(tp);
+    }
+
+    if (n_fail > 0) {
+        fprintf(stderr, "%d graphs differ from the single thread results\n", n_fail);
+        return 1;
+    }
+
+    printf("OK\n");
+
+    return 0;
+}
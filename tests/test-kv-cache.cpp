@@ -0,0 +1,746 @@
+// tests the bookkeeping of the KV cache: the positions and the sequences of the cells after the copy-on-write of shared
+// cells, the eviction and the rollback, and that the decoded logits do not change with the paged allocation and the
+// defragmentation
+//
+// the models are tiny random models without a vocabulary, created by the test
+
+#include "ggml.h"
+#include "gguf.h"
+#include "llama.h"
+
+#include "../src/llama-kv-cells.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_vocab = 128;
+
+//
+// llama_kv_cells_unified
+//
+
+static void test_cells() {
+    llama_kv_cells_unified cells;
+
+    cells.resize(64);
+    cells.set_block_size(16);
+
+    GGML_ASSERT(cells.get_n_blocks_free() == 4);
+
+    // seq 0 at positions [0, 10) in the cells [0, 10)
+    for (uint32_t i = 0; i < 10; ++i) {
+        cells.pos_set(i, i);
+        cells.seq_add(i, 0);
+    }
+
+    GGML_ASSERT(cells.get_used() == 10 && cells.get_n_seq_cells() == 10);
+    GGML_ASSERT(cells.seq_pos_min(0) == 0 && cells.seq_pos_max(0) == 9 && cells.pos_max() == 9);
+    GGML_ASSERT(cells.get_n_blocks_free() == 3 && cells.get_block_used(0) == 10);
+    GGML_ASSERT(cells.used_max_p1() == 10 && cells.next_used(10) == 64);
+
+    // share the cells with seq 1
+    for (uint32_t i = 0; i < 10; ++i) {
+        cells.seq_add(i, 1);
+    }
+
+    GGML_ASSERT(cells.get_used() == 10 && cells.get_n_seq_cells() == 20);
+    GGML_ASSERT(cells.seq_n_cells(1) == 10 && cells.seq_pos_max(1) == 9);
+
+    // copy-on-write: move seq 1 out of the shared cells [5, 10) to [16, 21), then shift its copies by 3
+    for (uint32_t i = 5; i < 10; ++i) {
+        cells.seq_mv(i, 11 + i, 1);
+        GGML_ASSERT(cells.seq_count(i) == 1 && cells.seq_has(i, 0) && !cells.seq_has(i, 1));
+    }
+    for (uint32_t i = 16; i < 21; ++i) {
+        GGML_ASSERT(!cells.pos_add(i, 3));
+        GGML_ASSERT(cells.get_shift(i) == 3);
+    }
+
+    GGML_ASSERT(cells.get_has_shift());
+    GGML_ASSERT(cells.get_used() == 15 && cells.get_n_seq_cells() == 20);
+    GGML_ASSERT(cells.seq_pos_min(0) == 0 && cells.seq_pos_max(0) ==  9 && !cells.seq_has_holes(0));
+    GGML_ASSERT(cells.seq_pos_min(1) == 0 && cells.seq_pos_max(1) == 12 &&  cells.seq_has_holes(1));
+    GGML_ASSERT(cells.pos_max() == 12);
+    GGML_ASSERT(cells.get_n_blocks_free() == 2 && cells.get_block_used(1) == 5);
+    GGML_ASSERT(cells.seq_cells(1, 8, 13) == std::vector<uint32_t>({16, 17, 18, 19, 20}));
+
+    cells.reset_shift();
+    GGML_ASSERT(!cells.get_has_shift() && cells.get_shift(16) == 0);
+
+    // rollback: remove the end of seq 1 - its block becomes free again
+    for (uint32_t i = 16; i < 21; ++i) {
+        GGML_ASSERT(cells.seq_rm(i, 1));
+    }
+
+    GGML_ASSERT(cells.get_used() == 10 && cells.get_n_seq_cells() == 15);
+    GGML_ASSERT(cells.seq_pos_max(1) == 4 && !cells.seq_has_holes(1));
+    GGML_ASSERT(cells.pos_max() == 9);
+    GGML_ASSERT(cells.get_n_blocks_free() == 3 && cells.get_block_used(1) == 0);
+
+    // the free list skips the blocks that have been used since they were added to it
+    GGML_ASSERT(cells.block_pop_free() == 1);
+    GGML_ASSERT(cells.block_pop_free() == 2);
+
+    // a block that is emptied is added back to the list
+    cells.pos_set(32, 100);
+    cells.seq_add(32, 2);
+    GGML_ASSERT(cells.get_n_blocks_free() == 2);
+    cells.rm(32);
+    GGML_ASSERT(cells.seq_pos_max(2) == -1 && cells.pos_max() == 9);
+    GGML_ASSERT(cells.get_n_blocks_free() == 3);
+    GGML_ASSERT(cells.block_pop_free() == 2);
+    GGML_ASSERT(cells.block_pop_free() == 3);
+    GGML_ASSERT(cells.block_pop_free() == -1);
+
+    // eviction: shifting the cells below 0 frees them
+    for (uint32_t i = 0; i < 5; ++i) {
+        GGML_ASSERT(!cells.seq_rm(i, 1));
+    }
+    for (uint32_t i = 0; i < 10; ++i) {
+        GGML_ASSERT(cells.pos_add(i, -4) == (i < 4));
+    }
+
+    GGML_ASSERT(cells.get_used() == 6 && cells.get_n_seq_cells() == 6);
+    GGML_ASSERT(cells.seq_pos_min(0) == 0 && cells.seq_pos_max(0) == 5);
+    GGML_ASSERT(cells.seq_pos_max(1) == -1 && cells.seq_n_cells(1) == 0);
+    GGML_ASSERT(cells.get_block_used(0) == 6);
+
+    // the positions of a divided sequence can repeat
+    for (uint32_t i = 4; i < 10; ++i) {
+        cells.pos_div(i, 2);
+    }
+
+    GGML_ASSERT(cells.seq_pos_min(0) == 0 && cells.seq_pos_max(0) == 2 && cells.seq_n_cells(0) == 6);
+    GGML_ASSERT(!cells.seq_has_holes(0));
+    GGML_ASSERT(cells.get_shift(9) == 2 - 9);
+
+    // moving a cell keeps its position
+    cells.mv(9, 40);
+    GGML_ASSERT(cells.is_empty(9) && cells.pos_get(40) == 2);
+    GGML_ASSERT(cells.get_block_used(0) == 5 && cells.get_block_used(2) == 1);
+    GGML_ASSERT(cells.used_max_p1() == 41 && cells.next_used(9) == 40);
+
+    // keep only seq 3: all the cells of seq 0 are freed
+    cells.seq_add(40, 3);
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        cells.seq_keep(i, 3);
+    }
+
+    GGML_ASSERT(cells.get_used() == 1 && cells.get_n_seq_cells() == 1);
+    GGML_ASSERT(cells.seq_pos_max(0) == -1 && cells.seq_pos_max(3) == 2);
+    GGML_ASSERT(cells.get_n_blocks_free() == 3);
+
+    cells.reset();
+
+    GGML_ASSERT(cells.get_used() == 0 && cells.pos_max() == -1 && cells.used_max_p1() == 0);
+    GGML_ASSERT(cells.get_n_blocks_free() == 4 && cells.block_pop_free() == 0);
+
+    printf("%s: OK\n", __func__);
+}
+
+//
+// llama_kv_cache
+//
+
+static void write_model(const std::string & fname, const std::string & arch) {
+    gguf_context * gguf = gguf_init_empty();
+
+    const int n_embd  = 64;
+    const int n_layer = 2;
+
+    gguf_set_val_str(gguf, "general.architecture", arch.c_str());
+    gguf_set_val_str(gguf, "tokenizer.ggml.model", "no_vocab");
+    gguf_set_val_u32(gguf, (arch + ".vocab_size").c_str(),       n_vocab);
+    gguf_set_val_u32(gguf, (arch + ".context_length").c_str(),   4096);
+    gguf_set_val_u32(gguf, (arch + ".embedding_length").c_str(), n_embd);
+    gguf_set_val_u32(gguf, (arch + ".block_count").c_str(),      n_layer);
+    gguf_set_val_f32(gguf, (arch + ".attention.layer_norm_rms_epsilon").c_str(), 1e-5f);
+
+    ggml_init_params params = { 16*1024*1024, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    // the weights are random with the given scale, the norms are around 1
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, float scale, float mean = 0.0f) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = mean + scale*dist(rng);
+        }
+
+        ggml_set_name(t, name.c_str());
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab, 1.0f);
+    add("output_norm.weight", n_embd, 0,       0.1f, 1.0f);
+    add("output.weight",      n_embd, n_vocab, 0.1f);
+
+    if (arch == "llama") {
+        const int n_head    = 4;
+        const int n_head_kv = 2;
+        const int n_ff      = 128;
+        const int n_rot     = n_embd/n_head;
+
+        gguf_set_val_u32(gguf, "llama.feed_forward_length",    n_ff);
+        gguf_set_val_u32(gguf, "llama.attention.head_count",    n_head);
+        gguf_set_val_u32(gguf, "llama.attention.head_count_kv", n_head_kv);
+        gguf_set_val_u32(gguf, "llama.rope.dimension_count",    n_rot);
+
+        for (int il = 0; il < n_layer; ++il) {
+            const std::string blk = "blk." + std::to_string(il) + ".";
+
+            add(blk + "attn_norm.weight",   n_embd, 0,                0.1f, 1.0f);
+            add(blk + "attn_q.weight",      n_embd, n_embd,           0.3f);
+            add(blk + "attn_k.weight",      n_embd, n_rot*n_head_kv,  0.3f);
+            add(blk + "attn_v.weight",      n_embd, n_rot*n_head_kv,  0.1f);
+            add(blk + "attn_output.weight", n_embd, n_embd,           0.1f);
+            add(blk + "ffn_norm.weight",    n_embd, 0,                0.1f, 1.0f);
+            add(blk + "ffn_gate.weight",    n_embd, n_ff,             0.1f);
+            add(blk + "ffn_up.weight",      n_embd, n_ff,             0.1f);
+            add(blk + "ffn_down.weight",    n_ff,   n_embd,           0.1f);
+        }
+    } else {
+        const int d_inner = 128;
+        const int d_state = 16;
+        const int d_conv  = 4;
+        const int dt_rank = 4;
+
+        gguf_set_val_u32(gguf, "mamba.feed_forward_length",   0);
+        gguf_set_val_u32(gguf, "mamba.attention.head_count",  0);
+        gguf_set_val_u32(gguf, "mamba.ssm.conv_kernel",       d_conv);
+        gguf_set_val_u32(gguf, "mamba.ssm.inner_size",        d_inner);
+        gguf_set_val_u32(gguf, "mamba.ssm.state_size",        d_state);
+        gguf_set_val_u32(gguf, "mamba.ssm.time_step_rank",    dt_rank);
+
+        for (int il = 0; il < n_layer; ++il) {
+            const std::string blk = "blk." + std::to_string(il) + ".";
+
+            add(blk + "attn_norm.weight",  n_embd,  0,                   0.1f, 1.0f);
+            add(blk + "ssm_in.weight",     n_embd,  2*d_inner,           0.2f);
+            add(blk + "ssm_conv1d.weight", d_conv,  d_inner,             0.3f);
+            add(blk + "ssm_conv1d.bias",   d_inner, 0,                   0.1f);
+            add(blk + "ssm_x.weight",      d_inner, dt_rank + 2*d_state, 0.2f);
+            add(blk + "ssm_dt.weight",     dt_rank, d_inner,             0.2f);
+            add(blk + "ssm_dt.bias",       d_inner, 0,                   0.1f, -1.0f);
+            add(blk + "ssm_a",             d_state, d_inner,             0.1f, -1.0f);
+            add(blk + "ssm_d",             d_inner, 0,                   0.1f,  1.0f);
+            add(blk + "ssm_out.weight",    d_inner, n_embd,              0.2f);
+        }
+    }
+
+    GGML_ASSERT(gguf_write_to_file(gguf, fname.c_str(), false));
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+}
+
+static llama_context_params test_cparams() {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = 256;
+    cparams.n_batch         = 256;
+    cparams.n_ubatch        = 256;
+    cparams.n_seq_max       = 4;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+    cparams.no_perf         = true;
+
+    return cparams;
+}
+
+static llama_context * init_context(llama_model * model, const llama_context_params & cparams = test_cparams()) {
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    GGML_ASSERT(ctx != nullptr);
+
+    return ctx;
+}
+
+// the same for all sequences, so that a copied sequence can be compared with the original
+static llama_token get_token(llama_pos pos) {
+    return (31*pos + 5) % n_vocab;
+}
+
+// a decoded token of a sequence
+struct test_token {
+    llama_seq_id seq_id;
+    llama_pos    pos;
+};
+
+// decode the tokens in one batch and return the logits of all of them
+static std::vector<std::vector<float>> decode(llama_context * ctx, const std::vector<test_token> & tokens) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+
+    for (const auto & t : tokens) {
+        const int k = batch.n_tokens++;
+
+        batch.token   [k]    = get_token(t.pos);
+        batch.pos     [k]    = t.pos;
+        batch.n_seq_id[k]    = 1;
+        batch.seq_id  [k][0] = t.seq_id;
+        batch.logits  [k]    = true;
+    }
+
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+    std::vector<std::vector<float>> res;
+    for (int k = 0; k < batch.n_tokens; ++k) {
+        const float * logits = llama_get_logits_ith(ctx, k);
+        res.emplace_back(logits, logits + n_vocab);
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+// decode the positions [p0, p1) of a sequence in batches of n_batch tokens and return the logits of the last one
+static std::vector<float> decode_seq(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int n_batch = 256) {
+    std::vector<float> res;
+
+    for (llama_pos p = p0; p < p1; p += n_batch) {
+        std::vector<test_token> tokens;
+        for (llama_pos i = p; i < std::min(p + n_batch, p1); ++i) {
+            tokens.push_back({seq_id, i});
+        }
+
+        res = decode(ctx, tokens).back();
+    }
+
+    return res;
+}
+
+static void check_logits(const char * name, const std::vector<float> & a, const std::vector<float> & b) {
+    GGML_ASSERT(a.size() == b.size());
+
+    double diff = 0.0;
+    double amax = 0.0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        diff = std::max(diff, (double) std::fabs(a[i] - b[i]));
+        amax = std::max(amax, (double) std::fabs(b[i]));
+    }
+
+    if (diff > 1e-3*std::max(1.0, amax)) {
+        fprintf(stderr, "%s: max diff of the logits %g (max |logit| %g)\n", name, diff, amax);
+        GGML_ABORT("the logits do not match");
+    }
+}
+
+static void check_seq(llama_context * ctx, llama_seq_id seq_id, llama_pos pos_min, llama_pos pos_max, bool holes) {
+    const llama_pos p0 = llama_kv_self_seq_pos_min(ctx, seq_id);
+    const llama_pos p1 = llama_kv_self_seq_pos_max(ctx, seq_id);
+
+    if (p0 != pos_min || p1 != pos_max || llama_kv_self_seq_has_holes(ctx, seq_id) != holes) {
+        fprintf(stderr, "seq %d: positions [%d, %d], holes %d - expected [%d, %d], holes %d\n",
+                seq_id, p0, p1, llama_kv_self_seq_has_holes(ctx, seq_id), pos_min, pos_max, holes);
+        GGML_ABORT("unexpected positions");
+    }
+}
+
+// the index of the last used cell + 1
+static int32_t get_used_max_p1(llama_context * ctx) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, 1);
+    llama_kv_cache_view_update(ctx, &view);
+
+    int32_t res = 0;
+    for (int32_t i = 0; i < view.n_cells; ++i) {
+        if (view.cells[i].pos >= 0) {
+            res = i + 1;
+        }
+    }
+
+    llama_kv_cache_view_free(&view);
+
+    return res;
+}
+
+// the sequences are interleaved in blocks, rolled back and removed - the freed blocks must be reused
+static void test_paged(llama_model * model) {
+    llama_context_params cparams = test_cparams();
+    cparams.kv_block_size = 16;
+
+    llama_context * ctx = init_context(model, cparams);
+    llama_context * ref = init_context(model);
+
+    for (int r = 0; r < 4; ++r) {
+        std::vector<test_token> tokens;
+        for (llama_pos p = 13*r; p < 13*(r + 1); ++p) {
+            tokens.push_back({0, p});
+        }
+        for (llama_pos p = 9*r; p < 9*(r + 1); ++p) {
+            tokens.push_back({1, p});
+        }
+
+        const auto res     = decode(ctx, tokens);
+        const auto res_ref = decode(ref, tokens);
+        for (size_t k = 0; k < tokens.size(); ++k) {
+            check_logits("paged", res[k], res_ref[k]);
+        }
+    }
+
+    check_seq(ctx, 0, 0, 51, false);
+    check_seq(ctx, 1, 0, 35, false);
+
+    // roll back the end of the sequences
+    for (auto * c : { ctx, ref }) {
+        GGML_ASSERT(llama_kv_self_seq_rm(c, 0, 45, -1));
+        GGML_ASSERT(llama_kv_self_seq_rm(c, 1, 20, -1));
+    }
+
+    check_seq(ctx, 0, 0, 44, false);
+    check_seq(ctx, 1, 0, 19, false);
+    GGML_ASSERT(llama_kv_self_used_cells(ctx) == 65);
+
+    {
+        const auto res     = decode(ctx, {{0, 45}, {1, 20}});
+        const auto res_ref = decode(ref, {{0, 45}, {1, 20}});
+        check_logits("paged rollback", res[0], res_ref[0]);
+        check_logits("paged rollback", res[1], res_ref[1]);
+    }
+
+    // seq 1 only fits in the cache if the blocks of seq 0 are reused
+    //   the free cells of the reference are runs of 13 cells, so it can only take smaller batches
+    for (auto * c : { ctx, ref }) {
+        GGML_ASSERT(llama_kv_self_seq_rm(c, 0, -1, -1));
+    }
+
+    check_logits("paged reuse", decode_seq(ctx, 1, 21, 220, 50), decode_seq(ref, 1, 21, 220, 10));
+    check_seq(ctx, 1, 0, 219, false);
+    GGML_ASSERT(llama_kv_self_used_cells(ctx) == 220);
+
+    llama_free(ref);
+    llama_free(ctx);
+
+    printf("%s: OK\n", __func__);
+}
+
+// shifting a sequence that shares its cells with another one must not change the other one
+static void test_cow(llama_model * model, uint32_t block_size) {
+    llama_context_params cparams = test_cparams();
+    cparams.kv_block_size = block_size;
+
+    // seq_add
+    {
+        llama_context * ctx = init_context(model, cparams);
+
+        decode_seq(ctx, 0, 0, 40);
+        llama_kv_self_seq_cp(ctx, 0, 1, -1, -1);
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) == 40);
+
+        llama_kv_self_seq_add(ctx, 1, 20, -1, 5);
+
+        check_seq(ctx, 0, 0, 39, false);
+        check_seq(ctx, 1, 0, 44, true);
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) == 60);
+        GGML_ASSERT(llama_kv_self_n_tokens(ctx) == 80);
+
+        const auto res = decode(ctx, {{0, 40}, {1, 45}});
+
+        // the same shift without sharing
+        llama_context * ref = init_context(model);
+
+        check_logits("cow add seq 0", res[0], decode_seq(ref, 0, 0, 41));
+
+        llama_kv_self_clear(ref);
+        decode_seq(ref, 0, 0, 40);
+        llama_kv_self_seq_add(ref, 0, 20, -1, 5);
+
+        check_logits("cow add seq 1", res[1], decode(ref, {{0, 45}})[0]);
+
+        llama_free(ref);
+        llama_free(ctx);
+    }
+
+    // seq_div
+    {
+        llama_context * ctx = init_context(model, cparams);
+
+        decode_seq(ctx, 0, 0, 40);
+        llama_kv_self_seq_cp(ctx, 0, 1, -1, -1);
+        llama_kv_self_seq_div(ctx, 1, 0, -1, 2);
+
+        check_seq(ctx, 0, 0, 39, false);
+        check_seq(ctx, 1, 0, 19, false);
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) == 80);
+
+        const auto res = decode(ctx, {{0, 40}, {1, 20}});
+
+        llama_context * ref = init_context(model);
+
+        check_logits("cow div seq 0", res[0], decode_seq(ref, 0, 0, 41));
+
+        llama_kv_self_clear(ref);
+        decode_seq(ref, 0, 0, 40);
+        llama_kv_self_seq_div(ref, 0, 0, -1, 2);
+
+        check_logits("cow div seq 1", res[1], decode(ref, {{0, 20}})[0]);
+
+        llama_free(ref);
+        llama_free(ctx);
+    }
+
+    // not enough free cells for the copies - the shift is refused and nothing changes
+    {
+        llama_context * ctx = init_context(model, cparams);
+
+        decode_seq(ctx, 0, 0, 200);
+        llama_kv_self_seq_cp(ctx, 0, 1, -1, -1);
+
+        GGML_ASSERT(!llama_kv_self_seq_try_add(ctx, 1, -1, -1, 5));
+        GGML_ASSERT(!llama_kv_self_seq_try_div(ctx, 1, -1, -1, 2));
+
+        check_seq(ctx, 1, 0, 199, false);
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) == 200);
+
+        GGML_ASSERT(llama_kv_self_seq_try_add(ctx, 1, 180, -1, 5));
+
+        check_seq(ctx, 0, 0, 199, false);
+        check_seq(ctx, 1, 0, 204, true);
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) == 220);
+
+        llama_free(ctx);
+    }
+
+    printf("%s(block_size = %u): OK\n", __func__, block_size);
+}
+
+// the sink/window eviction must give the same result as removing the evicted cells and shifting the kept ones
+static void test_window(llama_model * model, uint32_t block_size) {
+    const int n_window = 32;
+    const int n_sink   = 4;
+
+    llama_context_params cparams = test_cparams();
+    cparams.kv_block_size = block_size;
+    cparams.kv_window     = n_window;
+    cparams.kv_sink       = n_sink;
+
+    llama_context * ctx = init_context(model, cparams);
+    llama_context * ref = init_context(model);
+
+    int n_evict = 0;
+
+    for (int t = 0; t < 80; ++t) {
+        const llama_pos p0 = t == 0 ? 0 : llama_kv_self_seq_pos_max(ctx, 0) + 1;
+        const llama_pos p1 = t == 0 ? 20 : p0 + 1;
+
+        check_logits("window", decode_seq(ctx, 0, p0, p1), decode_seq(ref, 0, p0, p1));
+
+        // the same eviction by hand
+        if (p1 > n_window) {
+            const llama_pos n_evicted = p1 - n_window + (n_window - n_sink)/2;
+
+            llama_kv_self_seq_rm (ref, 0, n_sink, n_sink + n_evicted);
+            llama_kv_self_seq_add(ref, 0, n_sink + n_evicted, -1, -n_evicted);
+
+            n_evict++;
+        }
+
+        const llama_pos n_cur = llama_kv_self_seq_pos_max(ref, 0) + 1;
+
+        check_seq(ctx, 0, 0, n_cur - 1, false);
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) == n_cur && n_cur <= n_window);
+    }
+
+    GGML_ASSERT(n_evict > 1);
+
+    llama_free(ref);
+    llama_free(ctx);
+
+    printf("%s(block_size = %u): OK\n", __func__, block_size);
+}
+
+// the heavy-hitter eviction keeps the sinks and the positions of the kept cells
+static void test_h2o(llama_model * model) {
+    const int n_window = 32;
+    const int n_sink   = 4;
+
+    llama_context_params cparams = test_cparams();
+    cparams.kv_window = n_window;
+    cparams.kv_sink   = n_sink;
+    cparams.kv_h2o    = true;
+
+    llama_context * ctx = init_context(model, cparams);
+
+    decode_seq(ctx, 0, 0, 20);
+    decode_seq(ctx, 1, 0, 10);
+
+    // seq 1 stays within the window
+    llama_pos n_past_1 = 10;
+
+    for (llama_pos p = 20; p < 100; ++p) {
+        std::vector<test_token> tokens = {{0, p}};
+        if (p % 4 == 0) {
+            tokens.push_back({1, n_past_1++});
+        }
+
+        decode(ctx, tokens);
+
+        check_seq(ctx, 0, 0, p, p >= n_window);
+        check_seq(ctx, 1, 0, n_past_1 - 1, false);
+
+        GGML_ASSERT(llama_kv_self_used_cells(ctx) <= n_window + n_past_1);
+        GGML_ASSERT(llama_kv_self_n_tokens(ctx) == llama_kv_self_used_cells(ctx));
+    }
+
+    llama_free(ctx);
+
+    printf("%s: OK\n", __func__);
+}
+
+// the incremental defragmentation moves a bounded number of cells per update and does not change the logits
+static void test_defrag(llama_model * model) {
+    const int n_seq = 4;
+
+    llama_context_params cparams = test_cparams();
+    cparams.defrag_n_cells = 8;
+
+    llama_context * ctx = init_context(model, cparams);
+    llama_context * ref = init_context(model);
+
+    // interleave the sequences in chunks of 7 tokens and remove some of them
+    for (auto * c : { ctx, ref }) {
+        for (int r = 0; r < 6; ++r) {
+            std::vector<test_token> tokens;
+            for (llama_seq_id s = 0; s < n_seq; ++s) {
+                for (llama_pos p = 7*r; p < 7*(r + 1); ++p) {
+                    tokens.push_back({s, p});
+                }
+            }
+            decode(c, tokens);
+        }
+
+        llama_kv_self_seq_rm(c, 1, -1, -1);
+        llama_kv_self_seq_rm(c, 0, 10, 30);
+        llama_kv_self_seq_rm(c, 2, 0, 5);
+    }
+
+    const int32_t n_used = llama_kv_self_used_cells(ctx);
+    GGML_ASSERT(n_used == 22 + 37 + 42);
+    GGML_ASSERT(get_used_max_p1(ctx) > n_used);
+
+    int n_update = 0;
+
+    llama_kv_self_defrag(ctx);
+    while (get_used_max_p1(ctx) > n_used) {
+        llama_kv_self_update(ctx);
+        GGML_ASSERT(++n_update < 100);
+    }
+
+    GGML_ASSERT(n_update > 1);
+    GGML_ASSERT(llama_kv_self_used_cells(ctx) == n_used);
+
+    check_seq(ctx, 0, 0, 41, true);
+    check_seq(ctx, 1, -1, 0, false);
+    check_seq(ctx, 2, 5, 41, false);
+    check_seq(ctx, 3, 0, 41, false);
+
+    const auto res     = decode(ctx, {{0, 42}, {2, 42}, {3, 42}});
+    const auto res_ref = decode(ref, {{0, 42}, {2, 42}, {3, 42}});
+    for (size_t k = 0; k < res.size(); ++k) {
+        check_logits("defrag", res[k], res_ref[k]);
+    }
+
+    llama_free(ref);
+    llama_free(ctx);
+
+    printf("%s: OK (%d updates)\n", __func__, n_update);
+}
+
+// removing the end of a recurrent sequence rolls its state back to the last checkpoint before it
+static void test_checkpoint(llama_model * model) {
+    llama_context_params cparams = test_cparams();
+    cparams.kv_checkpoint = 16;
+
+    llama_context * ctx = init_context(model, cparams);
+
+    const auto ref = decode_seq(ctx, 0, 0, 100);
+
+    llama_kv_self_clear(ctx);
+
+    decode_seq(ctx, 0, 0, 100, 10);
+
+    // there is no checkpoint before position 5
+    GGML_ASSERT(!llama_kv_self_seq_rm(ctx, 0, 5, -1));
+    GGML_ASSERT(llama_kv_self_seq_pos_max(ctx, 0) == 99);
+
+    GGML_ASSERT(llama_kv_self_seq_rm(ctx, 0, 70, -1));
+
+    const llama_pos pos_max = llama_kv_self_seq_pos_max(ctx, 0);
+    GGML_ASSERT(pos_max < 70 && pos_max >= 70 - 16 - 10);
+
+    check_logits("checkpoint", decode_seq(ctx, 0, pos_max + 1, 100, 7), ref);
+
+    // roll back a copy - the original is not changed
+    llama_kv_self_seq_cp(ctx, 0, 1, -1, -1);
+
+    GGML_ASSERT(llama_kv_self_seq_rm(ctx, 1, 50, -1));
+
+    const llama_pos pos_max_1 = llama_kv_self_seq_pos_max(ctx, 1);
+    GGML_ASSERT(pos_max_1 < 50);
+    GGML_ASSERT(llama_kv_self_seq_pos_max(ctx, 0) == 99);
+
+    check_logits("checkpoint copy", decode_seq(ctx, 1, pos_max_1 + 1, 100), ref);
+
+    const auto res = decode(ctx, {{0, 100}, {1, 100}});
+    check_logits("checkpoint seqs", res[0], res[1]);
+
+    llama_free(ctx);
+
+    printf("%s: OK\n", __func__);
+}
+
+int main(void) {
+    test_cells();
+
+    llama_backend_init();
+
+    llama_log_set([](ggml_log_level level, const char * text, void *) {
+        if (level >= GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    for (const std::string arch : { "llama", "mamba" }) {
+        const std::string fname = "test-kv-cache-" + arch + ".gguf";
+
+        write_model(fname, arch);
+
+        llama_model * model = llama_model_load_from_file(fname.c_str(), llama_model_default_params());
+        GGML_ASSERT(model != nullptr);
+
+        std::remove(fname.c_str());
+
+        if (arch == "llama") {
+            test_paged(model);
+
+            for (uint32_t block_size : { 0, 16 }) {
+                test_cow   (model, block_size);
+                test_window(model, block_size);
+            }
+
+            test_h2o   (model);
+            test_defrag(model);
+        } else {
+            test_checkpoint(model);
+        }
+
+        llama_model_free(model);
+    }
+
+    llama_backend_free();
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -267,6 +267,7 @@ struct cmd_params {
     int                              delay;
     bool                             verbose;
     bool                             progress;
+    std::string                      cpu_profile;
     output_formats                   output_format;
     output_formats                   output_format_stderr;
 };
@@ -303,6 +304,7 @@ static const cmd_params cmd_params_defaults = {
     /* delay                */ 0,
     /* verbose              */ false,
     /* progress             */ false,
+    /* cpu_profile          */ "",
     /* output_format        */ MARKDOWN,
     /* output_format_stderr */ NONE,
 };
@@ -325,6 +327,9 @@ static void print_usage(int /* argc */, char ** argv) {
            output_format_str(cmd_params_defaults.output_format_stderr));
     printf("  -v, --verbose                             verbose output\n");
     printf("  --progress                                print test progress indicators\n");
+    printf("  --cpu-profile <filename>                  profile the ops of the CPU backend in the test runs, print a\n");
+    printf("                                            summary per op and save a Chrome trace of the last 16\n");
+    printf("                                            graphs to filename\n");
     printf("\n");
     printf("test parameters:\n");
     printf("  -m, --model <filename>                    (default: %s)\n", join(cmd_params_defaults.model, ",").c_str());
@@ -425,6 +430,7 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     params.prio                 = cmd_params_defaults.prio;
     params.delay                = cmd_params_defaults.delay;
     params.progress             = cmd_params_defaults.progress;
+    params.cpu_profile          = cmd_params_defaults.cpu_profile;
 
     for (int i = 1; i < argc; i++) {
         arg = argv[i];
@@ -798,6 +804,12 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 params.verbose = true;
             } else if (arg == "--progress") {
                 params.progress = true;
+            } else if (arg == "--cpu-profile") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                params.cpu_profile = argv[i];
             } else {
                 invalid_param = true;
                 break;
@@ -1840,6 +1852,14 @@ int main(int argc, char ** argv) {
     auto * cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
     auto * ggml_threadpool_new_fn = (decltype(ggml_threadpool_new) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_threadpool_new");
     auto * ggml_threadpool_free_fn = (decltype(ggml_threadpool_free) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_threadpool_free");
+    auto * ggml_threadpool_set_profiler_fn = (decltype(ggml_threadpool_set_profiler) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_threadpool_set_profiler");
+
+    // the profile of the test runs of all the tests, without the warmup runs
+    ggml_cpu_profiler_t profiler = nullptr;
+    if (!params.cpu_profile.empty()) {
+        auto * ggml_cpu_profiler_new_fn = (decltype(ggml_cpu_profiler_new) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_cpu_profiler_new");
+        profiler = ggml_cpu_profiler_new_fn();
+    }
 
     // initialize llama.cpp
     if (!params.verbose) {
@@ -1946,6 +1966,10 @@ int main(int argc, char ** argv) {
             }
         }
 
+        if (profiler) {
+            ggml_threadpool_set_profiler_fn(threadpool, profiler);
+        }
+
         for (int i = 0; i < params.reps; i++) {
             llama_kv_self_clear(ctx);
 
@@ -2017,6 +2041,18 @@ int main(int argc, char ** argv) {
         p_err->print_footer();
     }
 
+    if (profiler) {
+        auto * ggml_cpu_profiler_print_summary_fn = (decltype(ggml_cpu_profiler_print_summary) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_cpu_profiler_print_summary");
+        auto * ggml_cpu_profiler_write_trace_fn   = (decltype(ggml_cpu_profiler_write_trace) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_cpu_profiler_write_trace");
+        auto * ggml_cpu_profiler_free_fn          = (decltype(ggml_cpu_profiler_free) *) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_cpu_profiler_free");
+
+        ggml_cpu_profiler_print_summary_fn(profiler, stderr);
+        if (ggml_cpu_profiler_write_trace_fn(profiler, params.cpu_profile.c_str())) {
+            fprintf(stderr, "llama-bench: CPU profile saved to '%s'\n", params.cpu_profile.c_str());
+        }
+        ggml_cpu_profiler_free_fn(profiler);
+    }
+
     llama_backend_free();
 
     return 0;
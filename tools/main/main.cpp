@@ -188,6 +188,18 @@ int main(int argc, char ** argv) {
 
     llama_attach_threadpool(ctx, threadpool, threadpool_batch);
 
+    ggml_cpu_profiler_t profiler = NULL;
+    if (!params.path_cpu_profile.empty()) {
+        auto * ggml_cpu_profiler_new_fn        = (decltype(ggml_cpu_profiler_new) *) ggml_backend_reg_get_proc_address(reg, "ggml_cpu_profiler_new");
+        auto * ggml_threadpool_set_profiler_fn = (decltype(ggml_threadpool_set_profiler) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_set_profiler");
+
+        profiler = ggml_cpu_profiler_new_fn();
+        ggml_threadpool_set_profiler_fn(threadpool, profiler);
+        if (threadpool_batch) {
+            ggml_threadpool_set_profiler_fn(threadpool_batch, profiler);
+        }
+    }
+
     const int n_ctx_train = llama_model_n_ctx_train(model);
     const int n_ctx = llama_n_ctx(ctx);
 
@@ -672,6 +684,11 @@ int main(int argc, char ** argv) {
 
                 n_past += n_eval;
 
+                if (params.kv_window > 0) {
+                    // the streaming eviction moves the kept cells down after the sinks
+                    n_past = llama_kv_self_seq_pos_max(ctx, 0) + 1;
+                }
+
                 LOG_DBG("n_past = %d\n", n_past);
                 // Display total tokens alongside total time
                 if (params.n_print > 0 && n_past % params.n_print == 0) {
@@ -966,6 +983,16 @@ int main(int argc, char ** argv) {
     LOG("\n\n");
     common_perf_print(ctx, smpl);
 
+    if (profiler) {
+        auto * ggml_cpu_profiler_print_summary_fn = (decltype(ggml_cpu_profiler_print_summary) *) ggml_backend_reg_get_proc_address(reg, "ggml_cpu_profiler_print_summary");
+        auto * ggml_cpu_profiler_write_trace_fn   = (decltype(ggml_cpu_profiler_write_trace) *) ggml_backend_reg_get_proc_address(reg, "ggml_cpu_profiler_write_trace");
+
+        ggml_cpu_profiler_print_summary_fn(profiler, stderr);
+        if (ggml_cpu_profiler_write_trace_fn(profiler, params.path_cpu_profile.c_str())) {
+            LOG_INF("%s: CPU profile saved to '%s'\n", __func__, params.path_cpu_profile.c_str());
+        }
+    }
+
     common_sampler_free(smpl);
 
     llama_backend_free();
@@ -973,5 +1000,10 @@ int main(int argc, char ** argv) {
     ggml_threadpool_free_fn(threadpool);
     ggml_threadpool_free_fn(threadpool_batch);
 
+    if (profiler) {
+        auto * ggml_cpu_profiler_free_fn = (decltype(ggml_cpu_profiler_free) *) ggml_backend_reg_get_proc_address(reg, "ggml_cpu_profiler_free");
+        ggml_cpu_profiler_free_fn(profiler);
+    }
+
     return 0;
 }
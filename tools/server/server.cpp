@@ -25,6 +25,7 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -1269,6 +1270,7 @@ struct server_slot {
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
+    int32_t n_pos_shift = 0;  // the streaming eviction (--kv-window) moved the cached tokens after the sinks down by this much
     int32_t n_decoded   = 0;
     int32_t n_remaining = -1;
     int32_t i_batch     = -1;
@@ -1376,6 +1378,17 @@ struct server_slot {
         return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
     }
 
+    // the position in the KV cache of the token n_past
+    int32_t pos_next() const {
+        return n_past - n_pos_shift;
+    }
+
+    // the first n_cached tokens of the slot have been decoded - get their shift from the positions in the KV cache
+    void update_pos_shift(int32_t n_cached) {
+        // note: the max position of an empty sequence is also 0
+        n_pos_shift = n_cached > 0 ? n_cached - (llama_kv_self_seq_pos_max(ctx, id) + 1) : 0;
+    }
+
     void add_token(const completion_token_output & token) {
         if (!is_processing()) {
             SLT_WRN(*this, "%s", "slot is not processing\n");
@@ -1546,6 +1559,311 @@ struct server_metrics {
     }
 };
 
+// prompt caches that can be reused by any slot
+//  - the tokens in the KV cache of each slot are indexed by the slot id
+//  - prompts evicted from the slots are retained in host memory as sequence states, indexed by negative ids
+//  - when the host memory is full, the least recently used states are spilled to files in the background
+struct server_prompt_cache {
+    struct state {
+        llama_tokens tokens;
+
+        std::vector<common_adapter_lora_info> lora;
+
+        std::vector<uint8_t> data; // empty if the state is on disk
+
+        std::string path;
+        size_t      n_bytes = 0;
+
+        int64_t t_last_used = 0;
+
+        bool on_disk() const {
+            return !path.empty();
+        }
+    };
+
+    server_prefix_tree tree;
+
+    std::map<int32_t, state> states;
+
+    size_t size     = 0; // bytes of the states in host memory
+    size_t size_max = 0;
+
+    size_t size_disk     = 0; // bytes of the states on disk
+    size_t size_disk_max = 0;
+
+    std::string dir;
+    std::string tag; // unique per server instance, so that several servers can share the directory
+
+    int32_t id_next = -1;
+
+    // the spilled states are written and removed by a background thread
+    std::thread io_thread;
+    std::mutex  io_mutex;
+    std::condition_variable io_cond;
+    std::deque<std::function<void()>> io_jobs;
+
+    bool io_running = false;
+    bool io_busy    = false;
+
+    ~server_prompt_cache() {
+        for (const auto & it : states) {
+            if (it.second.on_disk()) {
+                const std::string path = it.second.path;
+                io_push([path]() { std::remove(path.c_str()); });
+            }
+        }
+
+        if (io_thread.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(io_mutex);
+                io_running = false;
+            }
+            io_cond.notify_all();
+            io_thread.join();
+        }
+    }
+
+    bool init(size_t ram_max, size_t disk_max, const std::string & path_dir) {
+        size_max      = ram_max;
+        size_disk_max = disk_max;
+
+        if (size_disk_max == 0) {
+            return true;
+        }
+
+        dir = path_dir.empty() ? fs_get_cache_directory() + "prompt-cache" : path_dir;
+        if (dir.back() != DIRECTORY_SEPARATOR) {
+            dir += DIRECTORY_SEPARATOR;
+        }
+
+        if (!fs_create_directory_with_parents(dir)) {
+            SRV_ERR("failed to create the prompt cache directory '%s'\n", dir.c_str());
+            size_disk_max = 0;
+            return false;
+        }
+
+        tag = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+
+        SRV_INF("spilling prompt caches to '%s', max size = %.3f MiB\n", dir.c_str(), size_disk_max / (1024.0 * 1024.0));
+
+        io_running = true;
+        io_thread  = std::thread([this]() {
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(io_mutex);
+                    io_cond.wait(lock, [this]() { return !io_jobs.empty() || !io_running; });
+                    if (io_jobs.empty()) {
+                        break;
+                    }
+                    job = std::move(io_jobs.front());
+                    io_jobs.pop_front();
+                    io_busy = true;
+                }
+
+                job();
+
+                {
+                    std::unique_lock<std::mutex> lock(io_mutex);
+                    io_busy = false;
+                }
+                io_cond.notify_all();
+            }
+        });
+
+        return true;
+    }
+
+    bool enabled() const {
+        return size_max > 0 || size_disk_max > 0;
+    }
+
+    void io_push(std::function<void()> && job) {
+        if (!io_thread.joinable()) {
+            job();
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(io_mutex);
+            io_jobs.push_back(std::move(job));
+        }
+        io_cond.notify_all();
+    }
+
+    // wait for the pending writes and removals
+    void io_wait() {
+        std::unique_lock<std::mutex> lock(io_mutex);
+        io_cond.wait(lock, [this]() { return io_jobs.empty() && !io_busy; });
+    }
+
+    // copy the KV cache of the sequence to host memory, evicting the least recently used states if needed
+    bool retain(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        if (!enabled() || tokens.empty()) {
+            return false;
+        }
+
+        // nothing to do if the tokens are already retained
+        for (const auto & [id, n_common] : tree.match(tokens)) {
+            if (n_common < (int32_t) tokens.size()) {
+                break;
+            }
+            if (id < 0 && are_lora_equal(states.at(id).lora, lora)) {
+                return false;
+            }
+        }
+
+        const size_t n_bytes = llama_state_seq_get_size(ctx, seq_id);
+        if (n_bytes == 0 || n_bytes > std::max(size_max, size_disk_max)) {
+            return false;
+        }
+
+        state st;
+        st.tokens      = tokens;
+        st.lora        = lora;
+        st.n_bytes     = n_bytes;
+        st.t_last_used = ggml_time_us();
+        st.data.resize(n_bytes);
+
+        if (llama_state_seq_get_data(ctx, st.data.data(), st.data.size(), seq_id) != n_bytes) {
+            return false;
+        }
+
+        const int32_t id = id_next--;
+
+        SRV_INF("retaining prompt cache %d, n_tokens = %zu, size = %.3f MiB\n", id, tokens.size(), n_bytes / (1024.0 * 1024.0));
+
+        size += n_bytes;
+        tree.insert(id, tokens);
+        states[id] = std::move(st);
+
+        fit();
+
+        return true;
+    }
+
+    // load the first n_tokens of a retained state into the sequence
+    bool restore(llama_context * ctx, int32_t id, llama_seq_id seq_id, int32_t n_tokens) {
+        auto it = states.find(id);
+
+        state & st = it->second;
+
+        st.t_last_used = ggml_time_us();
+
+        if (st.on_disk()) {
+            io_wait();
+
+            std::vector<uint8_t> data(st.n_bytes);
+
+            std::ifstream file(st.path, std::ios::binary);
+            if (!file.read((char *) data.data(), data.size())) {
+                SRV_ERR("failed to read prompt cache %d from '%s'\n", id, st.path.c_str());
+                drop(it);
+                return false;
+            }
+
+            SRV_INF("loaded prompt cache %d from disk, size = %.3f MiB\n", id, st.n_bytes / (1024.0 * 1024.0));
+
+            // move the state back to host memory if it fits
+            if (st.n_bytes <= size_max) {
+                const std::string path = st.path;
+                io_push([path]() { std::remove(path.c_str()); });
+
+                size_disk -= st.n_bytes;
+                size      += st.n_bytes;
+
+                st.path.clear();
+                st.data = std::move(data);
+
+                fit(id);
+            } else {
+                return llama_state_seq_set_data(ctx, data.data(), data.size(), seq_id) != 0 && llama_kv_self_seq_rm(ctx, seq_id, n_tokens, -1);
+            }
+        }
+
+        if (llama_state_seq_set_data(ctx, st.data.data(), st.data.size(), seq_id) == 0) {
+            return false;
+        }
+
+        return llama_kv_self_seq_rm(ctx, seq_id, n_tokens, -1);
+    }
+
+    // move the least recently used states out of host memory until the rest fits
+    void fit(int32_t id_keep = 0) {
+        while (size > size_max) {
+            auto it_lru = states.end();
+            for (auto it = states.begin(); it != states.end(); ++it) {
+                if (it->second.on_disk() || it->first == id_keep) {
+                    continue;
+                }
+                if (it_lru == states.end() || it->second.t_last_used < it_lru->second.t_last_used) {
+                    it_lru = it;
+                }
+            }
+
+            GGML_ASSERT(it_lru != states.end());
+
+            spill(it_lru);
+        }
+    }
+
+    void spill(std::map<int32_t, state>::iterator it) {
+        state & st = it->second;
+
+        if (st.n_bytes > size_disk_max) {
+            drop(it);
+            return;
+        }
+
+        while (size_disk + st.n_bytes > size_disk_max) {
+            auto it_lru = states.end();
+            for (auto it_disk = states.begin(); it_disk != states.end(); ++it_disk) {
+                if (!it_disk->second.on_disk()) {
+                    continue;
+                }
+                if (it_lru == states.end() || it_disk->second.t_last_used < it_lru->second.t_last_used) {
+                    it_lru = it_disk;
+                }
+            }
+
+            drop(it_lru);
+        }
+
+        SRV_DBG("spilling prompt cache %d to disk, n_tokens = %zu, size = %.3f MiB\n", it->first, st.tokens.size(), st.n_bytes / (1024.0 * 1024.0));
+
+        st.path = string_format("%sprompt-cache-%s-%d.bin", dir.c_str(), tag.c_str(), -it->first);
+
+        size      -= st.n_bytes;
+        size_disk += st.n_bytes;
+
+        io_push([path = st.path, data = std::move(st.data)]() {
+            std::ofstream file(path, std::ios::binary);
+            if (!file.write((const char *) data.data(), data.size())) {
+                SRV_ERR("failed to write prompt cache to '%s'\n", path.c_str());
+            }
+        });
+
+        st.data.clear();
+    }
+
+    void drop(std::map<int32_t, state>::iterator it) {
+        state & st = it->second;
+
+        SRV_DBG("evicting retained prompt cache %d, n_tokens = %zu, size = %.3f MiB\n", it->first, st.tokens.size(), st.n_bytes / (1024.0 * 1024.0));
+
+        if (st.on_disk()) {
+            const std::string path = st.path;
+            io_push([path]() { std::remove(path.c_str()); });
+
+            size_disk -= st.n_bytes;
+        } else {
+            size -= st.n_bytes;
+        }
+
+        tree.remove(it->first);
+        states.erase(it);
+    }
+};
+
 struct server_queue {
     int id = 0;
     bool running;
@@ -1879,6 +2197,8 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prompt_cache prompt_cache;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -1998,6 +2318,13 @@ struct server_context {
                 SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
             }
 
+            if (params_base.kv_share_prefix || params_base.cache_ram > 0 || params_base.cache_disk > 0) {
+                params_base.kv_share_prefix = false;
+                params_base.cache_ram       = 0;
+                params_base.cache_disk      = 0;
+                SRV_WRN("%s\n", "sharing and retaining prompt caches is not supported by multimodal, it will be disabled");
+            }
+
             if (!params_base.speculative.model.path.empty()) {
                 SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
                 return false;
@@ -2060,9 +2387,17 @@ struct server_context {
             batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
         }
 
+        if (!prompt_cache.init((size_t) params_base.cache_ram * 1024 * 1024, (size_t) params_base.cache_disk * 1024 * 1024, params_base.cache_dir)) {
+            params_base.cache_disk = 0;
+        }
+
         metrics.init();
     }
 
+    bool prompt_cache_enabled() const {
+        return params_base.kv_share_prefix || prompt_cache.enabled();
+    }
+
     server_slot * get_slot_by_id(int id) {
         for (server_slot & slot : slots) {
             if (slot.id == id) {
@@ -2135,6 +2470,95 @@ struct server_context {
         return ret;
     }
 
+    // replace the cache of the slot with the longest prefix of the prompt found in the prompt cache
+    void reuse_prompt_cache(server_slot & slot, const llama_tokens & tokens) {
+        // index the tokens generated by the idle slots since their entry was last updated
+        for (const server_slot & other : slots) {
+            if (!other.is_processing() && other.cache_tokens.size() > prompt_cache.tree.n_tokens(other.id)) {
+                prompt_cache.tree.insert(other.id, other.cache_tokens.get_text_tokens());
+            }
+        }
+
+        int32_t id_src = 0;
+        int32_t n_src  = slot.n_past;
+
+        for (const auto & [id, n_common] : prompt_cache.tree.match(tokens)) {
+            if (n_common <= n_src) {
+                break;
+            }
+
+            if (id == slot.id) {
+                continue;
+            }
+
+            int32_t n_reuse = n_common;
+
+            if (id >= 0) {
+                const server_slot & other = slots[id];
+
+                if (!params_base.kv_share_prefix || !are_lora_equal(other.lora, slot.lora)) {
+                    continue;
+                }
+
+                // the start of the prompt or some of the tokens in the middle have been evicted from the KV cache of the other slot
+                if (other.n_pos_shift > 0 || llama_kv_self_seq_pos_min(ctx, other.id) > 0 || llama_kv_self_seq_has_holes(ctx, other.id)) {
+                    continue;
+                }
+
+                // only the tokens that have already been decoded are in the KV cache
+                // note: the max position of an empty sequence is also 0, so a single token is never shared
+                n_reuse = std::min(n_reuse, llama_kv_self_seq_pos_max(ctx, other.id) + 1);
+                if (n_reuse <= 1) {
+                    continue;
+                }
+            } else if (!are_lora_equal(prompt_cache.states.at(id).lora, slot.lora)) {
+                continue;
+            }
+
+            if (n_reuse > n_src) {
+                id_src = id;
+                n_src  = n_reuse;
+            }
+        }
+
+        // keep the evicted prompt in host memory if most of it is about to be discarded
+        const int32_t n_cached = std::min<int32_t>(slot.cache_tokens.size(), llama_kv_self_seq_pos_max(ctx, slot.id) + 1);
+        if (prompt_cache.enabled() && n_src < n_cached/2) {
+            const llama_tokens & cached = slot.cache_tokens.get_text_tokens();
+
+            prompt_cache.retain(ctx, slot.id, { cached.begin(), cached.begin() + n_cached }, slot.lora);
+        }
+
+        if (n_src == slot.n_past) {
+            return;
+        }
+
+        if (id_src >= 0) {
+            SLT_INF(slot, "sharing %d prompt tokens with slot %d\n", n_src, id_src);
+
+            // the KV cells are shared between the sequences and copied only when one of them shifts them
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+            llama_kv_self_seq_cp(ctx, id_src, slot.id, -1, n_src);
+        } else {
+            SLT_INF(slot, "restoring %d prompt tokens from retained prompt cache %d\n", n_src, id_src);
+
+            if (!prompt_cache.restore(ctx, id_src, slot.id, n_src)) {
+                SLT_WRN(slot, "%s\n", "failed to restore the retained prompt cache");
+
+                llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                slot.n_past = 0;
+
+                return;
+            }
+        }
+
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert({ tokens.begin(), tokens.begin() + n_src });
+
+        slot.n_past = n_src;
+    }
+
     bool launch_slot_with_task(server_slot & slot, server_task && task) {
         slot.reset();
         slot.id_task       = task.id;
@@ -2146,6 +2570,7 @@ struct server_context {
         if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
             slot.cache_tokens.clear();
+            prompt_cache.tree.remove(slot.id);
             slot.lora = slot.params.lora;
         }
 
@@ -2252,7 +2677,7 @@ struct server_context {
         }
 
         // if context shifting is disabled, make sure that we don't run out of context
-        if (!params_base.ctx_shift && slot.n_past + 1 >= slot.n_ctx) {
+        if (!params_base.ctx_shift && slot.pos_next() + 1 >= slot.n_ctx) {
             slot.stop           = STOP_TYPE_LIMIT;
             slot.has_next_token = false;
 
@@ -2317,7 +2742,7 @@ struct server_context {
         }
 
         // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_past >= slot.n_ctx) {
+        if (slot.pos_next() >= slot.n_ctx) {
             slot.truncated      = true;
             slot.stop           = STOP_TYPE_LIMIT;
             slot.has_next_token = false;
@@ -2843,6 +3268,7 @@ struct server_context {
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
                     if (nread == 0) {
                         slot->cache_tokens.clear(); // KV may already been invalidated?
+                        prompt_cache.tree.remove(slot->id);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
@@ -2850,6 +3276,15 @@ struct server_context {
                     slot->cache_tokens.clear();
                     slot->cache_tokens.insert(tokens);
 
+                    if (params_base.kv_window > 0) {
+                        // the saved slot may have been through the streaming eviction
+                        slot->update_pos_shift(token_count);
+                    }
+
+                    if (prompt_cache_enabled()) {
+                        prompt_cache.tree.insert(slot->id, tokens);
+                    }
+
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
 
@@ -2883,6 +3318,8 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    prompt_cache.tree.remove(slot->id);
+                    slot->n_pos_shift = 0;
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2934,7 +3371,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+            if (slot.is_processing() && slot.pos_next() + 1 >= slot.n_ctx) {
                 if (!params_base.ctx_shift) {
                     // this check is redundant (for good)
                     // we should never get here, because generation should already stopped in process_token()
@@ -2943,6 +3380,14 @@ struct server_context {
                     continue;
                 }
 
+                if (slot.n_pos_shift > 0) {
+                    // the positions of the slot only reach the context size if --kv-window + the batch size does not fit
+                    // in the context of the slot
+                    slot.release();
+                    send_error(slot, "context shift is not supported after the streaming eviction - reduce --kv-window", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
                 if (mctx) {
                     // we should never reach this because params_base.ctx_shift is automatically disabled if mmproj is loaded
                     // we don't support ctx_shift because an image chunk may contains multiple tokens
@@ -2956,8 +3401,21 @@ struct server_context {
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
-                llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
-                llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                llama_kv_self_seq_rm(ctx, slot.id, n_keep, n_keep + n_discard);
+
+                if (!llama_kv_self_seq_try_add(ctx, slot.id, n_keep + n_discard, slot.n_past, -n_discard)) {
+                    // the cells shared with other slots (see --kv-share-prefix) could not be copied, and the cache is
+                    // full: the remaining cells of the slot were not shifted and no longer match its tokens
+                    SLT_WRN(slot, "%s", "failed to shift the shared cells of the slot - clearing the slot\n");
+
+                    llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                    slot.cache_tokens.clear();
+                    prompt_cache.tree.remove(slot.id);
+
+                    slot.release();
+                    send_error(slot, "failed to shift the context: not enough free KV cells to copy the shared prompt prefix", ERROR_TYPE_SERVER);
+                    continue;
+                }
 
                 // add generated tokens to cache
                 {
@@ -2969,6 +3427,10 @@ struct server_context {
                     new_tokens.resize(slot.cache_tokens.size() - n_discard);
                     slot.cache_tokens.clear();
                     slot.cache_tokens.insert(new_tokens);
+
+                    if (prompt_cache_enabled()) {
+                        prompt_cache.tree.insert(slot.id, new_tokens);
+                    }
                 }
 
                 slot.n_past -= n_discard;
@@ -3002,7 +3464,7 @@ struct server_context {
 
             slot.i_batch = batch.n_tokens;
 
-            common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
+            common_batch_add(batch, slot.sampled, slot.pos_next(), { slot.id }, true);
 
             slot.n_past += 1;
             slot.cache_tokens.push_back(slot.sampled);
@@ -3031,6 +3493,11 @@ struct server_context {
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
+                    if (params_base.kv_window > 0 && slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+                        // the previous part of the prompt may have been evicted
+                        slot.update_pos_shift(slot.n_past);
+                    }
+
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
                         slot.t_start_process_prompt = ggml_time_us();
@@ -3042,6 +3509,14 @@ struct server_context {
 
                         SLT_INF(slot, "new prompt, n_ctx_slot = %d, n_keep = %d, n_prompt_tokens = %d\n", slot.n_ctx, slot.params.n_keep, slot.n_prompt_tokens);
 
+                        if (slot.n_pos_shift > 0) {
+                            // the streaming eviction dropped some of the cached tokens and moved the others down
+                            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                            slot.cache_tokens.clear();
+                            prompt_cache.tree.remove(slot.id);
+                            slot.n_pos_shift = 0;
+                        }
+
                         // print prompt tokens (for debugging)
                         /*if (1) {
                             // first 16 tokens (avoid flooding logs)
@@ -3129,6 +3604,11 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
+                                // reuse a longer common prefix from the cache of another slot or from a retained prompt
+                                if (prompt_cache_enabled()) {
+                                    reuse_prompt_cache(slot, prompt_tokens.get_text_tokens());
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3160,8 +3640,14 @@ struct server_context {
 
                                             const int64_t kv_shift = (int64_t) head_p - (int64_t) head_c;
 
-                                            llama_kv_self_seq_rm (ctx, slot.id, head_p, head_c);
-                                            llama_kv_self_seq_add(ctx, slot.id, head_c, head_c + n_match, kv_shift);
+                                            llama_kv_self_seq_rm(ctx, slot.id, head_p, head_c);
+
+                                            if (!llama_kv_self_seq_try_add(ctx, slot.id, head_c, head_c + n_match, kv_shift)) {
+                                                // the shared cells of the chunk could not be copied - the cells from
+                                                // slot.n_past on are removed below
+                                                SLT_WRN(slot, "%s", "failed to shift the shared cells of the chunk - stop reusing chunks\n");
+                                                break;
+                                            }
 
                                             for (size_t i = 0; i < n_match; i++) {
                                                 slot.cache_tokens.set_token(head_p + i, slot.cache_tokens[head_c + i]);
@@ -3204,12 +3690,22 @@ struct server_context {
                     }
 
                     // keep only the common part
-                    if (!llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1)) {
+                    if (!llama_kv_self_seq_rm(ctx, slot.id, slot.pos_next(), -1)) {
                         // could not partially delete (likely using a non-Transformer model)
                         llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
 
                         // there is no common part left
                         slot.n_past = 0;
+                    } else if (llama_model_is_recurrent(model)) {
+                        // the state was rolled back to a checkpoint, which can be before n_past
+                        if (llama_kv_self_seq_pos_min(ctx, slot.id) < 0) {
+                            slot.n_past = 0;
+                        } else {
+                            slot.n_past = std::min(slot.n_past, llama_kv_self_seq_pos_max(ctx, slot.id) + 1);
+                        }
+                    } else if (params_base.kv_window > 0) {
+                        // only the tokens that have been decoded are in the cache
+                        slot.n_past = std::min(slot.n_past, llama_kv_self_seq_pos_max(ctx, slot.id) + 1 + slot.n_pos_shift);
                     }
 
                     SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
@@ -3217,13 +3713,18 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.keep_first(slot.n_past);
 
+                    // the slot is going to hold the tokens of the prompt
+                    if (prompt_cache_enabled()) {
+                        prompt_cache.tree.insert(slot.id, slot.prompt_tokens.get_text_tokens());
+                    }
+
                     // check if we should process the image
                     if (slot.n_past < slot.n_prompt_tokens
                             && slot.prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
                         // process the image
                         int32_t new_n_past;
-                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past);
-                        int32_t n_pos = new_n_past - slot.n_past;
+                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.pos_next(), slot.id, new_n_past);
+                        int32_t n_pos = new_n_past - slot.pos_next();
 
                         if (res != 0) {
                             SLT_ERR(slot, "failed to process image, res = %d\n", res);
@@ -3253,7 +3754,7 @@ struct server_context {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
-                        common_batch_add(batch, cur_tok, slot.n_past, { slot.id }, need_embd);
+                        common_batch_add(batch, cur_tok, slot.pos_next(), { slot.id }, need_embd);
                         slot.cache_tokens.push_back(cur_tok);
 
                         slot.n_prompt_tokens_processed++;
@@ -3360,6 +3861,10 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
+                if (params_base.kv_window > 0) {
+                    slot.update_pos_shift(slot.n_past);
+                }
+
                 if (slot.state == SLOT_STATE_DONE_PROMPT) {
                     if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
                         // prompt evaluated for embedding
@@ -3441,7 +3946,7 @@ struct server_context {
 
                 // note: n_past is not yet increased for the `id` token sampled above
                 //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.pos_next() - 2);
 
                 if (slot.n_remaining > 0) {
                     n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
@@ -3477,16 +3982,20 @@ struct server_context {
 
                 // construct the speculation batch
                 common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+                common_batch_add  (slot.batch_spec, id, slot.pos_next(), { slot.id }, true);
 
                 for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
+                    common_batch_add(slot.batch_spec, draft[i], slot.pos_next() + 1 + i, { slot.id }, true);
                 }
 
                 SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
 
                 llama_decode(ctx, slot.batch_spec);
 
+                if (params_base.kv_window > 0) {
+                    slot.update_pos_shift(slot.n_past + slot.batch_spec.n_tokens);
+                }
+
                 // the accepted tokens from the speculation
                 const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
 
@@ -3499,7 +4008,7 @@ struct server_context {
                 slot.cache_tokens.push_back(id);
                 slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
 
-                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+                llama_kv_self_seq_rm(ctx, slot.id, slot.pos_next(), -1);
 
                 for (size_t i = 0; i < ids.size(); ++i) {
                     completion_token_output result;
@@ -18,7 +18,9 @@
 #include "json.hpp"
 #include "chat.h"
 
+#include <map>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -1295,6 +1297,165 @@ public:
     }
 };
 
+/**
+ * server_prefix_tree is a radix tree over the token sequences held in the prompt caches.
+ * each entry is identified by an id and every node along its path records that id,
+ * so the entries sharing the longest prefix with a prompt are found in a single walk.
+ */
+struct server_prefix_tree {
+    struct node {
+        llama_tokens edge;
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+
+        // ids of the entries that pass through this node
+        std::set<int32_t> ids;
+    };
+
+    node root;
+
+    std::map<int32_t, llama_tokens> entries;
+
+    bool contains(int32_t id) const {
+        return entries.find(id) != entries.end();
+    }
+
+    size_t n_tokens(int32_t id) const {
+        const auto it = entries.find(id);
+        return it == entries.end() ? 0 : it->second.size();
+    }
+
+    void insert(int32_t id, const llama_tokens & tokens) {
+        remove(id);
+
+        entries[id] = tokens;
+
+        node * cur = &root;
+        cur->ids.insert(id);
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto leaf = std::make_unique<node>();
+                leaf->edge.assign(tokens.begin() + i, tokens.end());
+                leaf->ids.insert(id);
+                cur->children[tokens[i]] = std::move(leaf);
+                break;
+            }
+
+            node * child = it->second.get();
+
+            size_t n_common = 0;
+            while (n_common < child->edge.size() && i + n_common < tokens.size() && child->edge[n_common] == tokens[i + n_common]) {
+                n_common++;
+            }
+
+            if (n_common < child->edge.size()) {
+                // split the edge at the first mismatch
+                auto mid = std::make_unique<node>();
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + n_common);
+                mid->ids = child->ids;
+
+                child->edge.erase(child->edge.begin(), child->edge.begin() + n_common);
+                mid->children[child->edge[0]] = std::move(it->second);
+
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
+
+            child->ids.insert(id);
+
+            i  += n_common;
+            cur = child;
+        }
+    }
+
+    void remove(int32_t id) {
+        const auto it_entry = entries.find(id);
+        if (it_entry == entries.end()) {
+            return;
+        }
+
+        const llama_tokens & tokens = it_entry->second;
+
+        node * cur = &root;
+        cur->ids.erase(id);
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
+
+            node * child = it->second.get();
+            child->ids.erase(id);
+
+            if (child->ids.empty()) {
+                // the ids of the descendants are a subset of the ids of the node
+                cur->children.erase(it);
+                break;
+            }
+
+            // merge the node with its only child when both are used by the same entries
+            if (child->children.size() == 1 && child->children.begin()->second->ids == child->ids) {
+                auto grandchild = std::move(child->children.begin()->second);
+                grandchild->edge.insert(grandchild->edge.begin(), child->edge.begin(), child->edge.end());
+                it->second = std::move(grandchild);
+                child = it->second.get();
+            }
+
+            i  += child->edge.size();
+            cur = child;
+        }
+
+        entries.erase(it_entry);
+    }
+
+    // returns the (id, length of the common prefix) of all entries sharing a prefix with tokens, longest first
+    std::vector<std::pair<int32_t, int32_t>> match(const llama_tokens & tokens) const {
+        std::vector<std::pair<const node *, int32_t>> path;
+
+        const node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            const auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            size_t n_common = 0;
+            while (n_common < child->edge.size() && i + n_common < tokens.size() && child->edge[n_common] == tokens[i + n_common]) {
+                n_common++;
+            }
+
+            i += n_common;
+            path.emplace_back(child, (int32_t) i);
+
+            if (n_common < child->edge.size()) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        std::vector<std::pair<int32_t, int32_t>> res;
+        std::set<int32_t> seen;
+
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            for (const int32_t id : it->first->ids) {
+                if (seen.insert(id).second) {
+                    res.emplace_back(id, it->second);
+                }
+            }
+        }
+
+        return res;
+    }
+};
+
 // Computes FNV-1a hash of the data
 static std::string fnv_hash(const uint8_t * data, size_t len) {
     const uint64_t fnv_prime = 0x100000001b3ULL;